@@ -244,6 +244,17 @@ int audio_playback_write(AudioPlayback *pb, const void *buf, size_t len)
     return 0;
 }
 
+int64_t audio_playback_latency_ns(AudioPlayback *pb)
+{
+    int err = 0;
+    pa_usec_t us = pa_simple_get_latency(pb->pa, &err);
+    if (us == (pa_usec_t)-1) {
+        LOG_E("pa_simple_get_latency: %s", pa_strerror(err));
+        return -1;
+    }
+    return (int64_t)us * 1000;
+}
+
 void audio_playback_close(AudioPlayback *pb)
 {
     if (!pb) return;
@@ -42,6 +42,12 @@ AudioPlayback *audio_playback_open(const AudioConfig *cfg);
  */
 int audio_playback_write(AudioPlayback *pb, const void *buf, size_t len);
 
+/**
+ * How long until a sample written now is heard: what PulseAudio still
+ * holds plus the sink's own delay.  Returns nanoseconds, or -1 on error.
+ */
+int64_t audio_playback_latency_ns(AudioPlayback *pb);
+
 /**
  * Drain pending samples, then close.
  */
@@ -0,0 +1,128 @@
+#include "caps.h"
+#include "opuscodec.h"
+
+/* ---- Our side ---- */
+
+void caps_local(PeerCaps *caps)
+{
+    DeviceCapabilities dc;
+    config_detect_capabilities(&dc);
+
+    memset(caps, 0, sizeof(*caps));
+    caps->known      = true;
+    caps->codecs     = 1u << FRAME_CODEC_PCM;
+    if (dc.supports_flac_decode) caps->codecs |= 1u << FRAME_CODEC_LOSSLESS;
+    if (dc.supports_opus)        caps->codecs |= 1u << FRAME_CODEC_OPUS;
+    caps->max_rate   = dc.max_sample_rate;
+    caps->max_bits   = dc.max_bit_depth;
+    caps->flags      = CAPS_PACKED24 | (dc.supports_float ? CAPS_FLOAT : 0);
+    caps->latency_ms = g_app.latency_ms;
+    caps->cpu_budget = g_app.cpu_budget;
+}
+
+void caps_encoding_config(const AudioConfig *session, const WireEncoding *w,
+                          AudioConfig *out)
+{
+    *out = *session;
+    out->compression_type = w->codec == FRAME_CODEC_OPUS     ? 2
+                          : w->codec == FRAME_CODEC_LOSSLESS ? 1 : 0;
+    out->use_flac = w->codec == FRAME_CODEC_LOSSLESS;
+    out->use_opus = w->codec == FRAME_CODEC_OPUS;
+    out->packed24 = w->packed24;
+}
+
+const char *caps_encoding_name(const WireEncoding *w)
+{
+    switch (w->codec) {
+    case FRAME_CODEC_OPUS:     return "Opus";
+    case FRAME_CODEC_LOSSLESS: return w->packed24 ? "lossless (packed PCM)" : "lossless";
+    default:                   return w->packed24 ? "packed 24-bit PCM" : "PCM";
+    }
+}
+
+/* ---- Choosing for a receiver ---- */
+
+/* Smaller is fewer bytes on the wire */
+static int wire_rank(const WireEncoding *w)
+{
+    switch (w->codec) {
+    case FRAME_CODEC_OPUS:     return 0;
+    case FRAME_CODEC_LOSSLESS: return 1;
+    default:                   return w->packed24 ? 2 : 3;
+    }
+}
+
+/* Share of one receiver core that decoding takes, percent */
+static double decode_percent(const AudioConfig *cfg, const WireEncoding *w)
+{
+    double sps = (double)cfg->sample_rate * cfg->channels;
+    switch (w->codec) {
+    case FRAME_CODEC_OPUS:     return 100.0 * sps / CAPS_OPUS_DECODE_RATE;
+    case FRAME_CODEC_LOSSLESS: return 100.0 * sps / CAPS_LOSSLESS_DECODE_RATE;
+    default:                   return 0.0;
+    }
+}
+
+/* Delay the encoding adds on top of the chunk itself */
+static double codec_delay_ms(const WireEncoding *w)
+{
+    return w->codec == FRAME_CODEC_OPUS ? OPUS_LOOKAHEAD_MS : 0.0;
+}
+
+/* Can the receiver decode `w` at all?  NULL if so, else why not. */
+static const char *cannot_take(const PeerCaps *caps, const WireEncoding *w)
+{
+    if (!(caps->codecs & (1u << FRAME_CODEC_PCM)) ||
+        !(caps->codecs & (1u << w->codec)))
+        return "codec not supported";
+    if (w->packed24 && !(caps->flags & CAPS_PACKED24))
+        return "no packed 24-bit support";
+    return NULL;
+}
+
+/* Within the receiver's latency and CPU wishes? */
+static bool suits(const AudioConfig *cfg, const PeerCaps *caps, const WireEncoding *w)
+{
+    if (caps->cpu_budget > 0 && decode_percent(cfg, w) > caps->cpu_budget)
+        return false;
+    if (caps->latency_ms > 0 &&
+        config_buffer_latency_ms(cfg) + codec_delay_ms(w) > caps->latency_ms)
+        return false;
+    return true;
+}
+
+int caps_choose(const AudioConfig *session, const WireEncoding *encs, int n,
+                const PeerCaps *caps, const char *who)
+{
+    if (session->sample_rate > caps->max_rate ||
+        session->bits_per_sample > caps->max_bits ||
+        (session->is_float && !(caps->flags & CAPS_FLOAT))) {
+        LOG_W("%s plays up to %d Hz / %d bit%s, stream is %d Hz / %d bit%s",
+              who, caps->max_rate, caps->max_bits,
+              (caps->flags & CAPS_FLOAT) ? "" : " integer",
+              session->sample_rate, session->bits_per_sample,
+              session->is_float ? " float" : "");
+        return -1;
+    }
+
+    /* The preset is what was asked for; the others are fallbacks, the
+       leanest that fits first                                        */
+    int best = -1, best_fit = -1;
+    for (int i = 0; i < n && best_fit != 0; i++) {
+        if (cannot_take(caps, &encs[i])) continue;
+        if (best < 0) best = i;
+        if (suits(session, caps, &encs[i]) &&
+            (best_fit < 0 || wire_rank(&encs[i]) < wire_rank(&encs[best_fit])))
+            best_fit = i;
+    }
+
+    if (best_fit >= 0) return best_fit;
+    if (best >= 0) {
+        LOG_W("%s: nothing fits its %d ms / %d%% CPU wishes, sending %s anyway",
+              who, caps->latency_ms, caps->cpu_budget, caps_encoding_name(&encs[best]));
+        return best;
+    }
+    LOG_W("%s cannot take %s: %s", who, caps_encoding_name(&encs[0]),
+          cannot_take(caps, &encs[0]));
+    return -1;
+}
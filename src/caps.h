@@ -0,0 +1,48 @@
+#ifndef CAPS_H
+#define CAPS_H
+
+#include "soundshare.h"
+#include "config.h"
+#include "protocol.h"
+
+/*
+ * Receiver capabilities and the per-receiver choice of encoding.
+ *
+ * A v4 receiver says in its HELLO which codecs it decodes, how far its
+ * output goes in rate and depth, and how much latency and CPU it wants
+ * to spend.  The streamer offers its session encoding plus at most one
+ * alternative and gives each receiver the smallest one on the wire that
+ * it can take.  Format limits and missing codecs rule an encoding out;
+ * decode cost over the CPU budget and codec delay over the preferred
+ * latency only count when something else fits.
+ */
+
+/* Rough single-core decode rates of a small ARM board, samples/s */
+#define CAPS_LOSSLESS_DECODE_RATE  8000000.0
+#define CAPS_OPUS_DECODE_RATE      2000000.0
+
+/* How chunks of one encoding are put on the wire */
+typedef struct {
+    int  codec;       /* FRAME_CODEC_* of coded chunks */
+    bool packed24;    /* PCM chunks as 3 bytes per sample */
+} WireEncoding;
+
+/** What this build and machine can take, for our own HELLO. */
+void caps_local(PeerCaps *caps);
+
+/** Format of a stream with the session's audio in encoding `w`. */
+void caps_encoding_config(const AudioConfig *session, const WireEncoding *w,
+                          AudioConfig *out);
+
+/**
+ * Index into `encs` of the encoding to send a receiver with `caps`, or
+ * -1 if none will play there (the reason is logged against `who`).
+ * encs[0], the preset's own, unless the receiver cannot take it or it
+ * misses the receiver's latency or CPU wishes.
+ */
+int caps_choose(const AudioConfig *session, const WireEncoding *encs, int n,
+                const PeerCaps *caps, const char *who);
+
+const char *caps_encoding_name(const WireEncoding *w);
+
+#endif /* CAPS_H */
@@ -1,13 +1,18 @@
 #include "chat.h"
 #include "protocol.h"
 #include "network.h"
+#include "reactor.h"
 #include "ui.h"
 
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #define MAX_CHAT_CLIENTS 16
+/* Output a chat client may have waiting before it is dropped as stuck */
+#define CHAT_QUEUE_MAX   (64 * 1024)
 
 /* ---- Callback ---- */
 static ChatMessageCallback g_chat_cb      = NULL;
@@ -26,26 +31,46 @@ static void notify_message(const char *sender, const char *msg)
 
 /* ---- Wire format helpers ---- */
 
-static int chat_write_msg(int fd, const char *sender, const char *message)
+size_t chat_encode(uint8_t *dst, const char *sender, const char *message)
 {
-    uint16_t slen = (uint16_t)strlen(sender);
-    uint16_t mlen = (uint16_t)strlen(message);
-
-    uint8_t hdr[5];
-    hdr[0] = CHAT_MSG;
-    write_be16(hdr + 1, slen);
-
-    if (write_fully(fd, hdr, 3) < 0) return -1;
-    if (write_fully(fd, sender, slen) < 0) return -1;
+    size_t slen = strlen(sender);
+    size_t mlen = strlen(message);
+    if (slen >= CHAT_MAX_SENDER) slen = CHAT_MAX_SENDER - 1;
+    if (mlen >= CHAT_MAX_MSG)    mlen = CHAT_MAX_MSG - 1;
+
+    size_t n = 0;
+    dst[n++] = CHAT_MSG;
+    write_be16(dst + n, (uint16_t)slen);
+    memcpy(dst + n + 2, sender, slen);
+    n += 2 + slen;
+    write_be16(dst + n, (uint16_t)mlen);
+    memcpy(dst + n + 2, message, mlen);
+    return n + 2 + mlen;
+}
 
-    uint8_t mhdr[2];
-    write_be16(mhdr, mlen);
-    if (write_fully(fd, mhdr, 2) < 0) return -1;
-    if (write_fully(fd, message, mlen) < 0) return -1;
+int chat_decode(const uint8_t *src, size_t len, char *sender, size_t smax,
+                char *message, size_t mmax)
+{
+    if (len < 3 || src[0] != CHAT_MSG) return -1;
+    size_t slen = read_be16(src + 1);
+    if (slen >= smax || 3 + slen + 2 > len) return -1;
+    size_t mlen = read_be16(src + 3 + slen);
+    if (mlen >= mmax || 3 + slen + 2 + mlen != len) return -1;
 
+    memcpy(sender, src + 3, slen);
+    sender[slen] = '\0';
+    memcpy(message, src + 5 + slen, mlen);
+    message[mlen] = '\0';
     return 0;
 }
 
+static int chat_write_msg(int fd, const char *sender, const char *message)
+{
+    uint8_t buf[CHAT_WIRE_MAX];
+    size_t  len = chat_encode(buf, sender, message);
+    return write_fully(fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
 static int chat_read_msg(int fd, char *sender, size_t smax,
                          char *message, size_t mmax)
 {
@@ -66,120 +91,240 @@ static int chat_read_msg(int fd, char *sender, size_t smax,
     return 0;
 }
 
+/*
+ * Bytes the message at `src` takes, judging by the `len` of it that are
+ * in: 0 until that can be told, -1 if it is over the limits.  Anything
+ * but CHAT_MSG is a single byte, skipped.
+ */
+static ssize_t chat_wire_len(const uint8_t *src, size_t len)
+{
+    if (len < 1) return 0;
+    if (src[0] != CHAT_MSG) return 1;
+    if (len < 3) return 0;
+    size_t slen = read_be16(src + 1);
+    if (slen >= CHAT_MAX_SENDER) return -1;
+    if (len < 3 + slen + 2) return 0;
+    size_t mlen = read_be16(src + 3 + slen);
+    if (mlen >= CHAT_MAX_MSG) return -1;
+    return (ssize_t)(3 + slen + 2 + mlen);
+}
+
 /* ============================================================ */
 /*  CHAT SERVER                                                  */
 /* ============================================================ */
 
+/* A receiver's chat connection, read on the reactor thread.  Writes
+   never block: what the socket does not take waits in `out`, which
+   the reactor drains on EPOLLOUT (guarded by csrv.lock).              */
+typedef struct {
+    int          fd;
+    uint8_t      in[CHAT_WIRE_MAX];   /* a message still coming in */
+    size_t       in_len;
+    uint8_t     *out;
+    size_t       out_len;
+    size_t       out_off;             /* already sent */
+    bool         want_out;            /* watching for EPOLLOUT */
+    ReactorWatch watch;
+} ChatConn;
+
 static struct {
-    int        server_fd;
-    int        clients[MAX_CHAT_CLIENTS];
-    atomic_bool client_connected[MAX_CHAT_CLIENTS];
-    int        client_count;
-    pthread_t  thread;
-    pthread_t  client_threads[MAX_CHAT_CLIENTS];
-    bool       running;
-    pthread_mutex_t lock;
+    int          server_fd;
+    ReactorWatch server_watch;
+    ChatConn     clients[MAX_CHAT_CLIENTS];
+    atomic_bool  client_connected[MAX_CHAT_CLIENTS];
+    int          client_count;
+    pthread_mutex_t lock;    /* writers vs. a client leaving */
 } csrv;
 
+/* Multiplexed receivers, reached through the streaming module */
+static ChatRelayFn g_chat_relay;
+
+void chat_server_set_relay(ChatRelayFn fn)
+{
+    g_chat_relay = fn;
+}
+
+static void relay(int except, const char *sender, const char *msg)
+{
+    if (g_chat_relay) g_chat_relay(except, sender, msg);
+}
+
+/* Send what the socket takes of the queue and watch for room while
+   some is left; -1 on a dead socket.  Caller holds csrv.lock.      */
+static int chat_conn_flush(ChatConn *cc)
+{
+    while (cc->out_off < cc->out_len) {
+        ssize_t n = send(cc->fd, cc->out + cc->out_off, cc->out_len - cc->out_off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        cc->out_off += (size_t)n;
+    }
+    if (cc->out_off == cc->out_len)
+        cc->out_off = cc->out_len = 0;
+
+    bool want = cc->out_len > 0;
+    if (want != cc->want_out &&
+        reactor_mod(&cc->watch, cc->fd, EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0)) == 0)
+        cc->want_out = want;
+    return 0;
+}
+
+/* Queue a message and send what the socket takes.  Caller holds csrv.lock. */
+static int chat_conn_queue(ChatConn *cc, const uint8_t *msg, size_t len)
+{
+    if (cc->out_len - cc->out_off + len > CHAT_QUEUE_MAX) return -1;
+
+    if (cc->out_off > 0) {
+        memmove(cc->out, cc->out + cc->out_off, cc->out_len - cc->out_off);
+        cc->out_len -= cc->out_off;
+        cc->out_off  = 0;
+    }
+    uint8_t *q = realloc(cc->out, cc->out_len + len);
+    if (!q) return -1;
+    memcpy(q + cc->out_len, msg, len);
+    cc->out      = q;
+    cc->out_len += len;
+    return chat_conn_flush(cc);
+}
+
+/*
+ * Any thread.  A client that is gone or has stopped reading is shut
+ * down rather than closed here: the reactor sees the hangup and
+ * closes it, so its callback never runs on a closed slot.
+ */
 static void chat_srv_broadcast_except(int exclude_idx,
                                       const char *sender, const char *msg)
 {
+    uint8_t buf[CHAT_WIRE_MAX];
+    size_t  len = chat_encode(buf, sender, msg);
+
     pthread_mutex_lock(&csrv.lock);
     for (int i = 0; i < MAX_CHAT_CLIENTS; i++) {
         if (i == exclude_idx) continue;
         if (!atomic_load(&csrv.client_connected[i])) continue;
-        chat_write_msg(csrv.clients[i], sender, msg);  /* best-effort */
+        ChatConn *cc = &csrv.clients[i];
+        if (chat_conn_queue(cc, buf, len) < 0) {
+            LOG_W("Chat: client in slot %d is gone or not reading, dropping it", i);
+            shutdown(cc->fd, SHUT_RDWR);
+        }
     }
     pthread_mutex_unlock(&csrv.lock);
 }
 
-typedef struct { int idx; } ChatClientArg;
-
-static void *chat_client_handler(void *arg)
+static void chat_conn_close(int idx)
 {
-    ChatClientArg *a = (ChatClientArg *)arg;
-    int idx = a->idx;
-    int fd  = csrv.clients[idx];
-    free(a);
+    ChatConn *cc = &csrv.clients[idx];
+
+    pthread_mutex_lock(&csrv.lock);
+    reactor_del(&cc->watch, cc->fd);
+    net_close(&cc->fd);
+    free(cc->out);
+    cc->out      = NULL;
+    cc->out_len  = 0;
+    cc->out_off  = 0;
+    cc->want_out = false;
+    atomic_store(&csrv.client_connected[idx], false);
+    csrv.client_count--;
+    pthread_mutex_unlock(&csrv.lock);
+}
 
+/* Every whole message a client has sent; -1 once it is gone */
+static int chat_conn_input(int idx)
+{
+    ChatConn *cc = &csrv.clients[idx];
     char sender[CHAT_MAX_SENDER];
     char message[CHAT_MAX_MSG];
 
-    while (atomic_load(&g_app.is_streaming) &&
-           atomic_load(&csrv.client_connected[idx]))
-    {
-        int ready = net_poll_read(fd, 1000);
-        if (ready <= 0) {
-            if (ready < 0) break;
-            continue;
+    for (;;) {
+        ssize_t n = recv(cc->fd, cc->in + cc->in_len, sizeof(cc->in) - cc->in_len,
+                         MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         }
-
-        uint8_t cmd;
-        if (read(fd, &cmd, 1) != 1) break;
-
-        if (cmd == CHAT_MSG) {
-            if (chat_read_msg(fd, sender, sizeof(sender),
-                              message, sizeof(message)) < 0)
-                break;
-
-            notify_message(sender, message);
-            chat_srv_broadcast_except(idx, sender, message);
+        cc->in_len += (size_t)n;
+
+        size_t off = 0;
+        for (;;) {
+            ssize_t len = chat_wire_len(cc->in + off, cc->in_len - off);
+            if (len < 0) return -1;
+            if (len == 0 || (size_t)len > cc->in_len - off) break;
+
+            if (cc->in[off] == CHAT_MSG) {
+                if (chat_decode(cc->in + off, (size_t)len, sender, sizeof(sender),
+                                message, sizeof(message)) < 0)
+                    return -1;
+                notify_message(sender, message);
+                chat_srv_broadcast_except(idx, sender, message);
+                relay(-1, sender, message);
+            }
+            off += (size_t)len;
         }
+        cc->in_len -= off;
+        memmove(cc->in, cc->in + off, cc->in_len);
     }
+}
 
-    pthread_mutex_lock(&csrv.lock);
-    net_close(&csrv.clients[idx]);
-    atomic_store(&csrv.client_connected[idx], false);
-    csrv.client_count--;
-    pthread_mutex_unlock(&csrv.lock);
+static void chat_conn_event(void *arg, uint32_t events)
+{
+    int idx = (int)(intptr_t)arg;
+    if (!atomic_load(&csrv.client_connected[idx])) return;
 
-    return NULL;
+    int rc = 0;
+    if (events & EPOLLOUT) {
+        pthread_mutex_lock(&csrv.lock);
+        rc = chat_conn_flush(&csrv.clients[idx]);
+        pthread_mutex_unlock(&csrv.lock);
+    }
+    if (rc < 0 || chat_conn_input(idx) < 0 || (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)))
+        chat_conn_close(idx);
 }
 
-static void *chat_server_thread(void *arg)
+static void chat_accept_all(void *arg, uint32_t events)
 {
     (void)arg;
-    LOG_I("Chat server started on port %d", CHAT_PORT);
-
-    while (atomic_load(&g_app.is_streaming)) {
-        int ready = net_poll_read(csrv.server_fd, 1000);
-        if (ready <= 0) continue;
+    (void)events;
 
+    for (;;) {
         char ip[INET_ADDRSTRLEN];
         int fd = net_accept_client(csrv.server_fd, ip, sizeof(ip));
-        if (fd < 0) continue;
+        if (fd < 0) return;
 
-        /* Find a slot */
+        /* Find a slot; only this thread fills them */
         int idx = -1;
-        pthread_mutex_lock(&csrv.lock);
-        for (int i = 0; i < MAX_CHAT_CLIENTS; i++) {
-            if (!atomic_load(&csrv.client_connected[i])) {
-                idx = i;
-                csrv.clients[i] = fd;
-                atomic_store(&csrv.client_connected[i], true);
-                csrv.client_count++;
-                break;
-            }
-        }
-        pthread_mutex_unlock(&csrv.lock);
-
+        for (int i = 0; i < MAX_CHAT_CLIENTS && idx < 0; i++)
+            if (!atomic_load(&csrv.client_connected[i])) idx = i;
         if (idx < 0) {
             LOG_W("Chat: max clients reached, rejecting %s", ip);
             close(fd);
             continue;
         }
 
+        ChatConn *cc = &csrv.clients[idx];
+        net_set_nonblocking(fd, true);
+        if (reactor_add(&cc->watch, fd, EPOLLIN | EPOLLRDHUP,
+                        chat_conn_event, (void *)(intptr_t)idx) < 0) {
+            close(fd);
+            continue;
+        }
+        pthread_mutex_lock(&csrv.lock);
+        cc->fd       = fd;
+        cc->in_len   = 0;
+        cc->out_len  = 0;
+        cc->out_off  = 0;
+        cc->want_out = false;
+        atomic_store(&csrv.client_connected[idx], true);
+        csrv.client_count++;
+        pthread_mutex_unlock(&csrv.lock);
+
         LOG_I("Chat client connected: %s (slot %d)", ip, idx);
         notify_message("", ip);  /* system message via UI */
-
-        ChatClientArg *a = malloc(sizeof(*a));
-        a->idx = idx;
-        pthread_create(&csrv.client_threads[idx], NULL, chat_client_handler, a);
-        pthread_detach(csrv.client_threads[idx]);
     }
-
-    LOG_I("Chat server stopped");
-    return NULL;
 }
 
 int chat_server_start(void)
@@ -189,70 +334,71 @@ int chat_server_start(void)
     pthread_mutex_init(&csrv.lock, NULL);
 
     for (int i = 0; i < MAX_CHAT_CLIENTS; i++) {
-        csrv.clients[i] = -1;
+        csrv.clients[i].fd = -1;
         atomic_store(&csrv.client_connected[i], false);
     }
 
     csrv.server_fd = net_create_server(CHAT_PORT, 8);
     if (csrv.server_fd < 0) return -1;
+    net_set_nonblocking(csrv.server_fd, true);
 
-    csrv.running = true;
-    if (pthread_create(&csrv.thread, NULL, chat_server_thread, NULL) != 0) {
+    if (reactor_add(&csrv.server_watch, csrv.server_fd, EPOLLIN, chat_accept_all, NULL) < 0) {
         net_close(&csrv.server_fd);
         return -1;
     }
+    LOG_I("Chat server started on port %d", CHAT_PORT);
     return 0;
 }
 
 void chat_server_stop(void)
 {
+    reactor_del(&csrv.server_watch, csrv.server_fd);
     net_close(&csrv.server_fd);
 
-    pthread_mutex_lock(&csrv.lock);
-    for (int i = 0; i < MAX_CHAT_CLIENTS; i++) {
-        if (atomic_load(&csrv.client_connected[i])) {
-            net_close(&csrv.clients[i]);
-            atomic_store(&csrv.client_connected[i], false);
-        }
-    }
-    pthread_mutex_unlock(&csrv.lock);
+    for (int i = 0; i < MAX_CHAT_CLIENTS; i++)
+        if (atomic_load(&csrv.client_connected[i]))
+            chat_conn_close(i);
 
-    if (csrv.running) {
-        pthread_join(csrv.thread, NULL);
-        csrv.running = false;
-    }
     pthread_mutex_destroy(&csrv.lock);
+    LOG_I("Chat server stopped");
 }
 
 void chat_server_broadcast(const char *sender, const char *message)
 {
-    pthread_mutex_lock(&csrv.lock);
-    for (int i = 0; i < MAX_CHAT_CLIENTS; i++) {
-        if (atomic_load(&csrv.client_connected[i]))
-            chat_write_msg(csrv.clients[i], sender, message);
-    }
-    pthread_mutex_unlock(&csrv.lock);
+    chat_srv_broadcast_except(-1, sender, message);
+    relay(-1, sender, message);
+}
+
+void chat_server_deliver(int from, const char *sender, const char *message)
+{
+    notify_message(sender, message);
+    chat_srv_broadcast_except(-1, sender, message);
+    relay(from, sender, message);
 }
 
 /* ============================================================ */
 /*  CHAT CLIENT                                                  */
 /* ============================================================ */
 
+/* One thread per session, which alone closes its socket; the stopper
+   signals stop_fd and shuts the socket down under write_lock, which
+   also guards fd and send against chat_client_send().               */
 static struct {
     int       fd;
+    int       stop_fd;     /* eventfd, readable once chat_client_stop() runs */
     pthread_t thread;
     bool      running;
     char      server_ip[INET_ADDRSTRLEN];
     pthread_mutex_t write_lock;
-} ccli = { .fd = -1 };
+    ChatSendFn send;       /* multiplexed: no socket of our own */
+} ccli = { .fd = -1, .stop_fd = -1, .write_lock = PTHREAD_MUTEX_INITIALIZER };
 
 static void *chat_client_thread(void *arg)
 {
     (void)arg;
 
-    usleep(500000);
-
-    int fd = net_connect(ccli.server_ip, CHAT_PORT, 5000);
+    /* The streamer's chat server is up before it sends a stream header */
+    int fd = net_connect_cancel(ccli.server_ip, CHAT_PORT, 5000, ccli.stop_fd);
     if (fd < 0) {
         LOG_W("Chat client: cannot connect");
         return NULL;
@@ -268,7 +414,7 @@ static void *chat_client_thread(void *arg)
     char message[CHAT_MAX_MSG];
 
     while (atomic_load(&g_app.is_receiving)) {
-        int ready = net_poll_read(fd, 1000);
+        int ready = net_poll_read_cancel(fd, ccli.stop_fd, 1000);
         if (ready <= 0) {
             if (ready < 0) break;
             continue;
@@ -286,8 +432,9 @@ static void *chat_client_thread(void *arg)
     }
 
     pthread_mutex_lock(&ccli.write_lock);
-    net_close(&ccli.fd);
+    ccli.fd = -1;
     pthread_mutex_unlock(&ccli.write_lock);
+    net_close(&fd);
 
     notify_message("", "Chat disconnected");
     LOG_I("Chat client stopped");
@@ -296,36 +443,66 @@ static void *chat_client_thread(void *arg)
 
 int chat_client_start(const char *server_ip)
 {
-    ccli.fd = -1;
+    pthread_mutex_lock(&ccli.write_lock);
+    ccli.fd   = -1;
+    ccli.send = NULL;
+    pthread_mutex_unlock(&ccli.write_lock);
     strncpy(ccli.server_ip, server_ip, INET_ADDRSTRLEN - 1);
-    pthread_mutex_init(&ccli.write_lock, NULL);
 
-    ccli.running = true;
+    ccli.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ccli.stop_fd < 0) {
+        LOG_E("eventfd(chat_client): %s", strerror(errno));
+        return -1;
+    }
     if (pthread_create(&ccli.thread, NULL, chat_client_thread, NULL) != 0) {
         LOG_E("pthread_create(chat_client): %s", strerror(errno));
+        net_close(&ccli.stop_fd);
         return -1;
     }
+    ccli.running = true;
     return 0;
 }
 
+void chat_client_attach(ChatSendFn send)
+{
+    pthread_mutex_lock(&ccli.write_lock);
+    ccli.fd   = -1;
+    ccli.send = send;
+    pthread_mutex_unlock(&ccli.write_lock);
+    notify_message("", "Connected to chat");
+}
+
+void chat_client_deliver(const char *sender, const char *message)
+{
+    notify_message(sender, message);
+}
+
+/* Signal and shut down; the thread closes its own socket */
 void chat_client_stop(void)
 {
     pthread_mutex_lock(&ccli.write_lock);
-    net_close(&ccli.fd);
+    ccli.send = NULL;
+    if (ccli.fd >= 0) shutdown(ccli.fd, SHUT_RDWR);
     pthread_mutex_unlock(&ccli.write_lock);
 
-    if (ccli.running) {
-        pthread_join(ccli.thread, NULL);
-        ccli.running = false;
-    }
-    pthread_mutex_destroy(&ccli.write_lock);
+    if (!ccli.running) return;
+
+    uint64_t one = 1;
+    if (write(ccli.stop_fd, &one, sizeof(one)) < 0)
+        LOG_W("wake chat client: %s", strerror(errno));
+    pthread_join(ccli.thread, NULL);
+    ccli.running = false;
+    net_close(&ccli.stop_fd);
 }
 
 void chat_client_send(const char *sender, const char *message)
 {
     pthread_mutex_lock(&ccli.write_lock);
-    if (ccli.fd >= 0) {
+    if (ccli.send) {
+        uint8_t buf[CHAT_WIRE_MAX];
+        ccli.send(buf, chat_encode(buf, sender, message));
+    } else if (ccli.fd >= 0) {
         chat_write_msg(ccli.fd, sender, message);
     }
     pthread_mutex_unlock(&ccli.write_lock);
-}
\ No newline at end of file
+}
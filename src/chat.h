@@ -5,6 +5,8 @@
 
 #define CHAT_MAX_SENDER  256
 #define CHAT_MAX_MSG    4096
+/* One message on the wire: CHAT_MSG, u16 length + sender, u16 length + text */
+#define CHAT_WIRE_MAX   (1 + 2 + CHAT_MAX_SENDER + 2 + CHAT_MAX_MSG)
 
 /* Callback invoked on the GTK thread when a message arrives */
 typedef void (*ChatMessageCallback)(const char *sender,
@@ -14,14 +16,35 @@ typedef void (*ChatMessageCallback)(const char *sender,
 /* Set the receive callback (UI sets this) */
 void chat_set_callback(ChatMessageCallback cb, void *user_data);
 
-/* ---- server (sender side) ---- */
+/* One message in wire form into `dst` (CHAT_WIRE_MAX bytes); returns its length */
+size_t chat_encode(uint8_t *dst, const char *sender, const char *message);
+/* The reverse, for exactly `len` bytes; -1 if malformed or too long */
+int    chat_decode(const uint8_t *src, size_t len, char *sender, size_t smax,
+                   char *message, size_t mmax);
+
+/* ---- server (sender side), served on the reactor thread ---- */
 int  chat_server_start(void);
+/* Once the reactor has stopped */
 void chat_server_stop(void);
 void chat_server_broadcast(const char *sender, const char *message);
 
+/*
+ * Multiplexed receivers chat over their audio connection.  The relay
+ * passes a message on to all of them but `except` (-1: none).
+ */
+typedef void (*ChatRelayFn)(int except, const char *sender, const char *message);
+void chat_server_set_relay(ChatRelayFn fn);
+/* A message from multiplexed receiver `from`: shown and passed on to everyone else */
+void chat_server_deliver(int from, const char *sender, const char *message);
+
 /* ---- client (receiver side) ---- */
 int  chat_client_start(const char *server_ip);
 void chat_client_stop(void);
 void chat_client_send(const char *sender, const char *message);
 
+/* Multiplexed: messages go out through `send` instead of a CHAT_PORT socket */
+typedef int (*ChatSendFn)(const uint8_t *msg, size_t len);
+void chat_client_attach(ChatSendFn send);
+void chat_client_deliver(const char *sender, const char *message);
+
 #endif /* CHAT_H */
\ No newline at end of file
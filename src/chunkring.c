@@ -0,0 +1,83 @@
+#include "chunkring.h"
+
+int chunk_ring_init(ChunkRing *r, int nslots, size_t slot_size, size_t alt_size)
+{
+    memset(r, 0, sizeof(*r));
+
+    r->slots = calloc((size_t)nslots, sizeof(*r->slots));
+    if (!r->slots) return -1;
+
+    for (int i = 0; i < nslots; i++) {
+        r->slots[i].data = malloc(slot_size);
+        if (alt_size > 0)
+            r->slots[i].alt = malloc(alt_size);
+        if (!r->slots[i].data || (alt_size > 0 && !r->slots[i].alt)) {
+            r->nslots = i + 1;
+            chunk_ring_destroy(r);
+            return -1;
+        }
+        r->slots[i].seq = UINT64_MAX;
+        atomic_store(&r->slots[i].refs, 0);
+    }
+
+    r->nslots    = nslots;
+    r->slot_size = slot_size;
+    r->alt_size  = alt_size;
+    atomic_store(&r->head, 0);
+    atomic_store(&r->overruns, 0);
+    return 0;
+}
+
+void chunk_ring_destroy(ChunkRing *r)
+{
+    if (r->slots) {
+        for (int i = 0; i < r->nslots; i++) {
+            free(r->slots[i].data);
+            free(r->slots[i].alt);
+        }
+        free(r->slots);
+    }
+    r->slots  = NULL;
+    r->nslots = 0;
+}
+
+ChunkSlot *chunk_ring_acquire(ChunkRing *r, uint64_t seq)
+{
+    ChunkSlot *s = &r->slots[seq % (uint64_t)r->nslots];
+
+    if (atomic_load_explicit(&s->refs, memory_order_acquire) != 0) {
+        atomic_fetch_add(&r->overruns, 1);
+        return NULL;
+    }
+    return s;
+}
+
+void chunk_ring_publish(ChunkRing *r, size_t len, int64_t capture_ns, int refs)
+{
+    uint64_t   seq = atomic_load_explicit(&r->head, memory_order_relaxed);
+    ChunkSlot *s   = &r->slots[seq % (uint64_t)r->nslots];
+
+    s->len        = len;
+    s->seq        = seq;
+    s->capture_ns = capture_ns;
+    atomic_store_explicit(&s->refs, refs, memory_order_relaxed);
+    atomic_store_explicit(&r->head, seq + 1, memory_order_release);
+}
+
+ChunkSlot *chunk_ring_get(ChunkRing *r, uint64_t seq)
+{
+    if (seq >= chunk_ring_head(r)) return NULL;
+
+    ChunkSlot *s = &r->slots[seq % (uint64_t)r->nslots];
+    return s->seq == seq ? s : NULL;
+}
+
+void chunk_ring_release(ChunkSlot *s)
+{
+    atomic_fetch_sub_explicit(&s->refs, 1, memory_order_release);
+}
+
+void chunk_ring_retain(ChunkSlot *s)
+{
+    atomic_fetch_add_explicit(&s->refs, 1, memory_order_relaxed);
+}
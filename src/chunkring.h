@@ -0,0 +1,102 @@
+#ifndef CHUNKRING_H
+#define CHUNKRING_H
+
+#include "soundshare.h"
+
+#include <stddef.h>
+
+/*
+ * Shared ring of capture chunks for zero-copy fan-out.
+ *
+ * Slots are filled in sequence order, by the capture thread or by the
+ * send thread's encoder; the send thread then publishes each one with a
+ * reference per receiver that still has to send it.  Receivers keep
+ * their own cursor (a sequence number) and release each slot once it is
+ * on the wire or skipped.  A slot is only reused when its reference
+ * count has dropped back to zero, so memory stays at nslots * slot_size
+ * regardless of the number of receivers.
+ */
+
+typedef struct {
+    uint8_t    *data;
+    size_t      len;
+    uint64_t    seq;
+    int64_t     capture_ns;   /* monotonic time the capture read returned */
+    bool        silent;       /* DTX: data is still filled in for v2 */
+    /* DTX: this chunk ends a silent run and carries its marker, for
+       [run_seq, run_seq + run_chunks); 0 chunks: no marker            */
+    uint64_t    run_seq;
+    int         run_chunks;
+    uint8_t     codec;        /* FRAME_CODEC_* of data */
+    /* The same chunk in the session's second encoding, if any */
+    uint8_t    *alt;
+    size_t      alt_len;
+    uint8_t     alt_codec;
+    bool        has_alt;      /* filled in for this chunk */
+    atomic_int  refs;
+} ChunkSlot;
+
+/* Captured chunk handed from the capture thread to the publisher:
+   PCM already in ring slot `seq`, or in staging buffer `stage` for the
+   publisher to encode into the next slot                             */
+typedef struct {
+    uint64_t    seq;          /* stage < 0 only */
+    size_t      len;          /* PCM bytes */
+    int64_t     capture_ns;
+    int         stage;        /* -1: read straight into the slot */
+} ChunkDesc;
+
+typedef struct {
+    ChunkSlot         *slots;
+    int                nslots;
+    size_t             slot_size;
+    size_t             alt_size;   /* 0: slots have no alt buffer */
+    _Atomic uint64_t   head;       /* sequence number of the next publish */
+    atomic_long        overruns;   /* acquire found the slot still in use */
+} ChunkRing;
+
+/** `alt_size` > 0 also gives every slot an `alt` buffer of that size. */
+int  chunk_ring_init(ChunkRing *r, int nslots, size_t slot_size, size_t alt_size);
+void chunk_ring_destroy(ChunkRing *r);
+
+/**
+ * Writer: get the slot that will hold sequence number `seq`, which may
+ * run ahead of head by less than nslots.  Returns NULL (and counts an
+ * overrun) while a receiver still references the previous occupant.
+ */
+ChunkSlot *chunk_ring_acquire(ChunkRing *r, uint64_t seq);
+
+/**
+ * Publisher: make the slot for sequence number `head` visible with
+ * `refs` outstanding references.  Advances head.
+ */
+void chunk_ring_publish(ChunkRing *r, size_t len, int64_t capture_ns, int refs);
+
+/**
+ * Reader: the slot holding `seq`, or NULL if it has not been published
+ * yet or was already overwritten.  Only stable while the caller holds
+ * a reference.
+ */
+ChunkSlot *chunk_ring_get(ChunkRing *r, uint64_t seq);
+
+/** Drop one reference taken at publish time. */
+void chunk_ring_release(ChunkSlot *s);
+
+/**
+ * Take one more reference on a published slot, e.g. to replay it.  The
+ * caller must know the writer cannot be reclaiming it at the same time.
+ */
+void chunk_ring_retain(ChunkSlot *s);
+
+/** Before the first publish: number the first chunk `seq` instead of 0. */
+static inline void chunk_ring_start_at(ChunkRing *r, uint64_t seq)
+{
+    atomic_store_explicit(&r->head, seq, memory_order_release);
+}
+
+static inline uint64_t chunk_ring_head(ChunkRing *r)
+{
+    return atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+#endif /* CHUNKRING_H */
@@ -9,6 +9,10 @@ const char *QUALITY_NAMES[NUM_PRESETS] = {
     "Maximum     – 48 kHz Stereo 24-bit",
     "Hi-Res      – 96 kHz Stereo 24-bit",
     "Hi-Res Ultra – 192 kHz Stereo 24-bit",
+    "Hi-Res Lossless – 96 kHz Stereo 24-bit",
+    "Hi-Res Lossless Ultra – 192 kHz Stereo 24-bit",
+    "Opus Low Latency – 48 kHz Stereo, 5 ms",
+    "Opus – 48 kHz Stereo, 10 ms",
 };
 
 const PresetData PRESETS[NUM_PRESETS] = {
@@ -19,6 +23,10 @@ const PresetData PRESETS[NUM_PRESETS] = {
     { 48000, 2,   9600, 24, 0, 0 },
     { 96000, 2,  96000, 24, 0, 0 },
     {192000, 2, 192000, 24, 0, 0 },
+    { 96000, 2,   4800, 24, 1, 0 },
+    {192000, 2,   9600, 24, 1, 0 },
+    { 48000, 2,    240, 16, 2, 0 },
+    { 48000, 2,    480, 16, 2, 0 },
 };
 
 /* ------------------------------------------------------------------ */
@@ -36,7 +44,9 @@ static void config_compute_derived(AudioConfig *cfg)
         cfg->pa_format = "s16le";
     }
 
-    cfg->use_flac = (cfg->compression_type == 1);
+    /* The lossless codec takes integer samples only */
+    cfg->use_flac = (cfg->compression_type == 1 && !cfg->is_float);
+    cfg->use_opus = (cfg->compression_type == 2);
     cfg->is_hires = (cfg->sample_rate > 48000 ||
                      cfg->bits_per_sample > 24 ||
                      (cfg->bits_per_sample == 24 && cfg->sample_rate >= 96000));
@@ -81,7 +91,8 @@ void config_from_header(AudioConfig *cfg, int sr, int ch, int fpb,
     cfg->bits_per_sample   = bps;
     cfg->compression_type  = comp;
     cfg->is_float          = (float_flag != 0);
-    cfg->preset_index      = (comp == 1) ? 7 : (sr > 48000 ? 5 : 2);
+    cfg->preset_index      = (comp == 2) ? 9 :
+                             (comp == 1) ? (sr > 96000 ? 8 : 7) : (sr > 48000 ? 5 : 2);
 
     config_compute_derived(cfg);
 }
@@ -99,7 +110,7 @@ int64_t config_raw_bitrate_kbps(const AudioConfig *cfg)
 
 void config_format_string(const AudioConfig *cfg, char *buf, size_t len)
 {
-    const char *codec  = cfg->use_flac ? "FLAC" : "PCM";
+    const char *codec  = cfg->use_opus ? "Opus" : cfg->use_flac ? "Lossless" : "PCM";
     const char *fl     = cfg->is_float ? " Float" : "";
     const char *hi     = cfg->is_hires ? " [Hi-Res]" : "";
     const char *ch     = cfg->channels == 1 ? "Mono" : "Stereo";
@@ -125,10 +136,12 @@ void config_channel_string(const AudioConfig *cfg, char *buf, size_t len)
 
 void config_compression_string(const AudioConfig *cfg, char *buf, size_t len)
 {
-    if (cfg->use_flac && cfg->is_hires)
-        snprintf(buf, len, "Hi-Res FLAC Lossless");
+    if (cfg->use_opus)
+        snprintf(buf, len, "Opus (lossy, low delay)");
+    else if (cfg->use_flac && cfg->is_hires)
+        snprintf(buf, len, "Hi-Res Lossless");
     else if (cfg->use_flac)
-        snprintf(buf, len, "FLAC Lossless");
+        snprintf(buf, len, "Lossless");
     else if (cfg->is_hires)
         snprintf(buf, len, "Hi-Res PCM");
     else
@@ -149,12 +162,14 @@ void config_detect_capabilities(DeviceCapabilities *caps)
     caps->supports_32bit  = true;
     caps->supports_float  = true;
 
-#ifdef HAVE_FLAC
+    /* Built-in codec (lossless.c), always there; integer audio up to
+       LOSSLESS_MAX_BITS, which lossless_supported() checks per stream */
     caps->supports_flac_encode = true;
     caps->supports_flac_decode = true;
+#ifdef HAVE_OPUS
+    caps->supports_opus = true;
 #else
-    caps->supports_flac_encode = false;
-    caps->supports_flac_decode = false;
+    caps->supports_opus = false;
 #endif
 
     caps->max_sample_rate = caps->supports_192khz ? 192000 :
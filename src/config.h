@@ -3,7 +3,7 @@
 
 #include "soundshare.h"
 
-#define NUM_PRESETS 7
+#define NUM_PRESETS 11
 
 /* Quality preset names */
 extern const char *QUALITY_NAMES[NUM_PRESETS];
@@ -15,10 +15,12 @@ typedef struct {
     int  frames_per_buffer;
     int  bits_per_sample;
     int  bytes_per_sample;
-    int  compression_type;   /* 0 = PCM, 1 = FLAC */
+    int  compression_type;   /* 0 = PCM, 1 = lossless, 2 = Opus */
     bool is_float;
     bool is_hires;
     bool use_flac;
+    bool use_opus;
+    bool packed24;           /* 24-bit PCM on the wire as 3 bytes/sample */
     int  chunk_size;
     int  socket_buffer_size;
     int  preset_index;
@@ -63,6 +65,7 @@ typedef struct {
     bool supports_float;
     bool supports_flac_encode;
     bool supports_flac_decode;
+    bool supports_opus;
     int  max_sample_rate;
     int  max_bit_depth;
 } DeviceCapabilities;
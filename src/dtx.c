@@ -0,0 +1,120 @@
+#include "dtx.h"
+#include "protocol.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Samples between early-out checks in the vector loops */
+#define DTX_BLOCK 64
+
+/* ---- Peak tests: is every |sample| <= level? ---- */
+
+static bool quiet_s16(const uint8_t *p, size_t n, int16_t level)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i hi = _mm_set1_epi16(level);
+    const __m128i lo = _mm_set1_epi16((int16_t)-level);
+    while (i + DTX_BLOCK <= n) {
+        __m128i out = _mm_setzero_si128();
+        for (size_t end = i + DTX_BLOCK; i < end; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 2));
+            out = _mm_or_si128(out, _mm_or_si128(_mm_cmpgt_epi16(v, hi),
+                                                 _mm_cmpgt_epi16(lo, v)));
+        }
+        if (_mm_movemask_epi8(out)) return false;
+    }
+#endif
+    for (; i < n; i++) {
+        int16_t v;
+        memcpy(&v, p + i * 2, 2);
+        if (v > level || v < -level) return false;
+    }
+    return true;
+}
+
+static bool quiet_s32(const uint8_t *p, size_t n, int32_t level)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i hi = _mm_set1_epi32(level);
+    const __m128i lo = _mm_set1_epi32(-level);
+    while (i + DTX_BLOCK <= n) {
+        __m128i out = _mm_setzero_si128();
+        for (size_t end = i + DTX_BLOCK; i < end; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 4));
+            out = _mm_or_si128(out, _mm_or_si128(_mm_cmpgt_epi32(v, hi),
+                                                 _mm_cmpgt_epi32(lo, v)));
+        }
+        if (_mm_movemask_epi8(out)) return false;
+    }
+#endif
+    for (; i < n; i++) {
+        int32_t v;
+        memcpy(&v, p + i * 4, 4);
+        if (v > level || v < -level) return false;
+    }
+    return true;
+}
+
+static bool quiet_f32(const uint8_t *p, size_t n, float level)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 lim  = _mm_set1_ps(level);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    while (i + DTX_BLOCK <= n) {
+        __m128 out = _mm_setzero_ps();
+        for (size_t end = i + DTX_BLOCK; i < end; i += 4) {
+            __m128 v = _mm_andnot_ps(sign, _mm_loadu_ps((const float *)(p + i * 4)));
+            out = _mm_or_ps(out, _mm_cmpgt_ps(v, lim));
+        }
+        if (_mm_movemask_ps(out)) return false;
+    }
+#endif
+    for (; i < n; i++) {
+        float v;
+        memcpy(&v, p + i * 4, 4);
+        if (fabsf(v) > level) return false;
+    }
+    return true;
+}
+
+/* ---- Public API ---- */
+
+void dtx_init(Dtx *d, const AudioConfig *cfg, int threshold_db, int hangover_ms)
+{
+    double amp  = pow(10.0, threshold_db / 20.0);
+    /* s32 containers hold 24-bit audio in the top bytes: same scale */
+    double full = cfg->bytes_per_sample == 2 ? 32768.0 : 2147483648.0;
+    double lvl  = floor(amp * full);
+    if (lvl > full - 1.0) lvl = full - 1.0;
+
+    memset(d, 0, sizeof(*d));
+    d->bytes_per_sample = cfg->bytes_per_sample;
+    d->is_float         = cfg->is_float;
+    d->level            = (int32_t)lvl;
+    d->level_f          = (float)amp;
+
+    double chunk_ms = config_buffer_latency_ms(cfg);
+    d->hangover = (int)ceil(hangover_ms / (chunk_ms > 0 ? chunk_ms : 1.0));
+    d->run_max  = (int)floor(DTX_RUN_MS / (chunk_ms > 0 ? chunk_ms : 1.0));
+    if (d->run_max < 1)               d->run_max = 1;
+    if (d->run_max > SILENCE_RUN_MAX) d->run_max = SILENCE_RUN_MAX;
+}
+
+bool dtx_update(Dtx *d, const void *pcm, size_t len)
+{
+    size_t n = len / (size_t)d->bytes_per_sample;
+    bool   q = d->is_float              ? quiet_f32(pcm, n, d->level_f)
+             : d->bytes_per_sample == 2 ? quiet_s16(pcm, n, (int16_t)d->level)
+                                        : quiet_s32(pcm, n, d->level);
+
+    if (!q) {
+        d->quiet = 0;
+        return false;
+    }
+    if (d->quiet <= d->hangover) d->quiet++;
+    return d->quiet > d->hangover;
+}
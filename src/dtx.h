@@ -0,0 +1,45 @@
+#ifndef DTX_H
+#define DTX_H
+
+#include "soundshare.h"
+#include "config.h"
+
+#include <stddef.h>
+
+/*
+ * Discontinuous transmission: the streamer replaces chunks of silence
+ * with a marker that says how many frames to play as zeros.
+ *
+ * A chunk counts as silent when no sample's magnitude exceeds the
+ * threshold (in dBFS).  Markers only start once the signal has been
+ * silent for the hangover time, so the tail of a quiet fade-out is
+ * still sent as audio.  One marker covers a run of up to run_max
+ * chunks and goes out with the chunk that ends the run, so short
+ * chunks do not each cost a marker.
+ */
+
+#define DTX_DEFAULT_DB          (-90)
+#define DTX_DEFAULT_HANGOVER_MS 500
+/* Longest a marker is held back for its run: well inside the smallest
+   jitter buffer target (JITTER_MIN_MS), so it still lands in time    */
+#define DTX_RUN_MS              5
+
+typedef struct {
+    int     bytes_per_sample;
+    bool    is_float;
+    int32_t level;          /* integer formats: largest silent magnitude */
+    float   level_f;
+    int     hangover;       /* silent chunks before markers start */
+    int     quiet;          /* silent chunks in a row so far */
+    int     run_max;        /* chunks one marker covers, at least 1 */
+} Dtx;
+
+void dtx_init(Dtx *d, const AudioConfig *cfg, int threshold_db, int hangover_ms);
+
+/**
+ * Feed one chunk of PCM in capture order.  True if it should go out as
+ * a silence marker.
+ */
+bool dtx_update(Dtx *d, const void *pcm, size_t len);
+
+#endif /* DTX_H */
@@ -0,0 +1,143 @@
+#include "histogram.h"
+
+/* ---- Buckets ---- */
+
+static int bucket_of(uint64_t v)
+{
+    if (v < HIST_SUB) return (int)v;
+    if (v >> HIST_MAX_BITS) return HIST_BUCKETS - 1;
+
+    int msb   = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) | (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Middle of the values a bucket holds */
+static int64_t bucket_value(int b)
+{
+    if (b < HIST_SUB) return b;
+
+    int      shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t low   = (uint64_t)(HIST_SUB | (b & (HIST_SUB - 1))) << shift;
+    return (int64_t)(low + ((1ULL << shift) >> 1));
+}
+
+/* ---- Public API ---- */
+
+void hist_reset(Histogram *h)
+{
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        atomic_store_explicit(&h->counts[b], 0, memory_order_relaxed);
+    atomic_store(&h->n, 0);
+    atomic_store(&h->sum, 0);
+    atomic_store(&h->min, INT64_MAX);
+    atomic_store(&h->max, -1);
+}
+
+void hist_record(Histogram *h, int64_t ns)
+{
+    if (ns < 0) ns = 0;
+
+    atomic_fetch_add_explicit(&h->counts[bucket_of((uint64_t)ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->n, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+
+    int64_t m = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while (ns < m && !atomic_compare_exchange_weak_explicit(&h->min, &m, ns,
+                                                            memory_order_relaxed,
+                                                            memory_order_relaxed)) {}
+    m = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > m && !atomic_compare_exchange_weak_explicit(&h->max, &m, ns,
+                                                            memory_order_relaxed,
+                                                            memory_order_relaxed)) {}
+}
+
+int64_t hist_percentile(const Histogram *h, double pct)
+{
+    /* The buckets, not n: a record in flight may have bumped one only */
+    uint64_t total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        total += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+    if (total == 0) return -1;
+
+    uint64_t want = (uint64_t)ceil(pct / 100.0 * (double)total);
+    if (want < 1) want = 1;
+    if (want > total) want = total;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+        if (seen >= want) {
+            /* Never outside what was actually recorded */
+            int64_t v   = bucket_value(b);
+            int64_t min = atomic_load(&h->min);
+            int64_t max = atomic_load(&h->max);
+            if (v > max) v = max;
+            if (v < min) v = min;
+            return v;
+        }
+    }
+    return atomic_load(&h->max);
+}
+
+void hist_merge(Histogram *dst, const Histogram *src)
+{
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        uint64_t c = atomic_load_explicit(&src->counts[b], memory_order_relaxed);
+        if (c) atomic_fetch_add_explicit(&dst->counts[b], c, memory_order_relaxed);
+    }
+    atomic_fetch_add(&dst->n, atomic_load(&src->n));
+    atomic_fetch_add(&dst->sum, atomic_load(&src->sum));
+
+    int64_t v = atomic_load(&src->min);
+    int64_t m = atomic_load(&dst->min);
+    while (v < m && !atomic_compare_exchange_weak(&dst->min, &m, v)) {}
+    v = atomic_load(&src->max);
+    m = atomic_load(&dst->max);
+    while (v > m && !atomic_compare_exchange_weak(&dst->max, &m, v)) {}
+}
+
+void hist_summary(const Histogram *h, HistSummary *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->count = atomic_load(&h->n);
+    if (out->count == 0) return;
+
+    out->min  = atomic_load(&h->min);
+    out->max  = atomic_load(&h->max);
+    out->mean = (double)atomic_load(&h->sum) / (double)out->count;
+    out->p50  = hist_percentile(h, 50.0);
+    out->p90  = hist_percentile(h, 90.0);
+    out->p99  = hist_percentile(h, 99.0);
+    out->p999 = hist_percentile(h, 99.9);
+}
+
+void hist_log(const char *name, const Histogram *h)
+{
+    HistSummary s;
+    hist_summary(h, &s);
+    if (s.count == 0) return;
+
+    LOG_I("%s: %llu samples, min %.3f / p50 %.3f / p90 %.3f / p99 %.3f / "
+          "p99.9 %.3f / max %.3f ms",
+          name, (unsigned long long)s.count, s.min / 1e6, s.p50 / 1e6,
+          s.p90 / 1e6, s.p99 / 1e6, s.p999 / 1e6, s.max / 1e6);
+}
+
+/* ---- Hot-path stages ---- */
+
+static const char *const HIST_NAMES[HIST_STAGES] = {
+    "Capture read", "Chunk inter-arrival", "Playback write", "End to end",
+};
+
+static Histogram stages[HIST_STAGES];
+
+Histogram *hist_stage(HistStage stage)
+{
+    return &stages[stage];
+}
+
+void hist_stage_log(HistStage stage)
+{
+    hist_log(HIST_NAMES[stage], &stages[stage]);
+}
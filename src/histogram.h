@@ -0,0 +1,75 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "soundshare.h"
+
+/*
+ * Log-bucketed histogram of nanosecond durations, HDR style.
+ *
+ * Each power of two is split into HIST_SUB linear buckets, so a bucket
+ * is never wider than 1/HIST_SUB of the values in it and percentiles
+ * come out within about 3% at any scale.  Recording is a handful of
+ * relaxed atomic adds, so any number of threads may record into one
+ * histogram while another reads it.  Where a thread records per item,
+ * such as one histogram per receiver, hist_merge() adds them up when
+ * they are read rather than have the hot path share one.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+/* Values up to 2^HIST_MAX_BITS ns (about 18 minutes); longer ones clamp */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t n;
+    _Atomic int64_t  sum;
+    _Atomic int64_t  min;
+    _Atomic int64_t  max;
+} Histogram;
+
+typedef struct {
+    uint64_t count;
+    int64_t  min;      /* exact, like max; percentiles are bucket midpoints */
+    int64_t  p50;
+    int64_t  p90;
+    int64_t  p99;
+    int64_t  p999;
+    int64_t  max;
+    double   mean;
+} HistSummary;
+
+void    hist_reset(Histogram *h);
+/** One value; negative ones count as 0. */
+void    hist_record(Histogram *h, int64_t ns);
+/** Smallest value with at least `pct` percent of the samples at or below it; -1 if empty. */
+int64_t hist_percentile(const Histogram *h, double pct);
+/** All zero with count 0 if empty. */
+void    hist_summary(const Histogram *h, HistSummary *out);
+/** Add everything in `src` to `dst`. */
+void    hist_merge(Histogram *dst, const Histogram *src);
+/** One line with count and percentiles, nothing if empty. */
+void    hist_log(const char *name, const Histogram *h);
+
+/*
+ * Hot-path timings, process-wide.  Each is recorded by the one thread
+ * that sees it and logged and reset by the side it belongs to, which
+ * must reset it before first use; SIGUSR1 asks for a dump, SIGUSR2 for
+ * a dump and a fresh start (AppState.hist_request).
+ */
+typedef enum {
+    HIST_CAPTURE_READ,    /* streamer: one chunk's capture read */
+    HIST_RECV_GAP,        /* receiver: between chunks arriving */
+    HIST_PLAYBACK_WRITE,  /* receiver: blocked writing a chunk to the sink */
+    HIST_END_TO_END,      /* receiver: capture to speaker */
+    HIST_STAGES
+} HistStage;
+
+#define HIST_REQ_DUMP   0x01
+#define HIST_REQ_RESET  0x02
+
+Histogram *hist_stage(HistStage stage);
+void       hist_stage_log(HistStage stage);
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,457 @@
+#include "jitterbuf.h"
+
+/* Drift loop gains: ppm per ms of depth error, and per ms*s of it */
+#define DRIFT_KP   50.0
+#define DRIFT_KI   0.6
+
+typedef struct {
+    uint8_t  *data;
+    size_t    len;
+    uint32_t  seq;
+    uint64_t  ts;
+    int64_t   put_ns;     /* when it came in */
+    bool      silent;     /* from a DTX marker */
+    bool      full;
+} JitterSlot;
+
+struct JitterBuffer {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+
+    JitterSlot *slots;
+    int         nslots;
+    size_t      slot_cap;
+    size_t      bpf;            /* bytes per sample frame */
+    int         sample_rate;
+    size_t      conceal_len;    /* length of the last chunk played */
+
+    bool        started;
+    bool        buffering;      /* holding playout until target depth */
+    bool        closed;
+    bool        draining;       /* play out what is left, then end */
+    bool        scheduled;      /* playout times itself: no trim, no drift */
+    uint32_t    next_seq;       /* next chunk to play */
+    uint64_t    next_ts;        /* its capture position, for concealment */
+    int         depth;          /* full slots */
+    int64_t     depth_frames;
+
+    /* Target depth */
+    int64_t     chunk_ns;
+    double      jitter_ns;
+    int64_t     last_transit;
+    bool        have_transit;
+    int64_t     boost_ns;       /* added after underruns, decays */
+    double      wait_ns;        /* smoothed time from put to get */
+    int64_t     calm_since;
+    int64_t     window_start;   /* trim window: lowest depth seen in it */
+    int64_t     window_min;
+    double      trim_ns;        /* excess depth still to play off */
+    double      trim_ppm;       /* speed-up applied for it */
+
+    /* Clock drift: hold the smoothed depth at its settled level */
+    double      fill_ns;        /* smoothed depth */
+    double      setpoint_ns;
+    bool        settled;        /* setpoint taken */
+    int64_t     settle_until;
+    double      drift_ppm;      /* integral term: the clock offset */
+    double      ratio_ppm;      /* correction currently applied */
+
+    long        late;
+    long        lost;
+    long        underruns;
+    double      trimmed_ns;
+};
+
+JitterBuffer *jitter_create(const AudioConfig *cfg)
+{
+    JitterBuffer *jb = calloc(1, sizeof(*jb));
+    if (!jb) return NULL;
+
+    /* First, so jitter_destroy() can clean up from here on */
+    pthread_mutex_init(&jb->lock, NULL);
+    pthread_cond_init(&jb->cond, NULL);
+
+    jb->bpf         = (size_t)(cfg->channels * cfg->bytes_per_sample);
+    jb->sample_rate = cfg->sample_rate;
+    jb->slot_cap    = (size_t)cfg->chunk_size;
+    jb->conceal_len = (size_t)cfg->chunk_size;
+    jb->chunk_ns    = (int64_t)cfg->frames_per_buffer * 1000000000LL / cfg->sample_rate;
+
+    /* Room for the deepest target and a replay, plus a little
+       reordering headroom                                         */
+    int64_t chunk_ms = jb->chunk_ns / 1000000;
+    jb->nslots = (int)((JITTER_MAX_MS + JITTER_REPLAY_MS) / (chunk_ms > 0 ? chunk_ms : 1)) + 4;
+    if (jb->nslots < 8) jb->nslots = 8;
+
+    jb->slots = calloc((size_t)jb->nslots, sizeof(JitterSlot));
+    if (!jb->slots) {
+        jitter_destroy(jb);
+        return NULL;
+    }
+    for (int i = 0; i < jb->nslots; i++) {
+        jb->slots[i].data = malloc(jb->slot_cap);
+        if (!jb->slots[i].data) {
+            jitter_destroy(jb);
+            return NULL;
+        }
+    }
+
+    jb->buffering  = true;
+    jb->calm_since   = current_time_ns();
+    jb->window_start = jb->calm_since;
+    jb->window_min   = INT64_MAX;
+    return jb;
+}
+
+void jitter_destroy(JitterBuffer *jb)
+{
+    if (!jb) return;
+    if (jb->slots) {
+        for (int i = 0; i < jb->nslots; i++)
+            free(jb->slots[i].data);
+        free(jb->slots);
+    }
+    pthread_mutex_destroy(&jb->lock);
+    pthread_cond_destroy(&jb->cond);
+    free(jb);
+}
+
+/* ---- Target depth ---- */
+
+static int64_t target_ns(JitterBuffer *jb, int64_t now)
+{
+    /* Underrun headroom wears off while playback stays clean */
+    if (jb->boost_ns > 0 && now - jb->calm_since >= (int64_t)JITTER_DECAY_MS * 1000000) {
+        jb->boost_ns  /= 2;
+        jb->calm_since = now;
+    }
+
+    int64_t t = jb->chunk_ns + (int64_t)(4.0 * jb->jitter_ns) + jb->boost_ns;
+    if (t < (int64_t)JITTER_MIN_MS * 1000000) t = (int64_t)JITTER_MIN_MS * 1000000;
+    if (t > (int64_t)JITTER_MAX_MS * 1000000) t = (int64_t)JITTER_MAX_MS * 1000000;
+    return t;
+}
+
+static int64_t depth_ns(const JitterBuffer *jb)
+{
+    return jb->depth_frames * 1000000000LL / jb->sample_rate;
+}
+
+static void slot_clear(JitterBuffer *jb, JitterSlot *s)
+{
+    if (!s->full) return;
+    s->full = false;
+    jb->depth--;
+    jb->depth_frames -= (int64_t)(s->len / jb->bpf);
+}
+
+/* ---- Clock drift ---- */
+
+/*
+ * The streamer's capture clock and our DAC never run at exactly the
+ * same rate, so with playback paced by PulseAudio the depth creeps up
+ * or down by the difference.  A slow PI loop on the smoothed depth
+ * turns that trend into a playout rate correction for the resampler;
+ * its integral term ends up as the clock offset itself.
+ */
+
+static void restart_drift(JitterBuffer *jb, int64_t now)
+{
+    jb->settled      = false;
+    jb->settle_until = now + (int64_t)JITTER_SETTLE_MS * 1000000;
+    jb->fill_ns      = (double)depth_ns(jb);
+}
+
+static void track_drift(JitterBuffer *jb, int64_t now, size_t played)
+{
+    double dt = (double)(played / jb->bpf) / jb->sample_rate;
+    double a  = dt / (JITTER_DRIFT_TAU_MS / 1000.0);
+    if (a > 1.0) a = 1.0;
+    jb->fill_ns += ((double)depth_ns(jb) - jb->fill_ns) * a;
+
+    if (!jb->settled) {
+        if (now < jb->settle_until) return;
+        jb->setpoint_ns = jb->fill_ns;
+        jb->settled     = true;
+    }
+
+    double err_ms = (jb->fill_ns - jb->setpoint_ns) / 1e6;
+    jb->drift_ppm += DRIFT_KI * err_ms * dt;
+    if (jb->drift_ppm >  JITTER_DRIFT_MAX_PPM) jb->drift_ppm =  JITTER_DRIFT_MAX_PPM;
+    if (jb->drift_ppm < -JITTER_DRIFT_MAX_PPM) jb->drift_ppm = -JITTER_DRIFT_MAX_PPM;
+
+    jb->ratio_ppm = jb->drift_ppm + DRIFT_KP * err_ms;
+    if (jb->ratio_ppm >  JITTER_DRIFT_MAX_PPM) jb->ratio_ppm =  JITTER_DRIFT_MAX_PPM;
+    if (jb->ratio_ppm < -JITTER_DRIFT_MAX_PPM) jb->ratio_ppm = -JITTER_DRIFT_MAX_PPM;
+}
+
+/*
+ * Play off excess depth on top of the drift correction.  The setpoint
+ * comes down with it, so the drift loop does not read the falling
+ * depth as a clock change and push back.
+ */
+static void play_off_excess(JitterBuffer *jb, size_t played)
+{
+    jb->trim_ppm = jb->trim_ns > 0.0 ? JITTER_TRIM_PPM : 0.0;
+    if (jb->trim_ppm == 0.0) return;
+
+    double dt_ns  = (double)(played / jb->bpf) * 1e9 / jb->sample_rate;
+    double gained = dt_ns * JITTER_TRIM_PPM * 1e-6;
+    if (gained > jb->trim_ns) gained = jb->trim_ns;
+
+    jb->trim_ns    -= gained;
+    jb->trimmed_ns += gained;
+    if (jb->settled)
+        jb->setpoint_ns -= gained;
+}
+
+/* ---- Network side ---- */
+
+/* Jitter: variation in transit time, on the streamer's timeline */
+static void track_transit(JitterBuffer *jb, int64_t now, uint64_t ts_frames)
+{
+    /* Split so the product stays in range for any stream age */
+    uint64_t rate    = (uint64_t)jb->sample_rate;
+    int64_t  ts_ns   = (int64_t)(ts_frames / rate * 1000000000ULL +
+                                 ts_frames % rate * 1000000000ULL / rate);
+    int64_t  transit = now - ts_ns;
+    if (jb->have_transit) {
+        int64_t d = transit - jb->last_transit;
+        if (d < 0) d = -d;
+        jb->jitter_ns += ((double)d - jb->jitter_ns) / 16.0;
+    }
+    jb->last_transit = transit;
+    jb->have_transit = true;
+}
+
+/* Where chunk `seq` goes, or NULL if its turn has passed.  Caller
+   holds the lock.                                                   */
+static JitterSlot *slot_for(JitterBuffer *jb, uint32_t seq)
+{
+    if (!jb->started) {
+        jb->next_seq = seq;
+        jb->started  = true;
+    }
+
+    int32_t ahead = (int32_t)(seq - jb->next_seq);
+    if (ahead < 0) return NULL;
+    if (ahead >= jb->nslots) {
+        /* Far ahead of playout (stall or streamer restart): start over */
+        LOG_W("Jitter buffer overflow (%d chunks ahead), resyncing", ahead);
+        for (int i = 0; i < jb->nslots; i++)
+            slot_clear(jb, &jb->slots[i]);
+        jb->next_seq  = seq;
+        jb->buffering = true;
+    }
+    return &jb->slots[seq % (uint32_t)jb->nslots];
+}
+
+static void slot_fill(JitterBuffer *jb, JitterSlot *s, uint32_t seq, uint64_t ts_frames,
+                      const void *data, size_t len, bool silent, int64_t now)
+{
+    if (s->full) return;
+    if (silent) memset(s->data, 0, len);
+    else        memcpy(s->data, data, len);
+    s->len    = len;
+    s->seq    = seq;
+    s->ts     = ts_frames;
+    s->put_ns = now;
+    s->silent = silent;
+    s->full   = true;
+    jb->depth++;
+    jb->depth_frames += (int64_t)(len / jb->bpf);
+}
+
+void jitter_put(JitterBuffer *jb, uint32_t seq, uint64_t ts_frames,
+                const void *data, size_t len)
+{
+    int64_t now = current_time_ns();
+    if (len > jb->slot_cap) len = jb->slot_cap;
+
+    pthread_mutex_lock(&jb->lock);
+    track_transit(jb, now, ts_frames);
+
+    JitterSlot *s = slot_for(jb, seq);
+    if (s) {
+        slot_fill(jb, s, seq, ts_frames, data, len, false, now);
+        pthread_cond_signal(&jb->cond);
+    } else {
+        jb->late++;
+    }
+    pthread_mutex_unlock(&jb->lock);
+}
+
+void jitter_put_silence(JitterBuffer *jb, uint32_t seq, uint64_t ts_frames,
+                        size_t len, int count)
+{
+    int64_t  now    = current_time_ns();
+    uint64_t frames = len / jb->bpf;
+    if (len > jb->slot_cap || count <= 0) return;
+
+    pthread_mutex_lock(&jb->lock);
+
+    /* The marker left once the run's last chunk was captured */
+    track_transit(jb, now, ts_frames + (uint64_t)(count - 1) * frames);
+
+    for (int i = 0; i < count; i++) {
+        /* A run can start before this receiver joined or resumed */
+        JitterSlot *s = slot_for(jb, seq + (uint32_t)i);
+        if (s) slot_fill(jb, s, seq + (uint32_t)i, ts_frames + (uint64_t)i * frames,
+                         NULL, len, true, now);
+    }
+    pthread_cond_signal(&jb->cond);
+    pthread_mutex_unlock(&jb->lock);
+}
+
+/* ---- Playout side ---- */
+
+size_t jitter_get(JitterBuffer *jb, void *out, size_t cap, uint64_t *ts_frames)
+{
+    size_t len    = 0;
+    bool   silent = false;
+
+    pthread_mutex_lock(&jb->lock);
+    while (!jb->closed) {
+        int64_t now    = current_time_ns();
+        int64_t target = target_ns(jb, now);
+
+        if (jb->draining && jb->depth == 0)
+            break;
+        if (jb->buffering && !jb->draining) {
+            if (jb->depth > 0 && (depth_ns(jb) >= target || jb->depth >= jb->nslots - 1)) {
+                jb->buffering = false;
+                restart_drift(jb, now);
+            } else {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 20000000;
+                if (ts.tv_nsec >= 1000000000) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&jb->cond, &jb->lock, &ts);
+                continue;
+            }
+        }
+
+        JitterSlot *s = &jb->slots[jb->next_seq % (uint32_t)jb->nslots];
+        if (s->full && s->seq == jb->next_seq) {
+            len = s->len < cap ? s->len : cap;
+            memcpy(out, s->data, len);
+            *ts_frames      = s->ts;
+            jb->next_ts     = s->ts + s->len / jb->bpf;
+            jb->wait_ns    += ((double)(now - s->put_ns) - jb->wait_ns) / 16.0;
+            jb->conceal_len = s->len;
+            silent          = s->silent;
+            slot_clear(jb, s);
+            jb->next_seq++;
+        } else if (jb->depth > 0) {
+            /* Later chunks are here, this one is not: it is gone */
+            len = jb->conceal_len < cap ? jb->conceal_len : cap;
+            memset(out, 0, len);
+            *ts_frames   = jb->next_ts;
+            jb->next_ts += len / jb->bpf;
+            jb->lost++;
+            jb->next_seq++;
+        } else {
+            jb->underruns++;
+            jb->boost_ns  += jb->chunk_ns;
+            jb->calm_since = now;
+            jb->buffering  = true;
+            jb->trim_ns    = 0.0;
+            LOG_D("Jitter buffer underrun, target now %lld ms",
+                  (long long)(target_ns(jb, now) / 1000000));
+            continue;
+        }
+        if (jb->scheduled)
+            break;
+
+        /*
+         * Depth that never got used over a whole window is pure latency.
+         * It is played off by running slightly fast until it is gone,
+         * which resampling keeps inaudible where dropping a chunk would
+         * click.
+         */
+        int64_t d = depth_ns(jb);
+        if (d < jb->window_min) jb->window_min = d;
+        if (now - jb->window_start >= (int64_t)JITTER_TRIM_MS * 1000000) {
+            int64_t excess = jb->window_min - target;
+            /* Idempotent while the previous excess is still going */
+            if (excess > jb->chunk_ns && (double)excess > jb->trim_ns)
+                jb->trim_ns = (double)excess;
+            jb->window_start = now;
+            jb->window_min   = INT64_MAX;
+        }
+
+        /* A marker is held back until its run ends, so the depth dips
+           through a silent run; that is not the clocks drifting       */
+        if (!silent) track_drift(jb, now, len);
+        play_off_excess(jb, len);
+        break;
+    }
+    pthread_mutex_unlock(&jb->lock);
+    return len;
+}
+
+void jitter_drain(JitterBuffer *jb)
+{
+    pthread_mutex_lock(&jb->lock);
+    jb->draining = true;
+    pthread_cond_broadcast(&jb->cond);
+    pthread_mutex_unlock(&jb->lock);
+}
+
+void jitter_reset(JitterBuffer *jb)
+{
+    pthread_mutex_lock(&jb->lock);
+    for (int i = 0; i < jb->nslots; i++)
+        slot_clear(jb, &jb->slots[i]);
+    jb->started      = false;
+    jb->buffering    = true;
+    jb->have_transit = false;   /* the outage is not jitter */
+    jb->trim_ns      = 0.0;
+    pthread_cond_broadcast(&jb->cond);
+    pthread_mutex_unlock(&jb->lock);
+}
+
+void jitter_set_scheduled(JitterBuffer *jb, bool on)
+{
+    pthread_mutex_lock(&jb->lock);
+    jb->scheduled = on;
+    jb->ratio_ppm = 0.0;
+    jb->trim_ppm  = 0.0;
+    jb->trim_ns   = 0.0;
+    pthread_mutex_unlock(&jb->lock);
+}
+
+void jitter_close(JitterBuffer *jb)
+{
+    pthread_mutex_lock(&jb->lock);
+    jb->closed = true;
+    pthread_cond_broadcast(&jb->cond);
+    pthread_mutex_unlock(&jb->lock);
+}
+
+double jitter_playout_ratio(JitterBuffer *jb)
+{
+    pthread_mutex_lock(&jb->lock);
+    double r = 1.0 + (jb->ratio_ppm + jb->trim_ppm) * 1e-6;
+    pthread_mutex_unlock(&jb->lock);
+    return r;
+}
+
+void jitter_get_stats(JitterBuffer *jb, JitterStats *out)
+{
+    pthread_mutex_lock(&jb->lock);
+    int64_t now = current_time_ns();
+    out->depth_ms  = (int)(depth_ns(jb) / 1000000);
+    out->target_ms = (int)(target_ns(jb, now) / 1000000);
+    out->jitter_ms = (int)(jb->jitter_ns / 1000000.0);
+    out->wait_ms   = jb->wait_ns / 1e6;
+    out->late      = jb->late;
+    out->lost      = jb->lost;
+    out->underruns = jb->underruns;
+    out->trimmed_ms = (long)(jb->trimmed_ns / 1e6);
+    out->drift_ppm = jb->drift_ppm;
+    pthread_mutex_unlock(&jb->lock);
+}
@@ -0,0 +1,106 @@
+#ifndef JITTERBUF_H
+#define JITTERBUF_H
+
+#include "soundshare.h"
+#include "config.h"
+
+/*
+ * Adaptive jitter buffer between the network and playback.
+ *
+ * The receive loop puts chunks in by sequence number as they arrive;
+ * a playout thread takes them out in order at the pace PulseAudio
+ * consumes them.  The buffer aims for a target depth derived from the
+ * measured inter-arrival jitter (RFC 3550 style), grows it after an
+ * underrun, lets that growth decay while the link stays calm, and
+ * plays slightly fast when it sits well above target for long.  Slow
+ * creep from clock drift is measured separately; both end up in the
+ * rate correction the playout side hands to the resampler, so no
+ * chunk is ever dropped to bring latency down.
+ */
+
+#define JITTER_MIN_MS        10
+#define JITTER_MAX_MS        500
+/* Room on top of that for what a resumed connection replays (the
+   streamer's RESUME_REPLAY_MS); it is then played off like any excess */
+#define JITTER_REPLAY_MS     2000
+/* Calm time before an underrun's extra depth is halved */
+#define JITTER_DECAY_MS      10000
+/* Time spent above target before the excess is played off, and how
+   much faster than real time that happens (0.5%, under 9 cents)    */
+#define JITTER_TRIM_MS       2000
+#define JITTER_TRIM_PPM      5000.0
+/* Clock drift loop: depth smoothing, settling after a (re)fill, limit */
+#define JITTER_DRIFT_TAU_MS  4000
+#define JITTER_SETTLE_MS     3000
+#define JITTER_DRIFT_MAX_PPM 1000.0
+
+typedef struct JitterBuffer JitterBuffer;
+
+typedef struct {
+    int    depth_ms;
+    int    target_ms;
+    int    jitter_ms;     /* smoothed inter-arrival jitter */
+    double wait_ms;       /* smoothed time a chunk spends queued */
+    long   late;          /* arrived after their turn had passed */
+    long   lost;          /* never arrived, played as silence */
+    long   underruns;     /* buffer ran dry */
+    long   trimmed_ms;    /* latency played off by playing fast */
+    double drift_ppm;     /* streamer clock relative to our playback */
+} JitterStats;
+
+JitterBuffer *jitter_create(const AudioConfig *cfg);
+void          jitter_destroy(JitterBuffer *jb);
+
+/**
+ * Network side: queue chunk `seq`, captured at `ts_frames` on the
+ * streamer's timeline.  Chunks may arrive out of order or not at all.
+ */
+void jitter_put(JitterBuffer *jb, uint32_t seq, uint64_t ts_frames,
+                const void *data, size_t len);
+
+/**
+ * Network side: a DTX marker for `count` chunks of silence from `seq`
+ * on, each `len` bytes, the first captured at `ts_frames`.  Chunks in
+ * it whose turn has passed are skipped without counting as late.
+ */
+void jitter_put_silence(JitterBuffer *jb, uint32_t seq, uint64_t ts_frames,
+                        size_t len, int count);
+
+/**
+ * Playout side: copy the next chunk (or concealment for a lost one)
+ * into `out`, waiting while the buffer (re)fills to its target, and
+ * its capture position into `*ts_frames`.
+ * Returns the byte count, or 0 once jitter_close() was called.
+ */
+size_t jitter_get(JitterBuffer *jb, void *out, size_t cap, uint64_t *ts_frames);
+
+/**
+ * No more input: jitter_get() plays what is queued without waiting to
+ * refill, then returns 0.
+ */
+void jitter_drain(JitterBuffer *jb);
+
+/**
+ * Forget what is queued and where playout stands: the next chunk put
+ * starts the stream over, as after rejoining it live.
+ */
+void jitter_reset(JitterBuffer *jb);
+
+/**
+ * The playout side keeps its own schedule (synchronized playout): no
+ * latency is trimmed and no drift correction is worked out here.
+ */
+void jitter_set_scheduled(JitterBuffer *jb, bool on);
+
+/** Wake the playout side and make jitter_get() return 0. */
+void jitter_close(JitterBuffer *jb);
+
+/**
+ * Input frames to consume per output frame so the depth stays level
+ * despite clock drift between the streamer and local playback.
+ */
+double jitter_playout_ratio(JitterBuffer *jb);
+
+void jitter_get_stats(JitterBuffer *jb, JitterStats *out);
+
+#endif /* JITTERBUF_H */
@@ -0,0 +1,81 @@
+#include "latency.h"
+
+/* Smoothing: each sample moves a stage 1/LAT_SMOOTH of the way */
+#define LAT_SMOOTH 8
+
+static const char *const STAGE_NAMES[LAT_STAGES] = {
+    "capture", "network", "send queue", "receive queue",
+    "decode", "jitter buffer", "playback",
+};
+
+/* Smoothed ns, -1 while unmeasured; written by one thread each */
+static _Atomic int64_t stage_ns[LAT_STAGES] = { -1, -1, -1, -1, -1, -1, -1 };
+static _Atomic int64_t total_ns = -1;
+
+static void smooth(_Atomic int64_t *v, int64_t ns)
+{
+    int64_t old = atomic_load_explicit(v, memory_order_relaxed);
+    if (ns < 0) ns = 0;
+    atomic_store_explicit(v, old < 0 ? ns : old + (ns - old) / LAT_SMOOTH,
+                          memory_order_relaxed);
+}
+
+void latency_reset(void)
+{
+    for (int i = 0; i < LAT_STAGES; i++)
+        atomic_store(&stage_ns[i], -1);
+    atomic_store(&total_ns, -1);
+}
+
+void latency_record(LatencyStage stage, int64_t ns)
+{
+    smooth(&stage_ns[stage], ns);
+}
+
+void latency_record_total(int64_t ns)
+{
+    smooth(&total_ns, ns);
+}
+
+void latency_get(LatencyBreakdown *out)
+{
+    out->sum_ms = 0.0;
+    for (int i = 0; i < LAT_STAGES; i++) {
+        int64_t ns = atomic_load_explicit(&stage_ns[i], memory_order_relaxed);
+        out->stage_ms[i] = ns < 0 ? -1.0 : ns / 1e6;
+        if (ns >= 0) out->sum_ms += ns / 1e6;
+    }
+    int64_t t = atomic_load_explicit(&total_ns, memory_order_relaxed);
+    out->total_ms = t < 0 ? -1.0 : t / 1e6;
+}
+
+int64_t latency_total_ms(void)
+{
+    LatencyBreakdown b;
+    latency_get(&b);
+    if (b.total_ms >= 0.0) return (int64_t)llround(b.total_ms);
+    return b.sum_ms > 0.0 ? (int64_t)llround(b.sum_ms) : -1;
+}
+
+void latency_log(void)
+{
+    LatencyBreakdown b;
+    latency_get(&b);
+
+    char   stages[256];
+    size_t n = 0;
+    for (int i = 0; i < LAT_STAGES && n < sizeof(stages); i++) {
+        if (b.stage_ms[i] < 0.0)
+            n += (size_t)snprintf(stages + n, sizeof(stages) - n, "%s%s -",
+                                  i ? ", " : "", STAGE_NAMES[i]);
+        else
+            n += (size_t)snprintf(stages + n, sizeof(stages) - n, "%s%s %.1f",
+                                  i ? ", " : "", STAGE_NAMES[i], b.stage_ms[i]);
+    }
+
+    if (b.total_ms >= 0.0)
+        LOG_I("Latency %.1f ms end to end, stages add up to %.1f: %s",
+              b.total_ms, b.sum_ms, stages);
+    else
+        LOG_I("Latency about %.1f ms (not measured end to end): %s", b.sum_ms, stages);
+}
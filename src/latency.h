@@ -0,0 +1,45 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "soundshare.h"
+
+/*
+ * Where a receiver's capture-to-speaker latency goes.
+ *
+ * Each stage is timed by the one thread that sees it (receive loop,
+ * playout, ping client) and smoothed.  The total is measured on its own,
+ * from the streamer's capture timestamps and the estimated offset
+ * between the two clocks, so the stages can be checked against it.
+ * The send queue is what is left of the measured transit once the wire
+ * and our own socket backlog are taken out.
+ */
+
+typedef enum {
+    LAT_CAPTURE,      /* a chunk fills before it is stamped and sent */
+    LAT_NETWORK,      /* half the round trip */
+    LAT_SEND_QUEUE,   /* streamer's ring and socket buffers */
+    LAT_RECV_QUEUE,   /* our socket's backlog (SIOCINQ) */
+    LAT_DECODE,
+    LAT_JITTER,       /* jitter buffer depth */
+    LAT_PLAYBACK,     /* PulseAudio and the sink, plus resampler delay */
+    LAT_STAGES
+} LatencyStage;
+
+typedef struct {
+    double stage_ms[LAT_STAGES];   /* -1 = not measured */
+    double sum_ms;                 /* of the measured stages */
+    double total_ms;               /* measured end to end, -1 = unknown */
+} LatencyBreakdown;
+
+/** Forget everything, e.g. for a new stream. */
+void    latency_reset(void);
+/** One sample of `stage`; each stage has a single writer. */
+void    latency_record(LatencyStage stage, int64_t ns);
+void    latency_record_total(int64_t ns);
+
+void    latency_get(LatencyBreakdown *out);
+/** The measured total if known, else the sum of the stages; -1 if neither. */
+int64_t latency_total_ms(void);
+void    latency_log(void);
+
+#endif /* LATENCY_H */
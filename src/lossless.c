@@ -0,0 +1,1032 @@
+#include "lossless.h"
+#include "protocol.h"
+
+/*
+ * Chunk layout:
+ *
+ *   u32 frames
+ *   u16 blocks
+ *   u32 byte length of each block
+ *   the blocks, each starting on a byte
+ *
+ * Block b holds frames [b * frames / blocks, (b + 1) * frames / blocks),
+ * never more than LOSSLESS_BLOCK.  Blocks share no state, so they are
+ * coded and decoded in parallel.  Inside a block (big-endian bit
+ * stream, padded to a byte at the end):
+ *
+ *   [2 bits stereo mode, stereo only]
+ *   per channel subframe:
+ *     2 bits type, 5 bits wasted (low zero bits shifted out)
+ *     CONSTANT: value
+ *     VERBATIM: every sample
+ *     FIXED:    3 bits order, `order` warm-up samples, residual
+ *     LPC:      4 bits order - 1, 4 bits precision - 1, 5 bits shift,
+ *               `order` coefficients of `precision` bits, `order`
+ *               warm-up samples, residual
+ *   residual:   4 bits partition order p, then 2^p partitions of
+ *               5 bits Rice k + codes; k == RICE_ESCAPE is followed
+ *               by 6 bits width and the residuals stored plainly.
+ *
+ * An LPC sample is predicted as (sum of coef[j] * x[i - 1 - j]) >> shift.
+ * Values and samples are two's complement, `width` bits wide: the
+ * stream's bit depth, one more for a side channel, less the wasted bits.
+ */
+
+#define MAX_CHANNELS    8
+#define MAX_ORDER       4
+#define MAX_LPC_ORDER   12
+#define MAX_LPC_SHIFT   15
+#define MAX_PORDER      8
+#define RICE_ESCAPE     31
+
+/* Blocks are split further down to this size to keep workers busy */
+#define MIN_BLOCK       1024
+
+/* lossless_estimate_bits() looks at this many windows of this many frames */
+#define PROBE_WINDOWS   16
+#define PROBE_FRAMES    64
+#define CHUNK_HDR_SIZE  6
+
+#define SUB_CONSTANT    0
+#define SUB_VERBATIM    1
+#define SUB_FIXED       2
+#define SUB_LPC         3
+
+#define STEREO_LR       0
+#define STEREO_LS       1   /* left, side */
+#define STEREO_SR       2   /* side, right */
+#define STEREO_MS       3   /* mid, side */
+
+/* Decoded values beyond this are corruption, not audio */
+#define VALUE_LIMIT     ((int64_t)1 << 40)
+
+/* ---- Bit I/O ---- */
+
+typedef struct {
+    uint8_t  *buf;
+    size_t    cap;
+    size_t    pos;
+    uint64_t  acc;
+    int       nacc;
+    bool      overflow;
+} BitWriter;
+
+typedef struct {
+    const uint8_t *buf;
+    size_t         len;
+    size_t         pos;
+    uint64_t       acc;
+    int            nacc;
+    bool           err;
+} BitReader;
+
+static inline uint64_t low_bits(uint64_t v, int n)
+{
+    return n >= 64 ? v : v & (((uint64_t)1 << n) - 1);
+}
+
+/* n <= 32 */
+static void bw_put(BitWriter *w, uint64_t v, int n)
+{
+    if (n == 0) return;
+    w->acc   = (w->acc << n) | low_bits(v, n);
+    w->nacc += n;
+    while (w->nacc >= 8) {
+        w->nacc -= 8;
+        if (w->pos < w->cap)
+            w->buf[w->pos++] = (uint8_t)(w->acc >> w->nacc);
+        else
+            w->overflow = true;
+    }
+}
+
+static void bw_put_signed(BitWriter *w, int64_t v, int n)
+{
+    if (n > 32) {
+        bw_put(w, (uint64_t)v >> 32, n - 32);
+        n = 32;
+    }
+    bw_put(w, (uint64_t)v, n);
+}
+
+static void bw_put_unary(BitWriter *w, uint64_t q)
+{
+    while (q >= 32) {
+        bw_put(w, 0, 32);
+        q -= 32;
+    }
+    bw_put(w, 1, (int)q + 1);
+}
+
+static void bw_flush(BitWriter *w)
+{
+    if (w->nacc > 0)
+        bw_put(w, 0, 8 - w->nacc);
+}
+
+/* n <= 32 */
+static uint64_t br_get(BitReader *r, int n)
+{
+    if (n == 0) return 0;
+    while (r->nacc < n) {
+        r->acc <<= 8;
+        if (r->pos < r->len)
+            r->acc |= r->buf[r->pos++];
+        else
+            r->err = true;
+        r->nacc += 8;
+    }
+    r->nacc -= n;
+    return low_bits(r->acc >> r->nacc, n);
+}
+
+static int64_t br_get_signed(BitReader *r, int n)
+{
+    if (n == 0) return 0;
+    uint64_t u = 0;
+    int      left = n;
+    if (left > 32) {
+        u     = br_get(r, left - 32) << 32;
+        left  = 32;
+    }
+    u |= br_get(r, left);
+    return (int64_t)(u << (64 - n)) >> (64 - n);
+}
+
+static uint64_t br_get_unary(BitReader *r)
+{
+    uint64_t q = 0;
+    while (br_get(r, 1) == 0) {
+        if (r->err) return 0;
+        q++;
+    }
+    return q;
+}
+
+/* ---- Prediction ---- */
+
+static inline int64_t fixed_residual(const int32_t *x, int i, int order)
+{
+    switch (order) {
+    case 0:  return x[i];
+    case 1:  return (int64_t)x[i] - x[i - 1];
+    case 2:  return (int64_t)x[i] - 2 * (int64_t)x[i - 1] + x[i - 2];
+    case 3:  return (int64_t)x[i] - 3 * (int64_t)x[i - 1] + 3 * (int64_t)x[i - 2] - x[i - 3];
+    default: return (int64_t)x[i] - 4 * (int64_t)x[i - 1] + 6 * (int64_t)x[i - 2]
+                    - 4 * (int64_t)x[i - 3] + x[i - 4];
+    }
+}
+
+static inline int64_t fixed_predict(const int64_t *x, int i, int order)
+{
+    switch (order) {
+    case 0:  return 0;
+    case 1:  return x[i - 1];
+    case 2:  return 2 * x[i - 1] - x[i - 2];
+    case 3:  return 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+    default: return 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4];
+    }
+}
+
+/* Order with the smallest absolute residual sum; that sum in *cost */
+static int best_order(const int32_t *x, int n, uint64_t *cost)
+{
+    uint64_t sum[MAX_ORDER + 1] = {0};
+    for (int i = MAX_ORDER; i < n; i++) {
+        for (int o = 0; o <= MAX_ORDER; o++) {
+            int64_t e = fixed_residual(x, i, o);
+            sum[o] += (uint64_t)(e < 0 ? -e : e);
+        }
+    }
+
+    int best = 0;
+    for (int o = 1; o <= MAX_ORDER && o < n; o++)
+        if (sum[o] < sum[best]) best = o;
+    *cost = sum[best];
+    return best;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int signed_width(int64_t v)
+{
+    uint64_t m = (uint64_t)(v < 0 ? ~v : v);
+    int w = 1;
+    while (m) {
+        w++;
+        m >>= 1;
+    }
+    return w;
+}
+
+/* ---- Residual coding ---- */
+
+typedef struct {
+    int      k;         /* RICE_ESCAPE: stored plainly */
+    int      width;     /* escape width */
+    uint64_t bits;
+} PartPlan;
+
+static PartPlan plan_partition(const uint64_t *u, const int64_t *e, int n)
+{
+    PartPlan best = { .k = RICE_ESCAPE, .width = 1 };
+    uint64_t sum  = 0;
+    int64_t  lo   = 0, hi = 0;
+    for (int i = 0; i < n; i++) {
+        sum += u[i];
+        if (e[i] < lo) lo = e[i];
+        if (e[i] > hi) hi = e[i];
+    }
+
+    int wl = signed_width(lo), wh = signed_width(hi);
+    best.width = wl > wh ? wl : wh;
+    best.bits  = 5 + 6 + (uint64_t)n * (uint64_t)best.width;
+    if (n == 0) {
+        best.k    = 0;
+        best.bits = 5;
+        return best;
+    }
+
+    int k0 = 0;
+    while (k0 < 30 && ((uint64_t)n << (k0 + 1)) <= sum) k0++;
+
+    for (int k = k0 > 0 ? k0 - 1 : 0; k <= k0 + 1 && k < RICE_ESCAPE; k++) {
+        uint64_t bits = 5 + (uint64_t)n * (uint64_t)(k + 1);
+        for (int i = 0; i < n; i++)
+            bits += u[i] >> k;
+        if (bits < best.bits) {
+            best.k    = k;
+            best.bits = bits;
+        }
+    }
+    return best;
+}
+
+static void write_partition(BitWriter *w, const PartPlan *pp,
+                            const uint64_t *u, const int64_t *e, int n)
+{
+    bw_put(w, (uint64_t)pp->k, 5);
+    if (pp->k == RICE_ESCAPE) {
+        bw_put(w, (uint64_t)pp->width, 6);
+        for (int i = 0; i < n; i++)
+            bw_put_signed(w, e[i], pp->width);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        bw_put_unary(w, u[i] >> pp->k);
+        bw_put(w, u[i], pp->k);
+    }
+}
+
+
+/* Partition order with the fewest bits for e[warm..n); those bits in *bits */
+static int plan_residual(const uint64_t *u, const int64_t *e, int n, int warm,
+                         uint64_t *bits)
+{
+    int best_p = 0;
+    *bits = UINT64_MAX;
+    for (int p = 0; p <= MAX_PORDER; p++) {
+        int part = n >> p;
+        if ((n & ((1 << p) - 1)) != 0 || part <= warm) break;
+
+        uint64_t sum = 0;
+        for (int j = 0, start = warm; j < (1 << p); j++) {
+            int end = (j + 1) * part;
+            sum += plan_partition(u + start, e + start, end - start).bits;
+            start = end;
+        }
+        if (sum < *bits) {
+            *bits  = sum;
+            best_p = p;
+        }
+    }
+    return best_p;
+}
+
+static void write_residual(BitWriter *w, const uint64_t *u, const int64_t *e,
+                           int n, int warm, int p)
+{
+    bw_put(w, (uint64_t)p, 4);
+
+    int part = n >> p;
+    for (int j = 0, start = warm; j < (1 << p); j++) {
+        int end = (j + 1) * part;
+        PartPlan pp = plan_partition(u + start, e + start, end - start);
+        write_partition(w, &pp, u + start, e + start, end - start);
+        start = end;
+    }
+}
+
+/* ---- LPC ---- */
+
+typedef struct {
+    int     order;
+    int     precision;      /* coefficient bits, sign included */
+    int     shift;
+    int32_t coef[MAX_LPC_ORDER];
+} LpcPlan;
+
+/*
+ * Fit a predictor to x: autocorrelation of the Welch-windowed block,
+ * Levinson-Durbin up to MAX_LPC_ORDER, and the order with the fewest
+ * estimated bits is quantized.  False when LPC does not apply.
+ */
+static bool lpc_plan(const int32_t *x, int n, int width, double *wx, LpcPlan *lp)
+{
+    if (n < 4 * MAX_LPC_ORDER) return false;
+
+    double mid = (n - 1) / 2.0, half = (n + 1) / 2.0;
+    for (int i = 0; i < n; i++) {
+        double d = (i - mid) / half;
+        wx[i] = x[i] * (1.0 - d * d);
+    }
+
+    double ac[MAX_LPC_ORDER + 1];
+    for (int lag = 0; lag <= MAX_LPC_ORDER; lag++) {
+        double sum = 0.0;
+        for (int i = lag; i < n; i++)
+            sum += wx[i] * wx[i - lag];
+        ac[lag] = sum;
+    }
+    if (ac[0] <= 0.0) return false;
+
+    /* a[o - 1] predicts x[i] from x[i - 1] .. x[i - o]; err[o] is what is left */
+    double a[MAX_LPC_ORDER][MAX_LPC_ORDER];
+    double err[MAX_LPC_ORDER + 1];
+    double cur[MAX_LPC_ORDER] = {0}, prev[MAX_LPC_ORDER];
+    double e      = ac[0];
+    int    orders = 0;
+    for (int m = 0; m < MAX_LPC_ORDER && e > 0.0; m++) {
+        double acc = ac[m + 1];
+        for (int j = 0; j < m; j++)
+            acc -= cur[j] * ac[m - j];
+        double k = acc / e;
+
+        memcpy(prev, cur, sizeof(prev));
+        for (int j = 0; j < m; j++)
+            cur[j] = prev[j] - k * prev[m - 1 - j];
+        cur[m] = k;
+        e *= 1.0 - k * k;
+
+        memcpy(a[m], cur, sizeof(double) * (size_t)(m + 1));
+        err[m + 1] = e;
+        orders     = m + 1;
+    }
+    if (orders == 0) return false;
+
+    int precision = width <= 16 ? 13 : 15;
+    int best      = 1;
+    double best_bits = 0.0;
+    for (int o = 1; o <= orders; o++) {
+        double bps  = err[o] > 0.0 ? 0.5 * log2(err[o] / n) : 0.0;
+        double bits = (bps > 0.0 ? bps : 0.0) * (n - o) + o * (double)(precision + width);
+        if (o == 1 || bits < best_bits) {
+            best      = o;
+            best_bits = bits;
+        }
+    }
+
+    const double *c = a[best - 1];
+    double cmax = 0.0;
+    for (int j = 0; j < best; j++)
+        if (fabs(c[j]) > cmax) cmax = fabs(c[j]);
+    if (cmax <= 0.0) return false;
+
+    int exp;
+    frexp(cmax, &exp);
+    int shift = precision - 1 - exp;
+    if (shift > MAX_LPC_SHIFT) shift = MAX_LPC_SHIFT;
+    if (shift < 0) return false;
+
+    /* Round with the error carried on, so the sum stays close */
+    const long qmax  = (1L << (precision - 1)) - 1;
+    double     carry = 0.0;
+    for (int j = 0; j < best; j++) {
+        carry += c[j] * (double)(1 << shift);
+        long q = lround(carry);
+        if (q > qmax) q = qmax;
+        if (q < -qmax - 1) q = -qmax - 1;
+        lp->coef[j] = (int32_t)q;
+        carry -= (double)q;
+    }
+    lp->order     = best;
+    lp->precision = precision;
+    lp->shift     = shift;
+    return true;
+}
+
+static void lpc_residual(const int32_t *x, int n, const LpcPlan *lp,
+                         int64_t *e, uint64_t *u)
+{
+    for (int i = lp->order; i < n; i++) {
+        int64_t pred = 0;
+        for (int j = 0; j < lp->order; j++)
+            pred += (int64_t)lp->coef[j] * x[i - 1 - j];
+        e[i] = (int64_t)x[i] - (pred >> lp->shift);
+        u[i] = zigzag(e[i]);
+    }
+}
+
+/* ---- Encoder ---- */
+
+typedef struct {
+    int32_t  x[LOSSLESS_BLOCK];
+    int64_t  e[2][LOSSLESS_BLOCK];  /* fixed and LPC residuals */
+    uint64_t u[2][LOSSLESS_BLOCK];
+    double   wx[LOSSLESS_BLOCK];    /* windowed copy for LPC analysis */
+} SubScratch;
+
+static void encode_subframe(BitWriter *w, int32_t *x, int n, int width, SubScratch *s)
+{
+    bool constant = true;
+    int32_t all = 0;
+    for (int i = 0; i < n; i++) {
+        all |= x[i];
+        if (x[i] != x[0]) constant = false;
+    }
+    if (constant) {
+        bw_put(w, SUB_CONSTANT, 2);
+        bw_put(w, 0, 5);
+        bw_put_signed(w, x[0], width);
+        return;
+    }
+
+    int wasted = 0;
+    while (wasted < 31 && !(all & (1 << wasted))) wasted++;
+    if (wasted > 0) {
+        for (int i = 0; i < n; i++) x[i] >>= wasted;
+        width -= wasted;
+    }
+
+    uint64_t est;
+    int order = best_order(x, n, &est);
+
+    for (int i = order; i < n; i++) {
+        s->e[0][i] = fixed_residual(x, i, order);
+        s->u[0][i] = zigzag(s->e[0][i]);
+    }
+    uint64_t res;
+    int      fixed_p    = plan_residual(s->u[0], s->e[0], n, order, &res);
+    uint64_t fixed_bits = res == UINT64_MAX ? UINT64_MAX
+                        : 3 + (uint64_t)order * (uint64_t)width + 4 + res;
+
+    LpcPlan  lp;
+    int      lpc_p    = 0;
+    uint64_t lpc_bits = UINT64_MAX;
+    if (lpc_plan(x, n, width, s->wx, &lp)) {
+        lpc_residual(x, n, &lp, s->e[1], s->u[1]);
+        lpc_p = plan_residual(s->u[1], s->e[1], n, lp.order, &res);
+        if (res != UINT64_MAX)
+            lpc_bits = 4 + 4 + 5 + (uint64_t)lp.order * (uint64_t)(lp.precision + width) +
+                       4 + res;
+    }
+
+    uint64_t verbatim_bits = (uint64_t)n * (uint64_t)width;
+    if (fixed_bits >= verbatim_bits && lpc_bits >= verbatim_bits) {
+        bw_put(w, SUB_VERBATIM, 2);
+        bw_put(w, (uint64_t)wasted, 5);
+        for (int i = 0; i < n; i++)
+            bw_put_signed(w, x[i], width);
+        return;
+    }
+
+    if (lpc_bits < fixed_bits) {
+        bw_put(w, SUB_LPC, 2);
+        bw_put(w, (uint64_t)wasted, 5);
+        bw_put(w, (uint64_t)(lp.order - 1), 4);
+        bw_put(w, (uint64_t)(lp.precision - 1), 4);
+        bw_put(w, (uint64_t)lp.shift, 5);
+        for (int j = 0; j < lp.order; j++)
+            bw_put_signed(w, lp.coef[j], lp.precision);
+        for (int i = 0; i < lp.order; i++)
+            bw_put_signed(w, x[i], width);
+        write_residual(w, s->u[1], s->e[1], n, lp.order, lpc_p);
+        return;
+    }
+
+    bw_put(w, SUB_FIXED, 2);
+    bw_put(w, (uint64_t)wasted, 5);
+    bw_put(w, (uint64_t)order, 3);
+    for (int i = 0; i < order; i++)
+        bw_put_signed(w, x[i], width);
+    write_residual(w, s->u[0], s->e[0], n, order, fixed_p);
+}
+
+static int sample_shift(const AudioConfig *cfg)
+{
+    return cfg->bytes_per_sample == 4 ? 32 - cfg->bits_per_sample : 0;
+}
+
+static int32_t load_sample(const AudioConfig *cfg, const uint8_t *p)
+{
+    if (cfg->bytes_per_sample == 2) {
+        int16_t v;
+        memcpy(&v, p, 2);
+        return v;
+    }
+    int32_t v;
+    memcpy(&v, p, 4);
+    return v >> sample_shift(cfg);
+}
+
+static void store_sample(const AudioConfig *cfg, uint8_t *p, int32_t v)
+{
+    if (cfg->bytes_per_sample == 2) {
+        int16_t s = (int16_t)v;
+        memcpy(p, &s, 2);
+        return;
+    }
+    uint32_t s = (uint32_t)v << sample_shift(cfg);
+    memcpy(p, &s, 4);
+}
+
+/* ---- Block layout ---- */
+
+static size_t block_start(size_t frames, size_t blocks, size_t b)
+{
+    return frames * b / blocks;
+}
+
+/* Enough blocks to stay within LOSSLESS_BLOCK, and one per worker while
+   they are at least MIN_BLOCK long */
+static size_t block_count(size_t frames, int workers)
+{
+    if (workers > WORKPOOL_MAX_THREADS) workers = WORKPOOL_MAX_THREADS;
+
+    size_t need = (frames + LOSSLESS_BLOCK - 1) / LOSSLESS_BLOCK;
+    size_t want = frames / MIN_BLOCK;
+    if (want > (size_t)workers) want = (size_t)workers;
+    return need > want ? need : want;
+}
+
+/* Verbatim everywhere plus the stereo mode and subframe headers */
+static size_t block_max_bytes(const AudioConfig *cfg, size_t n)
+{
+    size_t nch   = (size_t)cfg->channels;
+    size_t width = (size_t)cfg->bits_per_sample + 1;
+    return (2 + nch * (7 + n * width) + 7) / 8;
+}
+
+/* Header, length table and every block at its largest */
+static size_t staged_size(const AudioConfig *cfg, size_t frames, size_t blocks)
+{
+    size_t size = CHUNK_HDR_SIZE + 4 * blocks;
+    for (size_t b = 0; b < blocks; b++)
+        size += block_max_bytes(cfg, block_start(frames, blocks, b + 1) -
+                                     block_start(frames, blocks, b));
+    return size;
+}
+
+bool lossless_supported(const AudioConfig *cfg)
+{
+    return !cfg->is_float &&
+           cfg->channels >= 1 && cfg->channels <= MAX_CHANNELS &&
+           cfg->bits_per_sample >= 8 &&
+           cfg->bits_per_sample <= LOSSLESS_MAX_BITS &&
+           cfg->bits_per_sample <= cfg->bytes_per_sample * 8;
+}
+
+size_t lossless_max_encoded(const AudioConfig *cfg)
+{
+    size_t frames = (size_t)cfg->frames_per_buffer;
+
+    /* More blocks never take less room */
+    return staged_size(cfg, frames, block_count(frames, WORKPOOL_MAX_THREADS));
+}
+
+/* ---- Estimate ---- */
+
+double lossless_estimate_bits(const AudioConfig *cfg, const void *pcm, size_t len)
+{
+    const int      nch    = cfg->channels;
+    const size_t   bps    = (size_t)cfg->bytes_per_sample;
+    const size_t   frames = len / (bps * (size_t)nch);
+    const uint8_t *src    = pcm;
+
+    size_t windows = frames / PROBE_FRAMES;
+    if (windows > PROBE_WINDOWS) windows = PROBE_WINDOWS;
+    if (windows == 0) return cfg->bits_per_sample;
+    size_t stride = frames / windows;
+
+    double bits = 0.0;
+    for (int c = 0; c < nch; c++) {
+        int32_t  x[PROBE_WINDOWS][PROBE_FRAMES];
+        int32_t  all = 0;
+        for (size_t w = 0; w < windows; w++) {
+            const uint8_t *p = src + (w * stride * (size_t)nch + (size_t)c) * bps;
+            for (int i = 0; i < PROBE_FRAMES; i++) {
+                x[w][i] = load_sample(cfg, p + (size_t)i * (size_t)nch * bps);
+                all |= x[w][i];
+            }
+        }
+
+        /* Digital silence and padded low bits cost nothing to code */
+        int wasted = 0;
+        while (wasted < cfg->bits_per_sample && !(((uint32_t)all >> wasted) & 1)) wasted++;
+        if (wasted == cfg->bits_per_sample) continue;
+
+        /* Per window, like the encoder's blocks: fixed orders 0-2 stand
+           in for its predictors, and a Rice code spends about log2 of
+           the mean residual plus two bits                              */
+        const int max = cfg->bits_per_sample - wasted;
+        for (size_t w = 0; w < windows; w++) {
+            uint64_t sum[3] = {0};
+            for (int i = 2; i < PROBE_FRAMES; i++)
+                for (int o = 0; o <= 2; o++) {
+                    int64_t e = fixed_residual(x[w], i, o) >> wasted;
+                    sum[o] += (uint64_t)(e < 0 ? -e : e);
+                }
+            uint64_t best = sum[0] < sum[1] ? sum[0] : sum[1];
+            if (sum[2] < best) best = sum[2];
+
+            double mean = (double)best / (PROBE_FRAMES - 2);
+            double b    = mean > 1.0 ? log2(mean) + 2.0 : 2.0;
+            bits += b < max ? b : max;
+        }
+    }
+    return bits / (double)(windows * (size_t)nch);
+}
+
+/* ---- Parallel encode ---- */
+
+typedef struct {
+    const AudioConfig *cfg;
+    const uint8_t     *pcm;
+    size_t             frames;
+    size_t             blocks;
+    uint8_t           *out;
+    size_t            *stage;   /* where block b is coded, clear of the others */
+    size_t            *size;    /* its coded bytes */
+    WorkPool          *pool;    /* holds each worker's scratch ... */
+    uint8_t           *own;     /* ... unless there is none: then this */
+    atomic_bool        failed;
+} EncodeJob;
+
+/* A worker's SubScratch, then a row per channel plus mid and side */
+static size_t encode_scratch_size(int nch)
+{
+    return sizeof(SubScratch) + sizeof(int32_t) * LOSSLESS_BLOCK * (size_t)(nch + 2);
+}
+
+static void encode_block(void *arg, int index, int worker)
+{
+    EncodeJob         *job   = arg;
+    const AudioConfig *cfg   = job->cfg;
+    const int          nch   = cfg->channels;
+    const size_t       bps   = (size_t)cfg->bytes_per_sample;
+    const int          width = cfg->bits_per_sample;
+
+    size_t off = block_start(job->frames, job->blocks, (size_t)index);
+    int    n   = (int)(block_start(job->frames, job->blocks, (size_t)index + 1) - off);
+    const uint8_t *src = job->pcm + off * (size_t)nch * bps;
+
+    uint8_t *mem = job->own ? job->own
+                            : workpool_scratch(job->pool, worker, encode_scratch_size(nch));
+    if (!mem) {
+        atomic_store(&job->failed, true);
+        return;
+    }
+    SubScratch *scr  = (SubScratch *)mem;
+    int32_t    *ch   = (int32_t *)(scr + 1);
+    int32_t    *mid  = ch + (size_t)nch * LOSSLESS_BLOCK;
+    int32_t    *side = mid + LOSSLESS_BLOCK;
+
+    BitWriter w = { .buf = job->out + job->stage[index],
+                    .cap = block_max_bytes(cfg, (size_t)n) };
+
+    for (int i = 0; i < n; i++)
+        for (int c = 0; c < nch; c++)
+            ch[(size_t)c * LOSSLESS_BLOCK + i] =
+                load_sample(cfg, src + ((size_t)i * (size_t)nch + (size_t)c) * bps);
+
+    if (nch != 2) {
+        for (int c = 0; c < nch; c++) {
+            memcpy(scr->x, ch + (size_t)c * LOSSLESS_BLOCK, sizeof(int32_t) * (size_t)n);
+            encode_subframe(&w, scr->x, n, width, scr);
+        }
+    } else {
+        /* Pick the cheapest of the four stereo pairings */
+        int32_t *l = ch, *r = ch + LOSSLESS_BLOCK;
+        for (int i = 0; i < n; i++) {
+            side[i] = l[i] - r[i];
+            mid[i]  = (int32_t)(((int64_t)l[i] + r[i]) >> 1);
+        }
+        uint64_t cl, cr, cm, cs;
+        best_order(l, n, &cl);
+        best_order(r, n, &cr);
+        best_order(mid, n, &cm);
+        best_order(side, n, &cs);
+
+        int      mode = STEREO_LR;
+        uint64_t best = cl + cr;
+        if (cl + cs < best) { best = cl + cs; mode = STEREO_LS; }
+        if (cs + cr < best) { best = cs + cr; mode = STEREO_SR; }
+        if (cm + cs < best) { best = cm + cs; mode = STEREO_MS; }
+        bw_put(&w, (uint64_t)mode, 2);
+
+        int32_t *a  = mode == STEREO_SR ? side : mode == STEREO_MS ? mid : l;
+        int32_t *b  = mode == STEREO_LR || mode == STEREO_SR ? r : side;
+        int      wa = width + (mode == STEREO_SR);
+        int      wb = width + (mode == STEREO_LS || mode == STEREO_MS);
+
+        memcpy(scr->x, a, sizeof(int32_t) * (size_t)n);
+        encode_subframe(&w, scr->x, n, wa, scr);
+        memcpy(scr->x, b, sizeof(int32_t) * (size_t)n);
+        encode_subframe(&w, scr->x, n, wb, scr);
+    }
+    bw_flush(&w);
+
+    if (w.overflow) atomic_store(&job->failed, true);
+    job->size[index] = w.pos;
+}
+
+ssize_t lossless_encode(const AudioConfig *cfg, const void *pcm, size_t len,
+                        uint8_t *out, size_t cap, WorkPool *pool)
+{
+    const int    nch     = cfg->channels;
+    const size_t frames  = len / ((size_t)cfg->bytes_per_sample * (size_t)nch);
+    const int    workers = workpool_size(pool);
+    const size_t blocks  = block_count(frames, workers);
+
+    if (!lossless_supported(cfg)) return -1;
+    if (blocks > UINT16_MAX || staged_size(cfg, frames, blocks) > cap) return -1;
+
+    /* Worker 0's scratch, with the block table behind it: asked for at
+       its largest first, so its own calls never move it */
+    size_t   scratch = encode_scratch_size(nch);
+    size_t   need    = scratch + sizeof(size_t) * 2 * (blocks + 1);
+    uint8_t *own     = pool ? NULL : malloc(need);
+    uint8_t *mem     = pool ? workpool_scratch(pool, 0, need) : own;
+    if (!mem) {
+        free(own);
+        return -1;
+    }
+
+    EncodeJob job = {
+        .cfg    = cfg,
+        .pcm    = pcm,
+        .frames = frames,
+        .blocks = blocks,
+        .out    = out,
+        .stage  = (size_t *)(mem + scratch),
+        .pool   = pool,
+        .own    = own,
+    };
+    ssize_t rc = -1;
+    job.size = job.stage + blocks + 1;
+    atomic_init(&job.failed, false);
+
+    size_t pos = CHUNK_HDR_SIZE + 4 * blocks;
+    for (size_t b = 0; b < blocks; b++) {
+        job.stage[b] = pos;
+        pos += block_max_bytes(cfg, block_start(frames, blocks, b + 1) -
+                                    block_start(frames, blocks, b));
+    }
+
+    workpool_run(pool, encode_block, &job, (int)blocks);
+    if (atomic_load(&job.failed)) goto out;
+
+    /* Close the gaps between blocks; each only moves towards the front */
+    write_be32(out, (uint32_t)frames);
+    write_be16(out + 4, (uint16_t)blocks);
+    pos = CHUNK_HDR_SIZE + 4 * blocks;
+    for (size_t b = 0; b < blocks; b++) {
+        write_be32(out + CHUNK_HDR_SIZE + 4 * b, (uint32_t)job.size[b]);
+        memmove(out + pos, out + job.stage[b], job.size[b]);
+        pos += job.size[b];
+    }
+    rc = (ssize_t)pos;
+
+out:
+    free(own);
+    return rc;
+}
+
+/* ---- Decoder ---- */
+
+static int decode_residual(BitReader *r, int64_t *e, int n, int warm)
+{
+    int p = (int)br_get(r, 4);
+    if (p > MAX_PORDER || (n & ((1 << p) - 1)) != 0 || (n >> p) < warm)
+        return -1;
+
+    int part = n >> p;
+    for (int j = 0, i = warm; j < (1 << p); j++) {
+        int end = (j + 1) * part;
+        int k   = (int)br_get(r, 5);
+        int ew  = k == RICE_ESCAPE ? (int)br_get(r, 6) : 0;
+        if (k == RICE_ESCAPE && (ew == 0 || ew > 48)) return -1;
+
+        for (; i < end; i++) {
+            if (k == RICE_ESCAPE) {
+                e[i] = br_get_signed(r, ew);
+            } else {
+                uint64_t u = (br_get_unary(r) << k) | br_get(r, k);
+                e[i] = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+            }
+            if (r->err) return -1;
+        }
+    }
+    return 0;
+}
+
+static int decode_subframe(BitReader *r, int64_t *x, int n, int width)
+{
+    int type   = (int)br_get(r, 2);
+    int wasted = (int)br_get(r, 5);
+    if (wasted >= width) return -1;
+    width -= wasted;
+
+    switch (type) {
+    case SUB_CONSTANT: {
+        int64_t v = br_get_signed(r, width + wasted);
+        for (int i = 0; i < n; i++) x[i] = v;
+        return r->err ? -1 : 0;
+    }
+    case SUB_VERBATIM:
+        for (int i = 0; i < n; i++)
+            x[i] = br_get_signed(r, width);
+        break;
+    case SUB_FIXED: {
+        int order = (int)br_get(r, 3);
+        if (order > MAX_ORDER || order > n) return -1;
+        for (int i = 0; i < order; i++)
+            x[i] = br_get_signed(r, width);
+
+        /* Residuals go in place, then become samples front to back */
+        if (decode_residual(r, x, n, order) < 0) return -1;
+        for (int i = order; i < n; i++) {
+            int64_t v = fixed_predict(x, i, order) + x[i];
+            if (v >= VALUE_LIMIT || v <= -VALUE_LIMIT) return -1;
+            x[i] = v;
+        }
+        break;
+    }
+    case SUB_LPC: {
+        int     order     = (int)br_get(r, 4) + 1;
+        int     precision = (int)br_get(r, 4) + 1;
+        int     shift     = (int)br_get(r, 5);
+        int64_t coef[MAX_LPC_ORDER];
+        if (order > MAX_LPC_ORDER || order > n || shift > MAX_LPC_SHIFT) return -1;
+        for (int j = 0; j < order; j++)
+            coef[j] = br_get_signed(r, precision);
+        for (int i = 0; i < order; i++)
+            x[i] = br_get_signed(r, width);
+
+        if (decode_residual(r, x, n, order) < 0) return -1;
+        for (int i = order; i < n; i++) {
+            int64_t pred = 0;
+            for (int j = 0; j < order; j++)
+                pred += coef[j] * x[i - 1 - j];
+            int64_t v = x[i] + (pred >> shift);
+            if (v >= VALUE_LIMIT || v <= -VALUE_LIMIT) return -1;
+            x[i] = v;
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    if (r->err) return -1;
+    for (int i = 0; i < n && wasted > 0; i++)
+        x[i] = (int64_t)((uint64_t)x[i] << wasted);
+    return 0;
+}
+
+/* ---- Parallel decode ---- */
+
+typedef struct {
+    const AudioConfig *cfg;
+    const uint8_t     *in;
+    size_t             frames;
+    size_t             blocks;
+    size_t            *off;     /* where block b starts in `in` */
+    size_t            *size;
+    uint8_t           *pcm;
+    WorkPool          *pool;    /* per worker: a row per channel ... */
+    int64_t           *own;     /* ... or here without a pool */
+    atomic_bool        failed;
+} DecodeJob;
+
+static size_t decode_scratch_size(int nch)
+{
+    return sizeof(int64_t) * LOSSLESS_BLOCK * (size_t)nch;
+}
+
+static void decode_block(void *arg, int index, int worker)
+{
+    DecodeJob         *job   = arg;
+    const AudioConfig *cfg   = job->cfg;
+    const int          nch   = cfg->channels;
+    const size_t       bps   = (size_t)cfg->bytes_per_sample;
+    const int          width = cfg->bits_per_sample;
+
+    if (atomic_load_explicit(&job->failed, memory_order_relaxed)) return;
+
+    size_t   off = block_start(job->frames, job->blocks, (size_t)index);
+    int      n   = (int)(block_start(job->frames, job->blocks, (size_t)index + 1) - off);
+    int64_t *x   = job->own ? job->own
+                            : workpool_scratch(job->pool, worker, decode_scratch_size(nch));
+    uint8_t *dst = job->pcm + off * (size_t)nch * bps;
+    if (!x) {
+        atomic_store(&job->failed, true);
+        return;
+    }
+
+    BitReader r = { .buf = job->in + job->off[index], .len = job->size[index] };
+    int mode = nch == 2 ? (int)br_get(&r, 2) : STEREO_LR;
+
+    for (int c = 0; c < nch; c++) {
+        bool is_side = (c == 0 && mode == STEREO_SR) ||
+                       (c == 1 && (mode == STEREO_LS || mode == STEREO_MS));
+        if (decode_subframe(&r, x + (size_t)c * LOSSLESS_BLOCK, n,
+                            width + (is_side ? 1 : 0)) < 0) {
+            atomic_store(&job->failed, true);
+            return;
+        }
+    }
+
+    int64_t *a = x, *b = x + LOSSLESS_BLOCK;
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < nch; c++) {
+            int64_t v = x[(size_t)c * LOSSLESS_BLOCK + i];
+            if (nch == 2) {
+                switch (mode) {
+                case STEREO_LS: v = c == 0 ? a[i] : a[i] - b[i]; break;
+                case STEREO_SR: v = c == 0 ? a[i] + b[i] : b[i]; break;
+                case STEREO_MS: {
+                    int64_t sum = a[i] * 2 + (b[i] & 1);
+                    v = c == 0 ? (sum + b[i]) >> 1 : (sum - b[i]) >> 1;
+                    break;
+                }
+                default: break;
+                }
+            }
+            store_sample(cfg, dst, (int32_t)v);
+            dst += bps;
+        }
+    }
+}
+
+ssize_t lossless_decode(const AudioConfig *cfg, const uint8_t *in, size_t len,
+                        void *pcm, size_t cap, WorkPool *pool)
+{
+    const int    nch = cfg->channels;
+    const size_t bps = (size_t)cfg->bytes_per_sample;
+
+    if (!lossless_supported(cfg) || len < CHUNK_HDR_SIZE) return -1;
+
+    size_t frames = read_be32(in);
+    size_t blocks = read_be16(in + 4);
+    if (frames * (size_t)nch * bps > cap) return -1;
+
+    /* No empty blocks, none too long */
+    if (blocks > frames ||
+        (frames > 0 && (blocks == 0 || (frames + blocks - 1) / blocks > LOSSLESS_BLOCK)) ||
+        len < CHUNK_HDR_SIZE + 4 * blocks)
+        return -1;
+
+    /* Worker 0's rows with the block table behind them, as in encode */
+    size_t   scratch = decode_scratch_size(nch);
+    size_t   need    = scratch + sizeof(size_t) * 2 * (blocks + 1);
+    uint8_t *own     = pool ? NULL : malloc(need);
+    uint8_t *mem     = pool ? workpool_scratch(pool, 0, need) : own;
+    if (!mem) {
+        free(own);
+        return -1;
+    }
+
+    DecodeJob job = {
+        .cfg    = cfg,
+        .in     = in,
+        .frames = frames,
+        .blocks = blocks,
+        .off    = (size_t *)(mem + scratch),
+        .pcm    = pcm,
+        .pool   = pool,
+        .own    = (int64_t *)own,
+    };
+    ssize_t rc = -1;
+    job.size = job.off + blocks + 1;
+    atomic_init(&job.failed, false);
+
+    size_t pos = CHUNK_HDR_SIZE + 4 * blocks;
+    for (size_t b = 0; b < blocks; b++) {
+        job.size[b] = read_be32(in + CHUNK_HDR_SIZE + 4 * b);
+        if (job.size[b] > len - pos) goto out;
+        job.off[b] = pos;
+        pos += job.size[b];
+    }
+
+    workpool_run(pool, decode_block, &job, (int)blocks);
+    if (!atomic_load(&job.failed))
+        rc = (ssize_t)(frames * (size_t)nch * bps);
+
+out:
+    free(own);
+    return rc;
+}
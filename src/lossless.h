@@ -0,0 +1,62 @@
+#ifndef LOSSLESS_H
+#define LOSSLESS_H
+
+#include "soundshare.h"
+#include "config.h"
+#include "workpool.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Built-in lossless codec for compression_type 1.
+ *
+ * FLAC-style, but its own bitstream: each chunk is coded on its own
+ * (so any chunk can be decoded after a loss) in independent blocks of
+ * up to LOSSLESS_BLOCK frames, which a WorkPool codes in parallel.
+ * Per block a stereo pair is decorrelated as left/side, side/right or
+ * mid/side when that is cheaper, and every channel is coded as a
+ * constant, verbatim, or with a fixed polynomial (order 0-4) or LPC
+ * (order 1-12) predictor and a partitioned Rice residual.
+ *
+ * Integer formats of up to LOSSLESS_MAX_BITS bits only.  Samples are
+ * coded at the stream's declared bit depth: in a 32-bit container
+ * carrying 24-bit audio the low byte is not transmitted and comes back
+ * as zero.
+ */
+
+#define LOSSLESS_BLOCK      4096
+/* A side channel (left - right) needs one bit more, in 32-bit arithmetic */
+#define LOSSLESS_MAX_BITS   24
+
+/** Can chunks in this format be coded? */
+bool lossless_supported(const AudioConfig *cfg);
+
+/** Largest encoding of one cfg->chunk_size byte chunk. */
+size_t lossless_max_encoded(const AudioConfig *cfg);
+
+/**
+ * Cheap guess at the coded bits per sample of a chunk, from fixed
+ * predictor residuals over a few short windows.  Costs a small fraction
+ * of lossless_encode(); meant for deciding whether to code at all.
+ */
+double lossless_estimate_bits(const AudioConfig *cfg, const void *pcm, size_t len);
+
+/**
+ * Encode `len` bytes of interleaved PCM into `out`, splitting the chunk
+ * into blocks across `pool` (NULL: on this thread only).  Returns the
+ * encoded length, or -1 if `cap` is too small or the format is not
+ * lossless_supported().
+ */
+ssize_t lossless_encode(const AudioConfig *cfg, const void *pcm, size_t len,
+                        uint8_t *out, size_t cap, WorkPool *pool);
+
+/**
+ * Decode one encoded chunk into interleaved PCM, its blocks spread over
+ * `pool` (may be NULL).  Returns the PCM byte count, or -1 on a corrupt
+ * chunk or one that does not fit in `cap`.
+ */
+ssize_t lossless_decode(const AudioConfig *cfg, const uint8_t *in, size_t len,
+                        void *pcm, size_t cap, WorkPool *pool);
+
+#endif /* LOSSLESS_H */
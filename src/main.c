@@ -1,9 +1,16 @@
 #include "soundshare.h"
 #include "config.h"
+#include "protocol.h"
+#include "udpmedia.h"
+#include "opuscodec.h"
+#include "dtx.h"
+#include "workpool.h"
+#include "histogram.h"
 #include "ui.h"
 
 #include <stdarg.h>
 #include <sys/time.h>
+#include <arpa/inet.h>
 
 /* ---- Global application state ---- */
 AppState g_app;
@@ -58,9 +65,201 @@ void app_state_init(void)
     atomic_store(&g_app.current_latency_ms, -1);
     atomic_store(&g_app.receiver_count, 0);
     g_app.selected_preset = 2;
+    g_app.overflow_policy = OVERFLOW_DROP_OLDEST;
+    g_app.capture_cpu     = CPU_AUTO;
+    g_app.send_cpu        = CPU_AUTO;
+    g_app.transport       = TRANSPORT_TCP;
+    g_app.fec_k           = 8;
+    g_app.opus_kbps       = OPUS_DEFAULT_KBPS;
+    g_app.pack24          = true;
+    g_app.dtx             = true;
+    g_app.dtx_db          = DTX_DEFAULT_DB;
+    g_app.dtx_hangover_ms = DTX_DEFAULT_HANGOVER_MS;
+    g_app.codec_threads   = 0;
+    g_app.adaptive_codec  = true;
+    g_app.latency_ms      = 0;
+    g_app.cpu_budget      = 0;
+    g_app.multiplex       = false;
+    g_app.ping_udp        = false;
+    g_app.sync_ms         = 0;
+    snprintf(g_app.mcast_group, sizeof(g_app.mcast_group), "%s", MCAST_DEFAULT_GROUP);
     pthread_mutex_init(&g_app.lock, NULL);
 }
 
+static int env_cpu(const char *name, int def)
+{
+    const char *v = getenv(name);
+    if (!v)                      return def;
+    if (strcmp(v, "off") == 0)   return CPU_NONE;
+    if (strcmp(v, "auto") == 0)  return CPU_AUTO;
+
+    char *end;
+    long cpu = strtol(v, &end, 10);
+    if (*end != '\0' || cpu < 0 || cpu > 1023) {
+        LOG_W("Ignoring %s='%s' (want a CPU index, auto or off)", name, v);
+        return def;
+    }
+    return (int)cpu;
+}
+
+/* Optional tuning knobs, read once at startup */
+static void app_state_load_env(void)
+{
+    g_app.capture_cpu = env_cpu("SOUNDSHARE_CAPTURE_CPU", g_app.capture_cpu);
+    g_app.send_cpu    = env_cpu("SOUNDSHARE_SEND_CPU",    g_app.send_cpu);
+
+    const char *v = getenv("SOUNDSHARE_OVERFLOW_POLICY");
+    if (v) {
+        if (strcmp(v, "drop-oldest") == 0)
+            g_app.overflow_policy = OVERFLOW_DROP_OLDEST;
+        else if (strcmp(v, "skip-to-live") == 0)
+            g_app.overflow_policy = OVERFLOW_SKIP_TO_LIVE;
+        else if (strcmp(v, "disconnect") == 0)
+            g_app.overflow_policy = OVERFLOW_DISCONNECT;
+        else
+            LOG_W("Unknown SOUNDSHARE_OVERFLOW_POLICY '%s' (want drop-oldest, "
+                  "skip-to-live or disconnect)", v);
+    }
+
+    v = getenv("SOUNDSHARE_TRANSPORT");
+    if (v) {
+        if (strcmp(v, "tcp") == 0)
+            g_app.transport = TRANSPORT_TCP;
+        else if (strcmp(v, "multicast") == 0)
+            g_app.transport = TRANSPORT_MULTICAST;
+        else if (strcmp(v, "udp") == 0)
+            g_app.transport = TRANSPORT_UDP;
+        else
+            LOG_W("Unknown SOUNDSHARE_TRANSPORT '%s' (want tcp, udp or multicast)", v);
+    }
+
+    v = getenv("SOUNDSHARE_MCAST_GROUP");
+    if (v) {
+        struct in_addr a;
+        if (inet_pton(AF_INET, v, &a) == 1 && IN_MULTICAST(ntohl(a.s_addr)))
+            snprintf(g_app.mcast_group, sizeof(g_app.mcast_group), "%s", v);
+        else
+            LOG_W("Ignoring SOUNDSHARE_MCAST_GROUP='%s' (want an IPv4 multicast "
+                  "address)", v);
+    }
+
+    v = getenv("SOUNDSHARE_FEC_K");
+    if (v) {
+        char *end;
+        long k = strtol(v, &end, 10);
+        if (*end != '\0' || k < 0 || k > MEDIA_MAX_FEC_K)
+            LOG_W("Ignoring SOUNDSHARE_FEC_K='%s' (want 0..%d)", v, MEDIA_MAX_FEC_K);
+        else
+            g_app.fec_k = (int)k;
+    }
+
+    v = getenv("SOUNDSHARE_OPUS_KBPS");
+    if (v) {
+        char *end;
+        long k = strtol(v, &end, 10);
+        if (*end != '\0' || k < 6 || k > 510)
+            LOG_W("Ignoring SOUNDSHARE_OPUS_KBPS='%s' (want 6..510)", v);
+        else
+            g_app.opus_kbps = (int)k;
+    }
+
+    /* Packed 24-bit streams turn v2 receivers away; 0 keeps them working */
+    v = getenv("SOUNDSHARE_PACK24");
+    if (v) {
+        if (strcmp(v, "0") == 0)
+            g_app.pack24 = false;
+        else if (strcmp(v, "1") != 0)
+            LOG_W("Ignoring SOUNDSHARE_PACK24='%s' (want 0 or 1)", v);
+    }
+
+    v = getenv("SOUNDSHARE_DTX_DB");
+    if (v) {
+        char *end;
+        long k = strtol(v, &end, 10);
+        if (strcmp(v, "off") == 0)
+            g_app.dtx = false;
+        else if (*end != '\0' || k < -140 || k > 0)
+            LOG_W("Ignoring SOUNDSHARE_DTX_DB='%s' (want -140..0 or off)", v);
+        else
+            g_app.dtx_db = (int)k;
+    }
+
+    v = getenv("SOUNDSHARE_DTX_HANGOVER_MS");
+    if (v) {
+        char *end;
+        long k = strtol(v, &end, 10);
+        if (*end != '\0' || k < 0 || k > 60000)
+            LOG_W("Ignoring SOUNDSHARE_DTX_HANGOVER_MS='%s' (want 0..60000)", v);
+        else
+            g_app.dtx_hangover_ms = (int)k;
+    }
+
+    v = getenv("SOUNDSHARE_CODEC_THREADS");
+    if (v) {
+        char *end;
+        long k = strtol(v, &end, 10);
+        if (*end != '\0' || k < 0 || k > WORKPOOL_MAX_THREADS)
+            LOG_W("Ignoring SOUNDSHARE_CODEC_THREADS='%s' (want 0..%d)", v,
+                  WORKPOOL_MAX_THREADS);
+        else
+            g_app.codec_threads = (int)k;
+    }
+
+    v = getenv("SOUNDSHARE_ADAPTIVE_CODEC");
+    if (v) {
+        if (strcmp(v, "0") == 0)
+            g_app.adaptive_codec = false;
+        else if (strcmp(v, "1") != 0)
+            LOG_W("Ignoring SOUNDSHARE_ADAPTIVE_CODEC='%s' (want 0 or 1)", v);
+    }
+
+    v = getenv("SOUNDSHARE_MUX");
+    if (v) {
+        if (strcmp(v, "1") == 0)
+            g_app.multiplex = true;
+        else if (strcmp(v, "0") != 0)
+            LOG_W("Ignoring SOUNDSHARE_MUX='%s' (want 0 or 1)", v);
+    }
+
+    v = getenv("SOUNDSHARE_PING_UDP");
+    if (v) {
+        if (strcmp(v, "1") == 0)
+            g_app.ping_udp = true;
+        else if (strcmp(v, "0") != 0)
+            LOG_W("Ignoring SOUNDSHARE_PING_UDP='%s' (want 0 or 1)", v);
+    }
+
+    v = getenv("SOUNDSHARE_SYNC_MS");
+    if (v) {
+        char *end;
+        long k = strtol(v, &end, 10);
+        if (*end != '\0' || k < 0 || k > SYNC_MAX_MS)
+            LOG_W("Ignoring SOUNDSHARE_SYNC_MS='%s' (want 0..%d)", v, SYNC_MAX_MS);
+        else
+            g_app.sync_ms = (int)k;
+    }
+
+    v = getenv("SOUNDSHARE_LATENCY_MS");
+    if (v) {
+        char *end;
+        long k = strtol(v, &end, 10);
+        if (*end != '\0' || k < 0 || k > 60000)
+            LOG_W("Ignoring SOUNDSHARE_LATENCY_MS='%s' (want 0..60000)", v);
+        else
+            g_app.latency_ms = (int)k;
+    }
+
+    v = getenv("SOUNDSHARE_CPU_BUDGET");
+    if (v) {
+        char *end;
+        long k = strtol(v, &end, 10);
+        if (*end != '\0' || k < 0 || k > 100)
+            LOG_W("Ignoring SOUNDSHARE_CPU_BUDGET='%s' (want 0..100)", v);
+        else
+            g_app.cpu_budget = (int)k;
+    }
+}
+
 void app_state_destroy(void)
 {
     pthread_mutex_destroy(&g_app.lock);
@@ -73,14 +272,24 @@ static void signal_handler(int sig)
     atomic_store(&g_app.shutdown_requested, true);
 }
 
+/* Whichever thread keeps the histograms dumps them at its next tick */
+static void hist_signal_handler(int sig)
+{
+    atomic_fetch_or(&g_app.hist_request,
+                    sig == SIGUSR2 ? HIST_REQ_DUMP | HIST_REQ_RESET : HIST_REQ_DUMP);
+}
+
 /* ---- main ---- */
 int main(int argc, char **argv)
 {
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, hist_signal_handler);
+    signal(SIGUSR2, hist_signal_handler);
 
     app_state_init();
+    app_state_load_env();
 
     LOG_I("SoundShare v%s starting", SS_VERSION);
 
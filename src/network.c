@@ -9,6 +9,9 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -147,6 +150,11 @@ int net_accept_client(int server_fd, char *client_ip, size_t ip_len)
 
 /* ------------------------------------------------------------------ */
 int net_connect(const char *host, int port, int timeout_ms)
+{
+    return net_connect_cancel(host, port, timeout_ms, -1);
+}
+
+int net_connect_cancel(const char *host, int port, int timeout_ms, int cancel_fd)
 {
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -174,7 +182,17 @@ int net_connect(const char *host, int port, int timeout_ms)
     }
 
     if (rc < 0) {
-        int ready = net_poll_write(fd, timeout_ms);
+        struct pollfd pfd[2] = {
+            { .fd = fd,        .events = POLLOUT },
+            { .fd = cancel_fd, .events = POLLIN  },   /* ignored if -1 */
+        };
+        int ready;
+        while ((ready = poll(pfd, 2, timeout_ms)) < 0 && errno == EINTR) {}
+        if (ready > 0 && pfd[1].revents) {
+            LOG_I("connect(%s:%d): cancelled", host, port);
+            close(fd);
+            return -1;
+        }
         if (ready <= 0) {
             LOG_E("connect(%s:%d): %s", host, port,
                   ready == 0 ? "timeout" : strerror(errno));
@@ -216,6 +234,57 @@ void net_set_audio_opts(int fd, int send_buf_size)
     setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
 }
 
+/* ------------------------------------------------------------------ */
+void net_set_buffers(int fd, int send_buf_size, int recv_buf_size)
+{
+    if (send_buf_size > 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+                   &send_buf_size, sizeof(send_buf_size));
+    if (recv_buf_size > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                   &recv_buf_size, sizeof(recv_buf_size));
+}
+
+/* ------------------------------------------------------------------ */
+void net_set_recv_timeout(int fd, int timeout_ms)
+{
+    struct timeval tv;
+    tv.tv_sec  = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/* ------------------------------------------------------------------ */
+int net_queued_bytes(int fd, bool outgoing)
+{
+    int n = 0;
+    if (ioctl(fd, outgoing ? SIOCOUTQ : SIOCINQ, &n) < 0)
+        return -1;
+    return n;
+}
+
+/* ------------------------------------------------------------------ */
+int net_tcp_rtt_us(int fd)
+{
+    struct tcp_info info;
+    socklen_t       len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return -1;
+    return (int)info.tcpi_rtt;
+}
+
+/* ------------------------------------------------------------------ */
+int net_socket_port(int fd, bool local)
+{
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    int rc = local ? getsockname(fd, (struct sockaddr *)&addr, &len)
+                   : getpeername(fd, (struct sockaddr *)&addr, &len);
+    if (rc < 0 || addr.sin_family != AF_INET)
+        return -1;
+    return ntohs(addr.sin_port);
+}
+
 /* ------------------------------------------------------------------ */
 void net_close(int *fd)
 {
@@ -253,6 +322,22 @@ int net_poll_read(int fd, int timeout_ms)
     return rc;
 }
 
+int net_poll_read_cancel(int fd, int cancel_fd, int timeout_ms)
+{
+    struct pollfd pfd[2] = {
+        { .fd = fd,        .events = POLLIN },
+        { .fd = cancel_fd, .events = POLLIN },
+    };
+
+    int rc = poll(pfd, 2, timeout_ms);
+    if (rc < 0 && errno == EINTR) return 0;
+    if (rc > 0 && pfd[1].revents) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return rc;
+}
+
 int net_poll_write(int fd, int timeout_ms)
 {
     struct pollfd pfd;
@@ -263,4 +348,135 @@ int net_poll_write(int fd, int timeout_ms)
     int rc = poll(&pfd, 1, timeout_ms);
     if (rc < 0 && errno == EINTR) return 0;
     return rc;
+}
+
+/* ------------------------------------------------------------------ */
+int net_create_udp_sender(int send_buf_size, int mcast_ttl)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        LOG_E("socket(udp): %s", strerror(errno));
+        return -1;
+    }
+
+    if (send_buf_size > 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+                   &send_buf_size, sizeof(send_buf_size));
+
+    unsigned char ttl  = (unsigned char)mcast_ttl;
+    unsigned char loop = 1;   /* a receiver on the streamer's host works too */
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL,  &ttl,  sizeof(ttl));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+    int tos = 0x10;
+    setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+
+    return fd;
+}
+
+/* ------------------------------------------------------------------ */
+int net_create_mcast_receiver(uint32_t group, int port, int recv_buf_size)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        LOG_E("socket(udp): %s", strerror(errno));
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (recv_buf_size > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                   &recv_buf_size, sizeof(recv_buf_size));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = group;
+    addr.sin_port        = htons((uint16_t)port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOG_E("bind udp port %d: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr.s_addr = group;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        char g[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &group, g, sizeof(g));
+        LOG_E("join multicast %s: %s", g, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* ------------------------------------------------------------------ */
+int net_create_udp_server(int port, int buf_size)
+{
+    int fd = net_create_udp_sender(buf_size, 1);
+    if (fd < 0) return -1;
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (buf_size > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons((uint16_t)port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOG_E("bind udp port %d: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    LOG_I("UDP socket on port %d", port);
+    return fd;
+}
+
+/* ------------------------------------------------------------------ */
+int net_create_udp_client(const char *ip, int port, int recv_buf_size)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        LOG_E("socket(udp): %s", strerror(errno));
+        return -1;
+    }
+
+    if (recv_buf_size > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                   &recv_buf_size, sizeof(recv_buf_size));
+
+    int tos = 0x10;
+    setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons((uint16_t)port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) {
+        LOG_E("inet_pton(%s): %s", ip, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* Connected: only the streamer's datagrams get through */
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOG_E("connect udp %s:%d: %s", ip, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
 }
\ No newline at end of file
@@ -29,10 +29,31 @@ int  net_get_device_ip(char *buf, size_t len);
 int  net_create_server(int port, int backlog);
 int  net_accept_client(int server_fd, char *client_ip, size_t ip_len);
 int  net_connect(const char *host, int port, int timeout_ms);
+/* The same, given up as soon as `cancel_fd` (an eventfd, say) turns readable */
+int  net_connect_cancel(const char *host, int port, int timeout_ms, int cancel_fd);
 void net_set_audio_opts(int fd, int send_buf_size);
+/* Kernel buffer sizes, e.g. after a format change; 0 keeps one as is */
+void net_set_buffers(int fd, int send_buf_size, int recv_buf_size);
+/* Blocking reads fail with EAGAIN after this long without data; 0 = never */
+void net_set_recv_timeout(int fd, int timeout_ms);
+/* Bytes waiting to be read (SIOCINQ) or, `outgoing`, not yet acknowledged
+   (SIOCOUTQ); -1 on error.  On UDP only the next datagram counts.       */
+int  net_queued_bytes(int fd, bool outgoing);
+/* Kernel's smoothed round trip of a TCP connection in µs; -1 on error */
+int  net_tcp_rtt_us(int fd);
+/* Port of a socket's own (`local`) or its peer's end; -1 on error */
+int  net_socket_port(int fd, bool local);
 void net_close(int *fd);
 int  net_set_nonblocking(int fd, bool nonblock);
 int  net_poll_read(int fd, int timeout_ms);
+/* net_poll_read, but -1 with ECANCELED once `cancel_fd` is readable */
+int  net_poll_read_cancel(int fd, int cancel_fd, int timeout_ms);
 int  net_poll_write(int fd, int timeout_ms);
 
+/* UDP media sockets */
+int  net_create_udp_sender(int send_buf_size, int mcast_ttl);
+int  net_create_mcast_receiver(uint32_t group, int port, int recv_buf_size);
+int  net_create_udp_server(int port, int buf_size);
+int  net_create_udp_client(const char *ip, int port, int recv_buf_size);
+
 #endif /* NETWORK_H */
\ No newline at end of file
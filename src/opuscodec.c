@@ -0,0 +1,141 @@
+#include "opuscodec.h"
+
+#ifdef HAVE_OPUS
+#include <opus/opus.h>
+#endif
+
+struct OpusCodec {
+    int          channels;
+    int          frames;       /* per chunk, one Opus frame */
+#ifdef HAVE_OPUS
+    OpusEncoder *enc;
+    OpusDecoder *dec;
+#endif
+};
+
+bool opuscodec_supported(const AudioConfig *cfg)
+{
+#ifdef HAVE_OPUS
+    int sr = cfg->sample_rate;
+    if (sr != 8000 && sr != 12000 && sr != 16000 && sr != 24000 && sr != 48000)
+        return false;
+    if (cfg->channels < 1 || cfg->channels > 2) return false;
+    if (cfg->is_float || cfg->bytes_per_sample != 2) return false;
+
+    /* Frame sizes Opus accepts: 2.5, 5, 10 or 20 ms */
+    int quarter_ms = cfg->frames_per_buffer * 400;
+    if (quarter_ms % sr != 0) return false;
+    int q = quarter_ms / sr;
+    return q == 1 || q == 2 || q == 4 || q == 8;
+#else
+    (void)cfg;
+    return false;
+#endif
+}
+
+OpusCodec *opuscodec_create_encoder(const AudioConfig *cfg, int kbps)
+{
+#ifdef HAVE_OPUS
+    if (!opuscodec_supported(cfg)) return NULL;
+
+    OpusCodec *oc = calloc(1, sizeof(*oc));
+    if (!oc) return NULL;
+    oc->channels = cfg->channels;
+    oc->frames   = cfg->frames_per_buffer;
+
+    int err = OPUS_OK;
+    oc->enc = opus_encoder_create(cfg->sample_rate, cfg->channels,
+                                  OPUS_APPLICATION_RESTRICTED_LOWDELAY, &err);
+    if (!oc->enc) {
+        LOG_E("opus_encoder_create: %s", opus_strerror(err));
+        free(oc);
+        return NULL;
+    }
+    opus_encoder_ctl(oc->enc, OPUS_SET_BITRATE(kbps * 1000));
+    opus_encoder_ctl(oc->enc, OPUS_SET_SIGNAL(OPUS_SIGNAL_MUSIC));
+
+    opus_int32 la = 0;
+    opus_encoder_ctl(oc->enc, OPUS_GET_LOOKAHEAD(&la));
+
+    LOG_I("Opus encoder: %d kbps, %.1f ms frames, %.1f ms look-ahead",
+          kbps, oc->frames * 1000.0 / cfg->sample_rate, la * 1000.0 / cfg->sample_rate);
+    return oc;
+#else
+    (void)cfg;
+    (void)kbps;
+    return NULL;
+#endif
+}
+
+OpusCodec *opuscodec_create_decoder(const AudioConfig *cfg)
+{
+#ifdef HAVE_OPUS
+    if (!opuscodec_supported(cfg)) return NULL;
+
+    OpusCodec *oc = calloc(1, sizeof(*oc));
+    if (!oc) return NULL;
+    oc->channels = cfg->channels;
+    oc->frames   = cfg->frames_per_buffer;
+
+    int err = OPUS_OK;
+    oc->dec = opus_decoder_create(cfg->sample_rate, cfg->channels, &err);
+    if (!oc->dec) {
+        LOG_E("opus_decoder_create: %s", opus_strerror(err));
+        free(oc);
+        return NULL;
+    }
+    return oc;
+#else
+    (void)cfg;
+    return NULL;
+#endif
+}
+
+void opuscodec_destroy(OpusCodec *oc)
+{
+    if (!oc) return;
+#ifdef HAVE_OPUS
+    if (oc->enc) opus_encoder_destroy(oc->enc);
+    if (oc->dec) opus_decoder_destroy(oc->dec);
+#endif
+    free(oc);
+}
+
+ssize_t opuscodec_encode(OpusCodec *oc, const void *pcm, size_t len,
+                         uint8_t *out, size_t cap)
+{
+#ifdef HAVE_OPUS
+    size_t need = (size_t)oc->frames * (size_t)oc->channels * sizeof(opus_int16);
+    if (!oc->enc || len != need) return -1;
+
+    opus_int32 n = opus_encode(oc->enc, pcm, oc->frames, out,
+                               (opus_int32)(cap < OPUS_MAX_PACKET ? cap : OPUS_MAX_PACKET));
+    if (n < 0) {
+        LOG_W("opus_encode: %s", opus_strerror(n));
+        return -1;
+    }
+    return (ssize_t)n;
+#else
+    (void)oc; (void)pcm; (void)len; (void)out; (void)cap;
+    return -1;
+#endif
+}
+
+ssize_t opuscodec_decode(OpusCodec *oc, const uint8_t *in, size_t len,
+                         void *pcm, size_t cap)
+{
+#ifdef HAVE_OPUS
+    size_t bpf = (size_t)oc->channels * sizeof(opus_int16);
+    if (!oc->dec || cap < (size_t)oc->frames * bpf) return -1;
+
+    int n = opus_decode(oc->dec, in, in ? (opus_int32)len : 0, pcm, oc->frames, 0);
+    if (n < 0) {
+        LOG_W("opus_decode: %s", opus_strerror(n));
+        return -1;
+    }
+    return (ssize_t)((size_t)n * bpf);
+#else
+    (void)oc; (void)in; (void)len; (void)pcm; (void)cap;
+    return -1;
+#endif
+}
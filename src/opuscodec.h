@@ -0,0 +1,53 @@
+#ifndef OPUSCODEC_H
+#define OPUSCODEC_H
+
+#include "soundshare.h"
+#include "config.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Opus mode (compression_type 2) for constrained links.
+ *
+ * Thin wrapper around libopus in its restricted low-delay (CELT only)
+ * mode: one chunk is one Opus frame of 2.5, 5, 10 or 20 ms, so the
+ * algorithmic delay is the chunk plus 2.5 ms of look-ahead.  Unlike
+ * the lossless codec both sides keep state across chunks: the streamer
+ * encodes every chunk exactly once, in order, and the receiver decodes
+ * in order and asks for loss concealment in place of missing chunks.
+ *
+ * Without libopus at build time (HAVE_OPUS unset) nothing is supported
+ * and the create functions return NULL.
+ */
+
+/* Largest packet for one frame, per RFC 6716 */
+#define OPUS_MAX_PACKET       1275
+#define OPUS_DEFAULT_KBPS     128
+/* Encoder look-ahead in restricted low-delay mode */
+#define OPUS_LOOKAHEAD_MS     2.5
+
+typedef struct OpusCodec OpusCodec;
+
+/** Built with libopus and the format (rate, channels, chunk) fits? */
+bool opuscodec_supported(const AudioConfig *cfg);
+
+OpusCodec *opuscodec_create_encoder(const AudioConfig *cfg, int kbps);
+OpusCodec *opuscodec_create_decoder(const AudioConfig *cfg);
+void       opuscodec_destroy(OpusCodec *oc);
+
+/**
+ * Encode one chunk of interleaved s16 PCM.  Returns the packet length,
+ * or -1 on error.
+ */
+ssize_t opuscodec_encode(OpusCodec *oc, const void *pcm, size_t len,
+                         uint8_t *out, size_t cap);
+
+/**
+ * Decode one packet into interleaved s16 PCM; a NULL `in` conceals one
+ * lost chunk instead.  Returns the PCM byte count, or -1 on error.
+ */
+ssize_t opuscodec_decode(OpusCodec *oc, const uint8_t *in, size_t len,
+                         void *pcm, size_t cap);
+
+#endif /* OPUSCODEC_H */
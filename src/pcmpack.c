@@ -0,0 +1,169 @@
+#include "pcmpack.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PCMPACK_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*PackFn)(const uint8_t *in, uint8_t *out, size_t samples);
+
+static PackFn      pack_fn;
+static PackFn      unpack_fn;
+static const char *impl_name;
+static pthread_once_t pick_once = PTHREAD_ONCE_INIT;
+
+/* ---- Scalar ---- */
+
+static void pack_scalar(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++) {
+        out[0] = in[1];
+        out[1] = in[2];
+        out[2] = in[3];
+        in  += 4;
+        out += 3;
+    }
+}
+
+static void unpack_scalar(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    for (size_t i = 0; i < samples; i++) {
+        out[0] = 0;
+        out[1] = in[0];
+        out[2] = in[1];
+        out[3] = in[2];
+        in  += 3;
+        out += 4;
+    }
+}
+
+/* ---- x86 shuffles ---- */
+
+/*
+ * Every vector store writes a few bytes past the samples it finishes;
+ * the loops stop while the next store still lands inside the buffer
+ * and leave the tail to the scalar code.
+ */
+#ifdef PCMPACK_X86
+
+/* 4 samples: drop byte 0 of each, 12 bytes to the front */
+#define PACK_MASK   15, 14, 13, 11, 10,  9,  7,  6,  5,  3,  2,  1
+/* 4 samples: 3 bytes each to the top of a 4-byte slot, zero below */
+#define UNPACK_MASK 11, 10,  9, -1,  8,  7,  6, -1,  5,  4,  3, -1,  2,  1,  0, -1
+
+__attribute__((target("ssse3")))
+static size_t pack_ssse3_run(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    const __m128i mask = _mm_set_epi8(-1, -1, -1, -1, PACK_MASK);
+    size_t i = 0;
+    for (; i + 6 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i * 4));
+        _mm_storeu_si128((__m128i *)(out + i * 3), _mm_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t unpack_ssse3_run(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    const __m128i mask = _mm_set_epi8(UNPACK_MASK);
+    size_t i = 0;
+    for (; i + 6 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i * 3));
+        _mm_storeu_si128((__m128i *)(out + i * 4), _mm_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+static void pack_ssse3(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    size_t i = pack_ssse3_run(in, out, samples);
+    pack_scalar(in + i * 4, out + i * 3, samples - i);
+}
+
+static void unpack_ssse3(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    size_t i = unpack_ssse3_run(in, out, samples);
+    unpack_scalar(in + i * 3, out + i * 4, samples - i);
+}
+
+/* vpshufb stays inside each 128-bit lane, so the lanes' 12-byte
+   halves are joined (pack) or split apart (unpack) with vpermd     */
+__attribute__((target("avx2")))
+static void pack_avx2(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    const __m256i mask = _mm256_set_epi8(-1, -1, -1, -1, PACK_MASK,
+                                         -1, -1, -1, -1, PACK_MASK);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 11 <= samples; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i * 4));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), join);
+        _mm256_storeu_si256((__m256i *)(out + i * 3), v);
+    }
+    i += pack_ssse3_run(in + i * 4, out + i * 3, samples - i);
+    pack_scalar(in + i * 4, out + i * 3, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void unpack_avx2(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    const __m256i mask  = _mm256_set_epi8(UNPACK_MASK, UNPACK_MASK);
+    const __m256i split = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    size_t i = 0;
+    for (; i + 11 <= samples; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i * 3));
+        v = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, split), mask);
+        _mm256_storeu_si256((__m256i *)(out + i * 4), v);
+    }
+    i += unpack_ssse3_run(in + i * 3, out + i * 4, samples - i);
+    unpack_scalar(in + i * 3, out + i * 4, samples - i);
+}
+
+#endif /* PCMPACK_X86 */
+
+/* ---- Dispatch ---- */
+
+static void pick_kernels(void)
+{
+    pack_fn   = pack_scalar;
+    unpack_fn = unpack_scalar;
+    impl_name = "scalar";
+
+#ifdef PCMPACK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        pack_fn   = pack_avx2;
+        unpack_fn = unpack_avx2;
+        impl_name = "AVX2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        pack_fn   = pack_ssse3;
+        unpack_fn = unpack_ssse3;
+        impl_name = "SSSE3";
+    }
+#endif
+}
+
+bool pcm_pack24_applicable(const AudioConfig *cfg)
+{
+    return (cfg->compression_type == 0 || cfg->use_flac) && !cfg->is_float &&
+           cfg->bits_per_sample == 24 && cfg->bytes_per_sample == 4;
+}
+
+void pcm_pack24(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    pthread_once(&pick_once, pick_kernels);
+    pack_fn(in, out, samples);
+}
+
+void pcm_unpack24(const uint8_t *in, uint8_t *out, size_t samples)
+{
+    pthread_once(&pick_once, pick_kernels);
+    unpack_fn(in, out, samples);
+}
+
+const char *pcm_pack24_impl(void)
+{
+    pthread_once(&pick_once, pick_kernels);
+    return impl_name;
+}
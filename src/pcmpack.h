@@ -0,0 +1,34 @@
+#ifndef PCMPACK_H
+#define PCMPACK_H
+
+#include "soundshare.h"
+#include "config.h"
+
+#include <stddef.h>
+
+/*
+ * Packed 24-bit wire format.
+ *
+ * PulseAudio hands 24-bit audio over as s32le with the sample in the
+ * top three bytes, so a quarter of every such chunk is padding.  The
+ * streamer drops the low byte of each sample before sending and the
+ * receiver puts a zero back.  The kernels are picked once at run time:
+ * AVX2 or SSSE3 byte shuffles where the CPU has them, scalar otherwise.
+ */
+
+/**
+ * 24-bit integer PCM in a 32-bit container: worth packing?  Also true
+ * for lossless streams, whose chunks may be sent as PCM.
+ */
+bool pcm_pack24_applicable(const AudioConfig *cfg);
+
+/** s32le -> 3 bytes per sample.  `out` holds samples * 3 bytes. */
+void pcm_pack24(const uint8_t *in, uint8_t *out, size_t samples);
+
+/** 3 bytes per sample -> s32le, low byte zero.  `out` holds samples * 4. */
+void pcm_unpack24(const uint8_t *in, uint8_t *out, size_t samples);
+
+/** Name of the kernels in use, for the log. */
+const char *pcm_pack24_impl(void);
+
+#endif /* PCMPACK_H */
@@ -1,178 +1,605 @@
 #include "ping.h"
 #include "protocol.h"
 #include "network.h"
-#include "config.h"
+#include "latency.h"
+#include "histogram.h"
+#include "receiving.h"
+#include "streaming.h"
+#include "reactor.h"
 #include "ui.h"
 
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 /* ============================================================ */
 /*  PING SERVER (streamer side)                                  */
 /* ============================================================ */
 
+/* Receivers' ping connections, served on the reactor thread */
+#define PING_MAX_CONNS MAX_CLIENTS
+/* Unparsed input kept per connection: the longest message and then some */
+#define PING_IN_SIZE   256
+
+typedef struct {
+    int          fd;
+    char         ip[INET_ADDRSTRLEN];
+    uint8_t      in[PING_IN_SIZE];
+    size_t       in_len;
+    ReactorWatch watch;
+} PingConn;
+
 static struct {
-    int       server_fd;
-    pthread_t thread;
-    bool      running;
-} ping_srv = { .server_fd = -1 };
+    int          server_fd;
+    int          udp_fd;       /* UDP probes, -1 if the port was taken */
+    ReactorWatch server_watch;
+    ReactorWatch udp_watch;
+    PingConn     conns[PING_MAX_CONNS];
+} ping_srv = { .server_fd = -1, .udp_fd = -1 };
+
+void ping_clock_response(uint8_t *dst, const uint8_t *req, int64_t t2)
+{
+    dst[0] = CLOCK_RESPONSE;
+    memcpy(dst + 1, req + 1, 8);
+    write_be64(dst +  9, (uint64_t)t2);
+    write_be64(dst + 17, (uint64_t)current_time_ns());
+}
 
-static void handle_ping_client(int fd)
+/* Bytes a message takes, type included; unknown types are skipped */
+static size_t ping_msg_len(uint8_t type)
 {
-    uint8_t cmd;
+    switch (type) {
+    case CLOCK_REQUEST:
+    case LATENCY_REPORT:  return 9;
+    case RECEIVER_REPORT: return RECEIVER_REPORT_SIZE;
+    default:              return 1;
+    }
+}
 
-    while (atomic_load(&g_app.is_streaming)) {
-        int ready = net_poll_read(fd, 1000);
-        if (ready <= 0) {
-            if (ready < 0) break;
-            continue;
-        }
+/*
+ * Answers are a few bytes to a socket that is otherwise idle, so they
+ * go out whole or the receiver has stopped reading: -1 drops it rather
+ * than leave it with half a message.
+ */
+static int ping_reply(PingConn *pc, const uint8_t *msg, size_t len)
+{
+    ssize_t n = send(pc->fd, msg, len, MSG_NOSIGNAL);
+    return n == (ssize_t)len ? 0 : -1;
+}
 
-        ssize_t n = read(fd, &cmd, 1);
-        if (n <= 0) break;
-
-        if (cmd == PING_REQUEST) {
-            uint8_t resp = PING_RESPONSE;
-            if (write_fully(fd, &resp, 1) < 0) break;
-        } else if (cmd == LATENCY_REPORT) {
-            uint8_t buf[8];
-            if (read_fully(fd, buf, 8) != 8) break;
-            int64_t ms = 0;
-            for (int i = 0; i < 8; i++)
-                ms = (ms << 8) | buf[i];
-            atomic_store(&g_app.current_latency_ms, ms);
-            ui_update_latency(ms);
+/* One complete message that arrived at `t2` */
+static int serve_message(PingConn *pc, const uint8_t *msg, int64_t t2)
+{
+    if (msg[0] == PING_REQUEST) {
+        uint8_t resp = PING_RESPONSE;
+        return ping_reply(pc, &resp, 1);
+    }
+    if (msg[0] == CLOCK_REQUEST) {
+        uint8_t resp[CLOCK_RESPONSE_SIZE];
+        ping_clock_response(resp, msg, t2);
+        return ping_reply(pc, resp, sizeof(resp));
+    }
+    if (msg[0] == LATENCY_REPORT) {
+        streaming_receiver_latency(pc->ip, (int64_t)read_be64(msg + 1));
+    } else if (msg[0] == RECEIVER_REPORT) {
+        ReceiverReport r;
+        protocol_parse_report(msg + 1, &r);
+        streaming_receiver_report(pc->ip, &r);
+    }
+    return 0;
+}
+
+/* Everything a connection has sent; -1 once it is gone */
+static int ping_conn_input(PingConn *pc)
+{
+    for (;;) {
+        ssize_t n = read(pc->fd, pc->in + pc->in_len, sizeof(pc->in) - pc->in_len);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         }
+        int64_t t2 = current_time_ns();
+        pc->in_len += (size_t)n;
+
+        size_t off = 0;
+        while (off < pc->in_len) {
+            size_t len = ping_msg_len(pc->in[off]);
+            if (pc->in_len - off < len) break;
+            if (serve_message(pc, pc->in + off, t2) < 0) return -1;
+            off += len;
+        }
+        pc->in_len -= off;
+        memmove(pc->in, pc->in + off, pc->in_len);
     }
 }
 
-static void *ping_server_thread(void *arg)
+static void ping_conn_close(PingConn *pc)
 {
-    (void)arg;
-    LOG_I("Ping server started on port %d", PING_PORT);
+    reactor_del(&pc->watch, pc->fd);
+    net_close(&pc->fd);
+    LOG_I("Ping client disconnected: %s", pc->ip);
+}
+
+static void ping_conn_event(void *arg, uint32_t events)
+{
+    PingConn *pc = arg;
+    if (pc->fd < 0) return;
 
-    while (atomic_load(&g_app.is_streaming)) {
-        int ready = net_poll_read(ping_srv.server_fd, 1000);
-        if (ready <= 0) continue;
+    /* Whatever came before a hangup still gets served */
+    if (ping_conn_input(pc) < 0 || (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)))
+        ping_conn_close(pc);
+}
+
+static void ping_accept_all(void *arg, uint32_t events)
+{
+    (void)arg;
+    (void)events;
 
+    for (;;) {
         char ip[INET_ADDRSTRLEN];
-        int fd = net_accept_client(ping_srv.server_fd, ip, sizeof(ip));
-        if (fd < 0) continue;
+        int  fd = net_accept_client(ping_srv.server_fd, ip, sizeof(ip));
+        if (fd < 0) return;
+
+        int idx = -1;
+        for (int i = 0; i < PING_MAX_CONNS && idx < 0; i++)
+            if (ping_srv.conns[i].fd < 0) idx = i;
+        if (idx < 0) {
+            LOG_W("Ping: too many connections, rejecting %s", ip);
+            close(fd);
+            continue;
+        }
 
+        PingConn *pc = &ping_srv.conns[idx];
+        net_set_nonblocking(fd, true);
+        if (reactor_add(&pc->watch, fd, EPOLLIN | EPOLLRDHUP, ping_conn_event, pc) < 0) {
+            close(fd);
+            continue;
+        }
+        pc->fd     = fd;
+        pc->in_len = 0;
+        snprintf(pc->ip, sizeof(pc->ip), "%s", ip);
         LOG_I("Ping client connected: %s", ip);
-        handle_ping_client(fd);
-        net_close(&fd);
-        LOG_I("Ping client disconnected: %s", ip);
     }
+}
 
-    LOG_I("Ping server stopped");
-    return NULL;
+/* UDP probes are answered straight back to wherever they came from */
+static void ping_udp_input(void *arg, uint32_t events)
+{
+    (void)arg;
+    (void)events;
+    uint8_t req[PING_UDP_PROBE_SIZE + 1];
+
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t          flen = sizeof(from);
+        ssize_t n = recvfrom(ping_srv.udp_fd, req, sizeof(req), MSG_DONTWAIT,
+                             (struct sockaddr *)&from, &flen);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        int64_t t2 = current_time_ns();
+        if (n != PING_UDP_PROBE_SIZE || req[0] != CLOCK_REQUEST) continue;
+
+        uint8_t resp[CLOCK_RESPONSE_SIZE];
+        ping_clock_response(resp, req, t2);
+        sendto(ping_srv.udp_fd, resp, sizeof(resp), MSG_DONTWAIT,
+               (struct sockaddr *)&from, flen);   /* best-effort */
+    }
 }
 
 int ping_server_start(void)
 {
-    ping_srv.server_fd = net_create_server(PING_PORT, 4);
-    if (ping_srv.server_fd < 0) return -1;
+    for (int i = 0; i < PING_MAX_CONNS; i++)
+        ping_srv.conns[i].fd = -1;
 
-    ping_srv.running = true;
-    if (pthread_create(&ping_srv.thread, NULL, ping_server_thread, NULL) != 0) {
-        LOG_E("pthread_create(ping_server): %s", strerror(errno));
+    ping_srv.server_fd = net_create_server(PING_PORT, 8);
+    if (ping_srv.server_fd < 0) return -1;
+    net_set_nonblocking(ping_srv.server_fd, true);
+    if (reactor_add(&ping_srv.server_watch, ping_srv.server_fd, EPOLLIN,
+                    ping_accept_all, NULL) < 0) {
         net_close(&ping_srv.server_fd);
         return -1;
     }
 
+    /* Receivers fall back to TCP probes without it */
+    ping_srv.udp_fd = net_create_udp_server(PING_PORT, 0);
+    if (ping_srv.udp_fd >= 0 &&
+        reactor_add(&ping_srv.udp_watch, ping_srv.udp_fd, EPOLLIN, ping_udp_input, NULL) < 0)
+        net_close(&ping_srv.udp_fd);
+
+    LOG_I("Ping server started on port %d", PING_PORT);
     return 0;
 }
 
+/* After reactor_stop(): nothing is served any more */
 void ping_server_stop(void)
 {
+    for (int i = 0; i < PING_MAX_CONNS; i++)
+        if (ping_srv.conns[i].fd >= 0)
+            ping_conn_close(&ping_srv.conns[i]);
+
+    reactor_del(&ping_srv.server_watch, ping_srv.server_fd);
+    reactor_del(&ping_srv.udp_watch, ping_srv.udp_fd);
     net_close(&ping_srv.server_fd);
-    if (ping_srv.running) {
-        pthread_join(ping_srv.thread, NULL);
-        ping_srv.running = false;
-    }
+    net_close(&ping_srv.udp_fd);
+    LOG_I("Ping server stopped");
 }
 
 /* ============================================================ */
 /*  PING CLIENT (receiver side)                                  */
 /* ============================================================ */
 
+/* One thread per session.  Only it closes its sockets; the stopper
+   signals stop_fd, which every wait watches, and shuts the sockets
+   down under `lock` to end a blocking read or write.               */
 static struct {
-    int       fd;
-    pthread_t thread;
-    bool      running;
-    char      server_ip[INET_ADDRSTRLEN];
-} ping_cli = { .fd = -1 };
+    pthread_mutex_t lock;
+    int         fd;
+    int         ufd;      /* UDP probes */
+    int         stop_fd;  /* eventfd, readable once ping_client_stop() runs */
+    atomic_bool stop;
+    int         stale_pings;   /* PING_REQUESTs timed out, answers unseen */
+    pthread_t   thread;
+    bool        running;
+    char        server_ip[INET_ADDRSTRLEN];
+} ping_cli = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .ufd = -1, .stop_fd = -1 };
+
+/* Publish the session's sockets to the stopper, or take them back (-1) */
+static void ping_cli_set_fds(int fd, int ufd)
+{
+    pthread_mutex_lock(&ping_cli.lock);
+    ping_cli.fd  = fd;
+    ping_cli.ufd = ufd;
+    pthread_mutex_unlock(&ping_cli.lock);
+}
 
-static void *ping_client_thread(void *arg)
+/* ---- Clock sync ---- */
+
+static struct {
+    pthread_mutex_t lock;
+    atomic_bool     fast;       /* synchronized playout leans on the clock */
+    atomic_bool     answered;   /* the streamer knows CLOCK_REQUEST ... */
+    atomic_bool     refused;    /* ... or it let one pass before it did */
+    int64_t         offset[CLOCK_WINDOW];
+    int64_t         rtt[CLOCK_WINDOW];
+    int             n;       /* samples held */
+    int             next;    /* slot the next one goes to */
+} clk = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* ---- Probe statistics ---- */
+
+/* Round trips of this connection's probes; one writer, the prober */
+static struct {
+    Histogram       rtt;
+    _Atomic int64_t last_ns;     /* -1 before the first */
+    _Atomic int64_t jitter_ns;   /* smoothed |change| between round trips */
+    atomic_long     lost;        /* never answered */
+    atomic_bool     udp;
+} probe;
+
+static void probe_reset(void)
 {
-    (void)arg;
-    LOG_I("Ping client starting – target %s:%d", ping_cli.server_ip, PING_PORT);
+    hist_reset(&probe.rtt);
+    atomic_store(&probe.last_ns, -1);
+    atomic_store(&probe.jitter_ns, 0);
+    atomic_store(&probe.lost, 0);
+    atomic_store(&probe.udp, false);
+}
+
+/* Jitter as RFC 3550 has it for transit times, over round trips */
+static void probe_record(int64_t rtt_ns)
+{
+    hist_record(&probe.rtt, rtt_ns);
 
-    /* Small delay so the server is ready */
-    usleep(500000);
+    int64_t last = atomic_load(&probe.last_ns);
+    if (last >= 0) {
+        int64_t d = rtt_ns > last ? rtt_ns - last : last - rtt_ns;
+        int64_t j = atomic_load(&probe.jitter_ns);
+        atomic_store(&probe.jitter_ns, j + (d - j) / PING_JITTER_SMOOTH);
+    }
+    atomic_store(&probe.last_ns, rtt_ns);
+}
 
-    int fd = net_connect(ping_cli.server_ip, PING_PORT, 3000);
-    if (fd < 0) {
-        LOG_W("Ping: could not connect");
-        return NULL;
+void ping_client_get_probe_stats(ProbeStats *out)
+{
+    hist_summary(&probe.rtt, &out->rtt);
+    out->jitter_ns = atomic_load(&probe.jitter_ns);
+    out->lost      = atomic_load(&probe.lost);
+    out->udp       = atomic_load(&probe.udp);
+}
+
+void ping_client_log_stats(void)
+{
+    ProbeStats ps;
+    ping_client_get_probe_stats(&ps);
+    if (ps.rtt.count == 0 && ps.lost == 0) return;
+
+    LOG_I("Probe round trip%s: %llu probes, min %.2f / p50 %.2f / p99 %.2f / "
+          "max %.2f ms, jitter %.2f ms, %ld lost",
+          ps.udp ? " over UDP" : "", (unsigned long long)ps.rtt.count,
+          ps.rtt.min / 1e6, ps.rtt.p50 / 1e6, ps.rtt.p99 / 1e6,
+          ps.rtt.max / 1e6, ps.jitter_ns / 1e6, ps.lost);
+}
+
+/* What goes into RECEIVER_REPORT besides the latency */
+static struct {
+    atomic_int      port;     /* of the audio connection; 0 = LATENCY_REPORT */
+    _Atomic int64_t rtt_us;   /* last probe */
+} rep;
+
+int64_t ping_client_measured(int64_t rtt_ns)
+{
+    latency_record(LAT_NETWORK, rtt_ns / 2);
+    atomic_store(&rep.rtt_us, rtt_ns / 1000);
+    probe_record(rtt_ns);
+
+    int64_t total = latency_total_ms();
+    if (total < 0) total = rtt_ns / 2000000;
+    atomic_store(&g_app.current_latency_ms, total);
+    ui_update_latency(total);
+    return total;
+}
+
+void ping_client_timed_out(void)
+{
+    atomic_fetch_add(&probe.lost, 1);
+    if (!atomic_load(&clk.answered))
+        atomic_store(&clk.refused, true);
+    atomic_store(&g_app.current_latency_ms, 999);
+    ui_update_latency(999);
+}
+
+/* A new connection may lead to another streamer: start the clock over */
+void ping_client_attach(void)
+{
+    pthread_mutex_lock(&clk.lock);
+    clk.n    = 0;
+    clk.next = 0;
+    pthread_mutex_unlock(&clk.lock);
+    atomic_store(&clk.answered, false);
+    atomic_store(&clk.refused, false);
+    probe_reset();
+}
+
+void ping_client_set_report_port(int port)
+{
+    atomic_store(&rep.port, port > 0 ? port : 0);
+}
+
+size_t ping_client_build_report(uint8_t *dst, int64_t latency_ms)
+{
+    int port = atomic_load(&rep.port);
+    if (port == 0) {
+        dst[0] = LATENCY_REPORT;
+        write_be64(dst + 1, (uint64_t)latency_ms);
+        return 9;
+    }
+
+    ReceiverReport r = {
+        .port       = (uint16_t)port,
+        .latency_us = (uint32_t)(latency_ms * 1000),
+        .rtt_us     = (uint32_t)atomic_load(&rep.rtt_us),
+        .reconnects = (uint32_t)receiving_reconnects(),
+    };
+    JitterStats js;
+    if (receiving_get_jitter_stats(&js) == 0) {
+        r.underruns = (uint32_t)js.underruns;
+        r.lost      = (uint32_t)js.lost;
     }
-    ping_cli.fd = fd;
+    ProbeStats ps;
+    ping_client_get_probe_stats(&ps);
+    if (ps.rtt.count > 0) {
+        r.probe_p50_us    = (uint32_t)(ps.rtt.p50 / 1000);
+        r.probe_p99_us    = (uint32_t)(ps.rtt.p99 / 1000);
+        r.probe_jitter_us = (uint32_t)(ps.jitter_ns / 1000);
+    }
+    protocol_write_report(dst, &r);
+    return RECEIVER_REPORT_SIZE;
+}
+
+void ping_client_set_clock(bool on)
+{
+    atomic_store(&clk.fast, on);
+}
+
+bool ping_client_clock_probes(void)
+{
+    return !atomic_load(&clk.refused);
+}
+
+int ping_client_probe_interval_ms(void)
+{
+    if (!atomic_load(&clk.fast)) return PING_INTERVAL_MS;
+
+    pthread_mutex_lock(&clk.lock);
+    int n = clk.n;
+    pthread_mutex_unlock(&clk.lock);
+    return n < CLOCK_WINDOW / 2 ? CLOCK_FAST_MS : CLOCK_PROBE_MS;
+}
 
-    int64_t smoothed = -1;
+int64_t ping_client_clock_sample(const uint8_t *resp, int64_t t1, int64_t t4)
+{
+    if (resp[0] != CLOCK_RESPONSE || (int64_t)read_be64(resp + 1) != t1)
+        return -1;
+    atomic_store(&clk.answered, true);
+    int64_t t2 = (int64_t)read_be64(resp + 9);
+    int64_t t3 = (int64_t)read_be64(resp + 17);
+
+    /* The streamer's turnaround is not part of the trip */
+    int64_t rtt = (t4 - t1) - (t3 - t2);
+    if (rtt < 0) rtt = 0;
+
+    pthread_mutex_lock(&clk.lock);
+    clk.offset[clk.next] = ((t2 - t1) + (t3 - t4)) / 2;
+    clk.rtt[clk.next]    = rtt;
+    clk.next = (clk.next + 1) % CLOCK_WINDOW;
+    if (clk.n < CLOCK_WINDOW) clk.n++;
+    pthread_mutex_unlock(&clk.lock);
+
+    return ping_client_measured(rtt);
+}
 
-    while (atomic_load(&g_app.is_receiving)) {
-        /* Send PING_REQUEST */
-        int64_t start_ns = current_time_ns();
-        uint8_t req = PING_REQUEST;
-        if (write_fully(fd, &req, 1) < 0) break;
+bool ping_client_clock_offset(int64_t *offset_ns)
+{
+    pthread_mutex_lock(&clk.lock);
+    int best = -1;
+    for (int i = 0; i < clk.n; i++)
+        if (best < 0 || clk.rtt[i] < clk.rtt[best])
+            best = i;
+    if (best >= 0)
+        *offset_ns = clk.offset[best];
+    pthread_mutex_unlock(&clk.lock);
+    return best >= 0;
+}
 
-        /* Wait for response */
-        int ready = net_poll_read(fd, 2000);
+/*
+ * One probe on the ping connection; -1 once the connection is gone.
+ * Answers to probes that timed out may still come first: they are
+ * skipped until this probe's own answer arrives or it times out too.
+ */
+static int tcp_probe(int fd, int64_t *latency_ms)
+{
+    /* CLOCK_REQUEST unless the streamer predates it */
+    bool    clock    = ping_client_clock_probes();
+    int64_t start_ns = current_time_ns();
+    uint8_t req[CLOCK_REQUEST_SIZE];
+    req[0] = clock ? CLOCK_REQUEST : PING_REQUEST;
+    write_be64(req + 1, (uint64_t)start_ns);
+    if (write_fully(fd, req, clock ? CLOCK_REQUEST_SIZE : 1) < 0) return -1;
+
+    int64_t deadline = start_ns + (int64_t)PING_TIMEOUT_MS * 1000000;
+    for (;;) {
+        int64_t left_ms = (deadline - current_time_ns()) / 1000000;
+        int     ready   = left_ms > 0
+                        ? net_poll_read_cancel(fd, ping_cli.stop_fd, (int)left_ms) : 0;
         if (ready <= 0) {
-            atomic_store(&g_app.current_latency_ms, 999);
-            ui_update_latency(999);
-            if (ready < 0) break;
-            usleep(500000);
-            continue;
+            if (ready < 0) return -1;
+            ping_client_timed_out();
+            if (!clock) ping_cli.stale_pings++;
+            return 0;
         }
 
-        uint8_t resp;
-        if (read(fd, &resp, 1) != 1) break;
-
-        if (resp == PING_RESPONSE) {
-            int64_t rtt_ms = (current_time_ns() - start_ns) / 1000000;
+        uint8_t resp[CLOCK_RESPONSE_SIZE];
+        if (read(fd, resp, 1) != 1) return -1;
+
+        if (resp[0] == CLOCK_RESPONSE) {
+            if (read_fully(fd, resp + 1, CLOCK_RESPONSE_SIZE - 1) != CLOCK_RESPONSE_SIZE - 1)
+                return -1;
+            int64_t ms = ping_client_clock_sample(resp, start_ns, current_time_ns());
+            if (ms >= 0) {
+                *latency_ms = ms;
+                return 0;
+            }
+        } else if (resp[0] == PING_RESPONSE && ping_cli.stale_pings > 0) {
+            /* Says nothing about which probe it answers: the oldest */
+            ping_cli.stale_pings--;
+        } else if (resp[0] == PING_RESPONSE && clock) {
+            /* An older streamer took the request for something else */
+            atomic_store(&clk.refused, true);
+            return 0;
+        } else if (resp[0] == PING_RESPONSE) {
+            *latency_ms = ping_client_measured(current_time_ns() - start_ns);
+            return 0;
+        }
+    }
+}
 
-            /* Add estimated buffer latency */
-            AudioConfig tmp;
-            config_load_preset(&tmp, g_app.selected_preset);
-            int64_t buf_ms = (int64_t)config_buffer_latency_ms(&tmp);
-            int64_t total  = rtt_ms / 2 + buf_ms;
+/*
+ * One probe as a datagram, clear of the TCP connection's Nagle and
+ * delayed ACKs.  Returns false if no answer came; answers to earlier
+ * probes that turn up late are skipped.
+ */
+static bool udp_probe(int ufd, int64_t *latency_ms)
+{
+    uint8_t req[PING_UDP_PROBE_SIZE] = { CLOCK_REQUEST };
+    int64_t start_ns = current_time_ns();
+    write_be64(req + 1, (uint64_t)start_ns);
+    if (send(ufd, req, sizeof(req), 0) != (ssize_t)sizeof(req))
+        return false;
+
+    int64_t deadline = start_ns + (int64_t)PING_UDP_TIMEOUT_MS * 1000000;
+    for (;;) {
+        int64_t left_ms = (deadline - current_time_ns()) / 1000000;
+        if (left_ms <= 0 || net_poll_read_cancel(ufd, ping_cli.stop_fd, (int)left_ms) <= 0)
+            return false;
+
+        uint8_t resp[CLOCK_RESPONSE_SIZE];
+        ssize_t n   = recv(ufd, resp, sizeof(resp), MSG_DONTWAIT);
+        int64_t now = current_time_ns();
+        if (n != CLOCK_RESPONSE_SIZE) continue;
+        int64_t ms = ping_client_clock_sample(resp, start_ns, now);
+        if (ms >= 0) {
+            *latency_ms = ms;
+            return true;
+        }
+    }
+}
 
-            if (smoothed < 0)
-                smoothed = total;
-            else
-                smoothed = (smoothed * 7 + total * 3) / 10;
+static void *ping_client_thread(void *arg)
+{
+    (void)arg;
+    LOG_I("Ping client starting – target %s:%d", ping_cli.server_ip, PING_PORT);
 
-            atomic_store(&g_app.current_latency_ms, smoothed);
-            ui_update_latency(smoothed);
+    /* The streamer's ping server is up before it sends a stream header */
+    int fd = net_connect_cancel(ping_cli.server_ip, PING_PORT, 3000, ping_cli.stop_fd);
+    if (fd < 0) {
+        LOG_W("Ping: could not connect");
+        return NULL;
+    }
+    /* Reads give up on their own too, should the stopper miss the socket */
+    net_set_recv_timeout(fd, PING_TIMEOUT_MS);
+    ping_cli.stale_pings = 0;
+
+    /* Reports still go over TCP; probes over UDP until it proves silent */
+    int  ufd      = g_app.ping_udp ? net_create_udp_client(ping_cli.server_ip, PING_PORT, 0) : -1;
+    bool udp_seen = false;
+    int  udp_miss = 0;
+    atomic_store(&probe.udp, ufd >= 0);
+    ping_cli_set_fds(fd, ufd);
+
+    while (atomic_load(&g_app.is_receiving) && !atomic_load(&ping_cli.stop)) {
+        int64_t smoothed = -1;
+
+        if (ufd >= 0) {
+            if (udp_probe(ufd, &smoothed)) {
+                udp_seen = true;
+            } else if (atomic_load(&ping_cli.stop)) {
+                break;
+            } else if (!udp_seen && ++udp_miss >= PING_UDP_TRIES) {
+                LOG_W("Ping: no answer over UDP, probing over TCP");
+                probe_reset();
+                ping_cli_set_fds(fd, -1);
+                net_close(&ufd);
+                continue;
+            } else {
+                atomic_fetch_add(&probe.lost, 1);
+            }
+        } else if (tcp_probe(fd, &smoothed) < 0) {
+            break;
+        }
 
+        if (smoothed >= 0) {
             /* Report latency back to server */
-            uint8_t report[9];
-            report[0] = LATENCY_REPORT;
-            for (int i = 0; i < 8; i++)
-                report[1 + i] = (uint8_t)(smoothed >> (56 - i * 8));
+            uint8_t report[RECEIVER_REPORT_SIZE];
+            size_t  len = ping_client_build_report(report, smoothed);
 
-            write_fully(fd, report, sizeof(report));  /* best-effort */
+            if (write_fully(fd, report, len) < 0) break;
         }
 
-        usleep(500000);  /* 500 ms between pings */
+        /* Pause between probes, whatever comes in meanwhile: a late
+           answer is the next probe's to skip.  ping_client_stop ends it. */
+        if (net_poll_read(ping_cli.stop_fd, ping_client_probe_interval_ms()) != 0)
+            break;
     }
 
+    ping_cli_set_fds(-1, -1);
+    net_close(&ufd);
     net_close(&fd);
-    ping_cli.fd = -1;
 
     LOG_I("Ping client stopped");
     return NULL;
@@ -181,20 +608,39 @@ static void *ping_client_thread(void *arg)
 int ping_client_start(const char *server_ip)
 {
     strncpy(ping_cli.server_ip, server_ip, INET_ADDRSTRLEN - 1);
-    ping_cli.running = true;
+    ping_client_attach();
 
+    atomic_store(&ping_cli.stop, false);
+    ping_cli.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ping_cli.stop_fd < 0) {
+        LOG_E("eventfd(ping_client): %s", strerror(errno));
+        return -1;
+    }
     if (pthread_create(&ping_cli.thread, NULL, ping_client_thread, NULL) != 0) {
         LOG_E("pthread_create(ping_client): %s", strerror(errno));
+        net_close(&ping_cli.stop_fd);
         return -1;
     }
+    ping_cli.running = true;
     return 0;
 }
 
+/* Signal and shut down; the thread closes its own sockets */
 void ping_client_stop(void)
 {
-    net_close(&ping_cli.fd);
-    if (ping_cli.running) {
-        pthread_join(ping_cli.thread, NULL);
-        ping_cli.running = false;
-    }
-}
\ No newline at end of file
+    if (!ping_cli.running) return;
+
+    atomic_store(&ping_cli.stop, true);
+    uint64_t one = 1;
+    if (write(ping_cli.stop_fd, &one, sizeof(one)) < 0)
+        LOG_W("wake ping client: %s", strerror(errno));
+
+    pthread_mutex_lock(&ping_cli.lock);
+    if (ping_cli.fd >= 0)  shutdown(ping_cli.fd, SHUT_RDWR);
+    if (ping_cli.ufd >= 0) shutdown(ping_cli.ufd, SHUT_RDWR);
+    pthread_mutex_unlock(&ping_cli.lock);
+
+    pthread_join(ping_cli.thread, NULL);
+    ping_cli.running = false;
+    net_close(&ping_cli.stop_fd);
+}
@@ -2,21 +2,101 @@
 #define PING_H
 
 #include "soundshare.h"
+#include "histogram.h"
+
+#define PING_INTERVAL_MS 500
+/* No answer this long shows the latency as 999 ms */
+#define PING_TIMEOUT_MS  2000
+
+/* UDP probes (SOUNDSHARE_PING_UDP): a datagram not answered this soon
+   counts as lost; this many lost before any answer means the streamer
+   does not take them and probes go back to TCP                        */
+#define PING_UDP_TIMEOUT_MS 1000
+#define PING_UDP_TRIES      3
+
+/* Jitter moves 1/PING_JITTER_SMOOTH of the way per round trip */
+#define PING_JITTER_SMOOTH  16
+
+/*
+ * Clock sync for synchronized playout, NTP style: each CLOCK_REQUEST
+ * yields an offset and a round trip, and the offset of the quickest
+ * round trip in the last CLOCK_WINDOW is the one believed, since
+ * queueing delay is what skews the others.  The window is kept short
+ * so drift between the clocks cannot age it much.
+ */
+#define CLOCK_WINDOW     8
+#define CLOCK_PROBE_MS   250
+/* Probe interval until the window is half full */
+#define CLOCK_FAST_MS    50
 
 /**
  * Start the ping/latency server (called by the streamer).
- * Listens on PING_PORT, responds to PING_REQUEST with PING_RESPONSE,
- * reads LATENCY_REPORT updates.
+ * Listens on PING_PORT and serves every receiver's connection on the
+ * reactor thread, which must be running: answers PING_REQUEST and
+ * CLOCK_REQUEST, hands LATENCY_REPORT and RECEIVER_REPORT on to the
+ * streamer.
  */
 int  ping_server_start(void);
+/** Once the reactor has stopped. */
 void ping_server_stop(void);
+/** CLOCK_RESPONSE (CLOCK_RESPONSE_SIZE bytes) to `req`, received at `t2`. */
+void ping_clock_response(uint8_t *dst, const uint8_t *req, int64_t t2);
 
 /**
  * Start the ping client (called by the receiver).
- * Connects to server_ip:PING_PORT, measures RTT,
- * reports smoothed latency back to the server.
+ * Connects to server_ip:PING_PORT, measures RTT and the streamer's
+ * clock, reports the receiver's latency back to the server.
  */
 int  ping_client_start(const char *server_ip);
 void ping_client_stop(void);
 
+/*
+ * Multiplexed receivers probe over the audio connection themselves and
+ * feed the results in here instead of running the client thread.
+ */
+void    ping_client_attach(void);
+/**
+ * A probe came back after `rtt_ns`: the network share of the latency.
+ * Returns the receiver's end-to-end latency in ms, to report.
+ */
+int64_t ping_client_measured(int64_t rtt_ns);
+void    ping_client_timed_out(void);
+
+/**
+ * Probes are CLOCK_REQUEST, so the streamer's clock is known, unless the
+ * streamer predates them: it left the first unanswered or answered it
+ * as a ping.
+ */
+bool    ping_client_clock_probes(void);
+/**
+ * Reports are RECEIVER_REPORT naming the audio connection by its local
+ * `port` from now on, for a streamer that asked; 0: LATENCY_REPORT.
+ */
+void    ping_client_set_report_port(int port);
+/** Report of `latency_ms` (RECEIVER_REPORT_SIZE bytes at most); returns its length. */
+size_t  ping_client_build_report(uint8_t *dst, int64_t latency_ms);
+/** Synchronized playout leans on the clock: probe more often. */
+void    ping_client_set_clock(bool on);
+/** Milliseconds until the next probe is due after one came back. */
+int     ping_client_probe_interval_ms(void);
+/**
+ * A CLOCK_RESPONSE `resp` to the request sent at `t1` came back at `t4`.
+ * Returns the latency to report, or -1 if it does not match.
+ */
+int64_t ping_client_clock_sample(const uint8_t *resp, int64_t t1, int64_t t4);
+/** Streamer's clock minus ours; false until a probe came back. */
+bool    ping_client_clock_offset(int64_t *offset_ns);
+
+/* Probe round trips on this connection, the streamer's turnaround
+   taken out where the probe carried timestamps                     */
+typedef struct {
+    HistSummary rtt;        /* ns */
+    int64_t     jitter_ns;
+    long        lost;
+    bool        udp;        /* probing over UDP */
+} ProbeStats;
+
+void    ping_client_get_probe_stats(ProbeStats *out);
+void    ping_client_log_stats(void);
+
 #endif /* PING_H */
\ No newline at end of file
@@ -6,6 +6,12 @@
 
 /* ---- Byte-order helpers ---- */
 
+void write_be64(uint8_t *dst, uint64_t val)
+{
+    write_be32(dst,     (uint32_t)(val >> 32));
+    write_be32(dst + 4, (uint32_t)val);
+}
+
 void write_be32(uint8_t *dst, uint32_t val)
 {
     dst[0] = (uint8_t)(val >> 24);
@@ -28,6 +34,11 @@ uint32_t read_be32(const uint8_t *src)
            ((uint32_t)src[3]);
 }
 
+uint64_t read_be64(const uint8_t *src)
+{
+    return ((uint64_t)read_be32(src) << 32) | read_be32(src + 4);
+}
+
 uint16_t read_be16(const uint8_t *src)
 {
     return ((uint16_t)src[0] << 8) |
@@ -78,39 +89,159 @@ bool protocol_valid_sample_rate(int sr)
            sr == 176400 || sr == 192000;
 }
 
-/* ---- Header I/O ---- */
+/* ---- Version negotiation ---- */
 
-int protocol_write_header(int fd, const AudioConfig *cfg)
+int protocol_write_hello(int fd, const PeerCaps *caps)
 {
-    uint8_t hdr[HEADER_SIZE];
+    uint8_t hello[HELLO_MAX_SIZE];
+    size_t  len = HELLO_SIZE;
 
-    write_be32(hdr +  0, HEADER_MAGIC);
-    write_be32(hdr +  4, HEADER_VERSION);
-    write_be32(hdr +  8, (uint32_t)cfg->sample_rate);
-    write_be16(hdr + 12, (uint16_t)cfg->bits_per_sample);
-    write_be16(hdr + 14, (uint16_t)cfg->channels);
-    write_be32(hdr + 16, (uint32_t)cfg->frames_per_buffer);
-    write_be32(hdr + 20, (uint32_t)cfg->chunk_size);
-    write_be16(hdr + 24, (uint16_t)cfg->compression_type);
-    hdr[26] = cfg->is_float ? 1 : 0;
-    hdr[27] = 0; /* reserved */
+    write_be32(hello,     HELLO_MAGIC);
+    write_be32(hello + 4, caps ? HEADER_VERSION : 3);
 
-    if (write_fully(fd, hdr, HEADER_SIZE) != HEADER_SIZE) {
-        LOG_E("protocol_write_header: write failed: %s", strerror(errno));
+    if (caps) {
+        write_be32(hello +  8, caps->codecs);
+        write_be32(hello + 12, (uint32_t)caps->max_rate);
+        hello[16] = (uint8_t)caps->max_bits;
+        hello[17] = caps->flags;
+        write_be16(hello + 18, (uint16_t)caps->latency_ms);
+        write_be16(hello + 20, (uint16_t)caps->cpu_budget);
+        write_be16(hello + 22, 0); /* reserved */
+        len += CAPS_SIZE;
+        if (caps->flags & CAPS_RESUME) {
+            write_be32(hello + 24, caps->resume_token);
+            write_be32(hello + 28, caps->resume_seq);
+            len += RESUME_SIZE;
+        }
+    }
+
+    if (write_fully(fd, hello, len) != (ssize_t)len) {
+        LOG_E("protocol_write_hello: write failed: %s", strerror(errno));
         return -1;
     }
     return 0;
 }
 
-int protocol_read_header(int fd, AudioConfig *cfg)
+size_t protocol_hello_size(const uint8_t *src, size_t len)
 {
-    uint8_t hdr[HEADER_SIZE];
+    if (len < HELLO_SIZE || read_be32(src) != HELLO_MAGIC || read_be32(src + 4) < 4)
+        return HELLO_SIZE;
+    if (len < HELLO_SIZE + CAPS_SIZE)
+        return HELLO_SIZE + CAPS_SIZE;
+    return src[HELLO_SIZE + 9] & CAPS_RESUME ? HELLO_MAX_SIZE : HELLO_SIZE + CAPS_SIZE;
+}
 
-    if (read_fully(fd, hdr, HEADER_SIZE) != HEADER_SIZE) {
-        LOG_E("protocol_read_header: read failed: %s", strerror(errno));
+int protocol_parse_hello(const uint8_t *src, size_t len, PeerCaps *caps)
+{
+    memset(caps, 0, sizeof(*caps));
+    if (len == 0)
+        return HEADER_VERSION_MIN;
+
+    if (len < HELLO_SIZE || read_be32(src) != HELLO_MAGIC) {
+        LOG_W("Garbled hello, assuming v%d", HEADER_VERSION_MIN);
+        return HEADER_VERSION_MIN;
+    }
+
+    uint32_t v = read_be32(src + 4);
+    if (v < HEADER_VERSION_MIN) return HEADER_VERSION_MIN;
+    if (v < 4)                  return (int)v;
+
+    /* Newer receivers still send a v4 block first */
+    const uint8_t *c = src + HELLO_SIZE;
+    if (len < HELLO_SIZE + CAPS_SIZE) {
+        LOG_W("Hello without capabilities, assuming v3");
+        return 3;
+    }
+    caps->known      = true;
+    caps->codecs     = read_be32(c);
+    caps->max_rate   = (int)read_be32(c + 4);
+    caps->max_bits   = c[8];
+    caps->flags      = c[9];
+    caps->latency_ms = read_be16(c + 10);
+    caps->cpu_budget = read_be16(c + 12);
+
+    const uint8_t *r = c + CAPS_SIZE;
+    if (caps->flags & CAPS_RESUME) {
+        if (len < HELLO_MAX_SIZE) {
+            LOG_W("Hello without its resume request, joining live");
+            caps->flags &= (uint8_t)~CAPS_RESUME;
+        } else {
+            caps->resume_token = read_be32(r);
+            caps->resume_seq   = read_be32(r + 4);
+        }
+    }
+
+    return v > HEADER_VERSION ? HEADER_VERSION : (int)v;
+}
+
+/* ---- Header I/O ---- */
+
+size_t protocol_build_header(uint8_t *dst, const AudioConfig *cfg,
+                             const TransportInfo *ti, int version)
+{
+    size_t len = HEADER_SIZE;
+
+    write_be32(dst +  0, HEADER_MAGIC);
+    write_be32(dst +  4, (uint32_t)version);
+    write_be32(dst +  8, (uint32_t)cfg->sample_rate);
+    write_be16(dst + 12, (uint16_t)cfg->bits_per_sample);
+    write_be16(dst + 14, (uint16_t)cfg->channels);
+    write_be32(dst + 16, (uint32_t)cfg->frames_per_buffer);
+    write_be32(dst + 20, (uint32_t)cfg->chunk_size);
+    write_be16(dst + 24, (uint16_t)cfg->compression_type);
+    dst[26] = (cfg->is_float ? HDR_FLAG_FLOAT    : 0) |
+              (cfg->packed24 ? HDR_FLAG_PACKED24 : 0) |
+              (ti->mux && version >= 4 ? HDR_FLAG_MUX : 0) |
+              (ti->resume_token && version >= 4 ? HDR_FLAG_RESUME : 0) |
+              (ti->sync_delay_us && version >= 4 ? HDR_FLAG_SYNC : 0) |
+              (ti->reports && version >= 4 ? HDR_FLAG_REPORT : 0) |
+              (ti->source_port && ti->mode == TRANSPORT_MULTICAST &&
+               version >= 4 ? HDR_FLAG_SOURCE : 0);
+    dst[27] = (uint8_t)ti->mode;
+
+    if (ti->mode != TRANSPORT_TCP) {
+        /* group for multicast, session token for unicast */
+        if (ti->mode == TRANSPORT_MULTICAST)
+            memcpy(dst + 28, &ti->group, 4);      /* already network order */
+        else
+            write_be32(dst + 28, ti->token);
+        write_be16(dst + 32, ti->port);
+        dst[34] = ti->fec_k;
+        dst[35] = 0; /* reserved */
+        len += UDP_INFO_SIZE;
+    }
+    if (dst[26] & HDR_FLAG_RESUME) {
+        write_be32(dst + len, ti->resume_token);
+        len += RESUME_INFO_SIZE;
+    }
+    if (dst[26] & HDR_FLAG_SYNC) {
+        write_be32(dst + len, ti->sync_delay_us);
+        len += SYNC_INFO_SIZE;
+    }
+    if (dst[26] & HDR_FLAG_SOURCE) {
+        write_be16(dst + len, ti->source_port);
+        write_be16(dst + len + 2, 0);
+        len += SOURCE_INFO_SIZE;
+    }
+    return len;
+}
+
+int protocol_write_header(int fd, const AudioConfig *cfg, const TransportInfo *ti,
+                          int version)
+{
+    uint8_t hdr[HEADER_MAX_SIZE];
+    size_t  len = protocol_build_header(hdr, cfg, ti, version);
+
+    if (write_fully(fd, hdr, len) != (ssize_t)len) {
+        LOG_E("protocol_write_header: write failed: %s", strerror(errno));
         return -1;
     }
+    return 0;
+}
 
+/* Checks and decodes the fixed part; returns the transport mode */
+static int parse_fixed(const uint8_t *hdr, AudioConfig *cfg, int *version_out)
+{
     uint32_t magic   = read_be32(hdr + 0);
     uint32_t version = read_be32(hdr + 4);
     int sr   = (int)read_be32(hdr + 8);
@@ -120,12 +251,18 @@ int protocol_read_header(int fd, AudioConfig *cfg)
     int cs   = (int)read_be32(hdr + 20);
     int comp = (int)read_be16(hdr + 24);
     int fl   = hdr[26];
+    int mode = hdr[27];
 
     if (magic != HEADER_MAGIC) {
         LOG_E("Bad magic: 0x%08X", magic);
         return -2;
     }
 
+    if (version < HEADER_VERSION_MIN || version > HEADER_VERSION) {
+        LOG_E("Unsupported stream version: %u", version);
+        return -2;
+    }
+
     if (!protocol_valid_sample_rate(sr)) {
         LOG_E("Invalid sample rate: %d", sr);
         return -2;
@@ -138,17 +275,174 @@ int protocol_read_header(int fd, AudioConfig *cfg)
         LOG_E("Invalid channels: %d", ch);
         return -2;
     }
-    if (comp != 0 && comp != 1) {
+    if (comp < 0 || comp > 2) {
         LOG_E("Invalid compression: %d", comp);
         return -2;
     }
 
-    LOG_I("Header v%u: %dHz %dch %dbit comp=%d float=%d cs=%d",
-          version, sr, ch, bps, comp, fl, cs);
+    if ((fl & HDR_FLAG_PACKED24) && (comp == 2 || bps != 24 || (fl & HDR_FLAG_FLOAT))) {
+        LOG_E("Packed samples on a non-24-bit stream");
+        return -2;
+    }
+
+    if (mode != TRANSPORT_TCP && mode != TRANSPORT_MULTICAST &&
+        mode != TRANSPORT_UDP) {
+        LOG_E("Invalid transport: %d", mode);
+        return -2;
+    }
 
-    config_from_header(cfg, sr, ch, fpb, bps, comp, fl);
+    LOG_I("Header v%u: %dHz %dch %dbit comp=%d float=%d cs=%d transport=%d",
+          version, sr, ch, bps, comp, fl, cs, mode);
+
+    config_from_header(cfg, sr, ch, fpb, bps, comp, fl & HDR_FLAG_FLOAT);
+    cfg->packed24 = (fl & HDR_FLAG_PACKED24) != 0;
     /* override chunk_size with the value the sender actually uses */
     (void)cs;
+    *version_out = (int)version;
+    return mode;
+}
+
+/* Bytes that follow the fixed header */
+static size_t ext_size(const uint8_t *hdr, int mode)
+{
+    return (mode != TRANSPORT_TCP ? UDP_INFO_SIZE : 0) +
+           (hdr[26] & HDR_FLAG_RESUME ? RESUME_INFO_SIZE : 0) +
+           (hdr[26] & HDR_FLAG_SYNC   ? SYNC_INFO_SIZE   : 0) +
+           (hdr[26] & HDR_FLAG_SOURCE ? SOURCE_INFO_SIZE : 0);
+}
+
+static void parse_transport(const uint8_t *hdr, int mode, TransportInfo *ti)
+{
+    const uint8_t *ext = hdr + HEADER_SIZE;
+
+    memset(ti, 0, sizeof(*ti));
+    ti->mode = (TransportMode)mode;
+    ti->mux  = (hdr[26] & HDR_FLAG_MUX) != 0;
+    ti->reports = (hdr[26] & HDR_FLAG_REPORT) != 0;
+    if (mode != TRANSPORT_TCP) {
+        if (mode == TRANSPORT_MULTICAST)
+            memcpy(&ti->group, ext, 4);
+        else
+            ti->token = read_be32(ext);
+        ti->port  = read_be16(ext + 4);
+        ti->fec_k = ext[6];
+        ext += UDP_INFO_SIZE;
+    }
+    if (hdr[26] & HDR_FLAG_RESUME) {
+        ti->resume_token = read_be32(ext);
+        ext += RESUME_INFO_SIZE;
+    }
+    if (hdr[26] & HDR_FLAG_SYNC) {
+        ti->sync_delay_us = read_be32(ext);
+        ext += SYNC_INFO_SIZE;
+    }
+    if (hdr[26] & HDR_FLAG_SOURCE)
+        ti->source_port = read_be16(ext);
+}
+
+int protocol_read_header(int fd, AudioConfig *cfg, TransportInfo *ti, int *version_out)
+{
+    uint8_t hdr[HEADER_MAX_SIZE];
+
+    if (read_fully(fd, hdr, HEADER_SIZE) != HEADER_SIZE) {
+        LOG_E("protocol_read_header: read failed: %s", strerror(errno));
+        return -1;
+    }
+
+    int mode = parse_fixed(hdr, cfg, version_out);
+    if (mode < 0) return mode;
+
+    size_t ext = ext_size(hdr, mode);
+    if (ext > 0 && read_fully(fd, hdr + HEADER_SIZE, ext) != (ssize_t)ext) {
+        LOG_E("protocol_read_header: transport info: %s", strerror(errno));
+        return -1;
+    }
+    parse_transport(hdr, mode, ti);
+    return 0;
+}
 
+int protocol_parse_header(const uint8_t *src, size_t len, AudioConfig *cfg,
+                          TransportInfo *ti, int *version_out)
+{
+    if (len < HEADER_SIZE) return -2;
+
+    int mode = parse_fixed(src, cfg, version_out);
+    if (mode < 0) return mode;
+    if (len < HEADER_SIZE + ext_size(src, mode)) return -2;
+
+    parse_transport(src, mode, ti);
     return 0;
-}
\ No newline at end of file
+}
+
+/* ---- v3 chunk framing ---- */
+
+static uint8_t frame_check(const uint8_t *hdr)
+{
+    uint8_t x = hdr[0];
+    for (int i = 2; i < FRAME_HDR_SIZE; i++)
+        x ^= hdr[i];
+    return x;
+}
+
+void protocol_write_frame(uint8_t *dst, const FrameHeader *f)
+{
+    dst[0] = FRAME_SYNC;
+    dst[2] = f->flags;
+    dst[3] = f->codec;
+    write_be32(dst +  4, f->seq);
+    write_be64(dst +  8, f->ts_frames);
+    write_be64(dst + 16, (uint64_t)f->capture_ns);
+    write_be32(dst + 24, f->len);
+    write_be32(dst + 28, f->frames);
+    dst[1] = frame_check(dst);
+}
+
+int protocol_parse_frame(const uint8_t *src, FrameHeader *f)
+{
+    if (src[0] != FRAME_SYNC || src[1] != frame_check(src))
+        return -1;
+
+    f->flags      = src[2];
+    f->codec      = src[3];
+    f->seq        = read_be32(src + 4);
+    f->ts_frames  = read_be64(src + 8);
+    f->capture_ns = (int64_t)read_be64(src + 16);
+    f->len        = read_be32(src + 24);
+    f->frames     = read_be32(src + 28);
+    return 0;
+}
+size_t protocol_build_control(uint8_t *dst, const uint8_t *msg, size_t len)
+{
+    FrameHeader f = { .flags = FRAME_CONTROL, .len = (uint32_t)len };
+    protocol_write_frame(dst, &f);
+    memcpy(dst + FRAME_HDR_SIZE, msg, len);
+    return FRAME_HDR_SIZE + len;
+}
+
+void protocol_write_report(uint8_t *dst, const ReceiverReport *r)
+{
+    dst[0] = RECEIVER_REPORT;
+    write_be16(dst +  1, r->port);
+    write_be16(dst +  3, 0);
+    write_be32(dst +  5, r->latency_us);
+    write_be32(dst +  9, r->rtt_us);
+    write_be32(dst + 13, r->underruns);
+    write_be32(dst + 17, r->lost);
+    write_be32(dst + 21, r->reconnects);
+    write_be32(dst + 25, r->probe_p50_us);
+    write_be32(dst + 29, r->probe_p99_us);
+    write_be32(dst + 33, r->probe_jitter_us);
+}
+
+void protocol_parse_report(const uint8_t *src, ReceiverReport *r)
+{
+    r->port            = read_be16(src);
+    r->latency_us      = read_be32(src +  4);
+    r->rtt_us          = read_be32(src +  8);
+    r->underruns       = read_be32(src + 12);
+    r->lost            = read_be32(src + 16);
+    r->reconnects      = read_be32(src + 20);
+    r->probe_p50_us    = read_be32(src + 24);
+    r->probe_p99_us    = read_be32(src + 28);
+    r->probe_jitter_us = read_be32(src + 32);
+}
@@ -10,23 +10,281 @@
 #include <sys/types.h>
 
 #define HEADER_MAGIC    0x53534844
-#define HEADER_VERSION  2
+#define HEADER_VERSION  4
 #define HEADER_SIZE     28
 
+/* Header byte 26 */
+#define HDR_FLAG_FLOAT      0x01
+#define HDR_FLAG_PACKED24   0x02   /* PCM chunks carry 3 bytes per sample,
+                                      lossless streams included */
+#define HDR_FLAG_MUX        0x04   /* v4: ping and chat ride this
+                                      connection as FRAME_CONTROL */
+#define HDR_FLAG_RESUME     0x08   /* v4: resume info follows */
+#define HDR_FLAG_SYNC       0x10   /* v4: sync info follows */
+#define HDR_FLAG_REPORT     0x20   /* v4: send RECEIVER_REPORT */
+#define HDR_FLAG_SOURCE     0x40   /* v4: multicast source info follows */
+
+/* Oldest stream version still spoken; v2 is unframed raw chunks */
+#define HEADER_VERSION_MIN  2
+
+/*
+ * Version negotiation: a v3+ receiver speaks first with HELLO (magic,
+ * highest version it understands).  A streamer that hears nothing
+ * within HELLO_WAIT_MS assumes a v2 receiver.
+ */
+#define HELLO_MAGIC     0x53534843
+#define HELLO_SIZE      8
+#define HELLO_WAIT_MS   300
+
+/*
+ * v4: the HELLO is followed by what the receiver can take, so the
+ * streamer can pick an encoding per receiver (caps.h):
+ *   0  u32  codecs      bit (1 << FRAME_CODEC_*) per codec it decodes
+ *   4  u32  max_rate    highest sample rate it plays
+ *   8  u8   max_bits    deepest samples it plays
+ *   9  u8   flags       CAPS_*
+ *  10  u16  latency_ms  preferred latency, 0 = no preference
+ *  12  u16  cpu_budget  percent of one core it spends decoding, 0 = any
+ *  14  u16  reserved
+ * A v3 streamer reads only the HELLO; the rest is drained unread.
+ */
+#define CAPS_SIZE       16
+
+#define CAPS_PACKED24   0x01   /* HDR_FLAG_PACKED24 streams */
+#define CAPS_FLOAT      0x02   /* float samples */
+#define CAPS_MUX        0x04   /* wants ping and chat multiplexed onto
+                                  the audio connection */
+#define CAPS_RESUME     0x08   /* resume request follows, below */
+#define CAPS_SYNC       0x10   /* plays chunks at presentation times */
+
+/*
+ * Stream resumption.  A receiver sending CAPS_RESUME follows its
+ * capabilities with
+ *   0  u32  token     resume token from its last header, 0 = none
+ *   4  u32  next_seq  first chunk it has not received
+ * and gets HDR_FLAG_RESUME headers, followed (after any UDP info) by
+ *   0  u32  token     names this streaming session
+ * On TCP a matching token gets the missed chunks replayed while the
+ * streamer still holds them, up to RESUME_REPLAY_MS of them: enough for
+ * a reconnect after the receiver's stall timeout.  Otherwise the
+ * receiver joins live, which it can tell from the first chunk's seq.
+ */
+#define RESUME_SIZE       8
+#define RESUME_INFO_SIZE  4
+
+/* Longest hello a receiver sends: v4 with a resume request */
+#define HELLO_MAX_SIZE    (HELLO_SIZE + CAPS_SIZE + RESUME_SIZE)
+
+/*
+ * Synchronized playout.  A streamer with a presentation delay sends a
+ * CAPS_SYNC receiver on framed TCP HDR_FLAG_SYNC headers, followed
+ * (after any resume info) by
+ *   0  u32  delay_us  every chunk is to be heard at its capture_ns
+ *                     plus this, on the streamer's clock
+ * Receivers learn that clock with CLOCK_REQUEST/CLOCK_RESPONSE on the
+ * ping channel and all play the same chunk at the same moment.
+ */
+#define SYNC_INFO_SIZE    4
+/* Longest delay a receiver's jitter buffer can hold chunks back for */
+#define SYNC_MAX_MS       400
+
+/*
+ * v3 framing on the TCP stream: every chunk is preceded by
+ *   0  u8   FRAME_SYNC
+ *   1  u8   check      XOR of all other header bytes
+ *   2  u8   flags      FRAME_*
+ *   3  u8   codec      FRAME_CODEC_*
+ *   4  u32  seq        chunk sequence number
+ *   8  u64  ts_frames  capture position in sample frames
+ *  16  u64  capture_ns streamer's monotonic clock at capture
+ *  24  u32  len        payload bytes that follow
+ *  28  u32  frames     sample frames the payload decodes to
+ */
+#define FRAME_HDR_SIZE  32
+#define FRAME_SYNC      0xA5
+
+#define FRAME_SILENCE       0x01   /* no payload: `frames` of silence, a
+                                      run of whole chunks from `seq` on */
+#define FRAME_FORMAT_CHANGE 0x02   /* payload is a new stream header that
+                                      holds from chunk `seq` on       */
+#define FRAME_CONTROL       0x04   /* payload is a side message, below */
+
+/* Most chunks one silence marker (TCP or UDP) may cover */
+#define SILENCE_RUN_MAX     64
+
+#define FRAME_CODEC_PCM     0
+#define FRAME_CODEC_LOSSLESS 1   /* lossless.h */
+#define FRAME_CODEC_OPUS    2   /* opuscodec.h */
+
+/* Follows the header when it announces a UDP transport */
+#define UDP_INFO_SIZE   8
+
+/*
+ * Multicast receivers on v4 get HDR_FLAG_SOURCE headers, followed (after
+ * any sync info) by
+ *   0  u16  port      the streamer's datagrams leave from this port
+ *   2  u16  reserved
+ * Other streamers may share the group, and the packets' source address
+ * is the interface that routes the group, not the one the receiver
+ * connected to, so the port is what tells this session's packets apart.
+ */
+#define SOURCE_INFO_SIZE  4
+
+/* Longest stream header with everything that may follow it */
+#define HEADER_MAX_SIZE (HEADER_SIZE + UDP_INFO_SIZE + RESUME_INFO_SIZE + \
+                         SYNC_INFO_SIZE + SOURCE_INFO_SIZE)
+
 #define AUDIO_PORT  5000
 #define PING_PORT   5001
 #define CHAT_PORT   5002
+#define MCAST_PORT  5003
+
+#define MCAST_DEFAULT_GROUP "239.255.83.83"
 
 #define PING_REQUEST   0x01
 #define PING_RESPONSE  0x02
 #define LATENCY_REPORT 0x03
+#define CLOCK_REQUEST  0x04
+#define CLOCK_RESPONSE 0x05
+#define RECEIVER_REPORT 0x06
 #define CHAT_MSG       0x10
 
-int protocol_write_header(int fd, const AudioConfig *cfg);
-int protocol_read_header(int fd, AudioConfig *cfg);
+/*
+ * Clock probes, on PING_PORT and multiplexed alike: the type byte, then
+ *   CLOCK_REQUEST   u64 t1  receiver's clock when sent
+ *   CLOCK_RESPONSE  u64 t1  echoed
+ *                   u64 t2  streamer's clock when the request came in
+ *                   u64 t3  streamer's clock when answered
+ */
+#define CLOCK_REQUEST_SIZE   9
+#define CLOCK_RESPONSE_SIZE  25
+
+/*
+ * A CLOCK_REQUEST may also come as a UDP datagram to PING_PORT and is
+ * answered the same way.  It is zero-padded to the size of the answer
+ * so the port cannot be used to amplify spoofed traffic.
+ */
+#define PING_UDP_PROBE_SIZE  CLOCK_RESPONSE_SIZE
+
+/*
+ * Receiver health, sent in place of LATENCY_REPORT to a streamer whose
+ * header has HDR_FLAG_REPORT: the type byte, then
+ *   0  u16  port        local port of the receiver's audio connection
+ *   2  u16  reserved
+ *   4  u32  latency_us  end-to-end latency
+ *   8  u32  rtt_us      round trip of the last probe
+ *  12  u32  underruns   jitter buffer ran dry
+ *  16  u32  lost        chunks played as concealment
+ *  20  u32  reconnects  audio connections after the first
+ *  24  u32  probe_p50_us   probe round trips on this connection,
+ *  28  u32  probe_p99_us   0 until one came back
+ *  32  u32  probe_jitter_us
+ * The counters run since playout started.  On PING_PORT the port tells
+ * the streamer which of the receivers at that address is reporting.
+ */
+#define RECEIVER_REPORT_SIZE 37
+
+/*
+ * Multiplexed connections (HDR_FLAG_MUX) carry these both ways as
+ * FRAME_CONTROL payloads: the type byte, then
+ *   PING_REQUEST / PING_RESPONSE  u64 requester's clock, echoed back
+ *   CLOCK_REQUEST / CLOCK_RESPONSE as above
+ *   LATENCY_REPORT                u64 receiver's latency in ms
+ *   RECEIVER_REPORT               as above
+ *   CHAT_MSG                      as on CHAT_PORT (chat.h)
+ * Frame seq and timestamps are 0; receivers must not count them as audio.
+ */
+
+/* Where the audio itself travels, announced in the header */
+typedef struct {
+    TransportMode mode;
+    uint32_t      group;     /* multicast group, network byte order */
+    uint32_t      token;     /* unicast: names this receiver's HELLO/NACKs */
+    uint16_t      port;
+    uint8_t       fec_k;
+    bool          mux;       /* ping and chat as FRAME_CONTROL (v4) */
+    uint32_t      resume_token;  /* HDR_FLAG_RESUME when nonzero (v4) */
+    uint32_t      sync_delay_us; /* HDR_FLAG_SYNC when nonzero (v4) */
+    bool          reports;   /* RECEIVER_REPORT wanted (v4) */
+    uint16_t      source_port;   /* multicast: HDR_FLAG_SOURCE when nonzero (v4) */
+} TransportInfo;
+
+/* A receiver's HELLO capabilities; `known` is false before v4 */
+typedef struct {
+    bool     known;
+    uint32_t codecs;
+    int      max_rate;
+    int      max_bits;
+    uint8_t  flags;
+    int      latency_ms;
+    int      cpu_budget;
+    /* CAPS_RESUME */
+    uint32_t resume_token;
+    uint32_t resume_seq;
+} PeerCaps;
+
+typedef struct {
+    uint16_t port;
+    uint32_t latency_us;
+    uint32_t rtt_us;
+    uint32_t underruns;
+    uint32_t lost;
+    uint32_t reconnects;
+    uint32_t probe_p50_us;
+    uint32_t probe_p99_us;
+    uint32_t probe_jitter_us;
+} ReceiverReport;
+
+typedef struct {
+    uint8_t  flags;
+    uint8_t  codec;
+    uint32_t seq;
+    uint64_t ts_frames;
+    int64_t  capture_ns;
+    uint32_t len;
+    uint32_t frames;
+} FrameHeader;
+
+/** HELLO, followed by `caps` (NULL: none, as v3 does). */
+int protocol_write_hello(int fd, const PeerCaps *caps);
+/**
+ * Bytes the hello in `src` takes in all, judging by the `len` of it
+ * read so far; grows as the version and capability flags come in.
+ */
+size_t protocol_hello_size(const uint8_t *src, size_t len);
+/**
+ * Version the peer asked for in the `len` hello bytes that came before
+ * it went quiet, or HEADER_VERSION_MIN if there were none.  `caps` is
+ * filled in from a v4 HELLO and marked unknown otherwise.
+ */
+int protocol_parse_hello(const uint8_t *src, size_t len, PeerCaps *caps);
+
+/** Stream header into `dst` (HEADER_MAX_SIZE bytes); returns its length. */
+size_t protocol_build_header(uint8_t *dst, const AudioConfig *cfg,
+                             const TransportInfo *ti, int version);
+int protocol_write_header(int fd, const AudioConfig *cfg, const TransportInfo *ti,
+                          int version);
+/** On success `*version_out` is the stream version the streamer chose. */
+int protocol_read_header(int fd, AudioConfig *cfg, TransportInfo *ti, int *version_out);
+/** The same from memory, e.g. a FRAME_FORMAT_CHANGE payload. */
+int protocol_parse_header(const uint8_t *src, size_t len, AudioConfig *cfg,
+                          TransportInfo *ti, int *version_out);
+
+void protocol_write_frame(uint8_t *dst, const FrameHeader *f);
+/** Returns 0 if `src` holds a frame header with good sync and check. */
+int  protocol_parse_frame(const uint8_t *src, FrameHeader *f);
+/** FRAME_CONTROL frame carrying `msg` into `dst`; returns its length. */
+size_t protocol_build_control(uint8_t *dst, const uint8_t *msg, size_t len);
+
+/** RECEIVER_REPORT (RECEIVER_REPORT_SIZE bytes) into `dst`. */
+void protocol_write_report(uint8_t *dst, const ReceiverReport *r);
+/** `src` holds one after its type byte. */
+void protocol_parse_report(const uint8_t *src, ReceiverReport *r);
 
+void     write_be64(uint8_t *dst, uint64_t val);
 void     write_be32(uint8_t *dst, uint32_t val);
 void     write_be16(uint8_t *dst, uint16_t val);
+uint64_t read_be64(const uint8_t *src);
 uint32_t read_be32(const uint8_t *src);
 uint16_t read_be16(const uint8_t *src);
 
@@ -0,0 +1,129 @@
+#include "reactor.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define REACTOR_EVENTS 32
+
+static struct {
+    int       epoll_fd;
+    int       stop_fd;      /* eventfd: readable once reactor_stop() runs */
+    pthread_t thread;
+    bool      running;
+} reactor = { .epoll_fd = -1, .stop_fd = -1 };
+
+static void *reactor_thread(void *arg)
+{
+    (void)arg;
+    LOG_I("Reactor started");
+
+    struct epoll_event evs[REACTOR_EVENTS];
+    bool               stop = false;
+
+    while (!stop) {
+        int n = epoll_wait(reactor.epoll_fd, evs, REACTOR_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_E("epoll_wait(reactor): %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            ReactorWatch *w = evs[i].data.ptr;
+            if (!w) {
+                stop = true;
+                continue;
+            }
+            /* Cleared by reactor_del() from an earlier callback */
+            if (w->fn) w->fn(w->arg, evs[i].events);
+        }
+    }
+
+    LOG_I("Reactor stopped");
+    return NULL;
+}
+
+static void reactor_close(void)
+{
+    if (reactor.stop_fd  >= 0) close(reactor.stop_fd);
+    if (reactor.epoll_fd >= 0) close(reactor.epoll_fd);
+    reactor.stop_fd  = -1;
+    reactor.epoll_fd = -1;
+}
+
+int reactor_start(void)
+{
+    reactor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor.stop_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (reactor.epoll_fd < 0 || reactor.stop_fd < 0 ||
+        epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, reactor.stop_fd, &ev) < 0) {
+        LOG_E("epoll/eventfd(reactor): %s", strerror(errno));
+        reactor_close();
+        return -1;
+    }
+
+    if (pthread_create(&reactor.thread, NULL, reactor_thread, NULL) != 0) {
+        LOG_E("pthread_create(reactor): %s", strerror(errno));
+        reactor_close();
+        return -1;
+    }
+    reactor.running = true;
+    return 0;
+}
+
+void reactor_stop(void)
+{
+    if (reactor.running) {
+        uint64_t one = 1;
+        if (write(reactor.stop_fd, &one, sizeof(one)) < 0)
+            LOG_W("wake reactor: %s", strerror(errno));
+        pthread_join(reactor.thread, NULL);
+        reactor.running = false;
+    }
+    reactor_close();
+}
+
+int reactor_add(ReactorWatch *w, int fd, uint32_t events, ReactorFn fn, void *arg)
+{
+    w->fn  = fn;
+    w->arg = arg;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LOG_E("epoll_ctl(reactor): %s", strerror(errno));
+        w->fn = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_mod(ReactorWatch *w, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        LOG_E("epoll_ctl(reactor): %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void reactor_del(ReactorWatch *w, int fd)
+{
+    if (reactor.epoll_fd >= 0 && fd >= 0)
+        epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    w->fn = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "soundshare.h"
+
+/*
+ * The streamer's control plane on one thread: listening sockets, ping
+ * and chat connections and receivers still saying hello.  Each socket
+ * is registered with a callback that runs on the reactor thread
+ * whenever epoll reports it, so a callback must never block; it must
+ * also cope with being called when there is nothing to read after all.
+ * The thread sleeps until there is work and an eventfd wakes it to
+ * stop, so nothing polls on a timeout.
+ */
+
+typedef void (*ReactorFn)(void *arg, uint32_t events);
+
+/* Owned by the caller and left in place while registered */
+typedef struct {
+    ReactorFn fn;
+    void     *arg;
+} ReactorWatch;
+
+int  reactor_start(void);
+/** Returns once the thread is gone; sockets stay open for their owners. */
+void reactor_stop(void);
+
+/**
+ * Call fn(arg, events) on the reactor thread while `fd` has any of
+ * `events` (EPOLLIN and so on).  Any thread, once started.
+ */
+int  reactor_add(ReactorWatch *w, int fd, uint32_t events, ReactorFn fn, void *arg);
+/** Watch `fd` for `events` instead from now on.  Any thread. */
+int  reactor_mod(ReactorWatch *w, int fd, uint32_t events);
+/** Before `fd` is closed; no further calls, even for events already in. */
+void reactor_del(ReactorWatch *w, int fd);
+
+#endif /* REACTOR_H */
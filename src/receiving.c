@@ -4,21 +4,665 @@
 #include "audio.h"
 #include "ping.h"
 #include "chat.h"
+#include "udpmedia.h"
+#include "jitterbuf.h"
+#include "resample.h"
+#include "lossless.h"
+#include "opuscodec.h"
+#include "pcmpack.h"
+#include "caps.h"
+#include "latency.h"
+#include "histogram.h"
 #include "ui.h"
 
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 
 static ReceiveContext rctx;
+/* Guards rctx.jb against stats readers on other threads, and
+   rctx.socket_fd against receiving_stop()                      */
+static pthread_mutex_t jb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Opus decodes strictly in order; only the receive thread touches this */
+static struct {
+    OpusCodec *dec;
+    uint32_t   next_seq;
+    bool       started;
+} opus;
+
+/* Lossless blocks decode in parallel; only the receive thread runs it */
+static WorkPool *codec_pool;
+
+/* Most chunks concealed for one gap; longer gaps fall to the jitter buffer */
+#define OPUS_PLC_MAX_CHUNKS 4
+
+/* Multiplexed ping and chat: the receive thread probes, chat sends from
+   the UI thread, so writes to the audio socket take the lock          */
+static struct {
+    bool            on;
+    pthread_mutex_t write_lock;
+    int64_t         ping_ms;     /* when the last probe went out */
+    int64_t         sent_ns;     /* its timestamp while unanswered, else 0 */
+} mux = { .write_lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Where to pick the stream up after a dropped connection */
+static struct {
+    uint32_t token;      /* streamer's resume token, 0 = none */
+    uint32_t next_seq;   /* first chunk not received yet */
+    bool     have_seq;   /* next_seq follows on from what is queued */
+} resume;
+
+/* How long a connection may stay quiet in this format before it is given up */
+static int stall_ms(const AudioConfig *cfg)
+{
+    int ms = (int)(RECEIVE_STALL_CHUNKS * config_buffer_latency_ms(cfg));
+    return ms > RECEIVE_STALL_MS ? ms : RECEIVE_STALL_MS;
+}
+
+/* Account received bytes and refresh the rate display once a second */
+static void count_bytes(int64_t n)
+{
+    atomic_fetch_add(&g_app.total_bytes_sent, n);
+    atomic_fetch_add(&g_app.bytes_sent_this_second, n);
+
+    int64_t now  = current_time_ms();
+    int64_t diff = now - atomic_load(&g_app.last_time_ms);
+    if (diff >= 1000) {
+        int64_t b = atomic_exchange(&g_app.bytes_sent_this_second, 0);
+        int64_t kbps = (b * 8) / diff;
+        atomic_store(&g_app.last_time_ms, now);
+        ui_update_stats(kbps,
+                        atomic_load(&g_app.total_bytes_sent),
+                        now - atomic_load(&g_app.stream_start_time));
+    }
+}
+
+/* Largest chunk payload the streamer can send in this format */
+static size_t max_payload(const AudioConfig *cfg)
+{
+    size_t cap = (size_t)cfg->chunk_size;
+    if (cfg->use_flac && lossless_max_encoded(cfg) > cap)
+        cap = lossless_max_encoded(cfg);
+    if (cfg->use_opus && OPUS_MAX_PACKET > cap)
+        cap = OPUS_MAX_PACKET;
+    return cap;
+}
+
+/* Frame codec of every chunk on a stream that carries no per-chunk codec */
+static int stream_codec(const AudioConfig *cfg)
+{
+    return cfg->use_opus ? FRAME_CODEC_OPUS
+         : cfg->use_flac ? FRAME_CODEC_LOSSLESS : FRAME_CODEC_PCM;
+}
+
+/*
+ * Opus chunks: run loss concealment over a gap before decoding, so the
+ * decoder's state follows the stream.  NULL `data` conceals `seq` itself
+ * (a UDP chunk with holes).  A chunk older than the decoder is useless.
+ */
+static void put_opus_chunk(JitterBuffer *jb, const AudioConfig *cfg,
+                           uint32_t seq, uint64_t ts_frames,
+                           const uint8_t *data, size_t len, uint8_t *pcm)
+{
+    size_t  cap = (size_t)cfg->chunk_size;
+    int32_t gap = opus.started ? (int32_t)(seq - opus.next_seq) : 0;
+
+    if (gap < 0) return;
+    for (int32_t i = gap > OPUS_PLC_MAX_CHUNKS ? gap - OPUS_PLC_MAX_CHUNKS : 0;
+         i < gap; i++) {
+        ssize_t n = opuscodec_decode(opus.dec, NULL, 0, pcm, cap);
+        if (n > 0)
+            jitter_put(jb, seq - (uint32_t)(gap - i),
+                       ts_frames - (uint64_t)(gap - i) * (uint64_t)cfg->frames_per_buffer,
+                       pcm, (size_t)n);
+    }
+
+    ssize_t n = opuscodec_decode(opus.dec, data, len, pcm, cap);
+    opus.next_seq = seq + 1;
+    opus.started  = true;
+    if (n < 0) {
+        LOG_W("Chunk %u does not decode, dropped", seq);
+        return;
+    }
+    jitter_put(jb, seq, ts_frames, pcm, (size_t)n);
+}
+
+/* A silence marker: `frames` of zeros from chunk `seq` on, with no
+   decoder involved.  One marker covers a run of whole chunks; returns
+   how many, 0 if the marker makes no sense.                         */
+static int put_silence(JitterBuffer *jb, const AudioConfig *cfg, uint32_t seq,
+                       uint64_t ts_frames, uint32_t frames)
+{
+    uint32_t fpb   = (uint32_t)cfg->frames_per_buffer;
+    uint32_t count = frames / fpb;
+    if (frames == 0 || frames % fpb != 0 || count > SILENCE_RUN_MAX) {
+        LOG_W("Silence marker for %u frames at chunk %u, ignored", frames, seq);
+        return 0;
+    }
+
+    /* The Opus decoder skips ahead instead of concealing the gap */
+    if (opus.dec && (!opus.started || (int32_t)(seq + count - opus.next_seq) > 0)) {
+        opus.next_seq = seq + count;
+        opus.started  = true;
+    }
+    jitter_put_silence(jb, seq, ts_frames, (size_t)cfg->chunk_size, (int)count);
+    return (int)count;
+}
+
+/* Queue a chunk for playout, decoding it first if it is coded.
+   `pcm` has room for one cfg->chunk_size chunk.                   */
+static void put_chunk(JitterBuffer *jb, const AudioConfig *cfg, int codec,
+                      uint32_t seq, uint64_t ts_frames,
+                      const uint8_t *data, size_t len, uint8_t *pcm)
+{
+    if (codec == FRAME_CODEC_PCM && cfg->packed24) {
+        if (len % 3 != 0 || len / 3 * 4 > (size_t)cfg->chunk_size) {
+            LOG_W("Chunk %u: %zu bytes is not packed 24-bit, dropped", seq, len);
+            return;
+        }
+        pcm_unpack24(data, pcm, len / 3);
+        jitter_put(jb, seq, ts_frames, pcm, len / 3 * 4);
+        return;
+    }
+    if (codec == FRAME_CODEC_PCM) {
+        jitter_put(jb, seq, ts_frames, data, len);
+        return;
+    }
+    if (codec == FRAME_CODEC_OPUS) {
+        if (opus.dec)
+            put_opus_chunk(jb, cfg, seq, ts_frames, data, len, pcm);
+        return;
+    }
+
+    ssize_t n = lossless_decode(cfg, data, len, pcm, (size_t)cfg->chunk_size,
+                                codec_pool);
+    if (n < 0) {
+        /* The jitter buffer conceals the gap */
+        LOG_W("Chunk %u does not decode, dropped", seq);
+        return;
+    }
+    jitter_put(jb, seq, ts_frames, pcm, (size_t)n);
+}
+
+/* ---- Playout ---- */
+
+/* One format's way to the speakers */
+typedef struct {
+    AudioConfig    cfg;
+    AudioPlayback *pb;
+    JitterBuffer  *jb;
+    pthread_t      thread;
+
+    /* The receive thread keeps the streamer's capture timeline,
+       smoothed, in the anchor.  In synchronized playout each chunk is
+       heard at its capture time plus delay_ns on that clock.         */
+    int64_t         delay_ns;    /* 0 = play chunks as they come */
+    pthread_mutex_t anchor_lock;
+    bool            anchored;
+    uint64_t        anchor_ts;   /* a chunk's capture position ... */
+    int64_t         anchor_ns;   /* ... and when it was captured */
+} Playout;
+
+/* The playout being fed, and the one still playing out the format
+   before the last switch.  Only the receive thread touches these.  */
+static Playout *play, *retired;
+
+/* ---- Capture timeline ---- */
+
+/* Capture stamps carry the streamer's scheduling jitter: each one moves
+   the anchor 1/SMOOTH of the way, and one this far off replaces it     */
+#define SYNC_ANCHOR_SMOOTH   32
+#define SYNC_REANCHOR_MS     50
+
+/* Receive thread: chunk at `ts_frames` was captured at `capture_ns` */
+static void capture_anchor(Playout *p, uint64_t ts_frames, int64_t capture_ns)
+{
+    pthread_mutex_lock(&p->anchor_lock);
+    int64_t predicted = p->anchor_ns +
+        (int64_t)((double)(int64_t)(ts_frames - p->anchor_ts) * 1e9 / p->cfg.sample_rate);
+    int64_t d = capture_ns - predicted;
+    if (!p->anchored || d > (int64_t)SYNC_REANCHOR_MS * 1000000 ||
+        d < -(int64_t)SYNC_REANCHOR_MS * 1000000)
+        p->anchor_ns = capture_ns;
+    else
+        p->anchor_ns = predicted + d / SYNC_ANCHOR_SMOOTH;
+    p->anchor_ts = ts_frames;
+    p->anchored  = true;
+    pthread_mutex_unlock(&p->anchor_lock);
+}
+
+/* When the chunk at `ts_frames` was stamped, i.e. completed, on the
+   streamer's clock; false before the first stamp                      */
+static bool playout_captured(Playout *p, uint64_t ts_frames, int64_t *ns)
+{
+    pthread_mutex_lock(&p->anchor_lock);
+    bool ok = p->anchored;
+    *ns = p->anchor_ns +
+        (int64_t)((double)(int64_t)(ts_frames - p->anchor_ts) * 1e9 / p->cfg.sample_rate);
+    pthread_mutex_unlock(&p->anchor_lock);
+    return ok;
+}
+
+/*
+ * Playout thread, about to write the chunk at `ts_frames`: the stages
+ * from the jitter buffer on, and the whole way from capture to the
+ * speaker once the streamer's clock is known.
+ */
+static void track_latency(Playout *p, uint64_t ts_frames)
+{
+    JitterStats js;
+    jitter_get_stats(p->jb, &js);
+    latency_record(LAT_JITTER, (int64_t)(js.wait_ms * 1e6));
+
+    int64_t sink = audio_playback_latency_ns(p->pb);
+    if (sink < 0) return;
+    int64_t out = sink + (int64_t)RESAMPLE_TAPS / 2 * 1000000000LL / p->cfg.sample_rate;
+    latency_record(LAT_PLAYBACK, out);
+
+    /* The chunk's first sample was captured a chunk before its stamp */
+    int64_t offset, captured;
+    int64_t chunk_ns = (int64_t)p->cfg.frames_per_buffer * 1000000000LL / p->cfg.sample_rate;
+    if (ping_client_clock_offset(&offset) && playout_captured(p, ts_frames, &captured)) {
+        int64_t total = current_time_ns() + out + offset - (captured - chunk_ns);
+        latency_record_total(total);
+        hist_record(hist_stage(HIST_END_TO_END), total);
+    }
+}
+
+/* The stages timed on this side */
+static const HistStage RECV_STAGES[] = { HIST_RECV_GAP, HIST_PLAYBACK_WRITE, HIST_END_TO_END };
+#define N_RECV_STAGES (sizeof(RECV_STAGES) / sizeof(RECV_STAGES[0]))
+
+static void dump_histograms(void)
+{
+    for (size_t i = 0; i < N_RECV_STAGES; i++)
+        hist_stage_log(RECV_STAGES[i]);
+}
+
+static void reset_histograms(void)
+{
+    for (size_t i = 0; i < N_RECV_STAGES; i++)
+        hist_reset(hist_stage(RECV_STAGES[i]));
+}
+
+/* SIGUSR1/SIGUSR2: the playout thread is the one always running */
+static void serve_hist_request(void)
+{
+    int req = atomic_exchange(&g_app.hist_request, 0);
+    if (!req) return;
+    ping_client_log_stats();
+    dump_histograms();
+    if (req & HIST_REQ_RESET)
+        reset_histograms();
+}
+
+/* Receive thread: gaps between chunks arriving, whatever the transport */
+static int64_t last_arrival_ns;
+
+static void note_arrival(int64_t now)
+{
+    if (last_arrival_ns > 0)
+        hist_record(hist_stage(HIST_RECV_GAP), now - last_arrival_ns);
+    last_arrival_ns = now;
+}
+
+/* ---- Synchronized playout ---- */
+/* Error smoothing per chunk, and how far off the playout may drift
+   before it jumps (drops or pads) instead of slewing                  */
+#define SYNC_ERR_SMOOTH      0.1
+#define SYNC_STEP_US         2000
+#define SYNC_RESYNC_MS       20
+/* Slew loop gains: ppm per ms of error, and per ms*s of it */
+#define SYNC_KP              200.0
+#define SYNC_KI              20.0
+
+typedef struct {
+    bool   locked;      /* first alignment done */
+    double err_ns;      /* smoothed error, + = late */
+    double drift_ppm;   /* integral term: our clock against theirs */
+} SyncLoop;
+
+/* When the chunk at `ts_frames` is due at the speaker, on our clock */
+static bool sync_due(Playout *p, uint64_t ts_frames, int64_t *due_ns)
+{
+    int64_t offset, captured;
+    if (!ping_client_clock_offset(&offset) || !playout_captured(p, ts_frames, &captured))
+        return false;
+    *due_ns = captured + p->delay_ns - offset;
+    return true;
+}
+
+static int write_silence(Playout *p, size_t frames, const uint8_t *zeros, size_t cap)
+{
+    size_t bpf = (size_t)(p->cfg.channels * p->cfg.bytes_per_sample);
+    size_t len = frames * bpf;
+    while (len > 0) {
+        size_t n = len < cap ? len : cap / bpf * bpf;
+        if (audio_playback_write(p->pb, zeros, n) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Line the chunk at `ts_frames` up with its due time: what the sink
+ * holds plus the resampler's delay says when it would be heard if
+ * written now.  Far off, pad with silence or drop the chunk's head;
+ * close, bend the resampling ratio until the error is gone.  Returns
+ * the bytes to drop from the chunk's start, or -1 on a playback error.
+ */
+static long sync_align(Playout *p, SyncLoop *sl, Resampler *rs, uint64_t ts_frames,
+                       size_t len, const uint8_t *zeros, size_t zcap)
+{
+    int     rate = p->cfg.sample_rate;
+    size_t  bpf  = (size_t)(p->cfg.channels * p->cfg.bytes_per_sample);
+    int64_t due, sink = audio_playback_latency_ns(p->pb);
+
+    if (sink < 0 || !sync_due(p, ts_frames, &due)) {
+        /* No clock yet: play along unscheduled */
+        resampler_set_ratio(rs, 1.0 + sl->drift_ppm * 1e-6);
+        return 0;
+    }
+
+    int64_t heard = current_time_ns() + sink +
+                    (int64_t)RESAMPLE_TAPS / 2 * 1000000000LL / rate;
+    int64_t err   = heard - due;
+    int64_t step  = 0;
+
+    if (!sl->locked || err > (int64_t)SYNC_RESYNC_MS * 1000000 ||
+        err < -(int64_t)SYNC_RESYNC_MS * 1000000) {
+        LOG_I("Playout %+.1f ms off schedule, %s", err / 1e6,
+              sl->locked ? "realigning" : "aligning to the streamer's clock");
+        sl->locked = true;
+        step = err;
+    } else {
+        sl->err_ns += ((double)err - sl->err_ns) * SYNC_ERR_SMOOTH;
+        if (fabs(sl->err_ns) > SYNC_STEP_US * 1000.0)
+            step = (int64_t)sl->err_ns;
+    }
+
+    if (step != 0) {
+        sl->err_ns = 0.0;
+        int64_t frames = (step < 0 ? -step : step) * rate / 1000000000LL;
+        if (step < 0)
+            return write_silence(p, (size_t)frames, zeros, zcap) < 0 ? -1 : 0;
+        size_t drop = (size_t)frames * bpf;
+        return (long)(drop < len ? drop : len);
+    }
+
+    double dt     = (double)(len / bpf) / rate;
+    double err_ms = sl->err_ns / 1e6;
+    sl->drift_ppm += SYNC_KI * err_ms * dt;
+    if (sl->drift_ppm >  JITTER_DRIFT_MAX_PPM) sl->drift_ppm =  JITTER_DRIFT_MAX_PPM;
+    if (sl->drift_ppm < -JITTER_DRIFT_MAX_PPM) sl->drift_ppm = -JITTER_DRIFT_MAX_PPM;
+
+    double ppm = sl->drift_ppm + SYNC_KP * err_ms;
+    if (ppm >  JITTER_DRIFT_MAX_PPM) ppm =  JITTER_DRIFT_MAX_PPM;
+    if (ppm < -JITTER_DRIFT_MAX_PPM) ppm = -JITTER_DRIFT_MAX_PPM;
+    resampler_set_ratio(rs, 1.0 + ppm * 1e-6);
+    return 0;
+}
+
+/*
+ * Paces chunks out of the jitter buffer into PulseAudio, resampled by
+ * the buffer's drift estimate so its depth stays put for hours.  In
+ * synchronized playout the schedule sets the pace instead.
+ */
+static void *playout_thread_func(void *arg)
+{
+    Playout   *p   = arg;
+    size_t     cap = (size_t)p->cfg.chunk_size;
+    Resampler *rs  = resampler_create(&p->cfg);
+    uint8_t   *buf = malloc(cap);
+    size_t     out_cap = rs ? resampler_max_output(rs, cap) : 0;
+    uint8_t   *out = rs ? malloc(out_cap) : NULL;
+    uint8_t   *zeros = p->delay_ns > 0 ? calloc(1, cap) : NULL;
+    if (!rs || !buf || !out || (p->delay_ns > 0 && !zeros)) {
+        LOG_E("Playout: out of memory");
+        resampler_destroy(rs);
+        free(buf);
+        free(out);
+        free(zeros);
+        return NULL;
+    }
+
+    SyncLoop sl = {0};
+    uint64_t ts;
+    size_t   n;
+    while ((n = jitter_get(p->jb, buf, cap, &ts)) > 0) {
+        long skip = 0;
+        if (p->delay_ns > 0)
+            skip = sync_align(p, &sl, rs, ts, n, zeros, cap);
+        else
+            resampler_set_ratio(rs, jitter_playout_ratio(p->jb));
+        if (skip < 0) break;
+        if ((size_t)skip >= n) continue;
+        track_latency(p, ts + (uint64_t)skip / (uint64_t)(p->cfg.channels * p->cfg.bytes_per_sample));
+
+        size_t m = resampler_process(rs, buf + skip, n - (size_t)skip, out, out_cap);
+        if (m > 0) {
+            int64_t t0 = current_time_ns();
+            int     rc = audio_playback_write(p->pb, out, m);
+            hist_record(hist_stage(HIST_PLAYBACK_WRITE), current_time_ns() - t0);
+            if (rc < 0) break;
+        }
+        if (atomic_load_explicit(&g_app.hist_request, memory_order_relaxed))
+            serve_hist_request();
+    }
+
+    resampler_destroy(rs);
+    free(zeros);
+    free(out);
+    free(buf);
+    return NULL;
+}
+
+/* `delay_ns` above 0 schedules playout to the streamer's clock */
+static Playout *playout_open(const AudioConfig *cfg, int64_t delay_ns)
+{
+    Playout *p = calloc(1, sizeof(*p));
+    if (!p) {
+        ui_update_status("Out of memory");
+        return NULL;
+    }
+    p->cfg      = *cfg;
+    p->delay_ns = delay_ns;
+    pthread_mutex_init(&p->anchor_lock, NULL);
+
+    p->pb = audio_playback_open(cfg);
+    if (!p->pb) {
+        ui_update_status("Failed to open audio playback");
+        free(p);
+        return NULL;
+    }
+    p->jb = jitter_create(cfg);
+    if (!p->jb) {
+        ui_update_status("Out of memory");
+        audio_playback_close(p->pb);
+        free(p);
+        return NULL;
+    }
+    jitter_set_scheduled(p->jb, delay_ns > 0);
+    if (pthread_create(&p->thread, NULL, playout_thread_func, p) != 0) {
+        LOG_E("pthread_create(playout): %s", strerror(errno));
+        jitter_destroy(p->jb);
+        audio_playback_close(p->pb);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* `drain` plays what is still queued first; otherwise it is cut off */
+static void playout_close(Playout *p, bool drain)
+{
+    if (!p) return;
+
+    if (drain)
+        jitter_drain(p->jb);
+    else
+        jitter_close(p->jb);
+    pthread_join(p->thread, NULL);
+    jitter_destroy(p->jb);
+    audio_playback_close(p->pb);
+    pthread_mutex_destroy(&p->anchor_lock);
+    free(p);
+}
+
+static void log_jitter_stats(void)
+{
+    JitterStats js;
+    if (receiving_get_jitter_stats(&js) < 0) return;
+    LOG_I("Jitter buffer: depth %d ms, target %d ms, jitter %d ms, %ld late, "
+          "%ld lost, %ld underruns, %ld ms trimmed, drift %+.1f ppm",
+          js.depth_ms, js.target_ms, js.jitter_ms, js.late, js.lost,
+          js.underruns, js.trimmed_ms, js.drift_ppm);
+}
+
+/* Decoder state for a stream in `cfg`; the lossless pool is kept */
+static int setup_decoders(const AudioConfig *cfg)
+{
+    opuscodec_destroy(opus.dec);
+    memset(&opus, 0, sizeof(opus));
+    if (cfg->use_opus && !(opus.dec = opuscodec_create_decoder(cfg))) {
+        ui_update_status("Opus not supported by this build");
+        return -1;
+    }
+    if (cfg->use_flac && !codec_pool) {
+        codec_pool = workpool_create(workpool_auto_helpers(g_app.codec_threads));
+        LOG_I("Lossless decode on %d thread(s)", workpool_size(codec_pool));
+    }
+    return 0;
+}
+
+static void show_format(const AudioConfig *cfg)
+{
+    char fmt[256], sr[64], status[256];
+    config_format_string(cfg, fmt, sizeof(fmt));
+    config_sample_rate_string(cfg, sr, sizeof(sr));
+
+    snprintf(status, sizeof(status),
+             "Receiving %s %s from %s",
+             sr, cfg->channels == 1 ? "Mono" : "Stereo", rctx.server_ip);
+    ui_update_status(status);
+    ui_update_format_info(sr, fmt);
+}
+
+/*
+ * FRAME_FORMAT_CHANGE: chunks from `first_seq` on are in the format of
+ * the header in `data`.  The current playout plays out what it has
+ * queued while a new one for the new format starts buffering, so the
+ * seam costs at most the chunk in flight.
+ */
+static int change_format(int fd, const uint8_t *data, size_t len, uint32_t first_seq,
+                         TransportMode mode)
+{
+    AudioConfig   cfg;
+    TransportInfo ti;
+    int           version;
+    if (protocol_parse_header(data, len, &cfg, &ti, &version) != 0 || ti.mode != mode) {
+        LOG_E("Unusable format change at chunk %u", first_seq);
+        ui_update_status("Invalid stream format");
+        return -1;
+    }
+
+    log_jitter_stats();
+    playout_close(retired, true);
+    jitter_drain(play->jb);
+    retired = play;
+
+    play = setup_decoders(&cfg) == 0
+         ? playout_open(&cfg, (int64_t)ti.sync_delay_us * 1000) : NULL;
+    pthread_mutex_lock(&jb_lock);
+    rctx.cfg = cfg;
+    rctx.jb  = play ? play->jb : NULL;
+    pthread_mutex_unlock(&jb_lock);
+    if (!play) return -1;
+    net_set_recv_timeout(fd, stall_ms(&cfg));
+
+    latency_record(LAT_CAPTURE, (int64_t)cfg.frames_per_buffer * 1000000000LL / cfg.sample_rate);
+
+    char fmt[256];
+    config_format_string(&cfg, fmt, sizeof(fmt));
+    LOG_I("Format change at chunk %u: %s", first_seq, fmt);
+    show_format(&cfg);
+    return 0;
+}
+
+/* ---- Multiplexed ping and chat ---- */
+
+static int send_control(const uint8_t *msg, size_t len)
+{
+    uint8_t frame[FRAME_HDR_SIZE + CHAT_WIRE_MAX];
+    size_t  n = protocol_build_control(frame, msg, len);
+
+    pthread_mutex_lock(&mux.write_lock);
+    ssize_t rc = write_fully(rctx.socket_fd, frame, n);
+    pthread_mutex_unlock(&mux.write_lock);
+    return rc == (ssize_t)n ? 0 : -1;
+}
+
+/* Receive thread, between chunks: time out or send a latency probe */
+static void mux_tick(void)
+{
+    if (!mux.on) return;
+
+    int64_t now = current_time_ms();
+    if (mux.sent_ns && current_time_ns() - mux.sent_ns > (int64_t)PING_TIMEOUT_MS * 1000000) {
+        ping_client_timed_out();
+        mux.sent_ns = 0;
+    }
+    if (mux.sent_ns || now - mux.ping_ms < ping_client_probe_interval_ms()) return;
+
+    uint8_t req[CLOCK_REQUEST_SIZE];
+    req[0] = ping_client_clock_probes() ? CLOCK_REQUEST : PING_REQUEST;
+    mux.sent_ns = current_time_ns();
+    write_be64(req + 1, (uint64_t)mux.sent_ns);
+    mux.ping_ms = now;
+    send_control(req, sizeof(req));   /* best-effort */
+}
+
+static void mux_report(int64_t smoothed)
+{
+    uint8_t report[RECEIVER_REPORT_SIZE];
+    send_control(report, ping_client_build_report(report, smoothed));
+}
+
+static void mux_control(const uint8_t *msg, size_t len)
+{
+    if (len == 9 && msg[0] == PING_RESPONSE) {
+        int64_t sent = (int64_t)read_be64(msg + 1);
+        if (sent != mux.sent_ns) return;   /* answer to a timed-out probe */
+        mux.sent_ns = 0;
+
+        /* Queued behind the audio, so this is the audio path's delay */
+        mux_report(ping_client_measured(current_time_ns() - sent));
+    } else if (len == CLOCK_RESPONSE_SIZE && msg[0] == CLOCK_RESPONSE) {
+        if (!mux.sent_ns) return;
+        int64_t smoothed = ping_client_clock_sample(msg, mux.sent_ns, current_time_ns());
+        if (smoothed < 0) return;
+        mux.sent_ns = 0;
+        mux_report(smoothed);
+    } else if (len > 0 && msg[0] == CHAT_MSG) {
+        char sender[CHAT_MAX_SENDER];
+        char message[CHAT_MAX_MSG];
+        if (chat_decode(msg, len, sender, sizeof(sender), message, sizeof(message)) == 0)
+            chat_client_deliver(sender, message);
+    }
+}
 
 /* ---- PCM receive loop ---- */
 
-static int receive_pcm_loop(int fd, AudioPlayback *pb, const AudioConfig *cfg)
+static int receive_pcm_loop(int fd, JitterBuffer *jb, const AudioConfig *cfg)
 {
     uint8_t *buf = malloc((size_t)cfg->chunk_size);
     if (!buf) return -1;
 
+    /* v2 carries no timing; chunks are numbered and timed by arrival order */
+    uint32_t seq = 0;
+
     while (atomic_load(&g_app.is_receiving)) {
         ssize_t n = read_fully(fd, buf, (size_t)cfg->chunk_size);
         if (n <= 0) {
@@ -27,35 +671,32 @@ static int receive_pcm_loop(int fd, AudioPlayback *pb, const AudioConfig *cfg)
             break;
         }
 
-        if (audio_playback_write(pb, buf, (size_t)n) < 0)
-            break;
-
-        atomic_fetch_add(&g_app.total_bytes_sent, n);
-        atomic_fetch_add(&g_app.bytes_sent_this_second, n);
+        note_arrival(current_time_ns());
+        jitter_put(jb, seq, (uint64_t)seq * (uint64_t)cfg->frames_per_buffer,
+                   buf, (size_t)n);
+        seq++;
 
-        int64_t now  = current_time_ms();
-        int64_t diff = now - atomic_load(&g_app.last_time_ms);
-        if (diff >= 1000) {
-            int64_t b = atomic_exchange(&g_app.bytes_sent_this_second, 0);
-            int64_t kbps = (b * 8) / diff;
-            atomic_store(&g_app.last_time_ms, now);
-            ui_update_stats(kbps,
-                            atomic_load(&g_app.total_bytes_sent),
-                            now - atomic_load(&g_app.stream_start_time));
-        }
+        count_bytes(n);
     }
 
     free(buf);
     return 0;
 }
 
-/* ---- FLAC receive loop ---- */
+/* ---- v2 coded receive loop ---- */
 
-static int receive_flac_loop(int fd, AudioPlayback *pb, const AudioConfig *cfg)
+static int receive_coded_loop(int fd, JitterBuffer *jb, const AudioConfig *cfg)
 {
-    size_t  comp_cap = (size_t)cfg->chunk_size * 2;
+    size_t   comp_cap = max_payload(cfg);
     uint8_t *comp_buf = malloc(comp_cap);
-    if (!comp_buf) return -1;
+    uint8_t *pcm      = malloc((size_t)cfg->chunk_size);
+    if (!comp_buf || !pcm) {
+        free(comp_buf);
+        free(pcm);
+        return -1;
+    }
+
+    uint32_t seq = 0;
 
     while (atomic_load(&g_app.is_receiving)) {
         uint8_t hdr[4];
@@ -67,111 +708,599 @@ static int receive_flac_loop(int fd, AudioPlayback *pb, const AudioConfig *cfg)
 
         uint32_t frame_len = read_be32(hdr);
         if (frame_len == 0 || frame_len > comp_cap) {
-            LOG_W("Invalid FLAC frame length: %u", frame_len);
-            continue;
+            /* Unframed v2 stream: nothing to resync on */
+            LOG_E("Invalid coded frame length: %u", frame_len);
+            ui_update_status("Stream corrupted");
+            break;
         }
 
         if (read_fully(fd, comp_buf, frame_len) != (ssize_t)frame_len)
             break;
 
-        audio_playback_write(pb, comp_buf, frame_len);
+        note_arrival(current_time_ns());
+        put_chunk(jb, cfg, stream_codec(cfg), seq, (uint64_t)seq * (uint64_t)cfg->frames_per_buffer,
+                  comp_buf, frame_len, pcm);
+        seq++;
+
+        count_bytes((int64_t)(frame_len + 4));
+    }
+
+    free(pcm);
+    free(comp_buf);
+    return 0;
+}
+
+/* ---- v3 framed receive loop ---- */
+
+/*
+ * A chunk stamped at capture came in at `arrived` and is queued for
+ * playout now.  Of its transit, what is neither the wire nor our own
+ * socket backlog waited at the streamer.
+ */
+static void track_transit(int fd, const FrameHeader *f, int64_t arrived)
+{
+    int64_t now = current_time_ns();
+    latency_record(LAT_DECODE, now - arrived);
+
+    /* What is queued behind this chunk waits about as long as it did */
+    int     inq     = net_queued_bytes(fd, false);
+    int64_t chunk_ns = (int64_t)f->frames * 1000000000LL / play->cfg.sample_rate;
+    int64_t backlog = inq > 0 ? (int64_t)inq * chunk_ns / (FRAME_HDR_SIZE + f->len) : 0;
+    if (inq >= 0)
+        latency_record(LAT_RECV_QUEUE, backlog);
+
+    int64_t offset;
+    LatencyBreakdown b;
+    latency_get(&b);
+    if (!ping_client_clock_offset(&offset) || b.stage_ms[LAT_NETWORK] < 0.0)
+        return;
+    int64_t transit = arrived + offset - f->capture_ns;
+    latency_record(LAT_SEND_QUEUE,
+                   transit - (int64_t)(b.stage_ms[LAT_NETWORK] * 1e6) - backlog);
+}
+
+/*
+ * Every chunk arrives behind a frame header.  One that fails its check
+ * means the byte stream is off; slide forward a byte at a time to the
+ * next good header instead of dropping the connection.  A format change
+ * swaps the playout and resizes the buffers for what follows it.
+ */
+static int receive_framed_loop(int fd)
+{
+    size_t   cap = 0, bpf = 0;
+    uint8_t *buf = NULL;
+    uint8_t *pcm = NULL;
+
+    uint8_t  hdr[FRAME_HDR_SIZE];
+    uint32_t expect  = 0;
+    bool     started = false;
+    bool     synced  = true;
+    long     lost    = 0;
+    long     resyncs = 0;
+    bool     ok      = true;
+
+    while (ok && atomic_load(&g_app.is_receiving)) {
+        if (!buf) {
+            cap = max_payload(&play->cfg);
+            if (mux.on && cap < CHAT_WIRE_MAX) cap = CHAT_WIRE_MAX;
+            bpf = (size_t)(play->cfg.channels * play->cfg.bytes_per_sample);
+            buf = malloc(cap);
+            pcm = malloc((size_t)play->cfg.chunk_size);
+            if (!buf || !pcm) {
+                ui_update_status("Out of memory");
+                break;
+            }
+            ok = read_fully(fd, hdr, FRAME_HDR_SIZE) == FRAME_HDR_SIZE;
+            continue;
+        }
+
+        const AudioConfig *cfg = &play->cfg;
+        FrameHeader f;
+        if (protocol_parse_frame(hdr, &f) < 0 || f.len > cap ||
+            (size_t)f.frames * bpf > (size_t)cfg->chunk_size *
+                                     ((f.flags & FRAME_SILENCE) ? SILENCE_RUN_MAX : 1)) {
+            if (synced) {
+                LOG_W("Lost frame sync, scanning");
+                synced = false;
+                resyncs++;
+            }
+            memmove(hdr, hdr + 1, FRAME_HDR_SIZE - 1);
+            ok = read_fully(fd, hdr + FRAME_HDR_SIZE - 1, 1) == 1;
+            continue;
+        }
+        synced = true;
+
+        if (f.len > 0 && read_fully(fd, buf, f.len) != (ssize_t)f.len) {
+            ok = false;
+            break;
+        }
+        int64_t arrived = current_time_ns();
+        count_bytes((int64_t)(FRAME_HDR_SIZE + f.len));
+
+        if (f.flags & FRAME_FORMAT_CHANGE) {
+            if (change_format(fd, buf, f.len, f.seq, TRANSPORT_TCP) < 0)
+                break;
+            free(buf);
+            free(pcm);
+            buf = pcm = NULL;
+            continue;
+        }
+        mux_tick();
+        if (f.flags & FRAME_CONTROL) {
+            mux_control(buf, f.len);
+            ok = read_fully(fd, hdr, FRAME_HDR_SIZE) == FRAME_HDR_SIZE;
+            continue;
+        }
 
-        atomic_fetch_add(&g_app.total_bytes_sent, (int64_t)(frame_len + 4));
-        atomic_fetch_add(&g_app.bytes_sent_this_second, (int64_t)(frame_len + 4));
+        if (!started && resume.have_seq && f.seq != resume.next_seq) {
+            /* Rejoined live: what is queued no longer leads up to this */
+            LOG_I("Rejoined live, %d chunks past the break",
+                  (int32_t)(f.seq - resume.next_seq));
+            jitter_reset(play->jb);
+            opus.started = false;
+        } else if (!started && resume.have_seq) {
+            LOG_I("Resumed at chunk %u", f.seq);
+        }
+        /* A silence marker stands for a whole run of chunks */
+        uint32_t span = 1;
+        if (f.flags & FRAME_SILENCE) {
+            int n = put_silence(play->jb, cfg, f.seq, f.ts_frames, f.frames);
+            if (n > 0) span = (uint32_t)n;
+        }
+        if (started && (int32_t)(f.seq - expect) > 0)
+            lost += (int32_t)(f.seq - expect);
+        expect  = f.seq + span;
+        started = true;
+        resume.next_seq = f.seq + span;
+        resume.have_seq = true;
 
-        int64_t now  = current_time_ms();
-        int64_t diff = now - atomic_load(&g_app.last_time_ms);
-        if (diff >= 1000) {
-            int64_t b = atomic_exchange(&g_app.bytes_sent_this_second, 0);
-            int64_t kbps = (b * 8) / diff;
-            atomic_store(&g_app.last_time_ms, now);
-            ui_update_stats(kbps,
-                            atomic_load(&g_app.total_bytes_sent),
-                            now - atomic_load(&g_app.stream_start_time));
+        note_arrival(arrived);
+        capture_anchor(play, f.ts_frames, f.capture_ns);
+        if (!(f.flags & FRAME_SILENCE)) {
+            put_chunk(play->jb, cfg, f.codec, f.seq, f.ts_frames, buf, f.len, pcm);
+            track_transit(fd, &f, arrived);
         }
+
+        ok = read_fully(fd, hdr, FRAME_HDR_SIZE) == FRAME_HDR_SIZE;
     }
 
-    free(comp_buf);
+    if (!ok && atomic_load(&g_app.is_receiving))
+        ui_update_status("Streamer disconnected");
+
+    LOG_I("Framed stream: %ld chunks lost upstream, %ld resyncs", lost, resyncs);
+    free(pcm);
+    free(buf);
     return 0;
 }
 
-/* ---- Receive thread ---- */
+/* ---- UDP receive loop (multicast and unicast) ---- */
 
-static void *receive_thread_func(void *arg)
+#define UDP_BATCH        32
+/* Unicast: how long a chunk may wait for retransmissions */
+#define UDP_HOLD_MS      60
+#define UDP_HELLO_MS     1000
+
+static void send_hello(int ufd, uint32_t token)
 {
-    (void)arg;
-    LOG_I("Receive thread started - connecting to %s", rctx.server_ip);
+    uint8_t pkt[MEDIA_HDR_SIZE];
+    size_t  len = media_build_hello(pkt, token);
+    if (send(ufd, pkt, len, 0) < 0)
+        LOG_W("UDP hello: %s", strerror(errno));
+}
 
-    int fd = net_connect(rctx.server_ip, AUDIO_PORT, 5000);
-    if (fd < 0) {
-        char msg[128];
-        snprintf(msg, sizeof(msg), "Cannot connect to %s:%d", rctx.server_ip, AUDIO_PORT);
-        ui_update_status(msg);
-        atomic_store(&g_app.is_receiving, false);
-        ui_reset();
-        return NULL;
+/*
+ * Audio arrives as datagrams; the TCP connection stays open so either
+ * side notices when the other goes away, and carries format changes
+ * and, when multiplexed, ping and chat.
+ * On unicast the receiver keeps saying HELLO and NACKs holes while
+ * there is still time to fill them.
+ */
+static int receive_udp_loop(int fd, const TransportInfo *ti)
+{
+    bool unicast = ti->mode == TRANSPORT_UDP;
+    int  ufd;
+
+    if (unicast)
+        ufd = net_create_udp_client(rctx.server_ip, ti->port, play->cfg.socket_buffer_size);
+    else
+        ufd = net_create_mcast_receiver(ti->group, ti->port, play->cfg.socket_buffer_size);
+    if (ufd < 0) {
+        ui_update_status(unicast ? "Cannot open UDP audio socket"
+                                 : "Cannot join multicast group");
+        return -1;
+    }
+
+    /* Enough slots to cover the hold time, plus the chunk window */
+    int chunk_ms = (int)config_buffer_latency_ms(&play->cfg);
+    int nslots   = unicast ? UDP_HOLD_MS / (chunk_ms > 0 ? chunk_ms : 1) + 4
+                           : MEDIA_REASM_SLOTS;
+    if (nslots > 256) nslots = 256;
+
+    MediaReassembler reasm;
+    size_t           reasm_cap = max_payload(&play->cfg);
+    if (media_reasm_init(&reasm, reasm_cap, nslots, unicast ? UDP_HOLD_MS : 0) < 0) {
+        close(ufd);
+        return -1;
+    }
+
+    uint8_t *pkts = malloc((size_t)UDP_BATCH * (MEDIA_HDR_SIZE + MEDIA_PAYLOAD));
+    uint8_t *pcm  = malloc((size_t)play->cfg.chunk_size);
+    if (!pkts || !pcm) {
+        free(pkts);
+        free(pcm);
+        media_reasm_destroy(&reasm);
+        close(ufd);
+        return -1;
+    }
+
+    struct in_addr server;
+    inet_pton(AF_INET, rctx.server_ip, &server);
+
+    struct mmsghdr     msgs[UDP_BATCH];
+    struct iovec       iov[UDP_BATCH];
+    struct sockaddr_in from[UDP_BATCH];
+    int64_t            hello_ms = 0;
+
+    /* After a format change, stragglers in the old format are dropped */
+    uint32_t first_seq = 0;
+    bool     switched  = false;
+    long     stale     = 0;
+    int64_t  heard_ms  = current_time_ms();
+
+    while (atomic_load(&g_app.is_receiving)) {
+        if (unicast && current_time_ms() - hello_ms >= UDP_HELLO_MS) {
+            send_hello(ufd, ti->token);
+            hello_ms = current_time_ms();
+        }
+
+        struct pollfd pfd[2] = {
+            { .fd = ufd, .events = POLLIN },
+            { .fd = fd,  .events = POLLIN },
+        };
+        int rc = poll(pfd, 2, unicast ? 5 : 500);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (current_time_ms() - heard_ms >= stall_ms(&play->cfg)) {
+            LOG_W("No audio for %d ms", stall_ms(&play->cfg));
+            ui_update_status("Stream stalled");
+            break;
+        }
+
+        mux_tick();
+        if (pfd[1].revents) {
+            /* Only format changes and control frames come this way */
+            uint8_t     hdr[FRAME_HDR_SIZE];
+            uint8_t     msg[CHAT_WIRE_MAX];
+            FrameHeader f;
+            if (read_fully(fd, hdr, FRAME_HDR_SIZE) != FRAME_HDR_SIZE) {
+                if (atomic_load(&g_app.is_receiving))
+                    ui_update_status("Streamer disconnected");
+                break;
+            }
+            if (protocol_parse_frame(hdr, &f) < 0 ||
+                !(f.flags & (FRAME_FORMAT_CHANGE | FRAME_CONTROL)) ||
+                f.len > sizeof(msg) || read_fully(fd, msg, f.len) != (ssize_t)f.len) {
+                LOG_E("Unexpected data on the stream connection");
+                ui_update_status("Stream corrupted");
+                break;
+            }
+            if (f.flags & FRAME_CONTROL) {
+                mux_control(msg, f.len);
+                continue;
+            }
+            if (change_format(fd, msg, f.len, f.seq, ti->mode) < 0)
+                break;
+            first_seq = f.seq;
+            switched  = true;
+            net_set_buffers(ufd, 0, play->cfg.socket_buffer_size);
+
+            free(pcm);
+            pcm = malloc((size_t)play->cfg.chunk_size);
+            if (!pcm) {
+                ui_update_status("Out of memory");
+                break;
+            }
+            /* Bigger chunks need a bigger reassembler; nothing of the new
+               format has arrived yet, since the change went out first    */
+            if (max_payload(&play->cfg) > reasm_cap) {
+                media_reasm_destroy(&reasm);
+                reasm_cap = max_payload(&play->cfg);
+                if (media_reasm_init(&reasm, reasm_cap, nslots,
+                                     unicast ? UDP_HOLD_MS : 0) < 0) {
+                    ui_update_status("Out of memory");
+                    break;
+                }
+            }
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < UDP_BATCH; i++) {
+                iov[i].iov_base = pkts + (size_t)i * (MEDIA_HDR_SIZE + MEDIA_PAYLOAD);
+                iov[i].iov_len  = MEDIA_HDR_SIZE + MEDIA_PAYLOAD;
+                msgs[i].msg_hdr.msg_iov     = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen  = 1;
+                msgs[i].msg_hdr.msg_name    = &from[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            }
+
+            int got = recvmmsg(ufd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+            int64_t bytes = 0;
+            for (int i = 0; i < got; i++) {
+                /* Other streamers may share the group; only take ours.  v4
+                   says which port they come from; older streamers are
+                   told apart by address, which fails when the group is
+                   routed out of another interface than we connected to */
+                if (ti->source_port ? from[i].sin_port != htons(ti->source_port)
+                                    : from[i].sin_addr.s_addr != server.s_addr)
+                    continue;
+                media_reasm_input(&reasm, iov[i].iov_base, msgs[i].msg_len);
+                bytes += msgs[i].msg_len;
+            }
+            if (bytes > 0) {
+                count_bytes(bytes);
+                heard_ms = current_time_ms();
+            }
+        }
+
+        const AudioConfig *cfg = &play->cfg;
+        MediaChunk ch;
+        while (media_reasm_next(&reasm, &ch)) {
+            if (switched && (int32_t)(ch.chunk_seq - first_seq) < 0) {
+                stale++;
+                continue;
+            }
+            note_arrival(current_time_ns());
+            if (ch.silent_frames > 0) {
+                put_silence(play->jb, cfg, ch.chunk_seq, ch.ts_frames, ch.silent_frames);
+                continue;
+            }
+            /* A coded chunk with holes cannot be decoded: lossless
+               leaves the gap, Opus conceals it */
+            bool holes = ch.missing > 0;
+            if (holes && ch.codec == FRAME_CODEC_LOSSLESS) continue;
+            int64_t t0 = current_time_ns();
+            put_chunk(play->jb, cfg, ch.codec, ch.chunk_seq, ch.ts_frames,
+                      holes && ch.codec == FRAME_CODEC_OPUS ? NULL : ch.data,
+                      ch.len, pcm);
+            latency_record(LAT_DECODE, current_time_ns() - t0);
+        }
+
+        if (unicast) {
+            size_t len;
+            while ((len = media_reasm_nack(&reasm, ti->token, pkts)) > 0) {
+                if (send(ufd, pkts, len, 0) < 0) break;
+            }
+        }
     }
 
-    rctx.socket_fd = fd;
+    LOG_I("UDP: %ld packets, %ld recovered by FEC, %ld resent after %ld NACKs, "
+          "%ld lost, %ld late, %ld from before a format change",
+          reasm.packets, reasm.recovered, reasm.retransmits, reasm.nacks_sent,
+          reasm.lost_packets, reasm.late_packets, stale);
 
-    AudioConfig cfg;
-    int hrc = protocol_read_header(fd, &cfg);
+    free(pcm);
+    free(pkts);
+    media_reasm_destroy(&reasm);
+    close(ufd);
+    return 0;
+}
+
+/* ---- Receive thread ---- */
+
+static bool same_format(const AudioConfig *a, const AudioConfig *b)
+{
+    return a->sample_rate       == b->sample_rate &&
+           a->channels          == b->channels &&
+           a->frames_per_buffer == b->frames_per_buffer &&
+           a->bits_per_sample   == b->bits_per_sample &&
+           a->compression_type  == b->compression_type &&
+           a->is_float          == b->is_float &&
+           a->packed24          == b->packed24;
+}
+
+/*
+ * One connection: HELLO, header, then the receive loop until the
+ * connection ends.  A playout left over from the last connection keeps
+ * playing into this one if the format is the same, so a resumed stream
+ * carries on where it broke off.  Returns 0 once the stream ran, -1 if
+ * no usable header came, -2 if this machine cannot play it at all.
+ */
+static int run_session(int fd, bool first)
+{
+    AudioConfig   cfg;
+    TransportInfo ti;
+    int           version = HEADER_VERSION_MIN;
+    PeerCaps      caps;
+    caps_local(&caps);
+    caps.flags |= CAPS_RESUME | CAPS_SYNC;
+    if (g_app.multiplex)
+        caps.flags |= CAPS_MUX;
+    if (resume.have_seq) {
+        caps.resume_token = resume.token;
+        caps.resume_seq   = resume.next_seq;
+    }
+
+    net_set_recv_timeout(fd, RECEIVE_HEADER_MS);
+    int hrc = protocol_write_hello(fd, &caps);
+    if (hrc == 0)
+        hrc = protocol_read_header(fd, &cfg, &ti, &version);
     if (hrc != 0) {
         ui_update_status("Invalid stream format");
-        net_close(&fd);
-        rctx.socket_fd = -1;
-        atomic_store(&g_app.is_receiving, false);
-        ui_reset();
-        return NULL;
+        return -1;
     }
+    net_set_recv_timeout(fd, stall_ms(&cfg));
 
-    rctx.cfg = cfg;
+    /* Another session, format or schedule: nothing queued carries over */
+    int64_t delay_ns = (int64_t)ti.sync_delay_us * 1000;
+    if (ti.resume_token != resume.token ||
+        (play && (!same_format(&play->cfg, &cfg) || play->delay_ns != delay_ns))) {
+        resume.have_seq = false;
+        if (play) {
+            log_jitter_stats();
+            pthread_mutex_lock(&jb_lock);
+            rctx.jb = NULL;
+            pthread_mutex_unlock(&jb_lock);
+            playout_close(retired, true);
+            playout_close(play, false);
+            retired = play = NULL;
+        }
+    }
+    resume.token = ti.resume_token;
+    /* Only framed TCP can tell a replay from a jump by the chunk seqs */
+    if (play && (ti.mode != TRANSPORT_TCP || version < 3)) {
+        jitter_reset(play->jb);
+        resume.have_seq = false;
+    }
 
-    /* Update UI with format info */
-    {
-        char fmt[256], sr[64], status[256];
-        config_format_string(&cfg, fmt, sizeof(fmt));
-        config_sample_rate_string(&cfg, sr, sizeof(sr));
+    rctx.cfg = cfg;
+    if (!play) {
+        if (setup_decoders(&cfg) < 0)
+            return -2;
+        play = playout_open(&cfg, delay_ns);
+        if (!play)
+            return -2;
+        pthread_mutex_lock(&jb_lock);
+        rctx.jb = play->jb;
+        pthread_mutex_unlock(&jb_lock);
+    }
 
-        snprintf(status, sizeof(status),
-                 "Receiving %s %s from %s",
-                 sr, cfg.channels == 1 ? "Mono" : "Stereo", rctx.server_ip);
-        ui_update_status(status);
+    show_format(&cfg);
+    if (first) {
         ui_show_receiving(rctx.server_ip);
-        ui_update_format_info(sr, fmt);
+        atomic_store(&g_app.stream_start_time, current_time_ms());
+        atomic_store(&g_app.last_time_ms, current_time_ms());
+        atomic_store(&g_app.total_bytes_sent, 0);
+        atomic_store(&g_app.bytes_sent_this_second, 0);
     }
 
-    /* Start sub-services */
-    ping_client_start(rctx.server_ip);
-    chat_client_start(rctx.server_ip);
+    if (delay_ns > 0)
+        LOG_I("Synchronized playout, %lld ms behind capture", (long long)(delay_ns / 1000000));
+    latency_reset();
+    reset_histograms();
+    last_arrival_ns = 0;
+    latency_record(LAT_CAPTURE, (int64_t)cfg.frames_per_buffer * 1000000000LL / cfg.sample_rate);
+    ping_client_set_clock(delay_ns > 0);
+    ping_client_set_report_port(ti.reports ? net_socket_port(fd, true) : 0);
 
-    /* Open playback */
-    AudioPlayback *pb = audio_playback_open(&cfg);
-    if (!pb) {
-        ui_update_status("Failed to open audio playback");
-        goto cleanup;
+    /* Start sub-services, or run them over this connection */
+    mux.on      = ti.mux;
+    mux.ping_ms = 0;
+    mux.sent_ns = 0;
+    if (mux.on) {
+        LOG_I("Ping and chat multiplexed onto the audio connection");
+        ping_client_attach();
+        chat_client_attach(send_control);
+    } else {
+        ping_client_start(rctx.server_ip);
+        chat_client_start(rctx.server_ip);
     }
 
-    atomic_store(&g_app.stream_start_time, current_time_ms());
-    atomic_store(&g_app.last_time_ms, current_time_ms());
-    atomic_store(&g_app.total_bytes_sent, 0);
-    atomic_store(&g_app.bytes_sent_this_second, 0);
-
-    if (cfg.use_flac)
-        receive_flac_loop(fd, pb, &cfg);
+    if (ti.mode != TRANSPORT_TCP)
+        receive_udp_loop(fd, &ti);
+    else if (version >= 3)
+        receive_framed_loop(fd);
+    else if (cfg.use_flac || cfg.use_opus)
+        receive_coded_loop(fd, play->jb, &cfg);
     else
-        receive_pcm_loop(fd, pb, &cfg);
-
-    audio_playback_close(pb);
+        receive_pcm_loop(fd, play->jb, &cfg);
 
-cleanup:
+    mux.on = false;
     ping_client_stop();
     chat_client_stop();
-    net_close(&fd);
-    rctx.socket_fd = -1;
+    ping_client_log_stats();
+    latency_log();
+    dump_histograms();
+    return 0;
+}
+
+/* Full jitter: anywhere in the upper half of the doubled delay, so
+   receivers dropped together do not all come back at once          */
+static int backoff_ms(int attempt)
+{
+    int64_t d = RECONNECT_BASE_MS;
+    for (int i = 0; i < attempt && d < RECONNECT_MAX_MS; i++)
+        d *= 2;
+    if (d > RECONNECT_MAX_MS) d = RECONNECT_MAX_MS;
+    return (int)(d / 2 + (current_time_ns() / 1000) % (d / 2 + 1));
+}
+
+static void *receive_thread_func(void *arg)
+{
+    (void)arg;
+    LOG_I("Receive thread started - connecting to %s", rctx.server_ip);
+
+    bool played  = false;
+    int  attempt = 0;
+    memset(&resume, 0, sizeof(resume));
+
+    while (atomic_load(&g_app.is_receiving)) {
+        int     fd = net_connect(rctx.server_ip, AUDIO_PORT, 5000);
+        int     rc = -1;
+        int64_t t0 = current_time_ms();
+
+        if (fd < 0 && !played) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Cannot connect to %s:%d", rctx.server_ip, AUDIO_PORT);
+            ui_update_status(msg);
+            break;
+        }
+        if (fd >= 0 && !atomic_load(&g_app.is_receiving)) {
+            net_close(&fd);
+            break;
+        }
+        if (fd >= 0) {
+            if (played)
+                atomic_fetch_add(&rctx.reconnects, 1);
+            pthread_mutex_lock(&jb_lock);
+            rctx.socket_fd = fd;
+            pthread_mutex_unlock(&jb_lock);
+            rc = run_session(fd, !played);
+            pthread_mutex_lock(&jb_lock);
+            rctx.socket_fd = -1;
+            pthread_mutex_unlock(&jb_lock);
+            net_close(&fd);
+        }
+        if (rc == -2 || (rc < 0 && !played))
+            break;
+        if (rc == 0) {
+            played = true;
+            if (current_time_ms() - t0 >= RECONNECT_STABLE_MS)
+                attempt = 0;
+        }
+        if (!atomic_load(&g_app.is_receiving))
+            break;
+
+        int  wait = backoff_ms(attempt++);
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Reconnecting to %s (attempt %d)...",
+                 rctx.server_ip, attempt);
+        ui_update_status(msg);
+        LOG_I("Connection lost, retrying in %d ms", wait);
+        for (int64_t until = current_time_ms() + wait;
+             atomic_load(&g_app.is_receiving) && current_time_ms() < until; )
+            usleep(20000);
+    }
+
+    log_jitter_stats();
+    pthread_mutex_lock(&jb_lock);
+    rctx.jb = NULL;
+    pthread_mutex_unlock(&jb_lock);
+
+    playout_close(retired, true);
+    playout_close(play, false);
+    retired = play = NULL;
+
+    opuscodec_destroy(opus.dec);
+    opus.dec = NULL;
+    workpool_destroy(codec_pool);
+    codec_pool = NULL;
     atomic_store(&g_app.is_receiving, false);
     ui_reset();
-    ui_update_status("Receiving stopped");
+    if (played)
+        ui_update_status("Receiving stopped");
 
     LOG_I("Receive thread stopped");
     return NULL;
@@ -200,6 +1329,23 @@ int receiving_start(const char *server_ip)
     return 0;
 }
 
+long receiving_reconnects(void)
+{
+    return atomic_load(&rctx.reconnects);
+}
+
+int receiving_get_jitter_stats(JitterStats *out)
+{
+    int rc = -1;
+    pthread_mutex_lock(&jb_lock);
+    if (rctx.jb) {
+        jitter_get_stats(rctx.jb, out);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&jb_lock);
+    return rc;
+}
+
 void receiving_stop(void)
 {
     if (!atomic_exchange(&g_app.is_receiving, false))
@@ -208,9 +1354,12 @@ void receiving_stop(void)
     LOG_I("Stopping receiving...");
     ui_update_status("Stopping...");
 
-    ping_client_stop();
-    chat_client_stop();
-    net_close(&rctx.socket_fd);
+    /* Wake the receive thread; it stops ping and chat and closes the
+       socket as the session ends                                      */
+    pthread_mutex_lock(&jb_lock);
+    if (rctx.socket_fd >= 0)
+        shutdown(rctx.socket_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&jb_lock);
 
     if (rctx.running) {
         pthread_join(rctx.receive_thread, NULL);
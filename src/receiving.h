@@ -7,22 +7,45 @@
 
 #include "soundshare.h"
 #include "config.h"
+#include "jitterbuf.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+/* Reconnect after a dropped connection: jittered exponential backoff */
+#define RECONNECT_BASE_MS    250
+#define RECONNECT_MAX_MS     8000
+/* A connection that lasted this long starts the backoff over */
+#define RECONNECT_STABLE_MS  10000
+/* Silence this long on a connection, and at least RECEIVE_STALL_CHUNKS
+   chunks' worth, means it is gone (the streamer sends at least once a
+   chunk, or every DTX_RUN_MS if that is longer).  Short enough that
+   the reconnect still finds what was missed in the streamer's replay
+   window (RESUME_REPLAY_MS).                                          */
+#define RECEIVE_STALL_MS     1000
+#define RECEIVE_STALL_CHUNKS 3
+/* Longest wait for the header, which a format switch can hold up */
+#define RECEIVE_HEADER_MS    3000
+
 /* Receiving context */
 typedef struct {
-    AudioConfig cfg;
-    int         socket_fd;
-    char        server_ip[INET_ADDRSTRLEN];
-    pthread_t   receive_thread;
-    bool        running;
+    AudioConfig   cfg;
+    int           socket_fd;
+    char          server_ip[INET_ADDRSTRLEN];
+    pthread_t     receive_thread;
+    bool          running;
+    JitterBuffer *jb;           /* NULL while nothing is played out */
+    atomic_long   reconnects;   /* connections after the first stream */
 } ReceiveContext;
 
 int  receiving_start(const char *server_ip);
 void receiving_stop(void);
 
+/** Snapshot of the jitter buffer; -1 when none is active. */
+int  receiving_get_jitter_stats(JitterStats *out);
+/** Times the stream came back over a new connection. */
+long receiving_reconnects(void);
+
 #endif /* RECEIVING_H */
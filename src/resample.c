@@ -0,0 +1,284 @@
+#include "resample.h"
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+/* Cutoff as a fraction of Nyquist and Kaiser window shape (~80 dB) */
+#define RESAMPLE_CUTOFF   0.91
+#define RESAMPLE_BETA     8.0
+
+struct Resampler {
+    int      channels;
+    int      bytes_per_sample;
+    bool     is_float;
+
+    float   *coefs;     /* (RESAMPLE_PHASES + 1) rows of RESAMPLE_TAPS */
+    float   *kern;      /* kernel for the current output position */
+
+    float   *hist;      /* planar: channel c at hist + c * cap */
+    uint8_t *raw;       /* the same frames as they came, for pass-through */
+    size_t   bpf;
+    size_t   cap;       /* frames per channel */
+    size_t   fill;      /* frames buffered */
+    double   pos;       /* input position of the next output frame */
+    double   ratio;
+};
+
+/* ---- Filter design ---- */
+
+/* Zeroth-order modified Bessel function, by its power series */
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum  += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+/*
+ * Row p holds the kernel for an output frame p/PHASES of the way past
+ * the input frame at tap TAPS/2 - 1.  The extra last row lets the
+ * interpolation between phases run off the end without a wrap.
+ */
+static void design_filter(float *coefs)
+{
+    const double half = RESAMPLE_TAPS / 2;
+    const double norm = bessel_i0(RESAMPLE_BETA);
+
+    for (int p = 0; p <= RESAMPLE_PHASES; p++) {
+        float *row = coefs + (size_t)p * RESAMPLE_TAPS;
+        double sum = 0.0;
+
+        for (int j = 0; j < RESAMPLE_TAPS; j++) {
+            double x = (j - half + 1) - (double)p / RESAMPLE_PHASES;
+            double s = x == 0.0 ? 1.0
+                                : sin(M_PI * RESAMPLE_CUTOFF * x) / (M_PI * RESAMPLE_CUTOFF * x);
+            double r = x / half;
+            double w = r * r < 1.0 ? bessel_i0(RESAMPLE_BETA * sqrt(1.0 - r * r)) / norm : 0.0;
+            row[j] = (float)(s * w);
+            sum   += s * w;
+        }
+        /* Unity gain at DC for every phase */
+        for (int j = 0; j < RESAMPLE_TAPS; j++)
+            row[j] = (float)(row[j] / sum);
+    }
+}
+
+/* ---- Inner loops ---- */
+
+static void interp_kernel(float *kern, const float *c0, const float *c1, float frac)
+{
+#if defined(__SSE__)
+    __m128 f = _mm_set1_ps(frac);
+    for (int j = 0; j < RESAMPLE_TAPS; j += 4) {
+        __m128 a = _mm_load_ps(c0 + j);
+        __m128 b = _mm_load_ps(c1 + j);
+        _mm_store_ps(kern + j, _mm_add_ps(a, _mm_mul_ps(f, _mm_sub_ps(b, a))));
+    }
+#else
+    for (int j = 0; j < RESAMPLE_TAPS; j++)
+        kern[j] = c0[j] + frac * (c1[j] - c0[j]);
+#endif
+}
+
+static float dot(const float *x, const float *kern)
+{
+#if defined(__SSE__)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (int j = 0; j < RESAMPLE_TAPS; j += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + j),     _mm_load_ps(kern + j)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + j + 4), _mm_load_ps(kern + j + 4)));
+    }
+    acc0 = _mm_add_ps(acc0, acc1);
+    acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+    acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+    return _mm_cvtss_f32(acc0);
+#else
+    float acc = 0.0f;
+    for (int j = 0; j < RESAMPLE_TAPS; j++)
+        acc += x[j] * kern[j];
+    return acc;
+#endif
+}
+
+/* ---- Sample format conversion ---- */
+
+static void load_frames(Resampler *rs, const uint8_t *in, size_t frames)
+{
+    memcpy(rs->raw + rs->fill * rs->bpf, in, frames * rs->bpf);
+    for (size_t i = 0; i < frames; i++) {
+        for (int c = 0; c < rs->channels; c++) {
+            float *dst = rs->hist + (size_t)c * rs->cap + rs->fill + i;
+            if (rs->is_float) {
+                memcpy(dst, in, 4);
+            } else if (rs->bytes_per_sample == 4) {
+                int32_t v;
+                memcpy(&v, in, 4);
+                *dst = (float)((double)v / 2147483648.0);
+            } else {
+                int16_t v;
+                memcpy(&v, in, 2);
+                *dst = (float)v / 32768.0f;
+            }
+            in += rs->bytes_per_sample;
+        }
+    }
+    rs->fill += frames;
+}
+
+static void store_sample(const Resampler *rs, uint8_t *out, float s)
+{
+    if (rs->is_float) {
+        memcpy(out, &s, 4);
+    } else if (rs->bytes_per_sample == 4) {
+        double d = (double)s * 2147483648.0;
+        if (d >  2147483647.0) d =  2147483647.0;
+        if (d < -2147483648.0) d = -2147483648.0;
+        int32_t v = (int32_t)lrint(d);
+        memcpy(out, &v, 4);
+    } else {
+        float f = s * 32768.0f;
+        if (f >  32767.0f) f =  32767.0f;
+        if (f < -32768.0f) f = -32768.0f;
+        int16_t v = (int16_t)lrintf(f);
+        memcpy(out, &v, 2);
+    }
+}
+
+/* ---- Public API ---- */
+
+Resampler *resampler_create(const AudioConfig *cfg)
+{
+    Resampler *rs = calloc(1, sizeof(*rs));
+    if (!rs) return NULL;
+
+    rs->channels         = cfg->channels;
+    rs->bytes_per_sample = cfg->bytes_per_sample;
+    rs->is_float         = cfg->is_float;
+    rs->ratio            = 1.0;
+    rs->cap              = (size_t)cfg->frames_per_buffer + RESAMPLE_TAPS;
+    rs->bpf              = (size_t)(cfg->channels * cfg->bytes_per_sample);
+
+    rs->coefs = aligned_alloc(16, sizeof(float) * (RESAMPLE_PHASES + 1) * RESAMPLE_TAPS);
+    rs->kern  = aligned_alloc(16, sizeof(float) * RESAMPLE_TAPS);
+    rs->hist  = calloc(rs->cap * (size_t)rs->channels, sizeof(float));
+    rs->raw   = calloc(rs->cap, rs->bpf);
+    if (!rs->coefs || !rs->kern || !rs->hist || !rs->raw) {
+        resampler_destroy(rs);
+        return NULL;
+    }
+    design_filter(rs->coefs);
+
+    /* Zero history so the first input frame lands mid-kernel */
+    rs->fill = RESAMPLE_TAPS / 2 - 1;
+    rs->pos  = RESAMPLE_TAPS / 2 - 1;
+    return rs;
+}
+
+void resampler_destroy(Resampler *rs)
+{
+    if (!rs) return;
+    free(rs->coefs);
+    free(rs->kern);
+    free(rs->hist);
+    free(rs->raw);
+    free(rs);
+}
+
+void resampler_set_ratio(Resampler *rs, double ratio)
+{
+    if (ratio > 1.0 + RESAMPLE_MAX_DEVIATION) ratio = 1.0 + RESAMPLE_MAX_DEVIATION;
+    if (ratio < 1.0 - RESAMPLE_MAX_DEVIATION) ratio = 1.0 - RESAMPLE_MAX_DEVIATION;
+
+    if (fabs(ratio - 1.0) < RESAMPLE_BYPASS_PPM * 1e-6) {
+        /* Pass-through reads whole input frames: round off the phase,
+           a jump of at most half a frame                              */
+        if (rs->ratio != 1.0)
+            rs->pos = floor(rs->pos + 0.5);
+        ratio = 1.0;
+    }
+    rs->ratio = ratio;
+}
+
+size_t resampler_max_output(const Resampler *rs, size_t in_len)
+{
+    size_t bpf    = (size_t)(rs->channels * rs->bytes_per_sample);
+    size_t frames = in_len / bpf;
+    return ((size_t)((double)frames / (1.0 - RESAMPLE_MAX_DEVIATION)) + 2) * bpf;
+}
+
+size_t resampler_process(Resampler *rs, const void *in, size_t in_len,
+                         void *out, size_t out_cap)
+{
+    const size_t bpf    = (size_t)(rs->channels * rs->bytes_per_sample);
+    const uint8_t *src  = in;
+    uint8_t       *dst  = out;
+    size_t frames_in    = in_len / bpf;
+    size_t frames_out   = 0;
+    size_t max_out      = out_cap / bpf;
+
+    while (frames_in > 0) {
+        size_t n = rs->cap - rs->fill;
+        if (n > frames_in) n = frames_in;
+        if (n == 0) {
+            LOG_W("Resampler output undersized, %zu frames dropped", frames_in);
+            break;
+        }
+        load_frames(rs, src, n);
+        src       += n * bpf;
+        frames_in -= n;
+
+        /* Emit every output frame whose kernel is fully buffered */
+        while (frames_out < max_out) {
+            size_t i = (size_t)rs->pos;
+            if (i + RESAMPLE_TAPS / 2 >= rs->fill) break;
+
+            if (rs->ratio == 1.0) {
+                /* Pass-through: every frame the kernel would reach, as is */
+                size_t run = rs->fill - RESAMPLE_TAPS / 2 - i;
+                if (run > max_out - frames_out) run = max_out - frames_out;
+                memcpy(dst, rs->raw + i * bpf, run * bpf);
+                dst        += run * bpf;
+                frames_out += run;
+                rs->pos    += (double)run;
+                continue;
+            }
+
+            double frac = rs->pos - (double)i;
+            int    p    = (int)(frac * RESAMPLE_PHASES);
+            float  f    = (float)(frac * RESAMPLE_PHASES - p);
+            interp_kernel(rs->kern,
+                          rs->coefs + (size_t)p * RESAMPLE_TAPS,
+                          rs->coefs + (size_t)(p + 1) * RESAMPLE_TAPS, f);
+
+            size_t start = i + 1 - RESAMPLE_TAPS / 2;
+            for (int c = 0; c < rs->channels; c++) {
+                float s = dot(rs->hist + (size_t)c * rs->cap + start, rs->kern);
+                store_sample(rs, dst, s);
+                dst += rs->bytes_per_sample;
+            }
+            frames_out++;
+            rs->pos += rs->ratio;
+        }
+
+        /* Slide out input no future kernel will reach */
+        size_t keep_from = (size_t)rs->pos + 1 - RESAMPLE_TAPS / 2;
+        if (keep_from > rs->fill) keep_from = rs->fill;
+        if (keep_from > 0) {
+            for (int c = 0; c < rs->channels; c++) {
+                float *h = rs->hist + (size_t)c * rs->cap;
+                memmove(h, h + keep_from, (rs->fill - keep_from) * sizeof(float));
+            }
+            memmove(rs->raw, rs->raw + keep_from * bpf, (rs->fill - keep_from) * bpf);
+            rs->fill -= keep_from;
+            rs->pos  -= (double)keep_from;
+        }
+    }
+
+    return frames_out * bpf;
+}
@@ -0,0 +1,57 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "soundshare.h"
+#include "config.h"
+
+#include <stddef.h>
+
+/*
+ * Variable-ratio resampler for clock drift compensation.
+ *
+ * Band-limited interpolation with a Kaiser-windowed sinc: the kernel is
+ * tabulated at RESAMPLE_PHASES fractional positions and linearly
+ * interpolated between them, so the ratio can change on every call
+ * without clicks.  Samples are kept planar in float and the inner
+ * products run four lanes at a time with SSE where available.
+ *
+ * Meant for ratios within a fraction of a percent of 1 (the cutoff is
+ * not lowered for downsampling); anything further out is clamped.  A
+ * ratio within RESAMPLE_BYPASS_PPM of 1 skips the filter and passes
+ * the input through bit for bit, with the same delay, so playback is
+ * untouched while the clocks agree.
+ */
+
+#define RESAMPLE_TAPS     64
+#define RESAMPLE_PHASES   256
+#define RESAMPLE_MAX_DEVIATION 0.01
+#define RESAMPLE_BYPASS_PPM    1.0
+
+typedef struct Resampler Resampler;
+
+/** Resampler for the PCM layout in `cfg`; NULL on failure. */
+Resampler *resampler_create(const AudioConfig *cfg);
+void       resampler_destroy(Resampler *rs);
+
+/**
+ * Input frames consumed per output frame: above 1 plays the input out
+ * faster (fewer output frames), below 1 slower.
+ */
+void resampler_set_ratio(Resampler *rs, double ratio);
+
+/**
+ * Most output bytes resampler_process() can produce from `in_len` input
+ * bytes at any ratio it accepts, for sizing the output buffer.
+ */
+size_t resampler_max_output(const Resampler *rs, size_t in_len);
+
+/**
+ * Convert interleaved PCM `in` (in the stream's sample format) and
+ * write the resampled result, same format, into `out`, which must hold
+ * resampler_max_output(in_len).  Returns the output byte count.  The
+ * filter delay of RESAMPLE_TAPS/2 frames is carried between calls.
+ */
+size_t resampler_process(Resampler *rs, const void *in, size_t in_len,
+                         void *out, size_t out_cap);
+
+#endif /* RESAMPLE_H */
@@ -32,11 +32,30 @@ void ss_log(LogLevel level, const char *fmt, ...);
 #define LOG_W(...) ss_log(LOG_WARN,  __VA_ARGS__)
 #define LOG_E(...) ss_log(LOG_ERROR, __VA_ARGS__)
 
+/* What the streamer does when a receiver falls too far behind */
+typedef enum {
+    OVERFLOW_DROP_OLDEST,   /* discard the oldest unsent chunks */
+    OVERFLOW_SKIP_TO_LIVE,  /* discard everything unsent, keep the newest */
+    OVERFLOW_DISCONNECT     /* drop the receiver */
+} OverflowPolicy;
+
+/* How audio gets from the streamer to receivers */
+typedef enum {
+    TRANSPORT_TCP       = 0,   /* raw stream on the AUDIO_PORT connection */
+    TRANSPORT_MULTICAST = 1,   /* one UDP copy to a group, FEC protected */
+    TRANSPORT_UDP       = 2    /* unicast UDP per receiver, NACK repair */
+} TransportMode;
+
+/* Thread pinning choices for AppState.capture_cpu / send_cpu */
+#define CPU_AUTO (-1)
+#define CPU_NONE (-2)
+
 /* Global app state */
 typedef struct {
     atomic_bool is_streaming;
     atomic_bool is_receiving;
     atomic_bool shutdown_requested;
+    atomic_int  hist_request;       /* HIST_REQ_* (histogram.h), from signals */
 
     atomic_long bytes_sent_this_second;
     atomic_long total_bytes_sent;
@@ -46,6 +65,25 @@ typedef struct {
     atomic_int  receiver_count;
 
     int selected_preset;
+    OverflowPolicy overflow_policy;
+    int capture_cpu;      /* CPU_AUTO, CPU_NONE or a CPU index */
+    int send_cpu;
+    TransportMode transport;
+    char mcast_group[16];
+    int  fec_k;           /* data packets per parity packet, 0 = no FEC */
+    int  opus_kbps;       /* Opus presets: target bitrate */
+    bool pack24;          /* send 24-bit PCM as 3 bytes per sample */
+    bool dtx;             /* send silence as markers */
+    int  dtx_db;          /* silence threshold, dBFS */
+    int  dtx_hangover_ms; /* silence before markers start */
+    int  codec_threads;   /* lossless encode/decode threads, 0 = per CPU */
+    bool adaptive_codec;  /* lossless: send hard-to-code chunks as PCM */
+    int  latency_ms;      /* receiver: preferred latency, 0 = none */
+    int  cpu_budget;      /* receiver: percent of a core for decoding, 0 = any */
+    bool multiplex;       /* receiver: ping and chat on the audio connection */
+    bool ping_udp;        /* receiver: latency probes as datagrams */
+    int  sync_ms;         /* streamer: presentation delay for synchronized
+                             playout, 0 = off */
 
     pthread_mutex_t lock;
 } AppState;
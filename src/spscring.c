@@ -0,0 +1,64 @@
+#include "spscring.h"
+
+int spsc_init(SpscRing *q, uint32_t capacity)
+{
+    memset(q, 0, sizeof(*q));
+
+    uint32_t cap = 2;
+    while (cap * 2 <= capacity) cap *= 2;
+
+    q->items = calloc(cap, sizeof(*q->items));
+    if (!q->items) return -1;
+
+    q->mask = cap - 1;
+    atomic_store(&q->head, 0);
+    atomic_store(&q->tail, 0);
+    atomic_store(&q->overruns, 0);
+    atomic_store(&q->max_occupancy, 0);
+    return 0;
+}
+
+void spsc_destroy(SpscRing *q)
+{
+    free(q->items);
+    q->items = NULL;
+}
+
+bool spsc_push(SpscRing *q, const ChunkDesc *d)
+{
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    uint32_t used = head - tail;
+
+    if (used > q->mask) {
+        atomic_fetch_add_explicit(&q->overruns, 1, memory_order_relaxed);
+        return false;
+    }
+
+    q->items[head & q->mask] = *d;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    /* Only the producer writes max_occupancy */
+    if ((int)(used + 1) > atomic_load_explicit(&q->max_occupancy, memory_order_relaxed))
+        atomic_store_explicit(&q->max_occupancy, (int)(used + 1), memory_order_relaxed);
+    return true;
+}
+
+bool spsc_pop(SpscRing *q, ChunkDesc *d)
+{
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (tail == head) return false;
+
+    *d = q->items[tail & q->mask];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+int spsc_depth(SpscRing *q)
+{
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    return (int)(head - tail);
+}
@@ -0,0 +1,43 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include "soundshare.h"
+#include "chunkring.h"
+
+/*
+ * Lock-free single-producer / single-consumer ring of chunk
+ * descriptors.  The capture thread is the only producer, the send
+ * thread the only consumer; head and tail live on separate cache
+ * lines so neither side bounces the other's line on every chunk.
+ */
+
+typedef struct {
+    ChunkDesc           *items;
+    uint32_t             mask;            /* capacity - 1 (power of two) */
+
+    _Alignas(64) _Atomic uint32_t head;   /* next write, producer only */
+    _Alignas(64) _Atomic uint32_t tail;   /* next read,  consumer only */
+
+    _Alignas(64) atomic_long overruns;    /* push found the ring full */
+    atomic_int           max_occupancy;
+} SpscRing;
+
+/* capacity is rounded down to a power of two, minimum 2 */
+int  spsc_init(SpscRing *q, uint32_t capacity);
+void spsc_destroy(SpscRing *q);
+
+/** Producer: false (and an overrun is counted) if the ring is full. */
+bool spsc_push(SpscRing *q, const ChunkDesc *d);
+
+/** Consumer: false if the ring is empty. */
+bool spsc_pop(SpscRing *q, ChunkDesc *d);
+
+/** Descriptors currently queued; safe from any thread. */
+int  spsc_depth(SpscRing *q);
+
+static inline int spsc_capacity(const SpscRing *q)
+{
+    return (int)q->mask + 1;
+}
+
+#endif /* SPSCRING_H */
@@ -4,130 +4,1732 @@
 #include "audio.h"
 #include "ping.h"
 #include "chat.h"
+#include "lossless.h"
+#include "opuscodec.h"
+#include "pcmpack.h"
+#include "dtx.h"
+#include "caps.h"
 #include "ui.h"
 
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sched.h>
 
 static StreamContext ctx;
 
-static void add_client(int fd, const char *ip)
+#define WAKE_ID ((uint32_t)MAX_CLIENTS)
+#define UDP_ID  ((uint32_t)MAX_CLIENTS + 1)
+
+/* ---- Ring cursors ---- */
+
+/* Give back the references a cursor holds on [from, to) */
+static void release_range(uint64_t from, uint64_t to)
+{
+    for (uint64_t seq = from; seq < to; seq++) {
+        ChunkSlot *slot = chunk_ring_get(&ctx.ring, seq);
+        if (slot) chunk_ring_release(slot);
+    }
+}
+
+/* Frame header of slot `seq` in encoding `enc`; enc == ctx.nencs is
+   the slot's DTX marker, shared by every encoding                    */
+static uint8_t *frame_hdr(uint64_t seq, int enc)
+{
+    uint64_t i = (seq % (uint64_t)ctx.ring.nslots) * (uint64_t)(ctx.nencs + 1) + (uint64_t)enc;
+    return ctx.frame_hdrs + i * FRAME_HDR_SIZE;
+}
+
+static uint8_t *len_prefix(uint64_t seq)
+{
+    return ctx.len_prefixes + (seq % (uint64_t)ctx.ring.nslots) * 4;
+}
+
+/* Most iovecs one chunk takes: DTX marker, frame header, payload */
+#define CHUNK_IOV_MAX 3
+
+/* A chunk as this client sees it on the wire: [frame header] payload,
+   or on v2 with a codec [be32 length] payload.  v3 gets nothing for a
+   silent chunk but the run's marker ahead of the chunk that ends it;
+   v2 has no marker and gets every chunk that was coded; one left
+   uncoded for want of a v2 receiver is skipped.  A client of the second
+   encoding gets nothing for chunks captured before anyone asked for
+   it.                                                                 */
+static int chunk_iov(const ClientConn *c, uint64_t seq, const ChunkSlot *slot,
+                     struct iovec *iov)
+{
+    int n = 0;
+    if (c->enc > 0 && !slot->has_alt) return 0;
+    if (!c->framed && (c->enc > 0 ? slot->alt_len : slot->len) == 0) return 0;
+    if (c->framed) {
+        if (slot->run_chunks > 0) {
+            iov[n].iov_base = frame_hdr(seq, ctx.nencs);
+            iov[n].iov_len  = FRAME_HDR_SIZE;
+            n++;
+        }
+        if (slot->silent) return n;
+        iov[n].iov_base = frame_hdr(seq, c->enc);
+        iov[n].iov_len  = FRAME_HDR_SIZE;
+        n++;
+    } else if (ctx.len_prefixes) {
+        iov[n].iov_base = len_prefix(seq);
+        iov[n].iov_len  = 4;
+        n++;
+    }
+    iov[n].iov_base = c->enc > 0 ? slot->alt     : slot->data;
+    iov[n].iov_len  = c->enc > 0 ? slot->alt_len : slot->len;
+    return n + 1;
+}
+
+static size_t chunk_wire_len(const ClientConn *c, const ChunkSlot *slot)
+{
+    if (c->enc > 0 && !slot->has_alt) return 0;
+
+    size_t len = c->enc > 0 ? slot->alt_len : slot->len;
+    if (!c->framed && len == 0) return 0;
+    if (c->framed)        return (slot->run_chunks > 0 ? FRAME_HDR_SIZE : 0) +
+                                 (slot->silent ? 0 : len + FRAME_HDR_SIZE);
+    if (ctx.len_prefixes) return len + 4;
+    return len;
+}
+
+/*
+ * Skip the client's cursor forward to `upto`.  A chunk that is already
+ * partly on the wire is finished from a private copy so the receiver
+ * keeps chunk alignment while its ring slot is freed.
+ */
+static int drop_chunks(ClientConn *c, uint64_t upto)
+{
+    if (c->next_seq >= upto) return 0;
+
+    if (c->offset > 0) {
+        ChunkSlot   *slot = chunk_ring_get(&ctx.ring, c->next_seq);
+        size_t       left = chunk_wire_len(c, slot) - c->offset;
+        uint8_t     *sp   = malloc(left);
+        struct iovec iov[CHUNK_IOV_MAX];
+        if (!sp) return -1;
+
+        size_t skip = c->offset, n = 0;
+        int    niov = chunk_iov(c, c->next_seq, slot, iov);
+        for (int i = 0; i < niov; i++) {
+            if (skip >= iov[i].iov_len) {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            memcpy(sp + n, (uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+            n   += iov[i].iov_len - skip;
+            skip = 0;
+        }
+
+        c->spill     = sp;
+        c->spill_len = left;
+        c->spill_off = 0;
+        chunk_ring_release(slot);
+        c->next_seq++;
+        c->offset = 0;
+    }
+
+    c->dropped_chunks += (int64_t)(upto - c->next_seq);
+    release_range(c->next_seq, upto);
+    c->next_seq = upto;
+    return 0;
+}
+
+/*
+ * Copy everything the client has yet to send out of the ring into its
+ * spill buffer, followed by `extra`, and give back its references.  The
+ * ring can then be torn down under it.  Caller holds clients_lock.
+ */
+static int spill_pending(ClientConn *c, const uint8_t *extra, size_t extra_len)
+{
+    uint64_t head  = ctx.transport.mode == TRANSPORT_TCP ? chunk_ring_head(&ctx.ring)
+                                                          : c->next_seq;
+    size_t   total = (c->spill ? c->spill_len - c->spill_off : 0) + extra_len;
+
+    for (uint64_t seq = c->next_seq; seq < head; seq++)
+        total += chunk_wire_len(c, chunk_ring_get(&ctx.ring, seq));
+    total -= c->offset;
+
+    uint8_t *sp = malloc(total > 0 ? total : 1);
+    if (!sp) return -1;
+
+    size_t n = 0;
+    if (c->spill) {
+        memcpy(sp, c->spill + c->spill_off, c->spill_len - c->spill_off);
+        n = c->spill_len - c->spill_off;
+    }
+    for (uint64_t seq = c->next_seq; seq < head; seq++) {
+        ChunkSlot   *slot = chunk_ring_get(&ctx.ring, seq);
+        struct iovec iov[CHUNK_IOV_MAX];
+        size_t       skip = seq == c->next_seq ? c->offset : 0;
+        int          niov = chunk_iov(c, seq, slot, iov);
+        for (int i = 0; i < niov; i++) {
+            if (skip >= iov[i].iov_len) {
+                skip -= iov[i].iov_len;
+                continue;
+            }
+            memcpy(sp + n, (uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+            n   += iov[i].iov_len - skip;
+            skip = 0;
+        }
+        chunk_ring_release(slot);
+    }
+    if (extra_len > 0)
+        memcpy(sp + n, extra, extra_len);
+
+    free(c->spill);
+    c->spill     = sp;
+    c->spill_len = total;
+    c->spill_off = 0;
+    c->next_seq  = head;
+    c->offset    = 0;
+    return 0;
+}
+
+/* Most chunks a reader may hold before the capture thread could stall */
+static uint64_t ring_max_lag(void)
+{
+    return (uint64_t)(ctx.ring.nslots - spsc_capacity(&ctx.pipe) - RING_RESERVE);
+}
+
+/*
+ * Apply the overflow policy to a client that fell too far behind the
+ * writer.  Caller holds clients_lock.  Returns -1 if the client has to
+ * be disconnected.
+ */
+static int enforce_lag(ClientConn *c, uint64_t head, OverflowPolicy policy)
+{
+    uint64_t max_lag = ring_max_lag();
+    if (head - c->next_seq <= max_lag) return 0;
+
+    switch (policy) {
+    case OVERFLOW_DISCONNECT:
+        LOG_W("%s is %llu chunks behind, disconnecting", c->ip,
+              (unsigned long long)(head - c->next_seq));
+        return -1;
+    case OVERFLOW_SKIP_TO_LIVE:
+        return drop_chunks(c, head - 1);
+    case OVERFLOW_DROP_OLDEST:
+    default:
+        return drop_chunks(c, head - max_lag);
+    }
+}
+
+/*
+ * Where a new client's cursor starts: live, or for a receiver resuming
+ * this session, at the first chunk it missed if that is still in the
+ * ring and recent enough to replay.  Takes the cursor's references on
+ * the replayed chunks.  Caller holds clients_lock, so head stays put
+ * and the writer stays ring_max_lag() chunks clear of them.
+ */
+static uint64_t join_seq(const ClientConn *c)
+{
+    uint64_t head = chunk_ring_head(&ctx.ring);
+    if (!(c->caps.flags & CAPS_RESUME) || c->caps.resume_token == 0)
+        return head;
+    if (c->caps.resume_token != ctx.resume_token) {
+        LOG_I("%s was on an earlier session, joining live", c->ip);
+        return head;
+    }
+
+    /* Chunk seqs are 32 bits on the wire */
+    uint32_t missed   = (uint32_t)head - c->caps.resume_seq;
+    double   chunk_ms = config_buffer_latency_ms(&ctx.config);
+    uint64_t limit    = (uint64_t)(RESUME_REPLAY_MS / (chunk_ms > 0 ? chunk_ms : 1.0));
+    if (limit < RESUME_REPLAY_CHUNKS) limit = RESUME_REPLAY_CHUNKS;
+    if (limit > ring_max_lag()) limit = ring_max_lag();
+
+    bool ok = ctx.transport.mode == TRANSPORT_TCP && missed <= limit;
+    for (uint64_t seq = head - missed; ok && seq < head; seq++) {
+        ChunkSlot *slot = chunk_ring_get(&ctx.ring, seq);
+        ok = slot && (c->enc == 0 || slot->has_alt);
+    }
+    if (!ok) {
+        LOG_I("%s resumes %u chunks behind, joining live", c->ip, missed);
+        return head;
+    }
+
+    for (uint64_t seq = head - missed; seq < head; seq++)
+        chunk_ring_retain(chunk_ring_get(&ctx.ring, seq));
+    LOG_I("%s resumes, replaying %u chunks", c->ip, missed);
+    return head - missed;
+}
+
+/* ---- Client table ---- */
+
+static void telemetry_reset(ClientTelemetry *t)
+{
+    atomic_store(&t->latency_ms, -1);
+    atomic_store(&t->probe_rtt_us, -1);
+    atomic_store(&t->probe_p50_us, -1);
+    atomic_store(&t->probe_p99_us, -1);
+    atomic_store(&t->probe_jitter_us, -1);
+    atomic_store(&t->rtt_us, -1);
+    atomic_store(&t->queued_bytes, 0);
+    atomic_store(&t->queue_chunks, 0);
+    atomic_store(&t->bytes_sent, 0);
+    atomic_store(&t->underruns, 0);
+    atomic_store(&t->lost, 0);
+    atomic_store(&t->reconnects, 0);
+    hist_reset(&t->send_ns);
+}
+
+/* The latency shown is the worst receiver's: that is the room that lags */
+static void show_worst_latency(void)
+{
+    int64_t worst = -1;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+        int64_t ms = atomic_load(&c->tel.latency_ms);
+        if (ms > worst) worst = ms;
+    }
+    atomic_store(&g_app.current_latency_ms, worst);
+    ui_update_latency(worst);
+}
+
+static int add_client(int fd, const char *ip, uint32_t token, int version,
+                      const PeerCaps *caps, int enc)
 {
+    int idx = -1;
+
     pthread_mutex_lock(&ctx.clients_lock);
     for (int i = 0; i < MAX_CLIENTS; i++) {
         if (!atomic_load(&ctx.clients[i].connected)) {
-            ctx.clients[i].fd = fd;
-            snprintf(ctx.clients[i].ip, INET_ADDRSTRLEN, "%s", ip);
-            atomic_store(&ctx.clients[i].connected, true);
-            ctx.client_count++;
-            atomic_store(&g_app.receiver_count, ctx.client_count);
-            LOG_I("Client connected: %s (total %d)", ip, ctx.client_count);
+            idx = i;
             break;
         }
     }
+
+    if (idx >= 0) {
+        ClientConn *c = &ctx.clients[idx];
+
+        c->fd = fd;
+        snprintf(c->ip, INET_ADDRSTRLEN, "%s", ip);
+        c->port           = net_socket_port(fd, false);
+        c->blocked        = false;
+        c->offset         = 0;
+        c->spill          = NULL;
+        c->spill_len      = 0;
+        c->spill_off      = 0;
+        c->dropped_chunks = 0;
+        c->framed         = version >= 3;
+        c->version        = version;
+        c->caps           = *caps;
+        c->mux            = caps->known && (caps->flags & CAPS_MUX);
+        c->in             = c->mux ? malloc(FRAME_HDR_SIZE + CHAT_WIRE_MAX) : NULL;
+        c->in_len         = 0;
+        c->ctrl           = NULL;
+        c->ctrl_len       = 0;
+        c->clock_due      = false;
+        c->enc            = enc;
+        c->token          = token;
+        c->udp_ready      = false;
+        c->retransmits    = 0;
+        c->retx_late      = 0;
+        c->joined_ms      = current_time_ms();
+        telemetry_reset(&c->tel);
+
+        if (c->mux && !c->in) {
+            LOG_E("Out of memory for %s", ip);
+            pthread_mutex_unlock(&ctx.clients_lock);
+            return -1;
+        }
+        net_set_nonblocking(fd, true);
+        c->next_seq = join_seq(c);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = (uint32_t)idx;
+        if (epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOG_E("epoll_ctl(add %s): %s", ip, strerror(errno));
+            if (ctx.transport.mode == TRANSPORT_TCP)
+                release_range(c->next_seq, chunk_ring_head(&ctx.ring));
+            free(c->in);
+            c->in = NULL;
+            c->fd = -1;
+            pthread_mutex_unlock(&ctx.clients_lock);
+            return -1;
+        }
+
+        if (!c->framed) atomic_fetch_add(&ctx.legacy_clients, 1);
+        atomic_fetch_add(&ctx.encs[enc].clients, 1);
+        atomic_store(&c->connected, true);
+        ctx.client_count++;
+        atomic_store(&g_app.receiver_count, ctx.client_count);
+        LOG_I("Client connected: %s (total %d)%s", ip, ctx.client_count,
+              c->mux ? ", ping and chat multiplexed" : "");
+    }
     pthread_mutex_unlock(&ctx.clients_lock);
+
+    if (idx < 0) {
+        LOG_W("Max receivers reached, rejecting %s", ip);
+        return -1;
+    }
+
     ui_update_receiver_count(ctx.client_count);
+    return idx;
+}
+
+/* Caller holds clients_lock */
+static void remove_client_locked(int idx)
+{
+    ClientConn *c = &ctx.clients[idx];
+    if (!atomic_load(&c->connected)) return;
+
+    if (ctx.transport.mode == TRANSPORT_UDP)
+        LOG_I("Client disconnected: %s (%ld packets resent, %ld NACKed too late)",
+              c->ip, c->retransmits, c->retx_late);
+    else
+        LOG_I("Client disconnected: %s (%lld chunks dropped)",
+              c->ip, (long long)c->dropped_chunks);
+    LOG_I("%s:%d after %lld s: %lld KB sent, latency %lld ms, "
+          "%lld underruns, %lld lost, %lld reconnects",
+          c->ip, c->port, (long long)((current_time_ms() - c->joined_ms) / 1000),
+          (long long)(atomic_load(&c->tel.bytes_sent) / 1024),
+          (long long)atomic_load(&c->tel.latency_ms),
+          (long long)atomic_load(&c->tel.underruns),
+          (long long)atomic_load(&c->tel.lost),
+          (long long)atomic_load(&c->tel.reconnects));
+    epoll_ctl(ctx.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    net_close(&c->fd);
+    hist_merge(&ctx.send_left, &c->tel.send_ns);
+
+    if (ctx.transport.mode == TRANSPORT_TCP)
+        release_range(c->next_seq, chunk_ring_head(&ctx.ring));
+    free(c->spill);
+    free(c->in);
+    free(c->ctrl);
+    c->spill    = NULL;
+    c->in       = NULL;
+    c->ctrl     = NULL;
+    c->ctrl_len = 0;
+
+    if (!c->framed) atomic_fetch_sub(&ctx.legacy_clients, 1);
+    atomic_fetch_sub(&ctx.encs[c->enc].clients, 1);
+    if (c->caps.flags & CAPS_RESUME)
+        atomic_store(&ctx.encs[c->enc].hold_until_ns,
+                     current_time_ns() + (int64_t)RESUME_REPLAY_MS * 1000000);
+    atomic_store(&c->connected, false);
+    ctx.client_count--;
+    if (ctx.client_count < 0) ctx.client_count = 0;
+    atomic_store(&g_app.receiver_count, ctx.client_count);
+    show_worst_latency();
+}
+
+static void remove_client(int idx)
+{
+    pthread_mutex_lock(&ctx.clients_lock);
+    remove_client_locked(idx);
+    pthread_mutex_unlock(&ctx.clients_lock);
+    ui_update_receiver_count(ctx.client_count);
+}
+
+/* Unguessable enough to keep stray datagrams from claiming a session */
+static uint32_t new_token(void)
+{
+    static uint64_t state;
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL) ^ (uint64_t)current_time_ns();
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (uint32_t)(z ^ (z >> 31));
+}
+
+/* Encoding for a new receiver, or -1 to turn it away */
+static int choose_encoding(const char *ip, int version, const PeerCaps *caps)
+{
+    if (!caps->known) {
+        /* v2 has no header flags: it would play packed chunks as s32,
+           so it gets the plain PCM fallback.  Lossless sessions code
+           every chunk while it is connected.                          */
+        if (version < 3 && ctx.config.packed24 && !ctx.config.use_flac) {
+            if (ctx.nencs > 1 && ctx.encs[1].wire.codec == FRAME_CODEC_PCM &&
+                !ctx.encs[1].wire.packed24) {
+                LOG_I("%s gets %s", ip, caps_encoding_name(&ctx.encs[1].wire));
+                return 1;
+            }
+            LOG_W("%s is v%d and cannot take packed 24-bit audio "
+                  "(SOUNDSHARE_PACK24=0 serves it)", ip, version);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Datagrams only ever carry the session encoding */
+    WireEncoding wires[MAX_ENCODINGS];
+    int          n = ctx.transport.mode == TRANSPORT_TCP ? ctx.nencs : 1;
+    for (int i = 0; i < n; i++)
+        wires[i] = ctx.encs[i].wire;
+
+    int enc = caps_choose(&ctx.config, wires, n, caps, ip);
+    if (enc >= 0)
+        LOG_I("%s gets %s", ip, caps_encoding_name(&wires[enc]));
+    return enc;
+}
+
+/* Presentation delay to announce to a receiver: synchronized playout
+   needs capture times, which only framed TCP carries               */
+static uint32_t sync_delay_us(const PeerCaps *caps)
+{
+    if (!caps->known || !(caps->flags & CAPS_SYNC) ||
+        ctx.transport.mode != TRANSPORT_TCP)
+        return 0;
+    return (uint32_t)g_app.sync_ms * 1000;
+}
+
+/* ---- Accepting receivers, on the reactor thread ---- */
+
+/* Out of the reactor; the socket is handed back */
+static int pending_release(PendingHello *p)
+{
+    int fd = p->fd;
+    reactor_del(&p->watch, p->fd);
+    reactor_del(&p->timer_watch, p->timer_fd);
+    if (p->timer_fd >= 0) close(p->timer_fd);
+    p->timer_fd = -1;
+    p->fd       = -1;
+    return fd;
+}
+
+/* Header out and into the client table, once its hello is in.  False
+   while a format switch holds format_lock: `p` stays pending.        */
+static bool welcome_receiver(PendingHello *p)
+{
+    /* The format must not change between header and first chunk */
+    if (pthread_mutex_trylock(&ctx.format_lock) != 0)
+        return false;
+    if (atomic_load(&ctx.park_req)) {
+        /* A failed switch, waiting for streaming_stop */
+        pthread_mutex_unlock(&ctx.format_lock);
+        return false;
+    }
+
+    /* Only this thread refills the slot, so its fields stay put */
+    const char *client_ip = p->ip;
+    int         client_fd = pending_release(p);
+
+    PeerCaps caps;
+    int version = protocol_parse_hello(p->hello, p->len, &caps);
+    LOG_I("%s speaks stream v%d", client_ip, version);
+
+    int enc = choose_encoding(client_ip, version, &caps);
+    int rc  = -1;
+    if (enc >= 0) {
+        AudioConfig cfg;
+        caps_encoding_config(&ctx.config, &ctx.encs[enc].wire, &cfg);
+
+        TransportInfo ti = ctx.transport;
+        ti.token = new_token();
+        ti.mux   = caps.known && (caps.flags & CAPS_MUX);
+        ti.resume_token = caps.known && (caps.flags & CAPS_RESUME) ? ctx.resume_token : 0;
+        ti.sync_delay_us = sync_delay_us(&caps);
+
+        if (protocol_write_header(client_fd, &cfg, &ti, version) < 0)
+            LOG_W("Failed to send header to %s", client_ip);
+        else
+            rc = add_client(client_fd, client_ip, ti.token, version, &caps, enc);
+    }
+    pthread_mutex_unlock(&ctx.format_lock);
+
+    if (rc < 0) {
+        close(client_fd);
+        return true;
+    }
+
+    char status[128];
+    snprintf(status, sizeof(status), "Streaming to %d receiver(s)",
+             atomic_load(&g_app.receiver_count));
+    ui_update_status(status);
+    return true;
+}
+
+/* Welcome `p`, or come back to it in WELCOME_RETRY_MS on its timer
+   alone; whatever else it sends waits until it is welcomed          */
+static void welcome_or_retry(PendingHello *p)
+{
+    if (welcome_receiver(p)) return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = (long)WELCOME_RETRY_MS * 1000000L;
+
+    reactor_del(&p->watch, p->fd);
+    /* Re-arming also clears the expiry that brought us here */
+    if (timerfd_settime(p->timer_fd, 0, &its, NULL) < 0) {
+        LOG_E("Waiting to welcome %s: %s", p->ip, strerror(errno));
+        close(pending_release(p));
+    }
+}
+
+static void hello_input(void *arg, uint32_t events)
+{
+    (void)events;
+    PendingHello *p = arg;
+    if (p->fd < 0) return;
+
+    size_t want;
+    while (p->len < (want = protocol_hello_size(p->hello, p->len))) {
+        ssize_t n = recv(p->fd, p->hello + p->len, want - p->len, MSG_DONTWAIT);
+        if (n > 0) {
+            p->len += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        LOG_I("%s left before its hello", p->ip);
+        close(pending_release(p));
+        return;
+    }
+
+    welcome_or_retry(p);
+}
+
+/* Quiet for HELLO_WAIT_MS: v2, or whatever part of a hello came.  Also
+   the retry of a welcome a format switch held up.                     */
+static void hello_timeout(void *arg, uint32_t events)
+{
+    (void)events;
+    PendingHello *p = arg;
+    if (p->fd < 0) return;
+
+    welcome_or_retry(p);
+}
+
+static void accept_receivers(void *arg, uint32_t events)
+{
+    (void)arg;
+    (void)events;
+
+    for (;;) {
+        char client_ip[INET_ADDRSTRLEN] = {0};
+        int client_fd = net_accept_client(ctx.server_fd, client_ip, sizeof(client_ip));
+        if (client_fd < 0) return;
+
+        /* Capture gave up: the stream is over */
+        if (!atomic_load(&g_app.is_streaming)) {
+            close(client_fd);
+            continue;
+        }
+
+        PendingHello *p = NULL;
+        for (int i = 0; i < MAX_PENDING_HELLOS && !p; i++)
+            if (ctx.pending[i].fd < 0) p = &ctx.pending[i];
+        if (!p) {
+            LOG_W("Too many receivers still to say hello, rejecting %s", client_ip);
+            close(client_fd);
+            continue;
+        }
+
+        net_set_audio_opts(client_fd, ctx.config.socket_buffer_size);
+
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec  = HELLO_WAIT_MS / 1000;
+        its.it_value.tv_nsec = (long)(HELLO_WAIT_MS % 1000) * 1000000L;
+
+        p->fd       = client_fd;
+        p->len      = 0;
+        p->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        snprintf(p->ip, sizeof(p->ip), "%s", client_ip);
+        if (p->timer_fd < 0 || timerfd_settime(p->timer_fd, 0, &its, NULL) < 0 ||
+            reactor_add(&p->timer_watch, p->timer_fd, EPOLLIN, hello_timeout, p) < 0 ||
+            reactor_add(&p->watch, client_fd, EPOLLIN | EPOLLRDHUP, hello_input, p) < 0) {
+            LOG_E("Waiting for the hello of %s: %s", client_ip, strerror(errno));
+            close(pending_release(p));
+        }
+    }
+}
+
+/* After reactor_stop() */
+static void drop_pending(void)
+{
+    for (int i = 0; i < MAX_PENDING_HELLOS; i++)
+        if (ctx.pending[i].fd >= 0)
+            close(pending_release(&ctx.pending[i]));
+}
+
+/* ---- Thread placement ---- */
+
+/* Best effort: keep capture and send on their own cores */
+static void pin_current_thread(const char *name, int cpu)
+{
+    if (cpu < 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0)
+        LOG_W("Pinning %s thread to CPU %d: %s", name, cpu, strerror(rc));
+    else
+        LOG_I("%s thread pinned to CPU %d", name, cpu);
+}
+
+static void choose_cpus(void)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ctx.capture_cpu = g_app.capture_cpu;
+    ctx.send_cpu    = g_app.send_cpu;
+
+    /* Auto: the two highest CPUs, which the desktop tends to use least */
+    if (ctx.capture_cpu == CPU_AUTO)
+        ctx.capture_cpu = ncpu >= 2 ? (int)ncpu - 1 : CPU_NONE;
+    if (ctx.send_cpu == CPU_AUTO)
+        ctx.send_cpu = ncpu >= 2 ? (int)ncpu - 2 : CPU_NONE;
+}
+
+/* ---- Encoding, on the send thread ---- */
+
+/* What every chunk is coded as, short of adaptive choices and DTX */
+static int session_codec(void)
+{
+    return ctx.config.use_opus ? FRAME_CODEC_OPUS
+         : ctx.config.use_flac ? FRAME_CODEC_LOSSLESS : FRAME_CODEC_PCM;
+}
+
+/*
+ * Put one chunk of PCM into encoding `e` at `out`, and say in `*codec`
+ * what it went out as.  Returns the wire length, 0 for a silence marker
+ * with nothing to code, or -1.
+ */
+static ssize_t produce_chunk(StreamEncoding *e, const uint8_t *pcm, size_t len,
+                             bool silent, bool legacy, uint8_t *out, size_t cap,
+                             int *codec)
+{
+    *codec = e->wire.codec;
+
+    /* v2 receivers play every chunk, and only in the session codec */
+    if (*codec == FRAME_CODEC_LOSSLESS && e->adaptive && !legacy && !silent &&
+        lossless_estimate_bits(&ctx.config, pcm, len) > e->adapt_max_bits) {
+        *codec = FRAME_CODEC_PCM;
+        e->pcm_chunks++;
+    }
+
+    /* Only the marker goes out: nothing to code */
+    if (silent && !legacy && *codec != FRAME_CODEC_OPUS)
+        return 0;
+
+    ssize_t n;
+    if (*codec == FRAME_CODEC_OPUS) {
+        /* A dropped Opus chunk still advances the encoder; the
+           receiver conceals the gap like any other loss            */
+        n = opuscodec_encode(ctx.opus, pcm, len, out, cap);
+    } else if (*codec == FRAME_CODEC_LOSSLESS) {
+        /* Threads and scratch come with the first chunk coded, so PCM
+           sessions run none until a receiver takes the lossless
+           alternate.  No pool just means coding on this thread alone. */
+        if (!ctx.pool) {
+            ctx.pool = workpool_create(workpool_auto_helpers(g_app.codec_threads));
+            LOG_I("Lossless encode on %d thread(s)", workpool_size(ctx.pool));
+        }
+        n = lossless_encode(&ctx.config, pcm, len, out, cap, ctx.pool);
+    } else if (e->wire.packed24) {
+        pcm_pack24(pcm, out, len / 4);
+        n = (ssize_t)(len / 4 * 3);
+    } else {
+        memcpy(out, pcm, len);
+        n = (ssize_t)len;
+    }
+    if (n >= 0) {
+        e->chunks++;
+        e->bytes += n;
+    }
+    return n;
+}
+
+static uint8_t *stage_buf(int i)
+{
+    return ctx.stage + (size_t)i * (size_t)ctx.config.chunk_size;
+}
+
+/*
+ * Turn a captured chunk into the slot for the next sequence number:
+ * DTX, the session encoding unless capture read it there already, and
+ * the second encoding while anybody takes it.  Sets `*len` to the
+ * session encoding's length; NULL if the chunk is lost.
+ */
+static ChunkSlot *encode_chunk(const ChunkDesc *d, size_t *len)
+{
+    uint64_t seq    = chunk_ring_head(&ctx.ring);
+    bool     direct = d->stage < 0;
+
+    if (direct && d->seq != seq) {
+        LOG_E("Pipe out of order: got %llu, head %llu",
+              (unsigned long long)d->seq, (unsigned long long)seq);
+        return NULL;
+    }
+    /* Capture already holds a direct chunk's slot, so this cannot fail */
+    ChunkSlot *slot = chunk_ring_acquire(&ctx.ring, seq);
+    if (!slot) return NULL;    /* ring overrun: chunk lost for everyone */
+
+    const uint8_t *pcm    = direct ? slot->data : stage_buf(d->stage);
+    bool           silent = g_app.dtx && dtx_update(&ctx.dtx, pcm, d->len);
+    bool           legacy = atomic_load(&ctx.legacy_clients) > 0;
+    int            codec  = session_codec();
+
+    *len = d->len;
+    if (!direct) {
+        ssize_t n = produce_chunk(&ctx.encs[0], pcm, d->len, silent, legacy,
+                                  slot->data, ctx.ring.slot_size, &codec);
+        if (n < 0) {
+            LOG_W("Chunk encode failed");
+            return NULL;
+        }
+        if (n > 0) {
+            ctx.coded_in  += (int64_t)d->len;
+            ctx.coded_out += n;
+        }
+        *len = (size_t)n;
+    }
+
+    /* The second encoding only costs while someone takes it, or may
+       come back for a replay */
+    slot->has_alt = false;
+    if (ctx.nencs > 1 && (atomic_load(&ctx.encs[1].clients) > 0 ||
+                          d->capture_ns < atomic_load(&ctx.encs[1].hold_until_ns))) {
+        int     alt_codec;
+        ssize_t n = produce_chunk(&ctx.encs[1], pcm, d->len, silent, legacy,
+                                  slot->alt, ctx.ring.alt_size, &alt_codec);
+        if (n >= 0) {
+            slot->alt_len   = (size_t)n;
+            slot->alt_codec = (uint8_t)alt_codec;
+            slot->has_alt   = true;
+        }
+    }
+
+    /* Silent chunks keep their data wherever a v2 receiver may play it */
+    slot->silent = silent;
+    slot->codec  = (uint8_t)codec;
+    ctx.chunks++;
+    if (silent) ctx.silent_chunks++;
+
+    /* A silent run goes out as one marker with the chunk that ends it:
+       the first audio after it, or its run_max'th chunk.  A run cut
+       short by a format switch is concealed as a loss: zeros as well. */
+    slot->run_chunks = 0;
+    if (silent && ctx.run_chunks++ == 0)
+        ctx.run_seq = seq;
+    if (ctx.run_chunks > 0 && (!silent || ctx.run_chunks >= ctx.dtx.run_max)) {
+        slot->run_seq    = ctx.run_seq;
+        slot->run_chunks = ctx.run_chunks;
+        ctx.run_chunks   = 0;
+        ctx.markers++;
+    }
+    return slot;
+}
+
+/*
+ * A v2 receiver came in between encode_chunk() and publishing a silent
+ * chunk that was left uncoded: it has no marker and plays every chunk,
+ * so code it after all, in whichever encoding it may take.  Staged PCM
+ * is still there: capture cannot reuse it before the next descriptor.
+ */
+static bool needs_legacy_code(const ChunkSlot *slot, size_t len)
+{
+    return len == 0 || (slot->has_alt && slot->alt_len == 0);
+}
+
+static void code_for_legacy(const ChunkDesc *d, ChunkSlot *slot, size_t *len)
+{
+    const uint8_t *pcm = d->stage < 0 ? slot->data : stage_buf(d->stage);
+    int            codec;
+    ssize_t        n;
+
+    if (*len == 0) {
+        n = produce_chunk(&ctx.encs[0], pcm, d->len, true, true,
+                          slot->data, ctx.ring.slot_size, &codec);
+        if (n > 0) {
+            ctx.coded_in  += (int64_t)d->len;
+            ctx.coded_out += n;
+            slot->codec    = (uint8_t)codec;
+            *len           = (size_t)n;
+        }
+    }
+    if (slot->has_alt && slot->alt_len == 0) {
+        n = produce_chunk(&ctx.encs[1], pcm, d->len, true, true,
+                          slot->alt, ctx.ring.alt_size, &codec);
+        if (n > 0) {
+            slot->alt_codec = (uint8_t)codec;
+            slot->alt_len   = (size_t)n;
+        }
+    }
+    if (needs_legacy_code(slot, *len))
+        LOG_W("Chunk encode failed; v2 receivers skip a silent chunk");
+}
+
+/* ---- Capture thread: PulseAudio -> ring slot or staging buffer -> pipe ---- */
+
+/*
+ * Only PulseAudio and the pipe are touched here.  PCM chunks are read
+ * straight into the next ring slot; anything to be coded or packed is
+ * read into a staging buffer for the send thread to encode.  Either way
+ * the chunk goes over as a descriptor, so neither network stalls nor
+ * the encoder can delay pa_simple_read.
+ */
+static void *stream_thread_func(void *arg)
+{
+    (void)arg;
+    LOG_I("Stream thread started");
+    pin_current_thread("Capture", ctx.capture_cpu);
+
+    AudioCapture *cap = audio_capture_open(&ctx.config);
+    if (!cap) {
+        LOG_E("Failed to open audio capture");
+        ui_update_status("Audio capture failed");
+        atomic_store(&g_app.is_streaming, false);
+        return NULL;
+    }
+
+    /* Where a chunk goes when no slot is free */
+    uint8_t *scratch = malloc((size_t)ctx.config.chunk_size);
+    if (!scratch) {
+        LOG_E("Out of memory for capture");
+        audio_capture_close(cap);
+        atomic_store(&g_app.is_streaming, false);
+        return NULL;
+    }
+
+    bool     staged   = ctx.stage != NULL;
+    int      stage    = 0;
+    uint64_t fill_seq = chunk_ring_head(&ctx.ring);
+
+    while (atomic_load(&g_app.is_streaming) && !atomic_load(&ctx.capture_stop)) {
+        ChunkSlot *slot = staged ? NULL : chunk_ring_acquire(&ctx.ring, fill_seq);
+        uint8_t   *dst  = staged ? stage_buf(stage) : slot ? slot->data : scratch;
+
+        int64_t t0 = current_time_ns();
+        int     rd = audio_capture_read(cap, dst, (size_t)ctx.config.chunk_size);
+        hist_record(hist_stage(HIST_CAPTURE_READ), current_time_ns() - t0);
+        if (rd <= 0) {
+            if (atomic_load(&g_app.is_streaming))
+                LOG_W("Capture read error");
+            break;
+        }
+
+        if (!staged && !slot) continue;   /* ring overrun: chunk lost for everyone */
+
+        ChunkDesc d = {
+            .seq        = fill_seq,
+            .len        = (size_t)rd,
+            .capture_ns = current_time_ns(),
+            .stage      = staged ? stage : -1,
+        };
+        if (!spsc_push(&ctx.pipe, &d))
+            continue;          /* pipe full: the buffer is refilled next time */
+        if (staged)
+            stage = (stage + 1) % ctx.nstage;
+        else
+            fill_seq++;
+
+        uint64_t one = 1;
+        if (write(ctx.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            LOG_W("wake send thread: %s", strerror(errno));
+    }
+
+    free(scratch);
+    audio_capture_close(cap);
+
+    LOG_I("Stream thread stopped");
+    return NULL;
+}
+
+/* ---- Multiplexed ping and chat ---- */
+
+/* Control frames a slow receiver may have waiting before more are dropped */
+#define CTRL_QUEUE_MAX (64 * 1024)
+
+/* Queue a FRAME_CONTROL for `c`.  Caller holds clients_lock. */
+static void queue_control(ClientConn *c, const uint8_t *msg, size_t len)
+{
+    if (c->ctrl_len + FRAME_HDR_SIZE + len > CTRL_QUEUE_MAX) {
+        LOG_D("%s: control queue full, message dropped", c->ip);
+        return;
+    }
+    uint8_t *q = realloc(c->ctrl, c->ctrl_len + FRAME_HDR_SIZE + len);
+    if (!q) return;
+    c->ctrl      = q;
+    c->ctrl_len += protocol_build_control(q + c->ctrl_len, msg, len);
+}
+
+/*
+ * Queued control frames may only go out between chunks: move them
+ * behind the spill, which always ends on a chunk boundary, once the
+ * chunk being written is done.  Returns true while they still wait.
+ */
+static bool take_control(ClientConn *c)
+{
+    bool waiting = false;
+
+    pthread_mutex_lock(&ctx.clients_lock);
+    /* The sendmsg this is for comes next: stamp the clock answer now */
+    if (c->clock_due && c->offset == 0) {
+        uint8_t resp[CLOCK_RESPONSE_SIZE];
+        ping_clock_response(resp, c->clock_req, c->clock_t2);
+        queue_control(c, resp, sizeof(resp));
+        c->clock_due = false;
+    }
+
+    if ((c->ctrl_len > 0 || c->clock_due) && c->offset > 0) {
+        waiting = true;
+    } else if (c->ctrl_len > 0 && !c->spill) {
+        c->spill     = c->ctrl;
+        c->spill_len = c->ctrl_len;
+        c->spill_off = 0;
+        c->ctrl      = NULL;
+        c->ctrl_len  = 0;
+    } else if (c->ctrl_len > 0) {
+        size_t   left = c->spill_len - c->spill_off;
+        uint8_t *sp   = malloc(left + c->ctrl_len);
+        if (sp) {
+            memcpy(sp, c->spill + c->spill_off, left);
+            memcpy(sp + left, c->ctrl, c->ctrl_len);
+            free(c->spill);
+            c->spill     = sp;
+            c->spill_len = left + c->ctrl_len;
+            c->spill_off = 0;
+            c->ctrl_len  = 0;
+        }
+    }
+    pthread_mutex_unlock(&ctx.clients_lock);
+    return waiting;
+}
+
+/* Chat for multiplexed receivers, from chat.c on any thread */
+static void relay_chat(int except, const char *sender, const char *message)
+{
+    uint8_t msg[CHAT_WIRE_MAX];
+    size_t  len    = chat_encode(msg, sender, message);
+    bool    queued = false;
+
+    pthread_mutex_lock(&ctx.clients_lock);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (i == except || !atomic_load(&c->connected) || !c->mux) continue;
+        queue_control(c, msg, len);
+        queued = true;
+    }
+    pthread_mutex_unlock(&ctx.clients_lock);
+
+    uint64_t one = 1;
+    if (queued && write(ctx.wake_fd, &one, sizeof(one)) < 0)
+        LOG_W("wake send thread: %s", strerror(errno));
+}
+
+/* ---- Receiver health ---- */
+
+static void apply_report(ClientConn *c, const ReceiverReport *r)
+{
+    atomic_store(&c->tel.latency_ms, (int64_t)(r->latency_us / 1000));
+    atomic_store(&c->tel.probe_rtt_us, (int64_t)r->rtt_us);
+    if (r->probe_p99_us > 0) {
+        atomic_store(&c->tel.probe_p50_us, (int64_t)r->probe_p50_us);
+        atomic_store(&c->tel.probe_p99_us, (int64_t)r->probe_p99_us);
+        atomic_store(&c->tel.probe_jitter_us, (int64_t)r->probe_jitter_us);
+    }
+    atomic_store(&c->tel.underruns, (int64_t)r->underruns);
+    atomic_store(&c->tel.lost, (int64_t)r->lost);
+    atomic_store(&c->tel.reconnects, (int64_t)r->reconnects);
+}
+
+/* Receiver a ping connection reports for.  Caller holds clients_lock. */
+static ClientConn *find_reporter(const char *ip, int port)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (atomic_load(&c->connected) && strcmp(c->ip, ip) == 0 &&
+            (port == 0 || c->port == port))
+            return c;
+    }
+    return NULL;
+}
+
+/* Kernel's view of every TCP connection, once a second from the send thread */
+static void sample_sockets(void)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+        int q   = net_queued_bytes(c->fd, true);
+        int rtt = net_tcp_rtt_us(c->fd);
+        if (q >= 0)   atomic_store(&c->tel.queued_bytes, (int64_t)q);
+        if (rtt >= 0) atomic_store(&c->tel.rtt_us, (int64_t)rtt);
+    }
+}
+
+/* The receiver health table, one line per receiver */
+static void log_receivers(void)
+{
+    static ReceiverStats rows[MAX_CLIENTS];
+    int n = streaming_get_receiver_stats(rows, MAX_CLIENTS);
+
+    for (int i = 0; i < n; i++) {
+        const ReceiverStats *r = &rows[i];
+        LOG_I("Receiver %s:%d: v%d %s%s, up %llds, latency %lld ms, probe rtt %lld us "
+              "(p50 %lld / p99 %lld / jitter %lld us), tcp rtt %lld us, queued %lld B / %lld chunks, sent %lld B, "
+              "send p99 %lld us max %lld us, dropped %lld, retx %ld, "
+              "underruns %lld, lost %lld, reconnects %lld",
+              r->ip, r->port, r->version, r->encoding, r->mux ? " mux" : "",
+              (long long)(r->connected_ms / 1000), (long long)r->latency_ms,
+              (long long)r->probe_rtt_us, (long long)r->probe_p50_us,
+              (long long)r->probe_p99_us, (long long)r->probe_jitter_us,
+              (long long)r->rtt_us,
+              (long long)r->queued_bytes, (long long)r->queue_chunks,
+              (long long)r->bytes_sent, (long long)r->send_p99_us,
+              (long long)r->send_max_us, (long long)r->dropped_chunks,
+              r->retransmits, (long long)r->underruns, (long long)r->lost,
+              (long long)r->reconnects);
+    }
+}
+
+/* Tails of the hot paths, each receiver's sends and all of them merged,
+   then the receiver table.  Send thread, or anyone once it has stopped. */
+static void dump_histograms(void)
+{
+    static Histogram all;
+
+    hist_stage_log(HIST_CAPTURE_READ);
+    hist_reset(&all);
+    hist_merge(&all, &ctx.send_left);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+
+        char name[64];
+        snprintf(name, sizeof(name), "Send to %s:%d", c->ip, c->port);
+        hist_log(name, &c->tel.send_ns);
+        hist_merge(&all, &c->tel.send_ns);
+    }
+    hist_log("Send, all receivers", &all);
+    log_receivers();
+}
+
+static void reset_histograms(void)
+{
+    hist_reset(hist_stage(HIST_CAPTURE_READ));
+    hist_reset(&ctx.send_left);
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        hist_reset(&ctx.clients[i].tel.send_ns);
+}
+
+static int handle_control(int idx, const uint8_t *msg, size_t len)
+{
+    ClientConn *c = &ctx.clients[idx];
+
+    if (len == 9 && msg[0] == PING_REQUEST) {
+        uint8_t resp[9];
+        resp[0] = PING_RESPONSE;
+        memcpy(resp + 1, msg + 1, 8);
+        pthread_mutex_lock(&ctx.clients_lock);
+        queue_control(c, resp, sizeof(resp));
+        pthread_mutex_unlock(&ctx.clients_lock);
+    } else if (len == CLOCK_REQUEST_SIZE && msg[0] == CLOCK_REQUEST) {
+        /* Answered by take_control(); a newer probe replaces an older one */
+        pthread_mutex_lock(&ctx.clients_lock);
+        memcpy(c->clock_req, msg, CLOCK_REQUEST_SIZE);
+        c->clock_t2  = current_time_ns();
+        c->clock_due = true;
+        pthread_mutex_unlock(&ctx.clients_lock);
+    } else if (len == 9 && msg[0] == LATENCY_REPORT) {
+        atomic_store(&c->tel.latency_ms, (int64_t)read_be64(msg + 1));
+        show_worst_latency();
+    } else if (len == RECEIVER_REPORT_SIZE && msg[0] == RECEIVER_REPORT) {
+        ReceiverReport r;
+        protocol_parse_report(msg + 1, &r);
+        apply_report(c, &r);
+        show_worst_latency();
+    } else if (len > 0 && msg[0] == CHAT_MSG) {
+        char sender[CHAT_MAX_SENDER];
+        char message[CHAT_MAX_MSG];
+        if (chat_decode(msg, len, sender, sizeof(sender), message, sizeof(message)) < 0)
+            return -1;
+        chat_server_deliver(idx, sender, message);
+    } else {
+        LOG_W("%s: unknown control message", c->ip);
+    }
+    return 0;
+}
+
+/* Collect a multiplexed receiver's frames; -1 on EOF or garbage */
+static int read_control(int idx)
+{
+    ClientConn *c = &ctx.clients[idx];
+
+    for (;;) {
+        size_t want = FRAME_HDR_SIZE;
+        FrameHeader f;
+        if (c->in_len >= FRAME_HDR_SIZE) {
+            if (protocol_parse_frame(c->in, &f) < 0 || !(f.flags & FRAME_CONTROL) ||
+                f.len > CHAT_WIRE_MAX) {
+                LOG_W("%s: bad frame on the audio connection", c->ip);
+                return -1;
+            }
+            want += f.len;
+        }
+        /* A whole frame; one with nothing in it has nothing to handle */
+        if (c->in_len == want && c->in_len >= FRAME_HDR_SIZE) {
+            c->in_len = 0;
+            if (want > FRAME_HDR_SIZE &&
+                handle_control(idx, c->in + FRAME_HDR_SIZE, want - FRAME_HDR_SIZE) < 0)
+                return -1;
+            continue;
+        }
+
+        ssize_t n = read(c->fd, c->in + c->in_len, want - c->in_len);
+        if (n > 0) {
+            c->in_len += (size_t)n;
+            continue;
+        }
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+}
+
+/* ---- Send thread: epoll-driven zero-copy fan-out ---- */
+
+#define SEND_IOV_MAX 64
+
+/* Move the cursor past `n` bytes that made it onto the socket */
+static void advance_cursor(ClientConn *c, size_t n)
+{
+    if (c->spill) {
+        size_t left = c->spill_len - c->spill_off;
+        if (n < left) {
+            c->spill_off += n;
+            return;
+        }
+        n -= left;
+        free(c->spill);
+        c->spill = NULL;
+    }
+
+    while (n > 0) {
+        ChunkSlot *slot = chunk_ring_get(&ctx.ring, c->next_seq);
+        size_t     left = chunk_wire_len(c, slot) - c->offset;
+        if (n < left) {
+            c->offset += n;
+            return;
+        }
+        n -= left;
+        chunk_ring_release(slot);
+        c->next_seq++;
+        c->offset = 0;
+    }
+}
+
+/* Write as much as the socket accepts straight from the ring slots.
+   Returns -1 on a dead socket.                                        */
+static int flush_client(ClientConn *c)
+{
+    for (;;) {
+        struct iovec iov[SEND_IOV_MAX];
+        int      niov = 0;
+        uint64_t head = ctx.transport.mode == TRANSPORT_TCP ? chunk_ring_head(&ctx.ring)
+                                                             : c->next_seq;
+
+        /* Finish the chunk under way first if control frames wait on it */
+        if (c->mux && take_control(c) && head > c->next_seq + 1)
+            head = c->next_seq + 1;
+
+        /* Chunks with nothing on the wire for this client */
+        while (c->offset == 0 && c->next_seq < head) {
+            ChunkSlot *slot = chunk_ring_get(&ctx.ring, c->next_seq);
+            if (chunk_wire_len(c, slot) > 0) break;
+            chunk_ring_release(slot);
+            c->next_seq++;
+        }
+
+        if (c->spill) {
+            iov[niov].iov_base = c->spill + c->spill_off;
+            iov[niov].iov_len  = c->spill_len - c->spill_off;
+            niov++;
+        }
+        for (uint64_t seq = c->next_seq; seq < head && niov + CHUNK_IOV_MAX <= SEND_IOV_MAX; seq++) {
+            ChunkSlot *slot  = chunk_ring_get(&ctx.ring, seq);
+            int        first = niov;
+            niov += chunk_iov(c, seq, slot, iov + niov);
+
+            /* Trim what already went out of the partly sent chunk */
+            size_t skip = (seq == c->next_seq) ? c->offset : 0;
+            while (skip > 0) {
+                if (skip >= iov[first].iov_len) {
+                    skip -= iov[first].iov_len;
+                    memmove(&iov[first], &iov[first + 1],
+                            (size_t)(niov - first - 1) * sizeof(iov[0]));
+                    niov--;
+                } else {
+                    iov[first].iov_base = (uint8_t *)iov[first].iov_base + skip;
+                    iov[first].iov_len -= skip;
+                    skip = 0;
+                }
+            }
+        }
+        if (niov == 0) return 0;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = (size_t)niov;
+
+        int64_t t0 = current_time_ns();
+        ssize_t n  = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        hist_record(&c->tel.send_ns, current_time_ns() - t0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->blocked = true;
+                return 0;
+            }
+            return -1;
+        }
+
+        atomic_fetch_add(&g_app.bytes_sent_this_second, (int64_t)n);
+        atomic_fetch_add(&g_app.total_bytes_sent, (int64_t)n);
+        atomic_fetch_add(&c->tel.bytes_sent, (int64_t)n);
+        advance_cursor(c, (size_t)n);
+    }
+}
+
+/* One chunk as datagrams, after the marker of the silent run it ends.
+   A silent chunk inside a run sends nothing.                          */
+static ssize_t send_media(const struct sockaddr_in *dsts, int ndst,
+                          const ChunkSlot *slot, uint64_t seq)
+{
+    uint64_t fpb  = (uint64_t)ctx.config.frames_per_buffer;
+    ssize_t  sent = 0;
+
+    if (slot->run_chunks > 0) {
+        ssize_t n = media_send_silence(&ctx.media, dsts, ndst,
+                                       (uint32_t)(fpb * (uint64_t)slot->run_chunks),
+                                       (uint32_t)slot->run_chunks,
+                                       (uint32_t)slot->run_seq,
+                                       (uint32_t)(slot->run_seq * fpb));
+        if (n > 0) sent += n;
+    }
+    if (slot->silent) return sent;
+
+    ssize_t n = media_send_chunk(&ctx.media, dsts, ndst, slot->data, slot->len,
+                                 (uint32_t)seq, (uint32_t)(seq * fpb), slot->codec);
+    if (n < 0) return sent > 0 ? sent : -1;
+    return sent + n;
+}
+
+/* Multicast: the chunk goes out once for the whole LAN, straight from
+   its slot, and nobody keeps a reference afterwards.  Called without
+   clients_lock: the slot stays put until capture comes round again,
+   and a full socket buffer must not hold up accept or control.        */
+static void send_mcast(uint64_t seq)
+{
+    ChunkSlot *slot = chunk_ring_get(&ctx.ring, seq);
+    if (!slot) return;
+
+    ssize_t n = send_media(&ctx.mcast_dst, 1, slot, seq);
+    if (n < 0) return;
+
+    atomic_fetch_add(&g_app.bytes_sent_this_second, (int64_t)n);
+    atomic_fetch_add(&g_app.total_bytes_sent, (int64_t)n);
+    /* Counted against every receiver: each one gets all of it */
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        if (atomic_load(&ctx.clients[i].connected))
+            atomic_fetch_add(&ctx.clients[i].tel.bytes_sent, (int64_t)n);
+}
+
+/* Unicast destinations of one chunk, gathered under clients_lock */
+typedef struct {
+    struct sockaddr_in addr[MAX_CLIENTS];
+    ClientConn        *to[MAX_CLIENTS];
+    int                n;
+} UnicastDsts;
+
+/* Every receiver that has said HELLO.  Caller holds clients_lock. */
+static void unicast_dsts(UnicastDsts *d)
+{
+    d->n = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (atomic_load(&c->connected) && c->udp_ready) {
+            d->to[d->n]     = c;
+            d->addr[d->n++] = c->udp_addr;
+        }
+    }
+}
+
+/* Unicast: one copy per receiver in `d`.  Called without clients_lock;
+   the retention window's reference keeps the slot.  A receiver that
+   left meanwhile only gets its byte count bumped.                     */
+static void send_unicast(uint64_t seq, const UnicastDsts *d)
+{
+    ctx.pkt_base[seq % (uint64_t)ctx.ring.nslots] = ctx.media.next_seq;
+    if (d->n == 0) return;
+
+    ChunkSlot *slot = chunk_ring_get(&ctx.ring, seq);
+    ssize_t    n    = send_media(d->addr, d->n, slot, seq);
+    if (n < 0) return;
+
+    atomic_fetch_add(&g_app.bytes_sent_this_second, (int64_t)n * d->n);
+    atomic_fetch_add(&g_app.total_bytes_sent, (int64_t)n * d->n);
+    for (int i = 0; i < d->n; i++)
+        atomic_fetch_add(&d->to[i]->tel.bytes_sent, (int64_t)n);
+}
+
+/* Unicast: let go of chunks too old to be worth resending */
+static void trim_retention(void)
+{
+    uint64_t head    = chunk_ring_head(&ctx.ring);
+    uint64_t max_lag = ring_max_lag();
+    int64_t  cutoff  = current_time_ns() - (int64_t)UDP_RETAIN_MS * 1000000;
+
+    while (ctx.retain_seq < head) {
+        ChunkSlot *slot = chunk_ring_get(&ctx.ring, ctx.retain_seq);
+        if (head - ctx.retain_seq <= max_lag && slot->capture_ns > cutoff)
+            break;
+        chunk_ring_release(slot);
+        ctx.retain_seq++;
+    }
+}
+
+/* Chunk headers, built once and shared by every client that needs them */
+static void write_frame_hdr(uint64_t seq, const ChunkSlot *slot, size_t len,
+                            int64_t capture_ns)
+{
+    /* Capture always hands over whole chunks */
+    FrameHeader f = {
+        .flags      = slot->silent ? FRAME_SILENCE : 0,
+        .codec      = slot->codec,
+        .seq        = (uint32_t)seq,
+        .ts_frames  = seq * (uint64_t)ctx.config.frames_per_buffer,
+        .capture_ns = capture_ns,
+        .len        = slot->silent ? 0 : (uint32_t)len,
+        .frames     = (uint32_t)ctx.config.frames_per_buffer,
+    };
+    protocol_write_frame(frame_hdr(seq, 0), &f);
+
+    if (slot->has_alt) {
+        f.codec = slot->alt_codec;
+        f.len   = slot->silent ? 0 : (uint32_t)slot->alt_len;
+        protocol_write_frame(frame_hdr(seq, 1), &f);
+    }
+
+    if (slot->run_chunks > 0) {
+        uint64_t back     = seq - slot->run_seq;
+        int64_t  chunk_ns = (int64_t)ctx.config.frames_per_buffer * 1000000000LL /
+                            ctx.config.sample_rate;
+        FrameHeader m = {
+            .flags      = FRAME_SILENCE,
+            .codec      = slot->codec,
+            .seq        = (uint32_t)slot->run_seq,
+            .ts_frames  = slot->run_seq * (uint64_t)ctx.config.frames_per_buffer,
+            .capture_ns = capture_ns - (int64_t)back * chunk_ns,
+            .frames     = (uint32_t)slot->run_chunks * (uint32_t)ctx.config.frames_per_buffer,
+        };
+        protocol_write_frame(frame_hdr(seq, ctx.nencs), &m);
+    }
+
+    if (ctx.len_prefixes)
+        write_be32(len_prefix(seq), (uint32_t)len);
 }
 
-static void remove_client(int idx)
-{
-    pthread_mutex_lock(&ctx.clients_lock);
-    if (atomic_load(&ctx.clients[idx].connected)) {
-        LOG_I("Client disconnected: %s", ctx.clients[idx].ip);
-        net_close(&ctx.clients[idx].fd);
-        atomic_store(&ctx.clients[idx].connected, false);
-        ctx.client_count--;
-        if (ctx.client_count < 0) ctx.client_count = 0;
-        atomic_store(&g_app.receiver_count, ctx.client_count);
+/*
+ * Encode and publish everything the capture thread has queued, in
+ * order.  Encoding happens outside clients_lock so accepting receivers
+ * and control traffic never wait for the codec.
+ */
+static void publish_pending(void)
+{
+    ChunkDesc d;
+    TransportMode mode = ctx.transport.mode;
+
+    while (spsc_pop(&ctx.pipe, &d)) {
+        size_t     len;
+        ChunkSlot *slot = encode_chunk(&d, &len);
+        if (!slot) continue;
+
+        uint64_t    seq    = chunk_ring_head(&ctx.ring);
+        bool        listen = false;
+        UnicastDsts dsts;
+
+        /* Datagrams go out once the lock is dropped.  v2 receivers only
+           join under the lock, so this is the last word on them.       */
+        pthread_mutex_lock(&ctx.clients_lock);
+        if (mode == TRANSPORT_TCP && needs_legacy_code(slot, len) &&
+            atomic_load(&ctx.legacy_clients) > 0) {
+            pthread_mutex_unlock(&ctx.clients_lock);
+            code_for_legacy(&d, slot, &len);
+            pthread_mutex_lock(&ctx.clients_lock);
+        }
+        switch (mode) {
+        case TRANSPORT_MULTICAST:
+            chunk_ring_publish(&ctx.ring, len, d.capture_ns, 0);
+            listen = ctx.client_count > 0;
+            break;
+        case TRANSPORT_UDP:
+            /* The one reference belongs to the retention window */
+            chunk_ring_publish(&ctx.ring, len, d.capture_ns, 1);
+            unicast_dsts(&dsts);
+            break;
+        case TRANSPORT_TCP:
+        default:
+            write_frame_hdr(seq, slot, len, d.capture_ns);
+            chunk_ring_publish(&ctx.ring, len, d.capture_ns, ctx.client_count);
+            break;
+        }
+        pthread_mutex_unlock(&ctx.clients_lock);
+
+        if (mode == TRANSPORT_MULTICAST && listen)
+            send_mcast(seq);
+        else if (mode == TRANSPORT_UDP)
+            send_unicast(seq, &dsts);
+    }
+    if (mode == TRANSPORT_UDP) {
+        pthread_mutex_lock(&ctx.clients_lock);
+        trim_retention();
+        pthread_mutex_unlock(&ctx.clients_lock);
+    }
+}
+
+/* Retained chunk that packet `pseq` belongs to, or -1.  Packet seqs
+   grow with chunk seqs, so a binary search over pkt_base will do.     */
+static int64_t chunk_for_packet(uint32_t pseq)
+{
+    uint64_t lo = ctx.retain_seq;
+    uint64_t hi = chunk_ring_head(&ctx.ring);
+    uint32_t n  = (uint32_t)ctx.ring.nslots;
+
+    if (lo >= hi) return -1;
+    if ((int32_t)(pseq - ctx.pkt_base[lo % n]) < 0) return -1;
+
+    /* Last chunk whose first packet is at or before pseq */
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if ((int32_t)(pseq - ctx.pkt_base[mid % n]) >= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return (int64_t)lo;
+}
+
+/* Serve one NACK: resend what is still retained and can still make it.
+   Caller holds clients_lock.                                          */
+static void resend_missing(ClientConn *c, const uint8_t *pkt, size_t len)
+{
+    MediaNack nk;
+    if (media_nack_read(pkt, len, &nk) < 0) return;
+
+    /* The NACK spent half a round trip getting here and the resend
+       needs the other half                                            */
+    if (nk.budget_ms <= nk.rtt_ms) {
+        c->retx_late += nk.count;
+        return;
+    }
+
+    for (int i = 0; i < nk.count; i++) {
+        int64_t seq = chunk_for_packet(nk.seqs[i]);
+        if (seq < 0) {
+            c->retx_late++;
+            continue;
+        }
+
+        ChunkSlot *slot = chunk_ring_get(&ctx.ring, (uint64_t)seq);
+        if (slot->silent) {
+            /* Markers take no packet seqs; should not map here */
+            c->retx_late++;
+            continue;
+        }
+        uint32_t   base = ctx.pkt_base[(uint64_t)seq % (uint64_t)ctx.ring.nslots];
+        uint32_t   ts   = (uint32_t)((uint64_t)seq * (uint64_t)ctx.config.frames_per_buffer);
+
+        if (media_resend(&ctx.media, &c->udp_addr, slot->data, slot->len,
+                         (uint32_t)seq, ts, slot->codec, base, nk.seqs[i]) == 0)
+            c->retransmits++;
     }
-    pthread_mutex_unlock(&ctx.clients_lock);
-    ui_update_receiver_count(ctx.client_count);
 }
 
-static void *accept_thread_func(void *arg)
+/* HELLOs and NACKs from unicast receivers */
+static void drain_udp_input(void)
 {
-    (void)arg;
-    LOG_I("Accept thread started");
+    uint8_t pkt[MEDIA_HDR_SIZE + MEDIA_PAYLOAD];
 
-    while (atomic_load(&g_app.is_streaming)) {
-        int ready = net_poll_read(ctx.server_fd, 1000);
-        if (ready <= 0) continue;
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t          flen = sizeof(from);
+        ssize_t n = recvfrom(ctx.udp_fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+                             (struct sockaddr *)&from, &flen);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (n < MEDIA_HDR_SIZE) continue;
 
-        char client_ip[INET_ADDRSTRLEN] = {0};
-        int client_fd = net_accept_client(ctx.server_fd, client_ip, sizeof(client_ip));
-        if (client_fd < 0) continue;
+        MediaHeader h;
+        media_header_read(pkt, &h);
 
-        net_set_audio_opts(client_fd, ctx.config.socket_buffer_size);
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
 
-        if (protocol_write_header(client_fd, &ctx.config) < 0) {
-            LOG_W("Failed to send header to %s", client_ip);
-            close(client_fd);
-            continue;
+        pthread_mutex_lock(&ctx.clients_lock);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            ClientConn *c = &ctx.clients[i];
+            if (!atomic_load(&c->connected) || c->token != h.seq) continue;
+            if (strcmp(c->ip, ip) != 0) break;
+
+            if (h.type == MEDIA_HELLO) {
+                if (!c->udp_ready)
+                    LOG_I("%s: UDP audio to port %d", c->ip, ntohs(from.sin_port));
+                c->udp_addr  = from;
+                c->udp_ready = true;
+            } else if (h.type == MEDIA_NACK && c->udp_ready) {
+                resend_missing(c, pkt, (size_t)n);
+            }
+            break;
         }
+        pthread_mutex_unlock(&ctx.clients_lock);
+    }
+}
 
-        add_client(client_fd, client_ip);
+/* Only multiplexed receivers talk on the audio socket; for the rest,
+   drain and watch for EOF                                             */
+static int drain_client_input(int idx)
+{
+    ClientConn *c = &ctx.clients[idx];
+    uint8_t     scratch[512];
 
-        char status[128];
-        snprintf(status, sizeof(status), "Streaming to %d receiver(s)",
-                 atomic_load(&g_app.receiver_count));
-        ui_update_status(status);
-    }
+    if (c->mux)
+        return read_control(idx);
 
-    LOG_I("Accept thread stopped");
-    return NULL;
+    for (;;) {
+        ssize_t n = read(c->fd, scratch, sizeof(scratch));
+        if (n > 0) continue;
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
 }
 
-static void *stream_thread_func(void *arg)
+/* TCP transport: bound every cursor, then push each receiver's backlog */
+static void fan_out_tcp(OverflowPolicy policy)
 {
-    (void)arg;
-    LOG_I("Stream thread started");
+    /* Keep every cursor within reach of the writer */
+    bool removed = false;
+    pthread_mutex_lock(&ctx.clients_lock);
+    uint64_t head = chunk_ring_head(&ctx.ring);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+        if (enforce_lag(c, head, policy) < 0) {
+            remove_client_locked(i);
+            removed = true;
+        }
+    }
+    pthread_mutex_unlock(&ctx.clients_lock);
+    if (removed)
+        ui_update_receiver_count(ctx.client_count);
 
-    AudioCapture *cap = audio_capture_open(&ctx.config);
-    if (!cap) {
-        LOG_E("Failed to open audio capture");
-        ui_update_status("Audio capture failed");
-        atomic_store(&g_app.is_streaming, false);
-        return NULL;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+        if (!c->blocked && flush_client(c) < 0) {
+            remove_client(i);
+            continue;
+        }
+        atomic_store(&c->tel.queue_chunks,
+                     (int64_t)(chunk_ring_head(&ctx.ring) - c->next_seq));
     }
+}
 
-    uint8_t *pcm_buf = malloc((size_t)ctx.config.chunk_size);
-    if (!pcm_buf) {
-        LOG_E("malloc failed");
-        audio_capture_close(cap);
-        atomic_store(&g_app.is_streaming, false);
-        return NULL;
+/* UDP transports: the TCP side only ever carries format changes */
+static void flush_spills(void)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected) || (!c->spill && !c->mux) || c->blocked)
+            continue;
+        if (flush_client(c) < 0)
+            remove_client(i);
     }
+}
 
-    atomic_store(&g_app.stream_start_time, current_time_ms());
-    atomic_store(&g_app.last_time_ms, current_time_ms());
-    atomic_store(&g_app.bytes_sent_this_second, 0);
-    atomic_store(&g_app.total_bytes_sent, 0);
+/* Format switch: put the last captured chunks into the ring, then sit
+   still until the pipeline has been rebuilt.  False when the session
+   stops instead: a failed switch leaves no pipeline to go back to.    */
+static bool park_send_thread(void)
+{
+    publish_pending();
+
+    pthread_mutex_lock(&ctx.park_lock);
+    ctx.parked = true;
+    pthread_cond_broadcast(&ctx.park_cond);
+    while (atomic_load(&ctx.park_req) && atomic_load(&g_app.is_streaming))
+        pthread_cond_wait(&ctx.park_cond, &ctx.park_lock);
+    ctx.parked = false;
+    pthread_mutex_unlock(&ctx.park_lock);
+    return !atomic_load(&ctx.park_req);
+}
+
+static void *send_thread_func(void *arg)
+{
+    (void)arg;
+    LOG_I("Send thread started");
+    pin_current_thread("Send", ctx.send_cpu);
+
+    struct epoll_event evs[MAX_CLIENTS + 2];
+    OverflowPolicy policy = g_app.overflow_policy;
 
     while (atomic_load(&g_app.is_streaming)) {
-        int rd = audio_capture_read(cap, pcm_buf, (size_t)ctx.config.chunk_size);
-        if (rd <= 0) {
-            if (atomic_load(&g_app.is_streaming))
-                LOG_W("Capture read error");
+        int n = epoll_wait(ctx.epoll_fd, evs, MAX_CLIENTS + 2, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_E("epoll_wait: %s", strerror(errno));
             break;
         }
 
-        int active = 0;
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (!atomic_load(&ctx.clients[i].connected)) continue;
-            active++;
+        for (int i = 0; i < n; i++) {
+            uint32_t id = evs[i].data.u32;
+
+            if (id == WAKE_ID) {
+                uint64_t v;
+                while (read(ctx.wake_fd, &v, sizeof(v)) > 0) {}
+                continue;
+            }
+            if (id == UDP_ID) {
+                drain_udp_input();
+                continue;
+            }
+
+            ClientConn *c = &ctx.clients[id];
+            if (!atomic_load(&c->connected)) continue;
 
-            ssize_t w = write_fully(ctx.clients[i].fd, pcm_buf, (size_t)rd);
-            if (w < 0) {
-                remove_client(i);
+            if (evs[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                remove_client((int)id);
+                continue;
             }
+            if ((evs[i].events & EPOLLIN) && drain_client_input((int)id) < 0) {
+                remove_client((int)id);
+                continue;
+            }
+            if (evs[i].events & EPOLLOUT)
+                c->blocked = false;
         }
 
-        if (active == 0) continue;
+        publish_pending();
+
+        if (ctx.transport.mode == TRANSPORT_TCP)
+            fan_out_tcp(policy);
+        else
+            flush_spills();
 
-        int64_t bytes = (int64_t)rd * active;
-        atomic_fetch_add(&g_app.bytes_sent_this_second, bytes);
-        atomic_fetch_add(&g_app.total_bytes_sent, bytes);
+        if (atomic_load(&ctx.park_req) && !park_send_thread())
+            break;
 
         int64_t now  = current_time_ms();
         int64_t diff = now - atomic_load(&g_app.last_time_ms);
@@ -135,40 +1737,517 @@ static void *stream_thread_func(void *arg)
             int64_t b = atomic_exchange(&g_app.bytes_sent_this_second, 0);
             int64_t kbps = (b * 8) / diff;
             atomic_store(&g_app.last_time_ms, now);
-            ui_update_stats(kbps,
-                            atomic_load(&g_app.total_bytes_sent),
-                            now - atomic_load(&g_app.stream_start_time));
+            sample_sockets();
+
+            int req = atomic_exchange(&g_app.hist_request, 0);
+            if (req) dump_histograms();
+            if (req & HIST_REQ_RESET) reset_histograms();
+            if (ctx.client_count > 0)
+                ui_update_stats(kbps,
+                                atomic_load(&g_app.total_bytes_sent),
+                                now - atomic_load(&g_app.stream_start_time));
         }
     }
 
-    free(pcm_buf);
-    audio_capture_close(cap);
-
-    LOG_I("Stream thread stopped");
+    LOG_I("Send thread stopped");
     return NULL;
 }
 
+/* ---- Session pipeline: format, encodings, ring, pipe ---- */
+
+static void init_encoding(StreamEncoding *e, WireEncoding w)
+{
+    memset(e, 0, sizeof(*e));
+    e->wire     = w;
+    e->adaptive = w.codec == FRAME_CODEC_LOSSLESS && g_app.adaptive_codec;
+    if (e->adaptive) {
+        int wire_bits = w.packed24 ? 24 : ctx.config.bytes_per_sample * 8;
+        e->adapt_max_bits = wire_bits * (1.0 - ADAPT_MIN_SAVING);
+    }
+    atomic_store(&e->clients, 0);
+    atomic_store(&e->hold_until_ns, 0);
+}
+
+/* Largest chunk in encoding `e` */
+static size_t encoding_max_chunk(const StreamEncoding *e)
+{
+    size_t pcm = e->wire.packed24 ? (size_t)ctx.config.chunk_size / 4 * 3
+                                  : (size_t)ctx.config.chunk_size;
+    size_t max = pcm;
+
+    if (e->wire.codec == FRAME_CODEC_OPUS)
+        max = OPUS_MAX_PACKET;
+    else if (e->wire.codec == FRAME_CODEC_LOSSLESS) {
+        max = lossless_max_encoded(&ctx.config);
+        if (e->adaptive && pcm > max) max = pcm;
+    }
+    return max;
+}
+
+static void pipeline_destroy(void)
+{
+    spsc_destroy(&ctx.pipe);
+    free(ctx.stage);
+    opuscodec_destroy(ctx.opus);
+    workpool_destroy(ctx.pool);
+    ctx.stage        = NULL;
+    ctx.opus         = NULL;
+    ctx.pool         = NULL;
+    free(ctx.frame_hdrs);
+    free(ctx.len_prefixes);
+    free(ctx.pkt_base);
+    ctx.frame_hdrs   = NULL;
+    ctx.len_prefixes = NULL;
+    ctx.pkt_base     = NULL;
+    chunk_ring_destroy(&ctx.ring);
+}
+
+/*
+ * Everything sized by the audio format, for `preset_index`.  The first
+ * chunk captured gets sequence number `first_seq`, so receivers see one
+ * numbering across format switches.  Needs ctx.transport.mode.
+ */
+static int pipeline_init(int preset_index, uint64_t first_seq)
+{
+    config_load_preset(&ctx.config, preset_index);
+    if (ctx.config.use_opus && !opuscodec_supported(&ctx.config)) {
+        LOG_E("Opus preset selected but not supported by this build");
+        ui_update_status("Opus not supported by this build");
+        return -1;
+    }
+    if (ctx.config.use_flac && !lossless_supported(&ctx.config)) {
+        LOG_E("Lossless preset needs integer audio of at most %d bits", LOSSLESS_MAX_BITS);
+        ui_update_status("Lossless does not support this format");
+        return -1;
+    }
+
+    bool adaptive = ctx.config.use_flac && g_app.adaptive_codec;
+    bool pack     = g_app.pack24 && pcm_pack24_applicable(&ctx.config);
+    /* Lossless sessions only send PCM chunks when adaptive */
+    ctx.config.packed24 = pack && (!ctx.config.use_flac || adaptive);
+    if (pack)
+        LOG_I("Packed 24-bit wire format (%s kernels)", pcm_pack24_impl());
+
+    /* The preset's encoding, and on TCP a fallback for receivers that
+       cannot take it: PCM next to a codec, plain PCM next to packed
+       (v2 among them), or lossless next to plain PCM                  */
+    init_encoding(&ctx.encs[0], (WireEncoding){ session_codec(), ctx.config.packed24 });
+    ctx.nencs = 1;
+    if (ctx.transport.mode == TRANSPORT_TCP) {
+        if (session_codec() != FRAME_CODEC_PCM)
+            init_encoding(&ctx.encs[ctx.nencs++],
+                          (WireEncoding){ FRAME_CODEC_PCM, pack });
+        else if (ctx.config.packed24)
+            init_encoding(&ctx.encs[ctx.nencs++],
+                          (WireEncoding){ FRAME_CODEC_PCM, false });
+        else if (lossless_supported(&ctx.config))
+            init_encoding(&ctx.encs[ctx.nencs++],
+                          (WireEncoding){ FRAME_CODEC_LOSSLESS,
+                                          ctx.config.packed24 && g_app.adaptive_codec });
+    }
+    for (int i = 0; i < ctx.nencs; i++) {
+        if (ctx.encs[i].adaptive)
+            LOG_I("Adaptive lossless: coding chunks estimated below %.1f bits/sample",
+                  ctx.encs[i].adapt_max_bits);
+    }
+    if (ctx.nencs > 1)
+        LOG_I("Offering %s as a fallback",
+              caps_encoding_name(&ctx.encs[1].wire));
+
+    /* Coded chunks vary in size; slots hold the worst case */
+    bool   coded     = ctx.config.use_flac || ctx.config.use_opus;
+    size_t slot_size = encoding_max_chunk(&ctx.encs[0]);
+    size_t alt_size  = ctx.nencs > 1 ? encoding_max_chunk(&ctx.encs[1]) : 0;
+
+    int nslots = (int)(RING_BYTES / slot_size);
+    if (nslots < RING_MIN_SLOTS) nslots = RING_MIN_SLOTS;
+    if (nslots > RING_MAX_SLOTS) nslots = RING_MAX_SLOTS;
+    if (chunk_ring_init(&ctx.ring, nslots, slot_size, alt_size) < 0) {
+        LOG_E("Chunk ring allocation failed (%d x %zu+%zu bytes)",
+              nslots, slot_size, alt_size);
+        ui_update_status("Out of memory");
+        return -1;
+    }
+    chunk_ring_start_at(&ctx.ring, first_seq);
+    LOG_I("Chunk ring: %d slots x %zu+%zu bytes", nslots, slot_size, alt_size);
+
+    ctx.frame_hdrs = malloc((size_t)nslots * (size_t)(ctx.nencs + 1) * FRAME_HDR_SIZE);
+    if (coded)
+        ctx.len_prefixes = malloc((size_t)nslots * 4);
+    if (ctx.transport.mode == TRANSPORT_UDP)
+        ctx.pkt_base = calloc((size_t)nslots, sizeof(uint32_t));
+
+    int pipe_depth = nslots / 4;
+    if (pipe_depth < PIPE_MIN_DEPTH) pipe_depth = PIPE_MIN_DEPTH;
+    if (pipe_depth > PIPE_MAX_DEPTH) pipe_depth = PIPE_MAX_DEPTH;
+
+    if (!ctx.frame_hdrs || (coded && !ctx.len_prefixes) ||
+        (ctx.transport.mode == TRANSPORT_UDP && !ctx.pkt_base) ||
+        spsc_init(&ctx.pipe, (uint32_t)pipe_depth) < 0) {
+        LOG_E("Pipeline allocation failed");
+        ui_update_status("Out of memory");
+        pipeline_destroy();
+        return -1;
+    }
+
+    /* Encoders, run by the send thread */
+    if (coded || ctx.config.packed24) {
+        ctx.nstage = spsc_capacity(&ctx.pipe) + 2;
+        ctx.stage  = malloc((size_t)ctx.nstage * (size_t)ctx.config.chunk_size);
+    }
+    if (ctx.config.use_opus)
+        ctx.opus = opuscodec_create_encoder(&ctx.config, g_app.opus_kbps);
+    if (((coded || ctx.config.packed24) && !ctx.stage) ||
+        (ctx.config.use_opus && !ctx.opus)) {
+        LOG_E("Encoder setup failed");
+        ui_update_status("Encoder setup failed");
+        pipeline_destroy();
+        return -1;
+    }
+    dtx_init(&ctx.dtx, &ctx.config, g_app.dtx_db, g_app.dtx_hangover_ms);
+
+    ctx.retain_seq    = first_seq;
+    ctx.coded_in      = 0;
+    ctx.coded_out     = 0;
+    ctx.chunks        = 0;
+    ctx.silent_chunks = 0;
+    ctx.markers       = 0;
+    ctx.run_chunks    = 0;
+    return 0;
+}
+
+static void log_pipeline_stats(void)
+{
+    PipelineStats ps;
+    streaming_get_pipeline_stats(&ps);
+    LOG_I("Pipeline: max occupancy %d/%d, %ld pipe overruns, %ld ring overruns",
+          ps.max_occupancy, ps.capacity, ps.overruns, ps.ring_overruns);
+
+    if (ctx.coded_in > 0)
+        LOG_I("%s: %.1f%% of PCM size (%lld -> %lld bytes)",
+              ctx.config.use_opus ? "Opus" :
+              ctx.config.use_flac ? "Lossless" : "Packed 24-bit",
+              100.0 * (double)ctx.coded_out / (double)ctx.coded_in,
+              (long long)ctx.coded_in, (long long)ctx.coded_out);
+    if (ctx.silent_chunks > 0)
+        LOG_I("DTX: %ld of %ld chunks sent as silence, in %ld markers",
+              ctx.silent_chunks, ctx.chunks, ctx.markers);
+    if (ctx.encs[0].adaptive)
+        LOG_I("Adaptive lossless: %ld of %ld chunks sent as PCM",
+              ctx.encs[0].pcm_chunks, ctx.chunks);
+    if (ctx.nencs > 1 && ctx.encs[1].chunks > 0)
+        LOG_I("Also sent as %s: %ld chunks, %lld bytes, %ld of them as PCM",
+              caps_encoding_name(&ctx.encs[1].wire), ctx.encs[1].chunks,
+              (long long)ctx.encs[1].bytes, ctx.encs[1].pcm_chunks);
+}
+
+/* ---- Live format switch ---- */
+
+
+/*
+ * Queue a FRAME_FORMAT_CHANGE for `c` behind what it still has to send,
+ * announcing its (re-chosen) encoding from chunk `first_seq` on.  Caller
+ * holds clients_lock.
+ */
+static int queue_format_change(ClientConn *c, uint64_t first_seq)
+{
+    uint8_t     frame[FRAME_HDR_SIZE + HEADER_MAX_SIZE];
+    AudioConfig cfg;
+    caps_encoding_config(&ctx.config, &ctx.encs[c->enc].wire, &cfg);
+
+    TransportInfo ti = ctx.transport;
+    ti.token = c->token;
+    ti.mux   = c->mux;
+    ti.resume_token = c->caps.flags & CAPS_RESUME ? ctx.resume_token : 0;
+    ti.sync_delay_us = sync_delay_us(&c->caps);
+    size_t len = protocol_build_header(frame + FRAME_HDR_SIZE, &cfg, &ti, c->version);
+
+    FrameHeader f = {
+        .flags      = FRAME_FORMAT_CHANGE,
+        .codec      = FRAME_CODEC_PCM,
+        .seq        = (uint32_t)first_seq,
+        .ts_frames  = first_seq * (uint64_t)ctx.config.frames_per_buffer,
+        .capture_ns = current_time_ns(),
+        .len        = (uint32_t)len,
+        .frames     = 0,
+    };
+    protocol_write_frame(frame, &f);
+
+    return spill_pending(c, frame, FRAME_HDR_SIZE + len);
+}
+
+/*
+ * Move every receiver over to the new format.  Runs with capture
+ * stopped and the send thread parked, under clients_lock: what the
+ * receivers have not been sent yet moves out of the ring into their
+ * spill buffers, the pipeline is rebuilt, and each framed receiver gets
+ * the new header in band.  v2 receivers cannot be told and are dropped.
+ */
+static int switch_pipeline(int preset_index)
+{
+    uint64_t head = chunk_ring_head(&ctx.ring);
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+        if (ctx.transport.mode == TRANSPORT_TCP && spill_pending(c, NULL, 0) < 0)
+            remove_client_locked(i);
+    }
+    if (ctx.transport.mode == TRANSPORT_UDP)
+        release_range(ctx.retain_seq, head);
+
+    log_pipeline_stats();
+    pipeline_destroy();
+    if (pipeline_init(preset_index, head) < 0)
+        return -1;
+    if (ctx.udp_fd >= 0)
+        net_set_buffers(ctx.udp_fd, ctx.config.socket_buffer_size,
+                        ctx.config.socket_buffer_size);
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+
+        int enc = c->framed ? choose_encoding(c->ip, c->version, &c->caps) : -1;
+        if (!c->framed)
+            LOG_W("%s is v%d and cannot follow a format change", c->ip, c->version);
+
+        /* Counted against the new encodings even when it goes, so the
+           removal balances                                            */
+        net_set_buffers(c->fd, ctx.config.socket_buffer_size, 0);
+        c->enc      = enc < 0 ? 0 : enc;
+        c->next_seq = head;
+        c->offset   = 0;
+        atomic_fetch_add(&ctx.encs[c->enc].clients, 1);
+        if (enc < 0 || queue_format_change(c, head) < 0)
+            remove_client_locked(i);
+    }
+    return 0;
+}
+
+/* The pipeline is gone and did not come back: let every receiver go
+   without touching the ring.  Caller holds clients_lock.             */
+static void drop_clients_locked(void)
+{
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+
+        LOG_I("Client disconnected: %s (no pipeline)", c->ip);
+        epoll_ctl(ctx.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        net_close(&c->fd);
+        free(c->spill);
+        free(c->in);
+        free(c->ctrl);
+        c->spill    = NULL;
+        c->in       = NULL;
+        c->ctrl     = NULL;
+        c->ctrl_len = 0;
+        atomic_store(&c->connected, false);
+    }
+    ctx.client_count = 0;
+    atomic_store(&g_app.receiver_count, 0);
+    atomic_store(&ctx.legacy_clients, 0);
+}
+
+int streaming_switch_preset(int preset_index)
+{
+    if (!atomic_load(&g_app.is_streaming)) return -1;
+    if (preset_index == ctx.config.preset_index) return 0;
+
+    AudioConfig next;
+    config_load_preset(&next, preset_index);
+    if (next.use_opus && !opuscodec_supported(&next)) {
+        LOG_W("Opus not supported by this build, keeping the current format");
+        return -1;
+    }
+    if (next.use_flac && !lossless_supported(&next)) {
+        LOG_W("Lossless does not support that format, keeping the current one");
+        return -1;
+    }
+
+    LOG_I("Switching to %s", QUALITY_NAMES[preset_index]);
+    pthread_mutex_lock(&ctx.format_lock);
+
+    /* Capture finishes its chunk and goes; the send thread puts what
+       it captured on the wire, then parks                            */
+    atomic_store(&ctx.capture_stop, true);
+    if (ctx.stream_running) {
+        pthread_join(ctx.stream_thread, NULL);
+        ctx.stream_running = false;
+    }
+    atomic_store(&ctx.capture_stop, false);
+
+    pthread_mutex_lock(&ctx.park_lock);
+    atomic_store(&ctx.park_req, true);
+    uint64_t one = 1;
+    if (write(ctx.wake_fd, &one, sizeof(one)) < 0)
+        LOG_W("wake send thread: %s", strerror(errno));
+    while (!ctx.parked && ctx.send_running)
+        pthread_cond_wait(&ctx.park_cond, &ctx.park_lock);
+    pthread_mutex_unlock(&ctx.park_lock);
+
+    pthread_mutex_lock(&ctx.clients_lock);
+    int rc = switch_pipeline(preset_index);
+    if (rc < 0)
+        drop_clients_locked();
+    pthread_mutex_unlock(&ctx.clients_lock);
+
+    /* On failure the send thread stays parked until streaming_stop
+       lets it go; park_req also keeps new receivers out till then  */
+    if (rc == 0) {
+        pthread_mutex_lock(&ctx.park_lock);
+        atomic_store(&ctx.park_req, false);
+        pthread_cond_broadcast(&ctx.park_cond);
+        pthread_mutex_unlock(&ctx.park_lock);
+    }
+
+    if (rc == 0 &&
+        pthread_create(&ctx.stream_thread, NULL, stream_thread_func, NULL) == 0)
+        ctx.stream_running = true;
+    pthread_mutex_unlock(&ctx.format_lock);
+
+    if (!ctx.stream_running) {
+        LOG_E("Format switch failed, stopping");
+        streaming_stop();
+        return -1;
+    }
+
+    ui_update_receiver_count(ctx.client_count);
+    char fmt[256], sr[64];
+    config_format_string(&ctx.config, fmt, sizeof(fmt));
+    config_sample_rate_string(&ctx.config, sr, sizeof(sr));
+    ui_update_format_info(sr, fmt);
+    return 0;
+}
+
+/* ---- Public API ---- */
+
 int streaming_start(int preset_index)
 {
     memset(&ctx, 0, sizeof(ctx));
     pthread_mutex_init(&ctx.clients_lock, NULL);
+    pthread_mutex_init(&ctx.format_lock, NULL);
+    pthread_mutex_init(&ctx.park_lock, NULL);
+    pthread_cond_init(&ctx.park_cond, NULL);
+    ctx.epoll_fd  = -1;
+    ctx.wake_fd   = -1;
+    ctx.udp_fd    = -1;
+    ctx.server_fd = -1;
 
     for (int i = 0; i < MAX_CLIENTS; i++) {
         ctx.clients[i].fd = -1;
         atomic_store(&ctx.clients[i].connected, false);
     }
+    for (int i = 0; i < MAX_PENDING_HELLOS; i++) {
+        ctx.pending[i].fd       = -1;
+        ctx.pending[i].timer_fd = -1;
+    }
 
-    config_load_preset(&ctx.config, preset_index);
+    ctx.transport.mode    = g_app.transport;
+    ctx.transport.reports = true;
+    do ctx.resume_token = new_token(); while (ctx.resume_token == 0);
+    if (g_app.sync_ms > 0 && ctx.transport.mode != TRANSPORT_TCP)
+        LOG_W("Synchronized playout needs the TCP transport, receivers play unsynchronized");
+    else if (g_app.sync_ms > 0)
+        LOG_I("Synchronized playout, %d ms behind capture", g_app.sync_ms);
+    reset_histograms();
+    if (pipeline_init(preset_index, 0) < 0)
+        goto fail_locks;
+
+    choose_cpus();
+
+    if (ctx.transport.mode == TRANSPORT_MULTICAST) {
+        struct in_addr group;
+        inet_pton(AF_INET, g_app.mcast_group, &group);
+
+        ctx.transport.group = group.s_addr;
+        ctx.transport.port  = MCAST_PORT;
+        ctx.transport.fec_k = (uint8_t)g_app.fec_k;
+
+        memset(&ctx.mcast_dst, 0, sizeof(ctx.mcast_dst));
+        ctx.mcast_dst.sin_family = AF_INET;
+        ctx.mcast_dst.sin_addr   = group;
+        ctx.mcast_dst.sin_port   = htons(MCAST_PORT);
+
+        /* Bound now, so receivers can be told the port it sends from */
+        struct sockaddr_in any;
+        memset(&any, 0, sizeof(any));
+        any.sin_family      = AF_INET;
+        any.sin_addr.s_addr = htonl(INADDR_ANY);
+        ctx.udp_fd = net_create_udp_sender(ctx.config.socket_buffer_size, MCAST_TTL);
+        if (ctx.udp_fd < 0 ||
+            bind(ctx.udp_fd, (struct sockaddr *)&any, sizeof(any)) < 0) {
+            LOG_E("Multicast socket: %s", strerror(errno));
+            ui_update_status("Failed to open multicast socket");
+            goto fail_fds;
+        }
+        ctx.transport.source_port = (uint16_t)net_socket_port(ctx.udp_fd, true);
+        media_sender_init(&ctx.media, ctx.udp_fd, g_app.fec_k);
+        LOG_I("Multicast audio to %s:%d from port %d, FEC 1 parity per %d packets",
+              g_app.mcast_group, MCAST_PORT, ctx.transport.source_port, g_app.fec_k);
+    } else if (ctx.transport.mode == TRANSPORT_UDP) {
+        ctx.transport.port  = AUDIO_PORT;
+        ctx.transport.fec_k = (uint8_t)g_app.fec_k;
+
+        ctx.udp_fd = net_create_udp_server(AUDIO_PORT, ctx.config.socket_buffer_size);
+        if (ctx.udp_fd < 0) {
+            ui_update_status("Failed to open UDP audio socket");
+            goto fail_fds;
+        }
+        media_sender_init(&ctx.media, ctx.udp_fd, g_app.fec_k);
+    }
+
+    ctx.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ctx.wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx.epoll_fd < 0 || ctx.wake_fd < 0) {
+        LOG_E("epoll/eventfd: %s", strerror(errno));
+        ui_update_status("Failed to set up send loop");
+        goto fail_fds;
+    }
+
+    struct epoll_event wev;
+    memset(&wev, 0, sizeof(wev));
+    wev.events   = EPOLLIN;
+    wev.data.u32 = WAKE_ID;
+    if (epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, ctx.wake_fd, &wev) < 0) {
+        LOG_E("epoll_ctl(wake): %s", strerror(errno));
+        ui_update_status("Failed to set up send loop");
+        goto fail_fds;
+    }
+
+    if (ctx.transport.mode == TRANSPORT_UDP) {
+        struct epoll_event uev;
+        memset(&uev, 0, sizeof(uev));
+        uev.events   = EPOLLIN;
+        uev.data.u32 = UDP_ID;
+        if (epoll_ctl(ctx.epoll_fd, EPOLL_CTL_ADD, ctx.udp_fd, &uev) < 0) {
+            LOG_E("epoll_ctl(udp): %s", strerror(errno));
+            ui_update_status("Failed to set up send loop");
+            goto fail_fds;
+        }
+    }
 
     ctx.server_fd = net_create_server(AUDIO_PORT, 8);
     if (ctx.server_fd < 0) {
         ui_update_status("Failed to bind audio port");
-        return -1;
+        goto fail_fds;
+    }
+    net_set_nonblocking(ctx.server_fd, true);
+
+    /* Listening and control sockets, ping and chat included */
+    if (reactor_start() < 0) {
+        ui_update_status("Failed to set up the control loop");
+        goto fail_fds;
     }
 
     atomic_store(&g_app.is_streaming, true);
     atomic_store(&g_app.receiver_count, 0);
     atomic_store(&g_app.current_latency_ms, -1);
+    atomic_store(&g_app.stream_start_time, current_time_ms());
+    atomic_store(&g_app.last_time_ms, current_time_ms());
+    atomic_store(&g_app.bytes_sent_this_second, 0);
+    atomic_store(&g_app.total_bytes_sent, 0);
 
     char fmt[256], sr[64];
     config_format_string(&ctx.config, fmt, sizeof(fmt));
@@ -184,23 +2263,43 @@ int streaming_start(int preset_index)
 
     ping_server_start();
     chat_server_start();
+    chat_server_set_relay(relay_chat);
 
-    ctx.accept_running = true;
-    ctx.stream_running = true;
+    if (reactor_add(&ctx.server_watch, ctx.server_fd, EPOLLIN, accept_receivers, NULL) < 0) {
+        streaming_stop();
+        return -1;
+    }
 
-    if (pthread_create(&ctx.accept_thread, NULL, accept_thread_func, NULL) != 0) {
-        LOG_E("pthread_create(accept): %s", strerror(errno));
+    if (pthread_create(&ctx.send_thread, NULL, send_thread_func, NULL) != 0) {
+        LOG_E("pthread_create(send): %s", strerror(errno));
         streaming_stop();
         return -1;
     }
+    ctx.send_running = true;
 
     if (pthread_create(&ctx.stream_thread, NULL, stream_thread_func, NULL) != 0) {
         LOG_E("pthread_create(stream): %s", strerror(errno));
         streaming_stop();
         return -1;
     }
+    ctx.stream_running = true;
 
     return 0;
+
+fail_fds:
+    net_close(&ctx.server_fd);
+    net_close(&ctx.udp_fd);
+    if (ctx.wake_fd  >= 0) close(ctx.wake_fd);
+    if (ctx.epoll_fd >= 0) close(ctx.epoll_fd);
+    ctx.wake_fd  = -1;
+    ctx.epoll_fd = -1;
+    pipeline_destroy();
+fail_locks:
+    pthread_cond_destroy(&ctx.park_cond);
+    pthread_mutex_destroy(&ctx.park_lock);
+    pthread_mutex_destroy(&ctx.format_lock);
+    pthread_mutex_destroy(&ctx.clients_lock);
+    return -1;
 }
 
 void streaming_stop(void)
@@ -211,29 +2310,65 @@ void streaming_stop(void)
     LOG_I("Stopping streaming...");
     ui_update_status("Stopping...");
 
+    chat_server_set_relay(NULL);
+    reactor_stop();
     ping_server_stop();
-    chat_server_stop();
+    drop_pending();
     net_close(&ctx.server_fd);
 
-    pthread_mutex_lock(&ctx.clients_lock);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (atomic_load(&ctx.clients[i].connected)) {
-            net_close(&ctx.clients[i].fd);
-            atomic_store(&ctx.clients[i].connected, false);
-        }
-    }
-    ctx.client_count = 0;
-    pthread_mutex_unlock(&ctx.clients_lock);
+    /* Kick the send thread out of epoll_wait, or out of a park a
+       failed format switch left it in                            */
+    uint64_t one = 1;
+    if (ctx.wake_fd >= 0 && write(ctx.wake_fd, &one, sizeof(one)) < 0)
+        LOG_W("wake send thread: %s", strerror(errno));
+    pthread_mutex_lock(&ctx.park_lock);
+    pthread_cond_broadcast(&ctx.park_cond);
+    pthread_mutex_unlock(&ctx.park_lock);
 
-    if (ctx.accept_running) {
-        pthread_join(ctx.accept_thread, NULL);
-        ctx.accept_running = false;
-    }
     if (ctx.stream_running) {
         pthread_join(ctx.stream_thread, NULL);
         ctx.stream_running = false;
     }
+    if (ctx.send_running) {
+        pthread_join(ctx.send_thread, NULL);
+        ctx.send_running = false;
+    }
+    /* After the send thread, which hands it multiplexed chat */
+    chat_server_stop();
+    dump_histograms();
+
+    /* All workers are gone; tear down what is left */
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientConn *c = &ctx.clients[i];
+        if (atomic_load(&c->connected)) {
+            net_close(&c->fd);
+            atomic_store(&c->connected, false);
+        }
+        free(c->spill);
+        free(c->in);
+        free(c->ctrl);
+        c->spill = NULL;
+        c->in    = NULL;
+        c->ctrl  = NULL;
+    }
+    ctx.client_count = 0;
 
+    log_pipeline_stats();
+    if (ctx.transport.mode != TRANSPORT_TCP)
+        LOG_I("UDP: %ld packets (%ld parity, %ld resent), %ld send errors",
+              ctx.media.packets, ctx.media.parity_packets,
+              ctx.media.retransmits, ctx.media.send_errors);
+    net_close(&ctx.udp_fd);
+    pipeline_destroy();
+
+    if (ctx.wake_fd  >= 0) close(ctx.wake_fd);
+    if (ctx.epoll_fd >= 0) close(ctx.epoll_fd);
+    ctx.wake_fd  = -1;
+    ctx.epoll_fd = -1;
+
+    pthread_cond_destroy(&ctx.park_cond);
+    pthread_mutex_destroy(&ctx.park_lock);
+    pthread_mutex_destroy(&ctx.format_lock);
     pthread_mutex_destroy(&ctx.clients_lock);
     atomic_store(&g_app.receiver_count, 0);
 
@@ -244,4 +2379,74 @@ void streaming_stop(void)
 int streaming_client_count(void)
 {
     return atomic_load(&g_app.receiver_count);
+}
+
+int streaming_get_receiver_stats(ReceiverStats *out, int max)
+{
+    int n = 0;
+    if (!atomic_load(&g_app.is_streaming)) return 0;
+
+    int64_t now = current_time_ms();
+    pthread_mutex_lock(&ctx.clients_lock);
+    for (int i = 0; i < MAX_CLIENTS && n < max; i++) {
+        const ClientConn *c = &ctx.clients[i];
+        if (!atomic_load(&c->connected)) continue;
+
+        ReceiverStats *r = &out[n++];
+        snprintf(r->ip, sizeof(r->ip), "%s", c->ip);
+        r->port            = c->port;
+        r->version         = c->version;
+        r->encoding        = caps_encoding_name(&ctx.encs[c->enc].wire);
+        r->mux             = c->mux;
+        r->connected_ms    = now - c->joined_ms;
+        r->latency_ms      = atomic_load(&c->tel.latency_ms);
+        r->probe_rtt_us    = atomic_load(&c->tel.probe_rtt_us);
+        r->probe_p50_us    = atomic_load(&c->tel.probe_p50_us);
+        r->probe_p99_us    = atomic_load(&c->tel.probe_p99_us);
+        r->probe_jitter_us = atomic_load(&c->tel.probe_jitter_us);
+        r->rtt_us          = atomic_load(&c->tel.rtt_us);
+        r->queued_bytes    = atomic_load(&c->tel.queued_bytes);
+        r->queue_chunks    = atomic_load(&c->tel.queue_chunks);
+        r->bytes_sent      = atomic_load(&c->tel.bytes_sent);
+        int64_t p99        = hist_percentile(&c->tel.send_ns, 99.0);
+        r->send_p99_us     = p99 >= 0 ? p99 / 1000 : -1;
+        r->send_max_us     = p99 >= 0 ? atomic_load(&c->tel.send_ns.max) / 1000 : -1;
+        r->dropped_chunks  = c->dropped_chunks;
+        r->retransmits     = c->retransmits;
+        r->underruns       = atomic_load(&c->tel.underruns);
+        r->lost            = atomic_load(&c->tel.lost);
+        r->reconnects      = atomic_load(&c->tel.reconnects);
+    }
+    pthread_mutex_unlock(&ctx.clients_lock);
+    return n;
+}
+
+void streaming_receiver_report(const char *ip, const ReceiverReport *r)
+{
+    pthread_mutex_lock(&ctx.clients_lock);
+    ClientConn *c = find_reporter(ip, r->port);
+    if (c) apply_report(c, r);
+    pthread_mutex_unlock(&ctx.clients_lock);
+    if (c) show_worst_latency();
+}
+
+void streaming_receiver_latency(const char *ip, int64_t ms)
+{
+    pthread_mutex_lock(&ctx.clients_lock);
+    ClientConn *c = find_reporter(ip, 0);
+    if (c) atomic_store(&c->tel.latency_ms, ms);
+    pthread_mutex_unlock(&ctx.clients_lock);
+    if (c) show_worst_latency();
+}
+
+void streaming_get_pipeline_stats(PipelineStats *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!ctx.pipe.items) return;
+
+    out->depth         = spsc_depth(&ctx.pipe);
+    out->capacity      = spsc_capacity(&ctx.pipe);
+    out->max_occupancy = atomic_load(&ctx.pipe.max_occupancy);
+    out->overruns      = atomic_load(&ctx.pipe.overruns);
+    out->ring_overruns = atomic_load(&ctx.ring.overruns);
 }
\ No newline at end of file
@@ -7,35 +7,281 @@
 
 #include "soundshare.h"
 #include "config.h"
+#include "chunkring.h"
+#include "spscring.h"
+#include "protocol.h"
+#include "udpmedia.h"
+#include "caps.h"
+#include "histogram.h"
+#include "reactor.h"
+#include "dtx.h"
+#include "opuscodec.h"
+#include "workpool.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#define MAX_CLIENTS 16
+#define MAX_CLIENTS 64
+
+/* Shared chunk ring budget; slot count is clamped to this range */
+#define RING_BYTES      (8 * 1024 * 1024)
+#define RING_MIN_SLOTS  8
+#define RING_MAX_SLOTS  4096
+/* Slots kept free ahead of the writer: a receiver lagging more than
+   nslots - pipe capacity - RING_RESERVE chunks hits the overflow policy */
+#define RING_RESERVE    2
+
+/* Hop limit for multicast audio: stay on the local network */
+#define MCAST_TTL       1
+
+/* Unicast UDP: how long sent chunks stay around for retransmission */
+#define UDP_RETAIN_MS   250
+
+/* TCP: most audio replayed to a receiver resuming after a dropped
+   connection, in time and, for long chunks, in chunks.  Covers the
+   receiver's stall timeout (RECEIVE_STALL_MS, RECEIVE_STALL_CHUNKS)
+   and its first reconnect, and fits its jitter buffer
+   (JITTER_REPLAY_MS); further behind, it joins live.                 */
+#define RESUME_REPLAY_MS     2000
+#define RESUME_REPLAY_CHUNKS 5
+
+/* Lossless has to save this share of the PCM size to be worth its CPU */
+#define ADAPT_MIN_SAVING 0.10
+
+/* Capture -> send descriptor pipe: nslots / 4, within these bounds */
+#define PIPE_MIN_DEPTH  2
+#define PIPE_MAX_DEPTH  1024
+
+/*
+ * Per-receiver health.  Each field has one writer (the send thread, or
+ * whoever handles the receiver's reports) and is read from anywhere.
+ */
+typedef struct {
+    _Atomic int64_t latency_ms;    /* its own end-to-end figure, -1 = none */
+    _Atomic int64_t probe_rtt_us;  /* its last probe's round trip, -1 = none */
+    _Atomic int64_t probe_p50_us;  /* its probes so far, -1 = none */
+    _Atomic int64_t probe_p99_us;
+    _Atomic int64_t probe_jitter_us;
+    _Atomic int64_t rtt_us;        /* kernel's smoothed TCP round trip */
+    _Atomic int64_t queued_bytes;  /* in the socket, not yet acknowledged */
+    _Atomic int64_t queue_chunks;  /* in the ring, not yet written out */
+    _Atomic int64_t bytes_sent;
+    _Atomic int64_t underruns;     /* as the receiver reports them */
+    _Atomic int64_t lost;
+    _Atomic int64_t reconnects;
+    Histogram       send_ns;       /* each sendmsg to it */
+} ClientTelemetry;
 
 typedef struct {
     int         fd;
     char        ip[INET_ADDRSTRLEN];
+    int         port;        /* its end of the audio connection */
     atomic_bool connected;
+    bool        blocked;     /* last send hit EAGAIN, wait for EPOLLOUT */
+    bool        framed;      /* v3: each chunk goes out behind a frame header */
+    int         enc;         /* index into StreamContext.encs */
+    int         version;     /* stream version it speaks */
+    PeerCaps    caps;        /* from its HELLO, for re-choosing on a switch */
+
+    /* Read cursor into the shared ring; holds one reference on every
+       slot in [next_seq, ring head)                                    */
+    uint64_t    next_seq;
+    size_t      offset;      /* bytes of next_seq already sent */
+
+    /* Unsent tail of a chunk whose slot was reclaimed mid-write */
+    uint8_t    *spill;
+    size_t      spill_len;
+    size_t      spill_off;
+
+    int64_t     dropped_chunks;
+
+    /* Multiplexed (CAPS_MUX): ping and chat as FRAME_CONTROL both ways.
+       `in` collects its frames; `ctrl` holds ours until a chunk ends
+       (guarded by clients_lock)                                        */
+    bool        mux;
+    uint8_t    *in;
+    size_t      in_len;
+    uint8_t    *ctrl;
+    size_t      ctrl_len;
+    /* CLOCK_REQUEST that came in at clock_t2, answered only as the
+       answer goes out so its t3 is the send time                    */
+    uint8_t     clock_req[CLOCK_REQUEST_SIZE];
+    int64_t     clock_t2;
+    bool        clock_due;
+
+    /* Unicast UDP: set once the receiver's HELLO arrives */
+    uint32_t           token;
+    bool               udp_ready;
+    struct sockaddr_in udp_addr;
+    long               retransmits;
+    long               retx_late;    /* NACKed too late to make playout */
+
+    int64_t            joined_ms;
+    ClientTelemetry    tel;
 } ClientConn;
 
+/* Session encodings: the preset's own, and on TCP a second one for
+   receivers whose capabilities make it the better choice             */
+#define MAX_ENCODINGS 2
+
+typedef struct {
+    WireEncoding wire;
+    /* Lossless: chunks whose estimate says coding is not worth it go
+       out as PCM instead, unless a v2 receiver needs them coded      */
+    bool         adaptive;
+    double       adapt_max_bits;  /* code only below this estimate */
+    long         pcm_chunks;
+    long         chunks;          /* produced in this encoding */
+    int64_t      bytes;
+    atomic_int   clients;         /* receivers taking it */
+    /* Still produced until then for a receiver that may resume */
+    _Atomic int64_t hold_until_ns;
+} StreamEncoding;
+
+/* Receivers connected but yet to say hello (or stay quiet for
+   HELLO_WAIT_MS, as v2 does); more than this are turned away     */
+#define MAX_PENDING_HELLOS 8
+/* A receiver whose hello came in during a format switch stays pending
+   and is tried again this much later                                  */
+#define WELCOME_RETRY_MS   20
+
+typedef struct {
+    int          fd;            /* -1: free */
+    int          timer_fd;      /* timerfd, fires at HELLO_WAIT_MS or a retry */
+    char         ip[INET_ADDRSTRLEN];
+    uint8_t      hello[HELLO_MAX_SIZE];
+    size_t       len;
+    ReactorWatch watch;
+    ReactorWatch timer_watch;
+} PendingHello;
+
 typedef struct {
     AudioConfig     config;
     int             server_fd;
+    ReactorWatch    server_watch;
+    PendingHello    pending[MAX_PENDING_HELLOS];
     ClientConn      clients[MAX_CLIENTS];
     int             client_count;
-    pthread_mutex_t clients_lock;
+    pthread_mutex_t clients_lock;   /* also orders ring publish vs. cursors */
+    ChunkRing       ring;
+    uint8_t        *frame_hdrs;  /* v3 frame header per ring slot and encoding,
+                                    then the slot's DTX marker          */
+    uint8_t        *len_prefixes;   /* v2 lossless: be32 length per slot */
+    SpscRing        pipe;        /* capture -> send, lock-free */
+
+    /* UDP transports: TCP only carries the header and tells us who is
+       listening.  Multicast sends one datagram copy per chunk; unicast
+       sends one per receiver and keeps a reference on recent chunks
+       in [retain_seq, head) for NACKed packets                       */
+    TransportInfo      transport;
+    int                udp_fd;
+    struct sockaddr_in mcast_dst;
+    MediaSender        media;
+    uint32_t          *pkt_base;     /* per ring slot: seq of packet 0 */
+    uint64_t           retain_seq;
+
+    /* Coded or packed sessions: capture reads into a staging buffer and
+       the send thread encodes into the ring.  One buffer per pipe entry,
+       plus the one being encoded and the one being read               */
+    uint8_t        *stage;
+    int             nstage;
+    OpusCodec      *opus;
+    WorkPool       *pool;        /* NULL: lossless on the send thread alone */
+    Dtx             dtx;
+    uint64_t        run_seq;     /* DTX: silent run waiting for its marker */
+    int             run_chunks;
+
+    /* Coded or packed: PCM bytes in and wire bytes out, send thread only */
+    int64_t         coded_in;
+    int64_t         coded_out;
+    /* Send times of receivers that have left, for the merged dump */
+    Histogram       send_left;
+    /* DTX: chunks captured, chunks that went out as silence and the
+       markers that carried them                                      */
+    long            chunks;
+    long            silent_chunks;
+    long            markers;
+
+    StreamEncoding  encs[MAX_ENCODINGS];
+    int             nencs;
+    atomic_int      legacy_clients;  /* connected v2 (unframed) receivers */
+    uint32_t        resume_token;    /* names this session to receivers */
+
+    /* Format switch: accept stays out while it runs; capture leaves
+       after its current chunk and the send thread parks              */
+    pthread_mutex_t format_lock;
+    atomic_bool     capture_stop;
+    pthread_mutex_t park_lock;
+    pthread_cond_t  park_cond;
+    atomic_bool     park_req;
+    bool            parked;
+
+    int             epoll_fd;
+    int             wake_fd;     /* eventfd doorbell for the pipe */
+    int             capture_cpu;
+    int             send_cpu;
 
-    pthread_t       accept_thread;
     pthread_t       stream_thread;
-    bool            accept_running;
+    pthread_t       send_thread;
     bool            stream_running;
+    bool            send_running;
 } StreamContext;
 
+/* Capture -> send pipeline counters */
+typedef struct {
+    int  depth;           /* descriptors waiting for the send thread */
+    int  capacity;
+    int  max_occupancy;
+    long overruns;        /* pipe full, chunk dropped at capture */
+    long ring_overruns;   /* ring slot still referenced, chunk dropped */
+} PipelineStats;
+
+/* One row of the receiver health table */
+typedef struct {
+    char        ip[INET_ADDRSTRLEN];
+    int         port;
+    int         version;
+    const char *encoding;
+    bool        mux;
+    int64_t     connected_ms;
+    int64_t     latency_ms;      /* -1 until it reports */
+    int64_t     probe_rtt_us;    /* -1 until it reports */
+    int64_t     probe_p50_us;    /* -1 until it reports them */
+    int64_t     probe_p99_us;
+    int64_t     probe_jitter_us;
+    int64_t     rtt_us;          /* -1 until sampled */
+    int64_t     queued_bytes;
+    int64_t     queue_chunks;
+    int64_t     bytes_sent;
+    int64_t     send_p99_us;     /* one sendmsg, -1 before the first */
+    int64_t     send_max_us;
+    int64_t     dropped_chunks;  /* overflow policy, TCP */
+    long        retransmits;     /* unicast UDP */
+    int64_t     underruns;
+    int64_t     lost;
+    int64_t     reconnects;
+} ReceiverStats;
+
 int  streaming_start(int preset_index);
 void streaming_stop(void);
+/**
+ * Change the format of a running stream without dropping receivers:
+ * capture reopens at the new preset and framed (v3+) receivers get the
+ * new header in band.  v2 receivers are disconnected.
+ */
+int  streaming_switch_preset(int preset_index);
 int  streaming_client_count(void);
+void streaming_get_pipeline_stats(PipelineStats *out);
+/** Up to `max` connected receivers' rows; returns how many.  SIGUSR1 logs them too. */
+int  streaming_get_receiver_stats(ReceiverStats *out, int max);
+/**
+ * Reports from the ping server.  RECEIVER_REPORT goes to the receiver
+ * at `ip` whose audio connection is on `r->port`; a LATENCY_REPORT, which
+ * does not say, to the first one there.
+ */
+void streaming_receiver_report(const char *ip, const ReceiverReport *r);
+void streaming_receiver_latency(const char *ip, int64_t ms);
 
 #endif /* STREAMING_H */
\ No newline at end of file
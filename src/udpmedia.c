@@ -0,0 +1,647 @@
+#include "udpmedia.h"
+#include "protocol.h"
+
+#include <sys/uio.h>
+
+/* ---- Header ---- */
+
+void media_header_write(uint8_t *dst, const MediaHeader *h)
+{
+    dst[0] = (uint8_t)(h->type | h->codec << 4);
+    dst[1] = h->fec_k;
+    write_be16(dst +  2, h->len);
+    write_be32(dst +  4, h->seq);
+    write_be32(dst +  8, h->chunk_seq);
+    write_be32(dst + 12, h->chunk_off);
+    write_be32(dst + 16, h->chunk_len);
+    write_be32(dst + 20, h->ts_frames);
+}
+
+void media_header_read(const uint8_t *src, MediaHeader *h)
+{
+    h->type      = src[0] & 0x0f;
+    h->codec     = src[0] >> 4;
+    h->fec_k     = src[1];
+    h->len       = read_be16(src +  2);
+    h->seq       = read_be32(src +  4);
+    h->chunk_seq = read_be32(src +  8);
+    h->chunk_off = read_be32(src + 12);
+    h->chunk_len = read_be32(src + 16);
+    h->ts_frames = read_be32(src + 20);
+}
+
+static void xor_into(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+/* ============================================================ */
+/*  SENDER                                                       */
+/* ============================================================ */
+
+void media_sender_init(MediaSender *s, int fd, int fec_k)
+{
+    memset(s, 0, sizeof(*s));
+    s->fd    = fd;
+    s->fec_k = fec_k < 0 ? 0 : (fec_k > MEDIA_MAX_FEC_K ? MEDIA_MAX_FEC_K : fec_k);
+}
+
+/* One FEC group: up to fec_k data packets plus the parity packet */
+#define GROUP_MAX (MEDIA_MAX_FEC_K + 1)
+
+ssize_t media_send_chunk(MediaSender *s,
+                         const struct sockaddr_in *dsts, int ndst,
+                         const uint8_t *data, size_t len,
+                         uint32_t chunk_seq, uint32_t ts_frames, uint8_t codec)
+{
+    if (len == 0 || ndst <= 0) return 0;
+
+    int    k      = s->fec_k > 0 ? s->fec_k : 1;
+    size_t off    = 0;
+    size_t wire   = 0;
+    bool   any_ok = false;
+
+    while (off < len) {
+        uint8_t        hdrs[GROUP_MAX][MEDIA_HDR_SIZE];
+        struct iovec   iov[GROUP_MAX][2];
+        struct mmsghdr msgs[GROUP_MAX];
+        int            n         = 0;
+        size_t         group_off = off;
+        uint32_t       group_seq = s->next_seq;
+        size_t         par_len   = 0;
+
+        /* Data packets of this group */
+        for (int i = 0; i < k && off < len; i++) {
+            size_t plen = len - off < MEDIA_PAYLOAD ? len - off : MEDIA_PAYLOAD;
+
+            MediaHeader h = {
+                .type      = MEDIA_DATA,
+                .codec     = codec,
+                .fec_k     = (uint8_t)s->fec_k,
+                .len       = (uint16_t)plen,
+                .seq       = s->next_seq++,
+                .chunk_seq = chunk_seq,
+                .chunk_off = (uint32_t)off,
+                .chunk_len = (uint32_t)len,
+                .ts_frames = ts_frames,
+            };
+            media_header_write(hdrs[n], &h);
+
+            if (s->fec_k > 0) {
+                if (i == 0) {
+                    par_len = plen;
+                    memcpy(s->parity, data + off, plen);
+                } else {
+                    xor_into(s->parity, data + off, plen);
+                }
+            }
+
+            iov[n][0].iov_base = hdrs[n];
+            iov[n][0].iov_len  = MEDIA_HDR_SIZE;
+            iov[n][1].iov_base = (void *)(data + off);
+            iov[n][1].iov_len  = plen;
+            n++;
+            off += plen;
+        }
+
+        /* Parity packet: the first payload of a group is always the
+           longest, so par_len covers every member                     */
+        if (s->fec_k > 0) {
+            MediaHeader h = {
+                .type      = MEDIA_PARITY,
+                .codec     = codec,
+                .fec_k     = (uint8_t)s->fec_k,
+                .len       = (uint16_t)par_len,
+                .seq       = group_seq,
+                .chunk_seq = chunk_seq,
+                .chunk_off = (uint32_t)group_off,
+                .chunk_len = (uint32_t)len,
+                .ts_frames = ts_frames,
+            };
+            media_header_write(hdrs[n], &h);
+            iov[n][0].iov_base = hdrs[n];
+            iov[n][0].iov_len  = MEDIA_HDR_SIZE;
+            iov[n][1].iov_base = s->parity;
+            iov[n][1].iov_len  = par_len;
+            n++;
+        }
+
+        for (int d = 0; d < ndst; d++) {
+            memset(msgs, 0, sizeof(msgs[0]) * (size_t)n);
+            for (int i = 0; i < n; i++) {
+                msgs[i].msg_hdr.msg_name    = (void *)&dsts[d];
+                msgs[i].msg_hdr.msg_namelen = sizeof(dsts[d]);
+                msgs[i].msg_hdr.msg_iov     = iov[i];
+                msgs[i].msg_hdr.msg_iovlen  = 2;
+            }
+
+            int sent = 0;
+            while (sent < n) {
+                int rc = sendmmsg(s->fd, msgs + sent, (unsigned)(n - sent), 0);
+                if (rc < 0) {
+                    if (errno == EINTR) continue;
+                    s->send_errors++;
+                    break;
+                }
+                sent += rc;
+            }
+            if (sent > 0) any_ok = true;
+        }
+
+        s->packets += n;
+        if (s->fec_k > 0) s->parity_packets++;
+        for (int i = 0; i < n; i++)
+            wire += MEDIA_HDR_SIZE + iov[i][1].iov_len;
+    }
+
+    return any_ok ? (ssize_t)wire : -1;
+}
+
+ssize_t media_send_silence(MediaSender *s,
+                           const struct sockaddr_in *dsts, int ndst,
+                           uint32_t frames, uint32_t chunks,
+                           uint32_t chunk_seq, uint32_t ts_frames)
+{
+    uint8_t     hdr[MEDIA_HDR_SIZE];
+    MediaHeader h = {
+        .type      = MEDIA_SILENCE,
+        .fec_k     = (uint8_t)s->fec_k,
+        .seq       = s->next_seq,
+        .chunk_seq = chunk_seq,
+        .chunk_off = chunks,
+        .chunk_len = frames,
+        .ts_frames = ts_frames,
+    };
+    media_header_write(hdr, &h);
+
+    bool any_ok = false;
+    for (int d = 0; d < ndst; d++) {
+        if (sendto(s->fd, hdr, sizeof(hdr), 0,
+                   (const struct sockaddr *)&dsts[d], sizeof(dsts[d])) < 0)
+            s->send_errors++;
+        else
+            any_ok = true;
+    }
+    s->packets++;
+    return any_ok ? MEDIA_HDR_SIZE : -1;
+}
+
+int media_resend(MediaSender *s, const struct sockaddr_in *dst,
+                 const uint8_t *data, size_t len,
+                 uint32_t chunk_seq, uint32_t ts_frames, uint8_t codec,
+                 uint32_t base_seq, uint32_t seq)
+{
+    size_t off = (size_t)(seq - base_seq) * MEDIA_PAYLOAD;
+    if (off >= len) return -1;
+    size_t plen = len - off < MEDIA_PAYLOAD ? len - off : MEDIA_PAYLOAD;
+
+    uint8_t     hdr[MEDIA_HDR_SIZE];
+    MediaHeader h = {
+        .type      = MEDIA_RETX,
+        .codec     = codec,
+        .fec_k     = (uint8_t)s->fec_k,
+        .len       = (uint16_t)plen,
+        .seq       = seq,
+        .chunk_seq = chunk_seq,
+        .chunk_off = (uint32_t)off,
+        .chunk_len = (uint32_t)len,
+        .ts_frames = ts_frames,
+    };
+    media_header_write(hdr, &h);
+
+    struct iovec iov[2] = {
+        { .iov_base = hdr,                .iov_len = MEDIA_HDR_SIZE },
+        { .iov_base = (void *)(data + off), .iov_len = plen },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name    = (void *)dst;
+    msg.msg_namelen = sizeof(*dst);
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = 2;
+
+    if (sendmsg(s->fd, &msg, 0) < 0) {
+        s->send_errors++;
+        return -1;
+    }
+    s->retransmits++;
+    return 0;
+}
+
+/* ---- Feedback ---- */
+
+size_t media_build_hello(uint8_t *pkt, uint32_t token)
+{
+    MediaHeader h = { .type = MEDIA_HELLO, .seq = token };
+    media_header_write(pkt, &h);
+    return MEDIA_HDR_SIZE;
+}
+
+int media_nack_read(const uint8_t *pkt, size_t len, MediaNack *out)
+{
+    if (len < MEDIA_HDR_SIZE + 4) return -1;
+
+    MediaHeader h;
+    media_header_read(pkt, &h);
+    if (h.type != MEDIA_NACK)                           return -1;
+    if (h.len < 4 || (h.len - 4) % 4 != 0)              return -1;
+    if (MEDIA_HDR_SIZE + (size_t)h.len > len)           return -1;
+    if ((h.len - 4) / 4 > MEDIA_NACK_MAX)               return -1;
+
+    const uint8_t *p = pkt + MEDIA_HDR_SIZE;
+    out->token     = h.seq;
+    out->budget_ms = read_be16(p);
+    out->rtt_ms    = read_be16(p + 2);
+    out->count     = (h.len - 4) / 4;
+    for (int i = 0; i < out->count; i++)
+        out->seqs[i] = read_be32(p + 4 + 4 * i);
+    return 0;
+}
+
+/* ============================================================ */
+/*  RECEIVER                                                     */
+/* ============================================================ */
+
+int media_reasm_init(MediaReassembler *r, size_t max_chunk, int nslots, int hold_ms)
+{
+    memset(r, 0, sizeof(*r));
+    r->max_chunk = max_chunk;
+    r->max_pkts  = (int)((max_chunk + MEDIA_PAYLOAD - 1) / MEDIA_PAYLOAD);
+    r->nslots    = nslots < 2 ? 2 : nslots;
+    r->hold_ns   = (int64_t)hold_ms * 1000000;
+
+    r->slots = calloc((size_t)r->nslots, sizeof(ReasmSlot));
+    if (!r->slots) return -1;
+
+    for (int i = 0; i < r->nslots; i++) {
+        ReasmSlot *s = &r->slots[i];
+        s->have        = calloc((size_t)r->max_pkts, 1);
+        s->data        = malloc(max_chunk);
+        s->parity      = malloc((size_t)r->max_pkts * MEDIA_PAYLOAD);
+        s->parity_have = calloc((size_t)r->max_pkts, 1);
+        if (!s->have || !s->data || !s->parity || !s->parity_have) {
+            media_reasm_destroy(r);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void media_reasm_destroy(MediaReassembler *r)
+{
+    if (!r->slots) return;
+
+    for (int i = 0; i < r->nslots; i++) {
+        ReasmSlot *s = &r->slots[i];
+        free(s->have);
+        free(s->data);
+        free(s->parity);
+        free(s->parity_have);
+    }
+    free(r->slots);
+    r->slots = NULL;
+}
+
+static ReasmSlot *slot_for(MediaReassembler *r, uint32_t chunk_seq)
+{
+    return &r->slots[chunk_seq % (uint32_t)r->nslots];
+}
+
+static size_t pkt_len(const ReasmSlot *s, int idx)
+{
+    size_t off = (size_t)idx * MEDIA_PAYLOAD;
+    size_t rem = s->chunk_len - off;
+    return rem < MEDIA_PAYLOAD ? rem : MEDIA_PAYLOAD;
+}
+
+/* ---- Loss list (unicast) ---- */
+
+/* Forget `seq`; returns when it was last NACKed, 0 if never, -1 if it
+   was not on the list                                                 */
+static int64_t loss_remove(MediaReassembler *r, uint32_t seq)
+{
+    for (int i = 0; i < r->nloss; i++) {
+        if (r->loss[i].seq != seq) continue;
+        int64_t nack_ns = r->loss[i].nack_ns;
+        memmove(&r->loss[i], &r->loss[i + 1],
+                (size_t)(r->nloss - i - 1) * sizeof(r->loss[0]));
+        r->nloss--;
+        return nack_ns;
+    }
+    return -1;
+}
+
+static void loss_add(MediaReassembler *r, uint32_t seq, int64_t deadline_ns)
+{
+    if (r->nloss == MEDIA_NACK_MAX) {
+        memmove(&r->loss[0], &r->loss[1], (size_t)(r->nloss - 1) * sizeof(r->loss[0]));
+        r->nloss--;
+    }
+    r->loss[r->nloss++] = (MediaLoss){ .seq = seq, .deadline_ns = deadline_ns };
+}
+
+/* Data packets carry consecutive seqs across chunks, so a jump means
+   the packets in between were lost, whichever chunk they belonged to */
+static void track_seq(MediaReassembler *r, uint32_t seq, bool retx)
+{
+    if (!r->hi_valid) {
+        r->hi_seq   = seq;
+        r->hi_valid = true;
+        return;
+    }
+
+    int32_t d = (int32_t)(seq - r->hi_seq);
+    if (d <= 0) {
+        int64_t nack_ns = loss_remove(r, seq);
+        if (retx && nack_ns > 0) {
+            int64_t rtt = current_time_ns() - nack_ns;
+            r->srtt_ns  = r->srtt_ns ? (r->srtt_ns * 7 + rtt) / 8 : rtt;
+        }
+        return;
+    }
+
+    if (d > MEDIA_NACK_SPAN) {
+        r->nloss = 0;
+    } else {
+        int64_t deadline = current_time_ns() + r->hold_ns;
+        for (uint32_t m = r->hi_seq + 1; m != seq; m++)
+            loss_add(r, m, deadline);
+    }
+    r->hi_seq = seq;
+}
+
+/* Rebuild the one missing packet of group g, if that is all it lacks */
+static void try_recover(MediaReassembler *r, ReasmSlot *s, int g)
+{
+    if (s->fec_k <= 0 || !s->parity_have[g]) return;
+
+    int first = g * s->fec_k;
+    int last  = first + s->fec_k;
+    if (last > s->npkts) last = s->npkts;
+
+    int missing = -1;
+    for (int i = first; i < last; i++) {
+        if (s->have[i]) continue;
+        if (missing >= 0) return;          /* two or more gone */
+        missing = i;
+    }
+    if (missing < 0) return;
+
+    uint8_t *dst  = s->data + (size_t)missing * MEDIA_PAYLOAD;
+    size_t   mlen = pkt_len(s, missing);
+    uint8_t *par  = s->parity + (size_t)g * MEDIA_PAYLOAD;
+
+    memcpy(dst, par, mlen);
+    for (int i = first; i < last; i++) {
+        if (i == missing) continue;
+        size_t plen = pkt_len(s, i);
+        xor_into(dst, s->data + (size_t)i * MEDIA_PAYLOAD, plen < mlen ? plen : mlen);
+    }
+
+    s->have[missing] = 1;
+    s->received++;
+    r->recovered++;
+    if (r->hold_ns > 0)
+        track_seq(r, s->base_seq + (uint32_t)missing, false);
+}
+
+static void slot_reset(ReasmSlot *s, const MediaHeader *h)
+{
+    bool silence = h->type == MEDIA_SILENCE;
+
+    s->used          = true;
+    s->chunk_seq     = h->chunk_seq;
+    s->chunk_len     = silence ? 0 : h->chunk_len;
+    s->ts_frames     = h->ts_frames;
+    s->silent_frames = silence ? h->chunk_len : 0;
+    s->silent_chunks = silence ? h->chunk_off : 0;
+    s->codec         = h->codec;
+    s->fec_k         = h->fec_k;
+    s->npkts     = (int)((s->chunk_len + MEDIA_PAYLOAD - 1) / MEDIA_PAYLOAD);
+    s->received  = 0;
+    s->first_ns  = current_time_ns();
+    s->base_seq  = 0;
+    memset(s->have, 0, (size_t)s->npkts);
+    memset(s->parity_have, 0, (size_t)s->npkts);
+}
+
+void media_reasm_input(MediaReassembler *r, const uint8_t *pkt, size_t len)
+{
+    if (len < MEDIA_HDR_SIZE) return;
+
+    MediaHeader h;
+    media_header_read(pkt, &h);
+
+    bool silence = h.type == MEDIA_SILENCE;
+
+    if (h.type != MEDIA_DATA && h.type != MEDIA_RETX &&
+        h.type != MEDIA_PARITY && !silence)                         return;
+    if (h.len > MEDIA_PAYLOAD || MEDIA_HDR_SIZE + (size_t)h.len > len) return;
+    if (h.chunk_len == 0)                                           return;
+    if (silence) {
+        if (h.len != 0 || h.chunk_off == 0 ||
+            h.chunk_off > SILENCE_RUN_MAX)                          return;
+    } else {
+        if (h.chunk_len > r->max_chunk)                             return;
+        if (h.fec_k > MEDIA_MAX_FEC_K)                              return;
+        if (h.chunk_off % MEDIA_PAYLOAD != 0)                       return;
+        if ((size_t)h.chunk_off + h.len > h.chunk_len)              return;
+    }
+
+    r->packets++;
+
+    /* Join at the start of a chunk so the first one handed out is whole */
+    if (!r->started) {
+        if ((h.type != MEDIA_DATA && !silence) || h.chunk_off != 0) return;
+        r->started    = true;
+        r->next_chunk = h.chunk_seq;
+        r->newest     = h.chunk_seq;
+    }
+
+    r->fec_k = h.fec_k;
+    if (r->hold_ns > 0 && h.type != MEDIA_PARITY && !silence)
+        track_seq(r, h.seq, h.type == MEDIA_RETX);
+
+    int32_t ahead = (int32_t)(h.chunk_seq - r->next_chunk);
+    if (ahead < 0) {
+        /* Parity for a chunk that completed without it is expected */
+        if (h.type != MEDIA_PARITY && !silence) r->late_packets++;
+        return;
+    }
+    if (ahead >= r->nslots) {
+        /* Fell far behind (or the streamer restarted): resync here */
+        LOG_W("Media stream jumped %d chunks, resyncing", ahead);
+        for (int i = 0; i < r->nslots; i++)
+            r->slots[i].used = false;
+        r->next_chunk = h.chunk_seq;
+        r->newest     = h.chunk_seq;
+    }
+    if ((int32_t)(h.chunk_seq - r->newest) > 0)
+        r->newest = h.chunk_seq;
+
+    ReasmSlot *s = slot_for(r, h.chunk_seq);
+    if (!s->used || s->chunk_seq != h.chunk_seq)
+        slot_reset(s, &h);
+    else if (s->chunk_len != h.chunk_len)
+        return;
+    if (silence) return;       /* complete as it stands */
+
+    int idx = (int)(h.chunk_off / MEDIA_PAYLOAD);
+    int g   = s->fec_k > 0 ? idx / s->fec_k : 0;
+
+    /* Data packets of a chunk carry consecutive seqs; parity carries
+       the seq of its group's first, which is also packet `idx`       */
+    s->base_seq = h.seq - (uint32_t)idx;
+
+    if (h.type != MEDIA_PARITY) {
+        if (h.len != pkt_len(s, idx) || s->have[idx]) return;
+        memcpy(s->data + h.chunk_off, pkt + MEDIA_HDR_SIZE, h.len);
+        s->have[idx] = 1;
+        s->received++;
+        if (h.type == MEDIA_RETX) r->retransmits++;
+    } else {
+        if (s->fec_k <= 0 || s->parity_have[g] || h.len != pkt_len(s, idx)) return;
+        memcpy(s->parity + (size_t)g * MEDIA_PAYLOAD, pkt + MEDIA_HDR_SIZE, h.len);
+        s->parity_have[g] = 1;
+    }
+
+    try_recover(r, s, g);
+}
+
+/* Has the in-order chunk waited long enough for its missing packets? */
+static bool chunk_expired(const MediaReassembler *r, const ReasmSlot *s, bool have)
+{
+    int32_t behind = (int32_t)(r->newest - r->next_chunk);
+
+    if (behind >= r->nslots - 1) return true;
+    if (r->hold_ns == 0)         return behind >= MEDIA_REASM_WINDOW;
+
+    int64_t now = current_time_ns();
+    if (have) return now - s->first_ns >= r->hold_ns;
+    if (behind <= 0) return false;
+
+    /* Nothing of it arrived: it was due no later than anything after it */
+    int64_t oldest = now;
+    for (uint32_t cs = r->next_chunk + 1; (int32_t)(r->newest - cs) >= 0; cs++) {
+        const ReasmSlot *o = &r->slots[cs % (uint32_t)r->nslots];
+        if (o->used && o->chunk_seq == cs && o->first_ns < oldest)
+            oldest = o->first_ns;
+    }
+    return now - oldest >= r->hold_ns;
+}
+
+bool media_reasm_next(MediaReassembler *r, MediaChunk *out)
+{
+    if (!r->started) return false;
+
+    ReasmSlot *s    = slot_for(r, r->next_chunk);
+    bool       have = s->used && s->chunk_seq == r->next_chunk;
+
+    if (have && s->received == s->npkts) {
+        out->missing = 0;
+    } else if (chunk_expired(r, s, have)) {
+        if (have) {
+            /* Give up: zero-fill whatever parity could not rebuild */
+            int missing = 0;
+            for (int i = 0; i < s->npkts; i++) {
+                if (s->have[i]) continue;
+                memset(s->data + (size_t)i * MEDIA_PAYLOAD, 0, pkt_len(s, i));
+                missing++;
+            }
+            out->missing = missing;
+            r->lost_packets += missing;
+        } else {
+            /* Nothing of this chunk arrived: stand in silence */
+            MediaHeader h = {
+                .codec     = r->last_codec,
+                .chunk_seq = r->next_chunk,
+                .chunk_len = r->last_len ? r->last_len : (uint32_t)r->max_chunk,
+            };
+            slot_reset(s, &h);
+            memset(s->data, 0, s->chunk_len);
+            out->missing = s->npkts;
+            r->lost_packets += s->npkts;
+        }
+    } else {
+        return false;
+    }
+
+    out->data          = s->data;
+    out->len           = s->chunk_len;
+    out->chunk_seq     = s->chunk_seq;
+    out->ts_frames     = s->ts_frames;
+    out->silent_frames = s->silent_frames;
+    out->codec         = s->codec;
+
+    if (s->chunk_len > 0) {
+        r->last_len   = s->chunk_len;
+        r->last_codec = s->codec;
+    }
+    s->used = false;
+    if (s->silent_chunks > 1) {
+        /* The rest of the run never comes on its own */
+        r->next_chunk += s->silent_chunks - 1;
+        if ((int32_t)(r->next_chunk - r->newest) > 0)
+            r->newest = r->next_chunk;
+    }
+    r->next_chunk++;
+    return true;
+}
+
+size_t media_reasm_nack(MediaReassembler *r, uint32_t token, uint8_t *pkt)
+{
+    if (r->hold_ns == 0 || r->nloss == 0) return 0;
+
+    int64_t now   = current_time_ns();
+    int64_t retry = r->srtt_ns > 0 ? r->srtt_ns + r->srtt_ns / 2 : 20000000;
+    if (retry < 5000000) retry = 5000000;
+    /* With FEC, give the group's parity a moment to rebuild it first */
+    int64_t grace = r->fec_k > 0 ? 2000000 : 0;
+
+    uint8_t *p      = pkt + MEDIA_HDR_SIZE;
+    int      count  = 0;
+    int      keep   = 0;
+    int64_t  budget = INT64_MAX;
+
+    for (int i = 0; i < r->nloss; i++) {
+        MediaLoss e = r->loss[i];
+        if (e.deadline_ns <= now || e.tries >= MEDIA_NACK_TRIES) continue;
+
+        bool due = e.nack_ns == 0 ? now - (e.deadline_ns - r->hold_ns) >= grace
+                                  : now - e.nack_ns >= retry;
+        if (due) {
+            write_be32(p + 4 + 4 * count, e.seq);
+            count++;
+            e.nack_ns = now;
+            e.tries++;
+            if (e.deadline_ns - now < budget) budget = e.deadline_ns - now;
+        }
+        r->loss[keep++] = e;
+    }
+    r->nloss = keep;
+    if (count == 0) return 0;
+
+    int64_t budget_ms = budget / 1000000;
+    int64_t rtt_ms    = (r->srtt_ns + 999999) / 1000000;
+    write_be16(p,     (uint16_t)(budget_ms > 65535 ? 65535 : budget_ms));
+    write_be16(p + 2, (uint16_t)(rtt_ms    > 65535 ? 65535 : rtt_ms));
+
+    MediaHeader h = {
+        .type = MEDIA_NACK,
+        .len  = (uint16_t)(4 + 4 * count),
+        .seq  = token,
+    };
+    media_header_write(pkt, &h);
+
+    r->nacks_sent++;
+    return MEDIA_HDR_SIZE + h.len;
+}
\ No newline at end of file
@@ -0,0 +1,239 @@
+#ifndef UDPMEDIA_H
+#define UDPMEDIA_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "soundshare.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+ * Datagram framing for the UDP audio transports.
+ *
+ * Every chunk is cut into MEDIA_PAYLOAD-sized data packets.  Packets
+ * are grouped fec_k at a time (groups never span chunks) and each
+ * group is followed by one parity packet holding the XOR of its
+ * payloads, so any single lost packet per group is rebuilt on the
+ * receiver without a retransmission.
+ *
+ * On the unicast transport the receiver also talks back: a HELLO
+ * carrying its session token tells the streamer where to send, and
+ * NACKs list the data packets still missing together with how long
+ * the receiver can wait for them.  The streamer resends only those
+ * that can still arrive in time.
+ *
+ * A run of silent chunks (dtx.h) goes out as a single MEDIA_SILENCE
+ * header instead, for chunk_seq on, with the frame count in chunk_len
+ * and the number of chunks in chunk_off.  It takes no packet seq, so it
+ * is never NACKed; if it is lost the run is concealed as zeros like any
+ * other loss.
+ *
+ * Packet header (big-endian, MEDIA_HDR_SIZE bytes):
+ *   0  u8   type       low 4 bits MEDIA_DATA / MEDIA_PARITY / ...,
+ *                      high 4 bits the chunk's FRAME_CODEC_*
+ *   1  u8   fec_k      data packets per group, 0 = no parity
+ *   2  u16  len        payload bytes
+ *   4  u32  seq        packet sequence (parity: seq of the group's first,
+ *                      HELLO/NACK: session token)
+ *   8  u32  chunk_seq
+ *  12  u32  chunk_off  payload offset in the chunk (parity: group start,
+ *                      silence: chunks in the run)
+ *  16  u32  chunk_len
+ *  20  u32  ts_frames  capture position of the chunk, in sample frames
+ */
+
+#define MEDIA_HDR_SIZE    24
+#define MEDIA_PAYLOAD     1400
+#define MEDIA_MAX_FEC_K   32
+
+#define MEDIA_DATA        0
+#define MEDIA_PARITY      1
+#define MEDIA_RETX        2   /* data packet sent again on request */
+#define MEDIA_HELLO       3   /* receiver -> streamer */
+#define MEDIA_NACK        4   /* receiver -> streamer */
+#define MEDIA_SILENCE     5   /* header only: chunk_len frames of silence */
+
+/* NACK payload: u16 budget_ms, u16 rtt_ms, then u32 seqs */
+#define MEDIA_NACK_MAX    ((MEDIA_PAYLOAD - 4) / 4)
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  codec;
+    uint8_t  fec_k;
+    uint16_t len;
+    uint32_t seq;
+    uint32_t chunk_seq;
+    uint32_t chunk_off;
+    uint32_t chunk_len;
+    uint32_t ts_frames;
+} MediaHeader;
+
+void media_header_write(uint8_t *dst, const MediaHeader *h);
+void media_header_read(const uint8_t *src, MediaHeader *h);
+
+/* ---- Sender ---- */
+
+typedef struct {
+    int       fd;
+    uint32_t  next_seq;
+    int       fec_k;
+    uint8_t   parity[MEDIA_PAYLOAD];
+    long      packets;
+    long      parity_packets;
+    long      send_errors;
+    long      retransmits;
+} MediaSender;
+
+void media_sender_init(MediaSender *s, int fd, int fec_k);
+
+/**
+ * Packetise one chunk and send it to every address in `dsts`.
+ * Payloads are sent straight from `data`.  Returns the number of
+ * bytes put on the wire per destination, or -1 if nothing went out.
+ */
+ssize_t media_send_chunk(MediaSender *s,
+                         const struct sockaddr_in *dsts, int ndst,
+                         const uint8_t *data, size_t len,
+                         uint32_t chunk_seq, uint32_t ts_frames, uint8_t codec);
+
+/**
+ * Send a silence marker for the `chunks` chunks from `chunk_seq` on,
+ * `frames` frames in all.  As above.
+ */
+ssize_t media_send_silence(MediaSender *s,
+                           const struct sockaddr_in *dsts, int ndst,
+                           uint32_t frames, uint32_t chunks,
+                           uint32_t chunk_seq, uint32_t ts_frames);
+
+/**
+ * Send data packet `seq` of a chunk again as MEDIA_RETX.  `base_seq`
+ * is what next_seq was when the chunk went out.  Returns -1 if `seq`
+ * is not part of the chunk or the send failed.
+ */
+int media_resend(MediaSender *s, const struct sockaddr_in *dst,
+                 const uint8_t *data, size_t len,
+                 uint32_t chunk_seq, uint32_t ts_frames, uint8_t codec,
+                 uint32_t base_seq, uint32_t seq);
+
+/* ---- Feedback ---- */
+
+typedef struct {
+    uint32_t token;
+    int      budget_ms;      /* time left before the receiver gives up */
+    int      rtt_ms;         /* receiver's estimate, 0 = unknown */
+    int      count;
+    uint32_t seqs[MEDIA_NACK_MAX];
+} MediaNack;
+
+size_t media_build_hello(uint8_t *pkt, uint32_t token);
+/** Returns 0 if `pkt` is a well-formed NACK. */
+int    media_nack_read(const uint8_t *pkt, size_t len, MediaNack *out);
+
+/* ---- Receiver ---- */
+
+#define MEDIA_REASM_SLOTS  4
+/* An incomplete chunk is given up once a chunk this much newer shows up */
+#define MEDIA_REASM_WINDOW 2
+/* NACKs per packet before leaving it to the deadline */
+#define MEDIA_NACK_TRIES   3
+/* Gaps wider than this are a restart or a long outage, not loss */
+#define MEDIA_NACK_SPAN    1024
+
+typedef struct {
+    bool      used;
+    uint32_t  chunk_seq;
+    uint32_t  chunk_len;
+    uint32_t  ts_frames;
+    uint32_t  silent_frames; /* > 0: a silence marker, no data */
+    uint32_t  silent_chunks; /* the run of chunks the marker covers */
+    uint8_t   codec;
+    int       fec_k;
+    int       npkts;
+    int       received;
+    int64_t   first_ns;      /* arrival of the first packet */
+    uint32_t  base_seq;      /* seq of data packet 0 */
+    uint8_t  *have;          /* one flag per data packet */
+    uint8_t  *data;
+    uint8_t  *parity;        /* MEDIA_PAYLOAD bytes per group */
+    uint8_t  *parity_have;
+} ReasmSlot;
+
+/* A data packet known to be missing, found from a gap in seqs */
+typedef struct {
+    uint32_t  seq;
+    int64_t   deadline_ns;   /* no point asking for it after this */
+    int64_t   nack_ns;       /* last asked for, 0 = not yet */
+    int       tries;
+} MediaLoss;
+
+typedef struct {
+    ReasmSlot *slots;
+    int       nslots;
+    int64_t   hold_ns;       /* 0: give up by chunk window, else by time */
+    size_t    max_chunk;
+    int       max_pkts;
+    bool      started;
+    uint32_t  next_chunk;    /* next chunk_seq to hand out */
+    uint32_t  newest;        /* newest chunk_seq seen */
+    uint32_t  last_len;
+    uint8_t   last_codec;    /* stands in for chunks lost whole */
+
+    long      packets;
+    long      recovered;     /* rebuilt from parity */
+    long      lost_packets;  /* gone for good, zero-filled */
+    long      late_packets;
+
+    /* Unicast only: loss list, oldest first */
+    MediaLoss loss[MEDIA_NACK_MAX];
+    int       nloss;
+    uint32_t  hi_seq;        /* highest data seq seen */
+    bool      hi_valid;
+    int       fec_k;
+
+    int64_t   srtt_ns;       /* NACK -> retransmission round trip */
+    long      nacks_sent;
+    long      retransmits;
+} MediaReassembler;
+
+typedef struct {
+    const uint8_t *data;
+    size_t         len;
+    uint32_t       chunk_seq;
+    uint32_t       ts_frames;
+    uint32_t       silent_frames;   /* > 0: play this many frames of zeros,
+                                       a run of chunks from chunk_seq on */
+    uint8_t        codec;    /* FRAME_CODEC_* of data */
+    int            missing;  /* data packets that could not be rebuilt */
+} MediaChunk;
+
+/**
+ * `nslots` chunks can be in reassembly at once.  With `hold_ms` == 0 a
+ * chunk is given up MEDIA_REASM_WINDOW chunks after it was due (FEC
+ * only); otherwise it waits up to `hold_ms` after its first packet so
+ * retransmissions have a chance to fill it.
+ */
+int  media_reasm_init(MediaReassembler *r, size_t max_chunk, int nslots, int hold_ms);
+void media_reasm_destroy(MediaReassembler *r);
+
+/** Feed one datagram; malformed or stale packets are ignored. */
+void media_reasm_input(MediaReassembler *r, const uint8_t *pkt, size_t len);
+
+/**
+ * Hand out the next chunk in order once it is complete, or once it has
+ * been given up on (holes are zero-filled and counted in `missing`).
+ * `out->data` stays valid until the next media_reasm_input() call.
+ */
+bool media_reasm_next(MediaReassembler *r, MediaChunk *out);
+
+/**
+ * Build a NACK for every missing packet that is due to be asked for
+ * (again) into `pkt`, which has room for a full datagram.  Returns the
+ * packet length, or 0 if nothing is due.
+ */
+size_t media_reasm_nack(MediaReassembler *r, uint32_t token, uint8_t *pkt);
+
+#endif /* UDPMEDIA_H */
@@ -323,7 +323,7 @@ void ui_show_streaming(const char *format_info)
                                 "<span color='#ffcc00'>Waiting for receivers...</span>");
     set_sensitive_threadsafe(ui.btn_receive, FALSE);
     set_sensitive_threadsafe(ui.entry_ip, FALSE);
-    set_sensitive_threadsafe(ui.combo_quality, FALSE);
+    /* The quality stays live: receivers follow a switch in band */
     set_button_label_threadsafe(ui.btn_stream, "  Stop Streaming");
     swap_style_class(ui.btn_stream, "stop-btn", "stream-btn");
 }
@@ -443,27 +443,104 @@ static void on_ip_copy(GtkWidget *w, gpointer data)
     ui_update_status("IP address copied!");
 }
 
-static void on_quality_changed(GtkComboBox *combo, gpointer data)
-{
-    (void)data;
-    int idx = gtk_combo_box_get_active(combo);
-    if (idx < 0 || idx >= NUM_PRESETS) return;
+/* ---- Format switch, off the GTK thread ---- */
+
+/* Reopening capture and resizing the pipeline takes a while; the
+   quality combo and the stream button wait until it is done         */
+static struct {
+    pthread_t thread;
+    bool      running;
+    int       from;
+    int       to;
+    int       rc;
+} preset_switch;
 
+static void on_quality_changed(GtkComboBox *combo, gpointer data);
+
+static void show_preset_info(int idx)
+{
     AudioConfig cfg;
     config_load_preset(&cfg, idx);
 
-    char info[256], sr[64], fmt[256];
+    char info[256], sr[64];
     config_sample_rate_string(&cfg, sr, sizeof(sr));
-    config_format_string(&cfg, fmt, sizeof(fmt));
     snprintf(info, sizeof(info), "%s  |  %s  |  Buffer: %.1f ms",
              sr, cfg.channels == 1 ? "Mono" : "Stereo",
              config_buffer_latency_ms(&cfg));
     gtk_label_set_text(GTK_LABEL(ui.lbl_preset_info), info);
 }
 
+/* Keep the new format, or put the combo back on the one still playing */
+static void switch_finished(void)
+{
+    if (preset_switch.rc == 0) {
+        g_app.selected_preset = preset_switch.to;
+    } else {
+        g_signal_handlers_block_by_func(ui.combo_quality, G_CALLBACK(on_quality_changed), NULL);
+        gtk_combo_box_set_active(GTK_COMBO_BOX(ui.combo_quality), preset_switch.from);
+        g_signal_handlers_unblock_by_func(ui.combo_quality, G_CALLBACK(on_quality_changed), NULL);
+        show_preset_info(preset_switch.from);
+    }
+    gtk_widget_set_sensitive(ui.combo_quality, TRUE);
+    gtk_widget_set_sensitive(ui.btn_stream, TRUE);
+}
+
+static gboolean switch_done_idle(gpointer data)
+{
+    (void)data;
+    if (preset_switch.running) {
+        pthread_join(preset_switch.thread, NULL);
+        preset_switch.running = false;
+        switch_finished();
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void *switch_thread_func(void *arg)
+{
+    (void)arg;
+    preset_switch.rc = streaming_switch_preset(preset_switch.to);
+    g_idle_add(switch_done_idle, NULL);
+    return NULL;
+}
+
+/* Before anything else stops the stream */
+static void wait_for_switch(void)
+{
+    if (preset_switch.running) {
+        pthread_join(preset_switch.thread, NULL);
+        preset_switch.running = false;
+    }
+}
+
+static void on_quality_changed(GtkComboBox *combo, gpointer data)
+{
+    (void)data;
+    int idx = gtk_combo_box_get_active(combo);
+    if (idx < 0 || idx >= NUM_PRESETS) return;
+
+    show_preset_info(idx);
+    if (!atomic_load(&g_app.is_streaming) || preset_switch.running ||
+        idx == g_app.selected_preset)
+        return;
+
+    preset_switch.from = g_app.selected_preset;
+    preset_switch.to   = idx;
+    gtk_widget_set_sensitive(ui.combo_quality, FALSE);
+    gtk_widget_set_sensitive(ui.btn_stream, FALSE);
+    if (pthread_create(&preset_switch.thread, NULL, switch_thread_func, NULL) != 0) {
+        LOG_E("pthread_create(format switch): %s", strerror(errno));
+        preset_switch.rc = -1;
+        switch_finished();
+        return;
+    }
+    preset_switch.running = true;
+}
+
 static void on_window_destroy(GtkWidget *w, gpointer data)
 {
     (void)w; (void)data;
+    wait_for_switch();
     streaming_stop();
     receiving_stop();
     gtk_main_quit();
@@ -0,0 +1,187 @@
+#include "workpool.h"
+
+#include <sched.h>
+
+struct WorkPool {
+    int             helpers;
+    pthread_t      *threads;
+
+    /* Per worker, caller included: kept between loops */
+    void          **scratch;
+    size_t         *scratch_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  start;       /* a new loop is up, or quit */
+    pthread_cond_t  done;        /* the last helper finished */
+    uint64_t        generation;  /* bumped per loop */
+    int             busy;        /* helpers still in the current loop */
+    bool            quit;
+
+    WorkFn          fn;
+    void           *ctx;
+    int             n;
+    atomic_int      next;        /* next index to hand out */
+};
+
+typedef struct {
+    WorkPool *pool;
+    int       worker;
+} HelperArg;
+
+static void drain(WorkPool *p, WorkFn fn, void *ctx, int n, int worker)
+{
+    int i;
+    while ((i = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed)) < n)
+        fn(ctx, i, worker);
+}
+
+static void *helper_func(void *arg)
+{
+    HelperArg *ha     = arg;
+    WorkPool  *p      = ha->pool;
+    int        worker = ha->worker;
+    uint64_t   seen   = 0;
+    free(ha);
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->quit && p->generation == seen)
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->quit) break;
+
+        seen = p->generation;
+        WorkFn fn  = p->fn;
+        void  *ctx = p->ctx;
+        int    n   = p->n;
+        pthread_mutex_unlock(&p->lock);
+
+        drain(p, fn, ctx, n, worker);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->busy == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Helpers go wherever the process may run: the main thread's mask,
+   not that of a pinned thread creating the pool */
+static void unpin_helper(pthread_t t)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(getpid(), sizeof(set), &set) < 0) return;
+
+    int rc = pthread_setaffinity_np(t, sizeof(set), &set);
+    if (rc != 0)
+        LOG_W("Work pool helper affinity: %s", strerror(rc));
+}
+
+WorkPool *workpool_create(int helpers)
+{
+    if (helpers < 0) helpers = 0;
+
+    WorkPool *p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    p->threads      = calloc((size_t)helpers + 1, sizeof(pthread_t));
+    p->scratch      = calloc((size_t)helpers + 1, sizeof(void *));
+    p->scratch_size = calloc((size_t)helpers + 1, sizeof(size_t));
+    if (!p->threads || !p->scratch || !p->scratch_size) {
+        free(p->scratch_size);
+        free(p->scratch);
+        free(p->threads);
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (int i = 0; i < helpers; i++) {
+        HelperArg *ha = malloc(sizeof(*ha));
+        if (ha) *ha = (HelperArg){ .pool = p, .worker = i + 1 };
+        if (!ha || pthread_create(&p->threads[i], NULL, helper_func, ha) != 0) {
+            LOG_W("Work pool: started %d of %d helper threads", i, helpers);
+            free(ha);
+            break;
+        }
+        unpin_helper(p->threads[i]);
+        p->helpers++;
+    }
+    return p;
+}
+
+void workpool_destroy(WorkPool *p)
+{
+    if (!p) return;
+
+    pthread_mutex_lock(&p->lock);
+    p->quit = true;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->helpers; i++)
+        pthread_join(p->threads[i], NULL);
+
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->start);
+    pthread_mutex_destroy(&p->lock);
+    for (int i = 0; i <= p->helpers; i++)
+        free(p->scratch[i]);
+    free(p->scratch_size);
+    free(p->scratch);
+    free(p->threads);
+    free(p);
+}
+
+int workpool_size(const WorkPool *p)
+{
+    return p ? p->helpers + 1 : 1;
+}
+
+void workpool_run(WorkPool *p, WorkFn fn, void *ctx, int n)
+{
+    if (!p || p->helpers == 0 || n <= 1) {
+        for (int i = 0; i < n; i++)
+            fn(ctx, i, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->fn   = fn;
+    p->ctx  = ctx;
+    p->n    = n;
+    p->busy = p->helpers;
+    atomic_store_explicit(&p->next, 0, memory_order_relaxed);
+    p->generation++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    drain(p, fn, ctx, n, 0);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy > 0)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void *workpool_scratch(WorkPool *p, int worker, size_t size)
+{
+    if (!p || worker < 0 || worker > p->helpers) return NULL;
+    if (size <= p->scratch_size[worker]) return p->scratch[worker];
+
+    /* Nothing in it needs keeping: a fresh block beats realloc's copy */
+    free(p->scratch[worker]);
+    p->scratch[worker]      = malloc(size);
+    p->scratch_size[worker] = p->scratch[worker] ? size : 0;
+    return p->scratch[worker];
+}
+
+int workpool_auto_helpers(int threads)
+{
+    if (threads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = ncpu > 0 ? (int)ncpu : 1;
+    }
+    if (threads > WORKPOOL_MAX_THREADS) threads = WORKPOOL_MAX_THREADS;
+    return threads - 1;
+}
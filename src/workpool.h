@@ -0,0 +1,49 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include "soundshare.h"
+
+/*
+ * Small fixed pool of threads for data-parallel loops.
+ *
+ * workpool_run() hands out the indices 0..n-1 to the pool and to the
+ * calling thread, which works along, and returns once all of them are
+ * done.  One loop runs at a time per pool.  Each call also says which
+ * worker it runs on (0 is the caller), so per-worker scratch can be
+ * set up once and indexed without locking.
+ */
+
+/* Upper bound for the automatic size */
+#define WORKPOOL_MAX_THREADS 16
+
+typedef struct WorkPool WorkPool;
+
+typedef void (*WorkFn)(void *ctx, int index, int worker);
+
+/**
+ * `helpers` threads besides the caller; with 0 or less loops run inline
+ * on the caller.  Helpers may run on any CPU the process was started
+ * with, whatever the creating thread is pinned to.  NULL if out of
+ * memory.
+ */
+WorkPool *workpool_create(int helpers);
+void      workpool_destroy(WorkPool *p);
+
+/** Workers a loop can run on, caller included.  1 for a NULL pool. */
+int  workpool_size(const WorkPool *p);
+
+/** Run fn(ctx, i, worker) for i in [0, n).  A NULL pool runs inline. */
+void workpool_run(WorkPool *p, WorkFn fn, void *ctx, int n);
+
+/**
+ * At least `size` bytes of scratch for `worker`, kept until the pool
+ * goes and only moved when a call asks for more than before.  Only from
+ * that worker (0: the thread calling workpool_run).  NULL for a NULL
+ * pool or when out of memory.
+ */
+void *workpool_scratch(WorkPool *p, int worker, size_t size);
+
+/** Helper count for `threads` (0 = one per online CPU), capped. */
+int  workpool_auto_helpers(int threads);
+
+#endif /* WORKPOOL_H */
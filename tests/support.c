@@ -0,0 +1,36 @@
+#include "soundshare.h"
+
+#include <stdarg.h>
+
+/*
+ * What the codec sources expect from main.c, for tests that link only
+ * those.  Warnings and errors still go to stderr so a failing case
+ * shows why.
+ */
+
+AppState g_app;
+
+void ss_log(LogLevel level, const char *fmt, ...)
+{
+    if (level < LOG_WARN) return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+int64_t current_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t current_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
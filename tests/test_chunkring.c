@@ -0,0 +1,207 @@
+#include "soundshare.h"
+#include "chunkring.h"
+
+#include <sched.h>
+
+/*
+ * Chunk ring: a slot is handed out only once every reference to its
+ * last occupant is gone, readers find exactly the chunks still in the
+ * ring, and a writer fanning out to several reader threads gets every
+ * chunk to each of them intact and in order.
+ */
+
+#define NSLOTS     8
+#define SLOT_SIZE  256
+#define READERS    3
+#define THREADED   200000
+
+static uint8_t chunk_byte(uint64_t seq, size_t i)
+{
+    uint64_t x = seq * 0x9e3779b97f4a7c15ull + i;
+    return (uint8_t)(x ^ x >> 29);
+}
+
+static size_t chunk_len(uint64_t seq)
+{
+    return 1 + (size_t)(seq * 37 % SLOT_SIZE);
+}
+
+static void fill(ChunkSlot *s, uint64_t seq)
+{
+    size_t len = chunk_len(seq);
+    for (size_t i = 0; i < len; i++)
+        s->data[i] = chunk_byte(seq, i);
+}
+
+static bool intact(const ChunkSlot *s, uint64_t seq)
+{
+    if (s->seq != seq || s->len != chunk_len(seq)) return false;
+    for (size_t i = 0; i < s->len; i++)
+        if (s->data[i] != chunk_byte(seq, i)) return false;
+    return true;
+}
+
+/* Publish `seq`, which must be head, with `refs` references */
+static int publish(ChunkRing *r, uint64_t seq, int refs)
+{
+    ChunkSlot *s = chunk_ring_acquire(r, seq);
+    if (!s) return -1;
+    fill(s, seq);
+    chunk_ring_publish(r, chunk_len(seq), (int64_t)seq, refs);
+    return 0;
+}
+
+/* ---- One thread ---- */
+
+static int single(uint64_t start)
+{
+    ChunkRing r;
+    if (chunk_ring_init(&r, NSLOTS, SLOT_SIZE, 0) < 0) return 1;
+    chunk_ring_start_at(&r, start);
+
+    int failed = 0;
+    if (chunk_ring_get(&r, start)) {
+        fprintf(stderr, "from %llu: chunk found before it was published\n",
+                (unsigned long long)start);
+        failed++;
+    }
+
+    /* Fill the ring; every chunk is held by one reader */
+    for (uint64_t seq = start; seq < start + NSLOTS; seq++)
+        if (publish(&r, seq, 1) < 0) failed++;
+    if (chunk_ring_head(&r) != start + NSLOTS) failed++;
+
+    for (uint64_t seq = start; seq < start + NSLOTS; seq++) {
+        ChunkSlot *s = chunk_ring_get(&r, seq);
+        if (!s || !intact(s, seq)) {
+            fprintf(stderr, "from %llu: chunk %llu not intact\n",
+                    (unsigned long long)start, (unsigned long long)seq);
+            failed++;
+        }
+    }
+
+    /* The oldest is still held: its slot cannot be reused */
+    uint64_t next = start + NSLOTS;
+    if (chunk_ring_acquire(&r, next) || atomic_load(&r.overruns) != 1) {
+        fprintf(stderr, "from %llu: held slot handed out\n", (unsigned long long)start);
+        failed++;
+    }
+
+    /* A replay holds it past the reader's release */
+    ChunkSlot *oldest = chunk_ring_get(&r, start);
+    chunk_ring_retain(oldest);
+    chunk_ring_release(oldest);
+    if (chunk_ring_acquire(&r, next)) failed++;
+    chunk_ring_release(oldest);
+
+    if (publish(&r, next, 1) < 0) {
+        fprintf(stderr, "from %llu: released slot not reused\n", (unsigned long long)start);
+        failed++;
+    }
+    if (chunk_ring_get(&r, start)) {
+        fprintf(stderr, "from %llu: overwritten chunk still found\n",
+                (unsigned long long)start);
+        failed++;
+    }
+    ChunkSlot *s = chunk_ring_get(&r, next);
+    if (!s || !intact(s, next)) failed++;
+
+    /* Published with no one to send it to: free straight away */
+    for (uint64_t seq = start + 1; seq <= next; seq++)
+        chunk_ring_release(chunk_ring_get(&r, seq));
+    for (uint64_t seq = next + 1; seq < next + 3 * NSLOTS; seq++)
+        if (publish(&r, seq, 0) < 0) failed++;
+    if (atomic_load(&r.overruns) != 2) failed++;
+
+    chunk_ring_destroy(&r);
+    return failed ? 1 : 0;
+}
+
+/* ---- Writer and readers ---- */
+
+typedef struct {
+    ChunkRing *ring;
+    int        bad;
+} Reader;
+
+/* Set by whichever side gives up, so the others do not wait forever */
+static atomic_bool stop;
+
+static void *reader_thread(void *arg)
+{
+    Reader *rd = arg;
+
+    for (uint64_t seq = 0; seq < THREADED; seq++) {
+        ChunkSlot *s;
+        while (!(s = chunk_ring_get(rd->ring, seq))) {
+            if (chunk_ring_head(rd->ring) > seq) {
+                fprintf(stderr, "reader: chunk %llu overwritten while held\n",
+                        (unsigned long long)seq);
+                rd->bad++;
+                atomic_store(&stop, true);
+            }
+            if (atomic_load(&stop)) return NULL;
+            sched_yield();
+        }
+        if (!intact(s, seq) && rd->bad++ == 0)
+            fprintf(stderr, "reader: chunk %llu not intact\n", (unsigned long long)seq);
+        chunk_ring_release(s);
+    }
+    return NULL;
+}
+
+static int threaded(void)
+{
+    ChunkRing r;
+    if (chunk_ring_init(&r, NSLOTS, SLOT_SIZE, 0) < 0) return 1;
+
+    Reader    rd[READERS];
+    pthread_t th[READERS];
+    for (int i = 0; i < READERS; i++) {
+        rd[i] = (Reader){ .ring = &r };
+        pthread_create(&th[i], NULL, reader_thread, &rd[i]);
+    }
+
+    int     failed = 0;
+    int64_t t0     = current_time_ms();
+    for (uint64_t seq = 0; seq < THREADED && !atomic_load(&stop); seq++) {
+        while (publish(&r, seq, READERS) < 0 && !atomic_load(&stop)) {
+            if (current_time_ms() - t0 > 10000) {
+                fprintf(stderr, "writer: stuck at chunk %llu\n", (unsigned long long)seq);
+                atomic_store(&stop, true);
+                failed++;
+            }
+            sched_yield();
+        }
+    }
+
+    for (int i = 0; i < READERS; i++) {
+        pthread_join(th[i], NULL);
+        failed += rd[i].bad;
+    }
+    for (int i = 0; i < NSLOTS; i++) {
+        if (atomic_load(&r.slots[i].refs) != 0) {
+            fprintf(stderr, "threaded: slot %d left with references\n", i);
+            failed++;
+        }
+    }
+
+    chunk_ring_destroy(&r);
+    return failed ? 1 : 0;
+}
+
+int main(void)
+{
+    int failed = 0, cases = 0;
+
+    static const uint64_t STARTS[] = { 0, 5, UINT64_MAX / 2 };
+    for (size_t i = 0; i < sizeof(STARTS) / sizeof(STARTS[0]); i++) {
+        failed += single(STARTS[i]);
+        cases++;
+    }
+    failed += threaded();
+    cases++;
+
+    printf("%d of %d chunk ring cases failed\n", failed, cases);
+    return failed ? 1 : 0;
+}
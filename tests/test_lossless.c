@@ -0,0 +1,165 @@
+#include "soundshare.h"
+#include "config.h"
+#include "lossless.h"
+#include "workpool.h"
+
+/*
+ * Lossless round trip: every integer preset's format, and the same
+ * formats with chunk lengths that leave odd tail blocks, must come back
+ * bit for bit, coded on this thread alone and across a pool.
+ */
+
+enum { SIG_SILENCE, SIG_NOISE, SIG_SQUARE, SIG_TONE, SIG_COUNT };
+
+static const char *SIG_NAMES[SIG_COUNT] = { "silence", "noise", "square", "tone" };
+
+/* Lengths around the block size and the pool's split size */
+static const int TAIL_FRAMES[] = {
+    1, 7, 1023, LOSSLESS_BLOCK - 1, LOSSLESS_BLOCK + 1, 3 * LOSSLESS_BLOCK + 333,
+};
+
+static uint32_t rng = 1;
+
+static uint32_t next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* A sample of `bits` bits, as it sits in its container */
+static void put_sample(const AudioConfig *cfg, uint8_t *p, int32_t v)
+{
+    if (cfg->bytes_per_sample == 2) {
+        int16_t s = (int16_t)v;
+        memcpy(p, &s, 2);
+    } else {
+        uint32_t s = (uint32_t)v << (32 - cfg->bits_per_sample);
+        memcpy(p, &s, 4);
+    }
+}
+
+static void fill(const AudioConfig *cfg, uint8_t *pcm, size_t frames, int sig)
+{
+    const int32_t max = (int32_t)((1u << (cfg->bits_per_sample - 1)) - 1);
+    const int32_t min = -max - 1;
+    const size_t  bps = (size_t)cfg->bytes_per_sample;
+
+    for (size_t i = 0; i < frames; i++) {
+        for (int c = 0; c < cfg->channels; c++) {
+            int32_t v = 0;
+            switch (sig) {
+            case SIG_NOISE:
+                v = (int32_t)(next_rand() >> (33 - cfg->bits_per_sample));
+                if (next_rand() & 1) v = -v - 1;
+                break;
+            case SIG_SQUARE:
+                /* Channels in opposite phase: the side channel spans
+                   one bit more than the samples                      */
+                v = ((i / 5 + (size_t)c) & 1) ? max : min;
+                break;
+            case SIG_TONE:
+                v = (int32_t)(max * 0.7 * sin(2 * M_PI * 441.0 * (double)i /
+                                              cfg->sample_rate + c));
+                break;
+            }
+            put_sample(cfg, pcm + (i * (size_t)cfg->channels + (size_t)c) * bps, v);
+        }
+    }
+}
+
+static int round_trip(const AudioConfig *cfg, int sig, WorkPool *pool, const char *what)
+{
+    size_t   len = (size_t)cfg->chunk_size;
+    size_t   cap = lossless_max_encoded(cfg);
+    uint8_t *pcm = malloc(len);
+    uint8_t *dec = malloc(len);
+    uint8_t *enc = malloc(cap);
+    int      rc  = 1;
+
+    if (!pcm || !dec || !enc) goto out;
+    fill(cfg, pcm, (size_t)cfg->frames_per_buffer, sig);
+    memset(dec, 0xa5, len);
+
+    ssize_t n = lossless_encode(cfg, pcm, len, enc, cap, pool);
+    if (n < 0) {
+        fprintf(stderr, "%s, %s: encode failed\n", what, SIG_NAMES[sig]);
+        goto out;
+    }
+    ssize_t m = lossless_decode(cfg, enc, (size_t)n, dec, len, pool);
+    if (m != (ssize_t)len) {
+        fprintf(stderr, "%s, %s: decoded %zd of %zu bytes\n", what, SIG_NAMES[sig], m, len);
+        goto out;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (pcm[i] != dec[i]) {
+            fprintf(stderr, "%s, %s: byte %zu is %02x, was %02x\n",
+                    what, SIG_NAMES[sig], i, dec[i], pcm[i]);
+            goto out;
+        }
+    }
+    rc = 0;
+out:
+    free(pcm);
+    free(dec);
+    free(enc);
+    return rc;
+}
+
+static int all_signals(const AudioConfig *cfg, WorkPool *pool, const char *what)
+{
+    int failed = 0;
+    for (int sig = 0; sig < SIG_COUNT; sig++)
+        failed += round_trip(cfg, sig, pool, what);
+    return failed;
+}
+
+int main(void)
+{
+    WorkPool *pool   = workpool_create(3);
+    WorkPool *solo   = workpool_create(0);   /* inline, but keeps scratch */
+    int       failed = 0;
+    int       cases  = 0;
+
+    for (int p = 0; p < NUM_PRESETS; p++) {
+        AudioConfig cfg;
+        config_load_preset(&cfg, p);
+        if (cfg.use_opus || !lossless_supported(&cfg)) continue;
+
+        char what[96];
+        WorkPool   *pools[] = { NULL, solo, pool };
+        const char *names[] = { "", ", no helpers", ", pool" };
+        for (int i = 0; i < 3; i++) {
+            snprintf(what, sizeof(what), "preset %d%s", p, names[i]);
+            failed += all_signals(&cfg, pools[i], what);
+            cases  += SIG_COUNT;
+        }
+
+        for (size_t t = 0; t < sizeof(TAIL_FRAMES) / sizeof(TAIL_FRAMES[0]); t++) {
+            AudioConfig tail;
+            config_from_header(&tail, cfg.sample_rate, cfg.channels, TAIL_FRAMES[t],
+                               cfg.bits_per_sample, 1, 0);
+            snprintf(what, sizeof(what), "preset %d, %d frames, pool", p, TAIL_FRAMES[t]);
+            failed += all_signals(&tail, pool, what);
+            cases  += SIG_COUNT;
+        }
+    }
+
+    /* Wider than the codec's arithmetic: refused, not mangled */
+    AudioConfig wide;
+    config_from_header(&wide, 48000, 2, 240, 32, 1, 0);
+    uint8_t pcm[240 * 2 * 4] = { 0 };
+    uint8_t enc[4096];
+    if (lossless_supported(&wide) ||
+        lossless_encode(&wide, pcm, sizeof(pcm), enc, sizeof(enc), NULL) >= 0) {
+        fprintf(stderr, "32-bit audio accepted\n");
+        failed++;
+    }
+    cases++;
+
+    workpool_destroy(solo);
+    workpool_destroy(pool);
+    printf("%d of %d lossless cases failed\n", failed, cases);
+    return failed ? 1 : 0;
+}
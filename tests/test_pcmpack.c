@@ -0,0 +1,123 @@
+/* The kernels are static: test them from inside */
+#include "../src/pcmpack.c"
+
+/*
+ * Packed 24-bit: every kernel this CPU runs must match the scalar code
+ * for every length up to a few vector widths, so each of the vector
+ * loops' tails (the i + 6 and i + 11 bounds) is taken, from any input
+ * alignment, and must not write a byte past the samples it was given.
+ */
+
+#define MAX_SAMPLES 300
+#define GUARD       64
+#define GUARD_BYTE  0x5a
+
+typedef struct {
+    const char *name;
+    PackFn      pack;
+    PackFn      unpack;
+} Kernels;
+
+static uint32_t rng = 1;
+
+static uint8_t next_byte(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return (uint8_t)rng;
+}
+
+/* Run fn over `samples` from `in`, into a guarded copy of `out` */
+static int run(PackFn fn, const uint8_t *in, size_t samples, size_t out_size,
+               uint8_t *out)
+{
+    uint8_t buf[MAX_SAMPLES * 4 + 2 * GUARD];
+    memset(buf, GUARD_BYTE, sizeof(buf));
+    fn(in, buf + GUARD, samples);
+    memcpy(out, buf + GUARD, out_size);
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        if ((i < GUARD || i >= GUARD + out_size) && buf[i] != GUARD_BYTE)
+            return -1;
+    }
+    return 0;
+}
+
+static int check(const Kernels *k, size_t samples, size_t align)
+{
+    uint8_t in[MAX_SAMPLES * 4 + 4];
+    uint8_t want[MAX_SAMPLES * 4], got[MAX_SAMPLES * 4];
+    const uint8_t *src = in + align;
+
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = next_byte();
+
+    pack_scalar(src, want, samples);
+    if (run(k->pack, src, samples, samples * 3, got) < 0) {
+        fprintf(stderr, "%s pack, %zu samples at +%zu: wrote past the end\n",
+                k->name, samples, align);
+        return 1;
+    }
+    if (memcmp(want, got, samples * 3) != 0) {
+        fprintf(stderr, "%s pack, %zu samples at +%zu: differs from scalar\n",
+                k->name, samples, align);
+        return 1;
+    }
+
+    unpack_scalar(src, want, samples);
+    if (run(k->unpack, src, samples, samples * 4, got) < 0) {
+        fprintf(stderr, "%s unpack, %zu samples at +%zu: wrote past the end\n",
+                k->name, samples, align);
+        return 1;
+    }
+    if (memcmp(want, got, samples * 4) != 0) {
+        fprintf(stderr, "%s unpack, %zu samples at +%zu: differs from scalar\n",
+                k->name, samples, align);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    Kernels kernels[3];
+    int     nkernels = 0;
+
+    kernels[nkernels++] = (Kernels){ "scalar", pack_scalar, unpack_scalar };
+#ifdef PCMPACK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        kernels[nkernels++] = (Kernels){ "SSSE3", pack_ssse3, unpack_ssse3 };
+    if (__builtin_cpu_supports("avx2"))
+        kernels[nkernels++] = (Kernels){ "AVX2", pack_avx2, unpack_avx2 };
+#endif
+
+    int failed = 0, cases = 0;
+    for (int k = 0; k < nkernels; k++) {
+        for (size_t n = 0; n <= MAX_SAMPLES; n++) {
+            for (size_t align = 0; align < 4; align++) {
+                failed += check(&kernels[k], n, align);
+                cases++;
+            }
+        }
+    }
+
+    /* The public entry points, whichever kernels they picked */
+    uint8_t in[MAX_SAMPLES * 4], packed[MAX_SAMPLES * 3], out[MAX_SAMPLES * 4];
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = next_byte();
+    pcm_pack24(in, packed, MAX_SAMPLES);
+    pcm_unpack24(packed, out, MAX_SAMPLES);
+    for (size_t i = 0; i < sizeof(in); i++) {
+        if (out[i] != (i % 4 ? in[i] : 0)) {
+            fprintf(stderr, "%s round trip: byte %zu differs\n", pcm_pack24_impl(), i);
+            failed++;
+            break;
+        }
+    }
+    cases++;
+
+    printf("%d of %d packing cases failed (%s in use)\n", failed, cases, pcm_pack24_impl());
+    return failed ? 1 : 0;
+}
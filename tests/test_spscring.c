@@ -0,0 +1,171 @@
+#include "soundshare.h"
+#include "spscring.h"
+
+#include <sched.h>
+
+/*
+ * SPSC ring: capacity rounds down to a power of two, a full ring
+ * refuses and counts the push, descriptors come out in order across
+ * the wrap of the 32-bit indices, and a producer and a consumer thread
+ * pass every descriptor through without loss or reordering.
+ */
+
+#define THREADED 1000000
+
+static ChunkDesc desc(uint64_t seq)
+{
+    return (ChunkDesc){
+        .seq        = seq,
+        .len        = (size_t)(seq * 7 % 4096),
+        .capture_ns = (int64_t)(seq * 3),
+        .stage      = (int)(seq % 5) - 1,
+    };
+}
+
+static bool same(const ChunkDesc *d, uint64_t seq)
+{
+    ChunkDesc want = desc(seq);
+    return d->seq == want.seq && d->len == want.len &&
+           d->capture_ns == want.capture_ns && d->stage == want.stage;
+}
+
+static int capacities(void)
+{
+    static const uint32_t ASKED[][2] = {
+        { 0, 2 }, { 1, 2 }, { 2, 2 }, { 5, 4 }, { 64, 64 }, { 100, 64 },
+    };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(ASKED) / sizeof(ASKED[0]); i++) {
+        SpscRing q;
+        if (spsc_init(&q, ASKED[i][0]) < 0) return 1;
+        if (spsc_capacity(&q) != (int)ASKED[i][1]) {
+            fprintf(stderr, "capacity %u: got %d, want %u\n",
+                    ASKED[i][0], spsc_capacity(&q), ASKED[i][1]);
+            failed++;
+        }
+        spsc_destroy(&q);
+    }
+    return failed ? 1 : 0;
+}
+
+/* Fill, overfill, drain, from indices `start` */
+static int single(uint32_t start)
+{
+    SpscRing q;
+    if (spsc_init(&q, 8) < 0) return 1;
+    atomic_store(&q.head, start);
+    atomic_store(&q.tail, start);
+
+    int       failed = 0;
+    uint64_t  pushed = 0, popped = 0;
+    ChunkDesc d;
+
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < spsc_capacity(&q); i++) {
+            d = desc(pushed);
+            if (!spsc_push(&q, &d)) failed++;
+            pushed++;
+        }
+        d = desc(pushed);
+        if (spsc_push(&q, &d) || spsc_depth(&q) != spsc_capacity(&q)) {
+            fprintf(stderr, "from %u: full ring took a push\n", start);
+            failed++;
+        }
+
+        /* Drain part of it, so the next round wraps mid-ring */
+        int take = round % 2 ? spsc_capacity(&q) : 3;
+        for (int i = 0; i < take; i++) {
+            if (!spsc_pop(&q, &d) || !same(&d, popped)) {
+                fprintf(stderr, "from %u: descriptor %llu out of order\n",
+                        start, (unsigned long long)popped);
+                failed++;
+            }
+            popped++;
+        }
+        while (spsc_depth(&q) < spsc_capacity(&q)) {
+            d = desc(pushed++);
+            spsc_push(&q, &d);
+        }
+        while (spsc_pop(&q, &d)) {
+            if (!same(&d, popped++)) failed++;
+        }
+        if (spsc_depth(&q) != 0) failed++;
+    }
+
+    if (atomic_load(&q.overruns) != 5 ||
+        atomic_load(&q.max_occupancy) != spsc_capacity(&q)) {
+        fprintf(stderr, "from %u: %ld overruns, max occupancy %d\n", start,
+                atomic_load(&q.overruns), atomic_load(&q.max_occupancy));
+        failed++;
+    }
+
+    spsc_destroy(&q);
+    return failed ? 1 : 0;
+}
+
+/* ---- Producer and consumer ---- */
+
+static void *consumer_thread(void *arg)
+{
+    SpscRing *q   = arg;
+    long      bad = 0;
+
+    for (uint64_t seq = 0; seq < THREADED; seq++) {
+        ChunkDesc d;
+        int64_t   t0 = current_time_ms();
+        while (!spsc_pop(q, &d)) {
+            if (current_time_ms() - t0 > 10000) {
+                fprintf(stderr, "consumer: descriptor %llu never came\n",
+                        (unsigned long long)seq);
+                return (void *)1;
+            }
+            sched_yield();
+        }
+        if (!same(&d, seq) && bad++ == 0)
+            fprintf(stderr, "consumer: descriptor %llu is %llu\n",
+                    (unsigned long long)seq, (unsigned long long)d.seq);
+    }
+    return (void *)bad;
+}
+
+static int threaded(void)
+{
+    SpscRing q;
+    if (spsc_init(&q, 16) < 0) return 1;
+
+    pthread_t th;
+    pthread_create(&th, NULL, consumer_thread, &q);
+
+    for (uint64_t seq = 0; seq < THREADED; seq++) {
+        ChunkDesc d = desc(seq);
+        while (!spsc_push(&q, &d))
+            sched_yield();
+    }
+
+    void *bad;
+    pthread_join(th, &bad);
+    int failed = bad != NULL || spsc_depth(&q) != 0;
+
+    spsc_destroy(&q);
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0, cases = 0;
+
+    failed += capacities();
+    cases++;
+
+    static const uint32_t STARTS[] = { 0, 3, UINT32_MAX - 4 };
+    for (size_t i = 0; i < sizeof(STARTS) / sizeof(STARTS[0]); i++) {
+        failed += single(STARTS[i]);
+        cases++;
+    }
+    failed += threaded();
+    cases++;
+
+    printf("%d of %d SPSC ring cases failed\n", failed, cases);
+    return failed ? 1 : 0;
+}
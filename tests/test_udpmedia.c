@@ -0,0 +1,582 @@
+#include "soundshare.h"
+#include "protocol.h"
+#include "udpmedia.h"
+
+#include <arpa/inet.h>
+
+/*
+ * UDP media framing: chunks cut up by media_send_chunk and put back
+ * together by the reassembler must come back byte for byte through
+ * loss, reordering, duplicates and sequence wrap.  With FEC any one
+ * data packet lost per group is rebuilt; what cannot be rebuilt comes
+ * out zero-filled and counted in `missing`, and a chunk lost whole
+ * stands in as silence the length of the one before.  On unicast the
+ * rest is NACKed and filled by the resend instead.
+ */
+
+#define MAX_CHUNK   (12 * MEDIA_PAYLOAD + 321)
+#define CHUNK_PKTS  (2 * (MAX_CHUNK / MEDIA_PAYLOAD + 1))   /* fec_k 1 doubles */
+#define NCHUNKS     24
+#define TAIL        MEDIA_REASM_WINDOW   /* clean chunks that push the last out */
+
+/* A byte, a packet and a byte either side of it, a full group, ... */
+static const size_t LENS[] = {
+    1, MEDIA_PAYLOAD - 1, MEDIA_PAYLOAD, MEDIA_PAYLOAD + 1,
+    5 * MEDIA_PAYLOAD, MAX_CHUNK, 3000,
+};
+
+enum { LOSS_NONE, LOSS_ONE_PER_GROUP, LOSS_TWO_IN_GROUP, LOSS_WHOLE, LOSS_COUNT };
+enum { ORDER_SENT, ORDER_REVERSED, ORDER_INTERLEAVED, ORDER_COUNT };
+
+static const char *LOSS_NAMES[LOSS_COUNT]   = { "no loss", "one per group", "two in a group",
+                                                "whole chunks" };
+static const char *ORDER_NAMES[ORDER_COUNT] = { "in order", "reversed", "interleaved" };
+
+typedef struct {
+    uint8_t     buf[MEDIA_HDR_SIZE + MEDIA_PAYLOAD];
+    size_t      len;
+    MediaHeader h;
+} Packet;
+
+typedef struct {
+    uint32_t seq;
+    size_t   len;
+    Packet   pkts[CHUNK_PKTS];
+    bool     drop[CHUNK_PKTS];
+    int      npkts;
+} SentChunk;
+
+typedef struct {
+    int      fec_k;
+    int      loss;
+    int      order;
+    bool     dup;
+    uint32_t first_chunk;
+    uint32_t first_pkt;
+} Scenario;
+
+static int                sock = -1;
+static struct sockaddr_in self;
+static SentChunk          sent[NCHUNKS + TAIL];
+
+static uint8_t chunk_byte(uint32_t seq, size_t i)
+{
+    uint32_t x = seq * 2654435761u + (uint32_t)i * 40503u;
+    return (uint8_t)(x ^ x >> 13);
+}
+
+static int open_loopback(void)
+{
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return -1;
+
+    int buf = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+
+    socklen_t alen = sizeof(self);
+    memset(&self, 0, sizeof(self));
+    self.sin_family      = AF_INET;
+    self.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr *)&self, sizeof(self)) < 0 ||
+        getsockname(sock, (struct sockaddr *)&self, &alen) < 0)
+        return -1;
+    return 0;
+}
+
+/* Send chunk `c` to ourselves and keep what arrives */
+static int send_chunk(MediaSender *s, SentChunk *c)
+{
+    uint8_t data[MAX_CHUNK];
+    for (size_t i = 0; i < c->len; i++)
+        data[i] = chunk_byte(c->seq, i);
+
+    if (media_send_chunk(s, &self, 1, data, c->len, c->seq, c->seq * 480u,
+                         FRAME_CODEC_PCM) < 0)
+        return -1;
+
+    int ndata  = (int)((c->len + MEDIA_PAYLOAD - 1) / MEDIA_PAYLOAD);
+    int expect = ndata + (s->fec_k > 0 ? (ndata + s->fec_k - 1) / s->fec_k : 0);
+
+    c->npkts = 0;
+    while (c->npkts < CHUNK_PKTS) {
+        Packet *p = &c->pkts[c->npkts];
+        ssize_t n = recv(sock, p->buf, sizeof(p->buf), MSG_DONTWAIT);
+        if (n < 0) break;
+        p->len = (size_t)n;
+        media_header_read(p->buf, &p->h);
+        c->drop[c->npkts++] = false;
+    }
+    return c->npkts == expect ? 0 : -1;
+}
+
+static int pkt_index(const Packet *p)
+{
+    return (int)(p->h.chunk_off / MEDIA_PAYLOAD);
+}
+
+/* Which packets of chunk `n` never arrive.  The first chunk always
+   does, whole and in order, so the reassembler has somewhere to join */
+static void mark_loss(SentChunk *c, int n, int loss, int fec_k)
+{
+    if (n == 0 || n >= NCHUNKS) return;
+
+    /* Without FEC a whole chunk counts as the group */
+    int k = fec_k > 0 ? fec_k : CHUNK_PKTS;
+    switch (loss) {
+    case LOSS_ONE_PER_GROUP:
+        /* Without parity, one-packet chunks stay whole: a run of them
+           lost would outrun the reassembly slots                      */
+        if (fec_k == 0 && c->len <= MEDIA_PAYLOAD) break;
+        for (int i = 0; i < c->npkts; i++) {
+            const Packet *p = &c->pkts[i];
+            int idx   = pkt_index(p);
+            int first = idx / k * k;
+            int size  = (int)((c->len - (size_t)first * MEDIA_PAYLOAD + MEDIA_PAYLOAD - 1) /
+                              MEDIA_PAYLOAD);
+            if (size > k) size = k;
+            if (p->h.type == MEDIA_DATA && idx == first + (n + idx / k) % size)
+                c->drop[i] = true;
+        }
+        break;
+    case LOSS_TWO_IN_GROUP:
+        /* First and last packet of the first group, every third chunk */
+        if (n % 3 != 1) break;
+        for (int i = 0; i < c->npkts; i++) {
+            const Packet *p = &c->pkts[i];
+            int last = (int)((c->len - 1) / MEDIA_PAYLOAD);
+            if (last >= k) last = k - 1;
+            if (p->h.type == MEDIA_DATA && last > 0 &&
+                (pkt_index(p) == 0 || pkt_index(p) == last))
+                c->drop[i] = true;
+        }
+        break;
+    case LOSS_WHOLE:
+        if (n % 5 != 2) break;
+        for (int i = 0; i < c->npkts; i++)
+            c->drop[i] = true;
+        break;
+    }
+}
+
+/* Feed order: chunks as sent, each one back to front, or chunk pairs
+   interleaved packet by packet                                       */
+static int build_feed(int order, const Packet **feed)
+{
+    int n = 0;
+    for (int ci = 0; ci < NCHUNKS + TAIL; ci++) {
+        SentChunk *a = &sent[ci];
+        SentChunk *b = ci + 1 < NCHUNKS ? &sent[ci + 1] : NULL;
+
+        if (ci == 0 || ci >= NCHUNKS || order == ORDER_SENT) {
+            for (int i = 0; i < a->npkts; i++)
+                if (!a->drop[i]) feed[n++] = &a->pkts[i];
+        } else if (order == ORDER_REVERSED) {
+            for (int i = a->npkts - 1; i >= 0; i--)
+                if (!a->drop[i]) feed[n++] = &a->pkts[i];
+        } else {
+            int bn = b ? b->npkts : 0;
+            for (int i = 0; i < a->npkts || i < bn; i++) {
+                if (i < a->npkts && !a->drop[i]) feed[n++] = &a->pkts[i];
+                if (i < bn && !b->drop[i])       feed[n++] = &b->pkts[i];
+            }
+            if (b) ci++;
+        }
+    }
+    return n;
+}
+
+static bool lost_whole(const SentChunk *c)
+{
+    for (int i = 0; i < c->npkts; i++)
+        if (!c->drop[i]) return false;
+    return true;
+}
+
+/* What chunk `n` must come out as: its bytes, minus the packets that
+   were lost and that parity cannot rebuild                           */
+static size_t expect_chunk(int n, int fec_k, uint8_t *want, int *missing)
+{
+    const SentChunk *c = &sent[n];
+    int ndata = (int)((c->len + MEDIA_PAYLOAD - 1) / MEDIA_PAYLOAD);
+    int k     = fec_k > 0 ? fec_k : ndata;
+
+    if (lost_whole(c)) {
+        /* Silence as long as the last chunk that did arrive */
+        int prev = n - 1;
+        while (lost_whole(&sent[prev])) prev--;
+        size_t len = sent[prev].len;
+        memset(want, 0, len);
+        *missing = (int)((len + MEDIA_PAYLOAD - 1) / MEDIA_PAYLOAD);
+        return len;
+    }
+
+    for (size_t i = 0; i < c->len; i++)
+        want[i] = chunk_byte(c->seq, i);
+
+    *missing = 0;
+    for (int g = 0; g * k < ndata; g++) {
+        int  lost   = 0;
+        bool parity = false;
+        for (int i = 0; i < c->npkts; i++) {
+            const Packet *p = &c->pkts[i];
+            if (pkt_index(p) / k != g) continue;
+            if (p->h.type == MEDIA_PARITY)
+                parity = fec_k > 0 && !c->drop[i];
+            else if (c->drop[i])
+                lost++;
+        }
+        if (lost == 1 && parity) continue;
+
+        for (int i = 0; i < c->npkts; i++) {
+            const Packet *p = &c->pkts[i];
+            if (p->h.type != MEDIA_DATA || !c->drop[i] || pkt_index(p) / k != g) continue;
+            memset(want + p->h.chunk_off, 0, p->h.len);
+            (*missing)++;
+        }
+    }
+    return c->len;
+}
+
+static int check_chunk(const char *what, int n, int fec_k, const MediaChunk *got)
+{
+    static uint8_t want[MAX_CHUNK];
+    int    missing;
+    size_t len = expect_chunk(n, fec_k, want, &missing);
+
+    if (got->chunk_seq != sent[n].seq) {
+        fprintf(stderr, "%s: chunk %u handed out for %u\n", what, got->chunk_seq, sent[n].seq);
+        return 1;
+    }
+    if (got->len != len || got->missing != missing) {
+        fprintf(stderr, "%s: chunk %u is %zu bytes, %d missing; want %zu, %d\n",
+                what, got->chunk_seq, got->len, got->missing, len, missing);
+        return 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (got->data[i] != want[i]) {
+            fprintf(stderr, "%s: chunk %u byte %zu is %02x, want %02x\n",
+                    what, got->chunk_seq, i, got->data[i], want[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int run(const Scenario *sc)
+{
+    char what[128];
+    snprintf(what, sizeof(what), "fec_k %d, %s, %s%s, from %u/%u",
+             sc->fec_k, LOSS_NAMES[sc->loss], ORDER_NAMES[sc->order],
+             sc->dup ? ", duplicated" : "", sc->first_chunk, sc->first_pkt);
+
+    MediaSender s;
+    media_sender_init(&s, sock, sc->fec_k);
+    s.next_seq = sc->first_pkt;
+
+    for (int n = 0; n < NCHUNKS + TAIL; n++) {
+        SentChunk *c = &sent[n];
+        c->seq = sc->first_chunk + (uint32_t)n;
+        c->len = LENS[(size_t)n % (sizeof(LENS) / sizeof(LENS[0]))];
+        if (send_chunk(&s, c) < 0) {
+            fprintf(stderr, "%s: chunk %d did not come back over loopback\n", what, n);
+            return 1;
+        }
+        mark_loss(c, n, sc->loss, sc->fec_k);
+    }
+
+    static const Packet *feed[(NCHUNKS + TAIL) * CHUNK_PKTS];
+    int nfeed = build_feed(sc->order, feed);
+
+    MediaReassembler r;
+    if (media_reasm_init(&r, MAX_CHUNK, MEDIA_REASM_SLOTS, 0) < 0) return 1;
+
+    int failed = 0, out = 0;
+    for (int i = 0; i < nfeed && !failed; i++) {
+        for (int d = 0; d <= (int)sc->dup; d++)
+            media_reasm_input(&r, feed[i]->buf, feed[i]->len);
+
+        /* Duplicates also turn up after their chunk has gone out */
+        if (sc->dup && i >= 40)
+            media_reasm_input(&r, feed[i - 40]->buf, feed[i - 40]->len);
+
+        MediaChunk mc;
+        while (!failed && out < NCHUNKS && media_reasm_next(&r, &mc))
+            failed = check_chunk(what, out++, sc->fec_k, &mc);
+    }
+    if (!failed && out < NCHUNKS) {
+        fprintf(stderr, "%s: %d of %d chunks handed out\n", what, out, NCHUNKS);
+        failed = 1;
+    }
+    if (!failed && sc->loss == LOSS_ONE_PER_GROUP && sc->fec_k > 0 && r.recovered == 0) {
+        fprintf(stderr, "%s: nothing rebuilt from parity\n", what);
+        failed = 1;
+    }
+
+    media_reasm_destroy(&r);
+    return failed;
+}
+
+/* ---- Unicast: NACK and retransmission ---- */
+
+#define TOKEN   0x5eed1e55u
+#define HOLD_MS 1000
+
+/* The data packet `seq` of this run, and the chunk it belongs to */
+static Packet *find_packet(uint32_t seq, SentChunk **chunk)
+{
+    for (int n = 0; n < NCHUNKS + TAIL; n++) {
+        for (int i = 0; i < sent[n].npkts; i++) {
+            Packet *p = &sent[n].pkts[i];
+            if (p->h.type == MEDIA_DATA && p->h.seq == seq) {
+                *chunk = &sent[n];
+                return p;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Ask for what is missing and answer the NACK the way the streamer
+   does; returns the packets resent, or -1 if the NACK was wrong    */
+static int nack_round(const char *what, MediaReassembler *r, MediaSender *s, int fec_k)
+{
+    /* Past the grace FEC gets before a loss is asked for */
+    if (fec_k > 0) usleep(3000);
+
+    uint8_t pkt[MEDIA_HDR_SIZE + MEDIA_PAYLOAD];
+    size_t  len = media_reasm_nack(r, TOKEN, pkt);
+    if (len == 0) return 0;
+
+    MediaNack nack;
+    if (media_nack_read(pkt, len, &nack) < 0 || nack.token != TOKEN ||
+        nack.budget_ms > HOLD_MS) {
+        fprintf(stderr, "%s: malformed NACK\n", what);
+        return -1;
+    }
+
+    for (int i = 0; i < nack.count; i++) {
+        SentChunk *c = NULL;
+        Packet    *p = find_packet(nack.seqs[i], &c);
+        bool       dropped = false;
+        for (int j = 0; p && j < c->npkts; j++)
+            if (&c->pkts[j] == p) dropped = c->drop[j];
+        if (!dropped) {
+            fprintf(stderr, "%s: NACK for seq %u, which arrived or was rebuilt\n",
+                    what, nack.seqs[i]);
+            return -1;
+        }
+
+        uint8_t data[MAX_CHUNK];
+        for (size_t b = 0; b < c->len; b++)
+            data[b] = chunk_byte(c->seq, b);
+        if (media_resend(s, &self, data, c->len, c->seq, c->seq * 480u, FRAME_CODEC_PCM,
+                         c->pkts[0].h.seq, nack.seqs[i]) < 0) {
+            fprintf(stderr, "%s: resend of seq %u refused\n", what, nack.seqs[i]);
+            return -1;
+        }
+
+        Packet  retx;
+        ssize_t n = recv(sock, retx.buf, sizeof(retx.buf), MSG_DONTWAIT);
+        if (n < 0) {
+            fprintf(stderr, "%s: resent seq %u lost on loopback\n", what, nack.seqs[i]);
+            return -1;
+        }
+        media_reasm_input(r, retx.buf, (size_t)n);
+
+        /* From here on the chunk must come out with it */
+        for (int j = 0; j < c->npkts; j++)
+            if (&c->pkts[j] == p) c->drop[j] = false;
+    }
+    return nack.count;
+}
+
+/*
+ * Every loss parity cannot cover is NACKed once, the resent packet
+ * fills it, and each chunk comes out whole; nothing parity rebuilt or
+ * that arrived is asked for.
+ */
+static int run_nack(int fec_k, int loss, uint32_t first_chunk, uint32_t first_pkt)
+{
+    char what[128];
+    snprintf(what, sizeof(what), "NACK, fec_k %d, %s, from %u/%u",
+             fec_k, LOSS_NAMES[loss], first_chunk, first_pkt);
+
+    MediaSender s;
+    media_sender_init(&s, sock, fec_k);
+    s.next_seq = first_pkt;
+
+    for (int n = 0; n < NCHUNKS + TAIL; n++) {
+        SentChunk *c = &sent[n];
+        c->seq = first_chunk + (uint32_t)n;
+        c->len = LENS[(size_t)n % (sizeof(LENS) / sizeof(LENS[0]))];
+        if (send_chunk(&s, c) < 0) {
+            fprintf(stderr, "%s: chunk %d did not come back over loopback\n", what, n);
+            return 1;
+        }
+        mark_loss(c, n, loss, fec_k);
+    }
+
+    /* At most one NACK each for what parity cannot rebuild */
+    static uint8_t scratch[MAX_CHUNK];
+    int unrecoverable = 0;
+    for (int n = 0; n < NCHUNKS; n++) {
+        int missing;
+        expect_chunk(n, fec_k, scratch, &missing);
+        if (lost_whole(&sent[n]))
+            missing = (int)((sent[n].len + MEDIA_PAYLOAD - 1) / MEDIA_PAYLOAD);
+        unrecoverable += missing;
+    }
+
+    MediaReassembler r;
+    if (media_reasm_init(&r, MAX_CHUNK, MEDIA_REASM_SLOTS, HOLD_MS) < 0) return 1;
+
+    int failed = 0, out = 0, resent = 0;
+    for (int n = 0; n < NCHUNKS + TAIL && !failed; n++) {
+        const SentChunk *c = &sent[n];
+        for (int i = 0; i < c->npkts; i++)
+            if (!c->drop[i]) media_reasm_input(&r, c->pkts[i].buf, c->pkts[i].len);
+
+        int k = nack_round(what, &r, &s, fec_k);
+        if (k < 0) failed = 1;
+        resent += k;
+
+        MediaChunk mc;
+        while (!failed && out < NCHUNKS && media_reasm_next(&r, &mc)) {
+            if (mc.missing) {
+                fprintf(stderr, "%s: chunk %u given up before its resend\n",
+                        what, mc.chunk_seq);
+                failed = 1;
+            } else {
+                failed = check_chunk(what, out++, fec_k, &mc);
+            }
+        }
+    }
+    if (!failed && out < NCHUNKS) {
+        fprintf(stderr, "%s: %d of %d chunks handed out\n", what, out, NCHUNKS);
+        failed = 1;
+    }
+    /* With parity, one resend can rebuild the next loss before it is
+       asked for, or before its own resend lands                      */
+    bool exact = fec_k == 0 ? resent == unrecoverable && r.retransmits == resent
+                            : resent <= unrecoverable && r.retransmits <= resent;
+    if (!failed && (!exact || (unrecoverable > 0 && r.retransmits == 0))) {
+        fprintf(stderr, "%s: %d resent, %ld taken, %d lost\n",
+                what, resent, r.retransmits, unrecoverable);
+        failed = 1;
+    }
+    uint8_t pkt[MEDIA_HDR_SIZE + MEDIA_PAYLOAD];
+    if (!failed && media_reasm_nack(&r, TOKEN, pkt) != 0) {
+        fprintf(stderr, "%s: NACK left over with nothing missing\n", what);
+        failed = 1;
+    }
+
+    media_reasm_destroy(&r);
+    return failed;
+}
+
+/* A loss never answered is asked for MEDIA_NACK_TRIES times, then the
+   chunk goes out zero-filled once the hold runs out                  */
+static int run_unanswered(void)
+{
+    const char *what = "NACK, unanswered";
+    const int   hold = 150;
+
+    MediaSender s;
+    media_sender_init(&s, sock, 0);
+    for (int n = 0; n < 4; n++) {
+        sent[n].seq = (uint32_t)n;
+        sent[n].len = 3 * MEDIA_PAYLOAD;
+        if (send_chunk(&s, &sent[n]) < 0) return 1;
+    }
+    uint32_t lost = sent[1].pkts[1].h.seq;
+
+    MediaReassembler r;
+    if (media_reasm_init(&r, MAX_CHUNK, MEDIA_REASM_SLOTS, hold) < 0) return 1;
+    for (int n = 0; n < 4; n++) {
+        for (int i = 0; i < sent[n].npkts; i++)
+            if (n != 1 || i != 1) media_reasm_input(&r, sent[n].pkts[i].buf, sent[n].pkts[i].len);
+    }
+
+    int     asked = 0, out = 0, failed = 0;
+    int64_t t0    = current_time_ms();
+    while (current_time_ms() - t0 < 2 * hold && out < 4) {
+        uint8_t   pkt[MEDIA_HDR_SIZE + MEDIA_PAYLOAD];
+        MediaNack nack;
+        size_t    len = media_reasm_nack(&r, TOKEN, pkt);
+        if (len > 0 && media_nack_read(pkt, len, &nack) == 0)
+            for (int i = 0; i < nack.count; i++)
+                asked += nack.seqs[i] == lost;
+
+        MediaChunk mc;
+        while (media_reasm_next(&r, &mc)) {
+            int want = mc.chunk_seq == 1 ? 1 : 0;
+            if (mc.chunk_seq != (uint32_t)out || mc.missing != want) {
+                fprintf(stderr, "%s: chunk %u with %d missing, want %d with %d\n",
+                        what, mc.chunk_seq, mc.missing, out, want);
+                failed = 1;
+            }
+            for (size_t b = MEDIA_PAYLOAD; want && b < 2 * MEDIA_PAYLOAD; b++)
+                if (mc.data[b] != 0) failed = 1;
+            out++;
+        }
+        usleep(5000);
+    }
+    if (asked != MEDIA_NACK_TRIES || out != 4) {
+        fprintf(stderr, "%s: asked %d times, %d chunks out\n", what, asked, out);
+        failed = 1;
+    }
+
+    media_reasm_destroy(&r);
+    return failed;
+}
+
+int main(void)
+{
+    if (open_loopback() < 0) {
+        fprintf(stderr, "loopback socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    static const int      FEC_KS[] = { 0, 1, 4, 5 };
+    static const uint32_t STARTS[][2] = {
+        { 0, 0 },
+        { 0xfffffff0u, 0xffffff00u },   /* both sequences wrap mid-run */
+    };
+
+    int failed = 0, cases = 0;
+    for (size_t f = 0; f < sizeof(FEC_KS) / sizeof(FEC_KS[0]); f++) {
+        for (int loss = 0; loss < LOSS_COUNT; loss++) {
+            for (int order = 0; order < ORDER_COUNT; order++) {
+                for (int dup = 0; dup < 2; dup++) {
+                    for (size_t st = 0; st < sizeof(STARTS) / sizeof(STARTS[0]); st++) {
+                        Scenario sc = {
+                            .fec_k       = FEC_KS[f],
+                            .loss        = loss,
+                            .order       = order,
+                            .dup         = dup,
+                            .first_chunk = STARTS[st][0],
+                            .first_pkt   = STARTS[st][1],
+                        };
+                        failed += run(&sc);
+                        cases++;
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t f = 0; f < sizeof(FEC_KS) / sizeof(FEC_KS[0]); f++) {
+        for (int loss = 0; loss < LOSS_COUNT; loss++) {
+            for (size_t st = 0; st < sizeof(STARTS) / sizeof(STARTS[0]); st++) {
+                failed += run_nack(FEC_KS[f], loss, STARTS[st][0], STARTS[st][1]);
+                cases++;
+            }
+        }
+    }
+    failed += run_unanswered();
+    cases++;
+
+    close(sock);
+    printf("%d of %d media cases failed\n", failed, cases);
+    return failed ? 1 : 0;
+}